@@ -0,0 +1,137 @@
+/**
+ * \file AttachmentStore.h
+ *
+ * \brief Header file for the persisted store of encoded attachments
+ *
+ * \details Declares an on-disk cache of base 64 encoded attachments that lets a restarted process map previously
+ * encoded attachments straight into memory instead of encoding them again.
+ */
+
+#ifndef ATTACHMENTSTORE_H_
+#define ATTACHMENTSTORE_H_
+
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+
+#include "./EmailAttachment.h"
+#include "./ThreadPool.h"
+
+namespace SimplyEmail {
+
+/**
+ * \brief Persisted store of base 64 encoded attachments
+ *
+ * \details Each source file is stored as one entry in the store directory. An entry starts with a header holding the
+ * canonical source path, the source size, modification time and checksum, the MIME type and the file name, followed by
+ * the encoded payload. Loading a file whose entry is still valid memory maps the entry and returns an attachment that
+ * points straight into the mapping; nothing is read or encoded until the message is written out. An entry is
+ * invalidated, and rebuilt, when the size or modification time of the source no longer match.
+ *
+ * The store only holds its configuration, so one store may be used from several threads at once. Entries are written
+ * to a temporary file and renamed into place, so concurrent writers and readers always see complete entries.
+ */
+class AttachmentStore {
+public:
+	static const std::uint32_t FORMAT_VERSION;			/// The entry format written by this version of the library
+
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \details Creates a store in the given directory, creating the directory if it does not exist.
+	 *
+	 * \param[in] directory The directory to keep entries in
+	 *
+	 * \return void
+	 */
+	explicit AttachmentStore(const std::string &directory);
+
+	/**
+	 * \brief Default destructor
+	 *
+	 * \details Destroys the store object. Entries on disk are kept.
+	 */
+	~AttachmentStore();
+
+	/**
+	 * \brief Loads an attachment through the store
+	 *
+	 * \details Returns an attachment mapped from the store if a valid entry exists for the file; this counts as an
+	 * attachment cache hit in the library metrics. Otherwise the file is encoded, on the pool if one is given, written
+	 * to the store and returned.
+	 *
+	 * \param[in] fileAddress The path of the file to attach
+	 * \param[in] pool The pool to encode large files on, or NULL to encode on the calling thread
+	 *
+	 * \return EmailAttachment The attachment
+	 */
+	EmailAttachment load(const std::string &fileAddress, SimplyEmail::ThreadPool *pool = NULL) const;
+
+	/**
+	 * \brief Removes the entry for a file
+	 *
+	 * \param[in] fileAddress The path of the file whose entry should be removed
+	 *
+	 * \return bool True if an entry was removed
+	 */
+	bool invalidate(const std::string &fileAddress) const;
+
+	/**
+	 * \brief Sets whether the source checksum is verified on load
+	 *
+	 * \details By default an entry is trusted when the source size and modification time match. With verification
+	 * on, the source is also read and its checksum compared, which catches changes that preserve the modification
+	 * time at the cost of reading every source on load.
+	 *
+	 * \param[in] verify True to verify checksums
+	 *
+	 * \return void
+	 */
+	void setVerifyChecksums(bool verify);
+
+	bool getVerifyChecksums() const;
+	const std::string& getDirectory() const;
+
+private:
+	std::string directory;								/// The directory holding the entries
+	bool verifyChecksums;								/// Whether sources are read and checksummed on load
+
+	/**
+	 * \brief Describes the current state of a source file
+	 */
+	struct SourceInfo {
+		std::string path;								/// The canonical path of the source
+		std::uint64_t size;								/// The size of the source in bytes
+		std::int64_t modifiedSeconds;					/// The modification time of the source, whole seconds
+		std::int64_t modifiedNanoseconds;				/// The modification time of the source, nanoseconds part
+	};
+
+	static SourceInfo describe(const std::string &fileAddress);
+
+	/**
+	 * \brief Gets the path of the entry for a source
+	 *
+	 * \param[in] canonicalPath The canonical path of the source
+	 *
+	 * \return std::string The path of the entry within the store directory
+	 */
+	std::string entryPath(const std::string &canonicalPath) const;
+
+	/**
+	 * \brief Writes a store entry
+	 *
+	 * \return void
+	 */
+	void write(const SourceInfo &source, std::uint64_t checksum, const EmailAttachment &attachment) const;
+
+	/**
+	 * \brief Calculates the FNV-1a checksum of a block of memory
+	 *
+	 * \return std::uint64_t The checksum
+	 */
+	static std::uint64_t checksum(const char *data, std::size_t length);
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* ATTACHMENTSTORE_H_ */
@@ -0,0 +1,95 @@
+/**
+ * \file Base64.h
+ *
+ * \brief Header file for the base 64 encoder
+ *
+ * \details Declares the base 64 encoder used for attachment data, which encodes twelve bytes at a time with SSE2 where
+ * the compiler targets it and two characters per table lookup otherwise.
+ */
+
+#ifndef BASE64_H_
+#define BASE64_H_
+
+#include <string>
+#include <cstddef>
+
+namespace SimplyEmail {
+
+/**
+ * \brief Base 64 encoder as described by RFC 4648
+ *
+ * \details All members are static and reentrant. The encoder writes into caller supplied memory so that large inputs
+ * can be split into chunks whose length is a multiple of three and encoded concurrently straight into their final
+ * position in a shared output buffer.
+ */
+class Base64 {
+public:
+	static const std::size_t LINE_LENGTH;				/// Characters per line of wrapped output; RFC 2045 allows at most 76
+	static const std::size_t LINE_INPUT;				/// Bytes of input that fill one line of wrapped output
+
+	/**
+	 * \brief Calculates the length of encoded data
+	 *
+	 * \param[in] inputLength The number of bytes to be encoded
+	 *
+	 * \return std::size_t The number of characters the encoded data occupies, including padding
+	 */
+	static std::size_t encodedLength(std::size_t inputLength);
+
+	/**
+	 * \brief Encodes a block of bytes
+	 *
+	 * \details Encodes the input into exactly encodedLength(inputLength) characters. Padding is only written when the
+	 * input length is not a multiple of three, so consecutive chunks of such lengths may be encoded independently and
+	 * concatenated.
+	 *
+	 * \param[in] input The bytes to encode
+	 * \param[in] inputLength The number of bytes to encode
+	 * \param[out] output The memory to write the encoded characters to
+	 *
+	 * \return void
+	 */
+	static void encode(const char *input, std::size_t inputLength, char *output);
+
+	/**
+	 * \brief Calculates the length of encoded data wrapped into lines
+	 *
+	 * \param[in] inputLength The number of bytes to be encoded
+	 *
+	 * \return std::size_t The number of characters the wrapped data occupies, including the line breaks between lines
+	 */
+	static std::size_t wrappedLength(std::size_t inputLength);
+
+	/**
+	 * \brief Encodes a block of bytes into lines for a MIME body
+	 *
+	 * \details Encodes the input into exactly wrappedLength(inputLength) characters: lines of LINE_LENGTH characters,
+	 * the last possibly shorter, separated by CRLF. No line break follows the last line. Each line is encoded in one
+	 * pass straight into the output, so wrapping costs no copy of its own. An input whose length is a multiple of
+	 * LINE_INPUT encodes to whole lines, so consecutive chunks of such lengths may be encoded independently and
+	 * joined with a CRLF.
+	 *
+	 * \param[in] input The bytes to encode
+	 * \param[in] inputLength The number of bytes to encode
+	 * \param[out] output The memory to write the encoded lines to
+	 *
+	 * \return void
+	 */
+	static void encodeWrapped(const char *input, std::size_t inputLength, char *output);
+
+	/**
+	 * \brief Encodes a string
+	 *
+	 * \param[in] input The bytes to encode
+	 *
+	 * \return std::string The encoded string
+	 */
+	static std::string encode(const std::string &input);
+
+private:
+	Base64();
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* BASE64_H_ */
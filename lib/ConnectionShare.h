@@ -0,0 +1,73 @@
+/**
+ * \file ConnectionShare.h
+ *
+ * \brief Header file for state shared between SMTP connections
+ */
+
+#ifndef CONNECTIONSHARE_H_
+#define CONNECTIONSHARE_H_
+
+#include <mutex>
+#include <curl/curl.h>
+
+namespace SimplyEmail {
+
+/**
+ * \brief Caches shared by every connection attached to it
+ *
+ * \details Wraps a CURL share handle holding TLS session IDs and resolved host names. A new connection to a relay
+ * another connection has already talked to resumes the TLS session instead of repeating the full handshake, and skips
+ * the DNS lookup. Each kind of shared data has its own lock, so connections on different threads only wait for each
+ * other while touching the same cache. A share may also pool open connections, but only for single threaded use.
+ *
+ * Every SMTPConnection is attached to the process wide share returned by getDefault() unless told otherwise. A share
+ * must outlive the connections attached to it.
+ */
+class ConnectionShare {
+public:
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \details Creates an empty share. With shareConnections, and CURL 7.57 or later, connections attached to it also
+	 * reuse each other's idle connections. CURL does not support sharing connections between transfers running at the
+	 * same time on different threads, so only attach connections that send from a single thread to such a share.
+	 *
+	 * \param[in] shareConnections True to also share open connections
+	 *
+	 * \return void
+	 */
+	explicit ConnectionShare(bool shareConnections = false);
+
+	/**
+	 * \brief Default destructor
+	 *
+	 * \details Releases the caches. No connection may still be attached.
+	 */
+	~ConnectionShare();
+
+	/**
+	 * \brief Gets the process wide share
+	 *
+	 * \details Created on first use and never destroyed, so connections in static storage may use it safely. Shares
+	 * TLS sessions and host names but not connections, so connections on any thread may be attached to it.
+	 *
+	 * \return ConnectionShare& The share
+	 */
+	static ConnectionShare& getDefault();
+
+	CURLSH* getHandle() const;
+
+private:
+	CURLSH *share;										/// The CURL share handle
+	std::mutex locks[CURL_LOCK_DATA_LAST];				/// One lock per kind of shared data
+
+	ConnectionShare(const ConnectionShare &other);
+	ConnectionShare& operator=(const ConnectionShare &other);
+
+	static void lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userData);
+	static void unlock(CURL *handle, curl_lock_data data, void *userData);
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* CONNECTIONSHARE_H_ */
@@ -17,8 +17,18 @@
 #include <stdexcept>
 #include <ctime>
 #include <cstdlib>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
 
 #include "./EmailAttachment.h"
+#include "./EncodedEmail.h"
+#include "./EncodeArena.h"
+#include "./HeaderList.h"
+#include "./SuppressionList.h"
+#include "./ThreadPool.h"
 
 /**
  * \brief Container for external SimplyEmail routines.
@@ -33,8 +43,19 @@ namespace SimplyEmail {
  *
  * \details Contains functions and members to facilitate generating a MIME encoded email that can be went with
  * via SMTP.
+ *
+ * The encoded body part and the part headers of each attachment are cached the first time they are needed and reused
+ * until the body changes, so encoding variants of one email that differ only in addresses, subject or header fields
+ * renders only the message header again. encodeSegments() goes further and references the cached sections and the
+ * attachment data instead of copying them.
+ *
+ * Thread safety: every const member function, including encode(), may be called concurrently on the same email.
+ * Non-const member functions (the add and set functions) require exclusive access; they must not run at the same
+ * time as any other call on the same email.
  */
 class Email {
+	friend class EmailSerializer;
+
 public:
 	/**
 	 * \brief Default constructor
@@ -90,7 +111,18 @@ public:
 	 *
 	 * \return void
 	 */
-	Email(Email& other);
+	Email(const Email& other);
+
+	/**
+	 * \brief Assignment operator
+	 *
+	 * \details Copies another email, sharing its cached sections.
+	 *
+	 * \param[in] other Reference to previously instantiated email
+	 *
+	 * \return Email& This email
+	 */
+	Email& operator=(const Email& other);
 
 	/**
 	 * \brief Default destructor
@@ -104,27 +136,82 @@ public:
 	/**
 	 * \brief Encodes email data for sending
 	 *
-	 * \details Takes saved email members and encodes them for sending via SMTP
+	 * \details Takes saved email members and encodes them for sending via SMTP. Encoding does not change the email,
+	 * so the same email may be encoded from several threads at once. The only state encoders share is the cache of
+	 * rendered sections: the first encode after the body or attachments change fills it under a mutex, and later ones
+	 * read it without locking.
 	 *
 	 * \return std::string The encoded email message
 	 */
-	std::string encode();
+	std::string encode() const;
+
+	/**
+	 * \brief Encodes email data for sending into an arena
+	 *
+	 * \details Produces the same message as encode() but draws the output string from the given arena instead of
+	 * the global allocator. Once the section cache is filled, encoding makes no other allocations unless a header
+	 * value needs RFC 2047 encoding, so a per-thread arena that is reset after each send makes steady state encoding
+	 * allocation free. The returned string must not outlive the next reset of the arena.
+	 *
+	 * \param[in] arena The arena to allocate the encoded message from
+	 *
+	 * \return ArenaString The encoded email message
+	 */
+	ArenaString encode(EncodeArena &arena) const;
+
+	/**
+	 * \brief Encodes email data as a list of segments
+	 *
+	 * \details Produces the same message as encode() without copying it into one string: only the message header is
+	 * rendered, and the body part, the attachment part headers and the attachment data are referenced where they
+	 * already live. The cost is proportional to the size of the header, not the message. The result keeps what it
+	 * references alive, so it stays valid if the email is changed or destroyed.
+	 *
+	 * \return EncodedEmail The encoded email message
+	 */
+	SimplyEmail::EncodedEmail encodeSegments() const;
+
+	/**
+	 * \brief Calculates the size of the encoded message without encoding it
+	 *
+	 * \details Counts the bytes encode() would produce, so a message can be checked against a relay's size limit
+	 * before any of it is rendered. Nothing is allocated for the body or the attachment data; the cost is that of
+	 * rendering the header. The result is exact unless the Date field changes length before the message is encoded.
+	 *
+	 * \return std::uint64_t The size of the encoded message in bytes
+	 */
+	std::uint64_t encodedSize() const;
 
-	const std::string getRecipient(unsigned int recipientNumber);
-	const std::vector<std::string> getRecipients();
-	unsigned int getRecipientNumber();
+	const std::string getRecipient(unsigned int recipientNumber) const;
+	const std::vector<std::string>& getRecipients() const;
+	unsigned int getRecipientNumber() const;
 	void addRecipient(const std::string &recipient);
 
-	const std::string getCC(unsigned int ccNumber);
-	const std::vector<std::string> getCCs();
-	unsigned int getCCNumber();
+	const std::string getCC(unsigned int ccNumber) const;
+	const std::vector<std::string>& getCCs() const;
+	unsigned int getCCNumber() const;
 	void addCC(const std::string& recipient);
 
-	const std::string getBCC(unsigned int bccNumber);
-	const std::vector<std::string> getBCCs();
-	unsigned int getBCCNumber();
+	const std::string getBCC(unsigned int bccNumber) const;
+	const std::vector<std::string>& getBCCs() const;
+	unsigned int getBCCNumber() const;
 	void addBCC(const std::string& recipient);
 
+	/**
+	 * \brief Sets the list of addresses that must not be sent to
+	 *
+	 * \details Listed addresses already added are removed at once, and addRecipient(), addCC() and addBCC() drop
+	 * listed addresses instead of adding them. Dropped addresses are kept for getSuppressed(). Copies of the email
+	 * keep the list.
+	 *
+	 * \param[in] list The list, which must outlive the email and its copies, or NULL to stop filtering
+	 *
+	 * \return void
+	 */
+	void setSuppressionList(const SimplyEmail::SuppressionList *list);
+	const SimplyEmail::SuppressionList* getSuppressionList() const;
+	const std::vector<std::string>& getSuppressed() const;
+
 	const std::string getBody() const;
 	void setBody(const std::string& body);
 
@@ -137,11 +224,85 @@ public:
 	const std::string getSubject() const;
 	void setSubject(const std::string& subject);
 
-	const SimplyEmail::EmailAttachment getAttachment(unsigned int attachmentNumber);
-	const std::vector<SimplyEmail::EmailAttachment> getAttachments();
-	unsigned int getAttachmentNumber();
+	/**
+	 * \brief Adds a header field
+	 *
+	 * \details Adds a field such as Message-ID, List-Unsubscribe or a tracking header, written after the date. Fields
+	 * are kept in the order added and may repeat. Throws a std::runtime_error if the name is invalid or is one the
+	 * email writes itself (From, To, Cc, Bcc, Subject, Date, MIME-Version or Content-Type), or if the value contains a
+	 * line break.
+	 *
+	 * \param[in] name The field name, without the colon
+	 * \param[in] value The field value
+	 *
+	 * \return void
+	 */
+	void addHeader(const std::string &name, const std::string &value);
+
+	/**
+	 * \brief Sets a header field, replacing any of the same name
+	 *
+	 * \param[in] name The field name, without the colon
+	 * \param[in] value The field value
+	 *
+	 * \return void
+	 */
+	void setHeader(const std::string &name, const std::string &value);
+
+	/**
+	 * \brief Removes every header field of a name
+	 *
+	 * \param[in] name The field name
+	 *
+	 * \return void
+	 */
+	void removeHeader(const std::string &name);
+
+	const SimplyEmail::HeaderList& getHeaders() const;
+
+	const SimplyEmail::EmailAttachment getAttachment(unsigned int attachmentNumber) const;
+	const std::vector<SimplyEmail::EmailAttachment> getAttachments() const;
+	unsigned int getAttachmentNumber() const;
 	void addAttachment(const std::string& fileLocation);
 
+	/**
+	 * \brief Adds an existing attachment
+	 *
+	 * \details Adds an attachment created elsewhere, for example loaded from an AttachmentStore. The encoded data is
+	 * shared with the given attachment rather than copied.
+	 *
+	 * \param[in] attachment The attachment to add
+	 *
+	 * \return void
+	 */
+	void addAttachment(const SimplyEmail::EmailAttachment& attachment);
+
+	/**
+	 * \brief Adds several attachments at once
+	 *
+	 * \details Reads and base 64 encodes the files concurrently on the given pool, splitting large files into
+	 * chunks that are encoded in parallel. The attachments are added in the given order. If any file cannot be read
+	 * none of them are added.
+	 *
+	 * \param[in] fileLocations The paths of the files to attach
+	 * \param[in] pool The pool to read and encode the files on
+	 *
+	 * \return void
+	 */
+	void addAttachments(const std::vector<std::string>& fileLocations, SimplyEmail::ThreadPool& pool);
+
+	/**
+	 * \brief Adds several attachments at once
+	 *
+	 * \details Behaves like addAttachments(fileLocations, pool) using a temporary pool.
+	 *
+	 * \param[in] fileLocations The paths of the files to attach
+	 * \param[in] threads The number of threads to use; 0 uses one thread per hardware thread
+	 *
+	 * \return void
+	 */
+	void addAttachments(const std::vector<std::string>& fileLocations, unsigned int threads = 0);
+
 private:
 	std::vector<std::string> recipients;								/// List of recipient addresses. Must be confirmed to be syntactically correct to add to the list.
 	std::vector<std::string> cc;										/// List of cc recipient addresses. Must be confirmed to be syntactically correct to add to the list.
@@ -152,30 +313,134 @@ private:
 	std::string body;													/// Text to be appended to the generated text of the email message
 
 	std::vector<SimplyEmail::EmailAttachment> attachments;			/// List of attachments to be sent with the message
+	SimplyEmail::HeaderList headers;									/// Additional header fields
+
+	const SimplyEmail::SuppressionList *suppression;					/// The addresses that must not be sent to, or NULL
+	std::vector<std::string> suppressed;								/// The addresses dropped because they are listed
+
+	mutable std::mutex cacheMutex;										/// Guards the cached sections
+	mutable std::shared_ptr<const std::string> bodySection;			/// The encoded body part, or NULL until rendered after the body last changed
+	mutable std::vector<std::shared_ptr<const std::string> > attachmentSections;	/// The encoded part headers of the first attachments, in order
+	mutable std::atomic<bool> sectionsReady;							/// Set once every section is cached; cleared by changes that need more rendered
 
 	static const std::string bodyType;									/// The MIME type of the body; currently only plain text is supported.
 	static const std::string bodyCharSet;								/// The character set of the body text; currently only UTF-8 is supported.
 	static const std::string boundryText;								/// The text to be used to encase boundries
 	static const std::string endLineText;								/// The text to be used to end a line
 
-	std::string encodeHeader();
-	std::string encodeBody();
-	std::string encodeAttachments();
-	
+	static const unsigned int ATTACHMENT_ID_LENGTH = 11;				/// The length of a generated attachment identifier
+	static const unsigned int MAX_LINE_LENGTH = 998;					/// The longest line RFC 5322 allows, without its CRLF
+
+	/**
+	 * \brief Encodes the whole message
+	 *
+	 * \details Appends the encoded message to the given buffer. The buffer type only needs an append function, which
+	 * lets the same code produce both std::string and ArenaString output.
+	 *
+	 * \param[out] buffer The buffer to append the message to
+	 *
+	 * \return void
+	 */
+	template <class Buffer>
+	void encodeTo(Buffer &buffer) const;
+
+	template <class Buffer>
+	void encodeHeader(Buffer &buffer) const;
+
+	template <class Buffer>
+	void encodeBody(Buffer &buffer) const;
+
+	/**
+	 * \brief Appends text with its line breaks made safe for SMTP
+	 *
+	 * \details Writes the text in a single pass, appending each run of ordinary characters straight from the source.
+	 * A bare LF or bare CR becomes CRLF, and a line longer than MAX_LINE_LENGTH is broken, at a UTF-8 character
+	 * boundary where there is one, so strict relays accept the message.
+	 *
+	 * \param[out] buffer The buffer to append to
+	 * \param[in] text The text
+	 *
+	 * \return void
+	 */
+	template <class Buffer>
+	void encodeText(Buffer &buffer, const std::string &text) const;
+
+	/**
+	 * \brief Encodes the part header that precedes an attachment's data
+	 *
+	 * \param[out] buffer The buffer to append the part header to
+	 * \param[in] attachment The attachment
+	 *
+	 * \return void
+	 */
+	template <class Buffer>
+	void encodeAttachmentHeader(Buffer &buffer, const SimplyEmail::EmailAttachment &attachment) const;
+
+	/**
+	 * \brief Renders any sections missing from the cache
+	 *
+	 * \details Takes cacheMutex only while sections are missing, which is once after each change to the body or the
+	 * attachments; after that it neither locks nor allocates.
+	 *
+	 * \return void
+	 */
+	void renderSections() const;
+
+	/**
+	 * \brief Gets the cached sections, rendering any that are missing
+	 *
+	 * \param[out] body Receives the encoded body part
+	 * \param[out] parts Receives the encoded part header of each attachment
+	 *
+	 * \return void
+	 */
+	void cachedSections(std::shared_ptr<const std::string> &body, std::vector<std::shared_ptr<const std::string> > &parts) const;
+
 	/**
 	 * \brief Encodes a vector of strings in a comma seperated list
 	 *
+	 * \details Folds the list between addresses to keep lines within HeaderEncoder::FOLD_COLUMN where it can.
+	 *
+	 * \param[out] buffer The buffer to append to
+	 * \param[in] toEncode The addresses
+	 * \param[in] column The column the list starts at
 	 */
-	std::string encodeVector(std::vector<std::string> toEncode);
-	
+	template <class Buffer>
+	void encodeVector(Buffer &buffer, const std::vector<std::string> &toEncode, std::size_t column) const;
+
+	/**
+	 * \brief Estimates the size of the encoded message
+	 *
+	 * \details Gives a slight overestimate of the encoded size so that output buffers can be reserved once.
+	 *
+	 * \return std::size_t The estimated size in bytes
+	 */
+	std::size_t encodedSizeHint() const;
+
 	/**
 	 * \brief Creates a timestamp in proper email format
 	 *
-	 * \details Gets the current time and generates a tiemstamp in the proper email format.
+	 * \details Gets the current time and generates a tiemstamp in the proper email format. Uses the reentrant time
+	 * conversion functions so that it is safe to call from several threads.
+	 *
+	 * \param[out] buffer The buffer to write the timestamp to
+	 * \param[in] bufferSize The size of the buffer; 64 bytes is always enough
+	 *
+	 * \return std::size_t The length of the timestamp
+	 */
+	std::size_t createTimestamp(char *buffer, std::size_t bufferSize) const;
+
+	/**
+	 * \brief Creates a random attachment identifier
+	 *
+	 * \details Generates an alphanumeric identifier from a lock free, process wide sequence. Unlike rand() this is
+	 * safe to call from several threads.
+	 *
+	 * \param[out] buffer The buffer to write the identifier to; must hold ATTACHMENT_ID_LENGTH characters
 	 *
-	 * \return std::string The current timestamp in email format
+	 * \return void
 	 */
-	std::string createTimestamp();
+	static void createAttachmentId(char *buffer);
 
 	/**
 	 * \brief Checks a given string to test whether or not it is a valid email address
@@ -189,7 +454,18 @@ private:
 	 *
 	 * \return bool True if the given string is an email address false otherwise.
 	 */
-	bool isAddress(const std::string& addressToTest);
+	bool isAddress(const std::string& addressToTest) const;
+
+	/**
+	 * \brief Checks that a header field may be added by the user
+	 *
+	 * \details Throws a std::runtime_error for the fields encodeHeader() writes itself.
+	 *
+	 * \param[in] name The field name
+	 *
+	 * \return void
+	 */
+	static void checkHeaderName(const std::string &name);
 };
 
 } /* namespace SimplyEmail */
@@ -13,6 +13,13 @@
 #include <fstream>
 #include <utility>
 #include <stdexcept>
+#include <vector>
+#include <memory>
+#include <future>
+#include <functional>
+#include <istream>
+
+#include "./ThreadPool.h"
 
 namespace SimplyEmail {
 
@@ -22,6 +29,8 @@ namespace SimplyEmail {
  * \details Contains information about email attachments to be used to generate MIME type email attachments
  */
 class EmailAttachment {
+	friend class AttachmentStore;
+
 public:
 
 	/**
@@ -44,6 +53,107 @@ public:
 	 */
 	EmailAttachment(std::string fileAddress);
 
+	/**
+	 * \brief Parametrized constructor using a thread pool
+	 *
+	 * \details Generates an email attachment using a provided file path. Files larger than PARALLEL_CHUNK_SIZE are
+	 * split into chunks that are base 64 encoded concurrently on the given pool, straight into their place in the
+	 * attachment data. Must not be called from a task running on the same pool.
+	 *
+	 * \param[in] fileAddress The path of a file relative to the root to be encoded.
+	 * \param[in] pool The pool to encode chunks of the file on
+	 *
+	 * \return void
+	 */
+	EmailAttachment(const std::string &fileAddress, SimplyEmail::ThreadPool &pool);
+
+	/**
+	 * \brief Parametrized constructor using already encoded data
+	 *
+	 * \details Creates an attachment around data that is already base 64 encoded, without copying it. The data may
+	 * live in any memory, such as a memory mapped file, as long as the shared pointer keeps it alive. It is sent as
+	 * given, so it should be wrapped into lines of at most 76 characters as the other constructors do.
+	 *
+	 * \param[in] fileName The name of the attachment
+	 * \param[in] mimeType The MIME type of the attachment
+	 * \param[in] encodedData The base 64 encoded data
+	 * \param[in] encodedLength The length of the encoded data
+	 *
+	 * \return void
+	 */
+	EmailAttachment(const std::string &fileName, const std::string &mimeType, const std::shared_ptr<const char> &encodedData, std::size_t encodedLength);
+
+	/**
+	 * \brief Parametrized constructor using a borrowed buffer
+	 *
+	 * \details Encodes raw data held in memory, such as a report generated by the caller, without writing it to disk.
+	 * The buffer is only read during the constructor and is not copied.
+	 *
+	 * \param[in] fileName The name of the attachment
+	 * \param[in] mimeType The MIME type of the attachment
+	 * \param[in] rawData The data to encode
+	 * \param[in] rawLength The length of the data
+	 *
+	 * \return void
+	 */
+	EmailAttachment(const std::string &fileName, const std::string &mimeType, const char *rawData, std::size_t rawLength);
+
+	/**
+	 * \brief Parametrized constructor taking ownership of a buffer
+	 *
+	 * \details Encodes raw data moved in by the caller and frees it once it is encoded.
+	 *
+	 * \param[in] fileName The name of the attachment
+	 * \param[in] mimeType The MIME type of the attachment
+	 * \param[in] rawData The data to encode
+	 *
+	 * \return void
+	 */
+	EmailAttachment(const std::string &fileName, const std::string &mimeType, std::string &&rawData);
+
+	/**
+	 * \brief Parametrized constructor taking ownership of a buffer, using a thread pool
+	 *
+	 * \details As above, except that data larger than PARALLEL_CHUNK_SIZE is encoded in chunks on the given pool. Must
+	 * not be called from a task running on the same pool.
+	 *
+	 * \param[in] fileName The name of the attachment
+	 * \param[in] mimeType The MIME type of the attachment
+	 * \param[in] rawData The data to encode
+	 * \param[in] pool The pool to encode chunks of the data on
+	 *
+	 * \return void
+	 */
+	EmailAttachment(const std::string &fileName, const std::string &mimeType, std::string &&rawData, SimplyEmail::ThreadPool &pool);
+
+	/**
+	 * \brief Parametrized constructor reading a stream
+	 *
+	 * \details Reads the stream to its end in blocks of STREAM_BLOCK_SIZE, encoding each block as it arrives, so only
+	 * the encoded result is ever held whole. Throws a std::runtime_error if the stream fails before its end.
+	 *
+	 * \param[in] fileName The name of the attachment
+	 * \param[in] mimeType The MIME type of the attachment
+	 * \param[in] input The stream to read
+	 *
+	 * \return void
+	 */
+	EmailAttachment(const std::string &fileName, const std::string &mimeType, std::istream &input);
+
+	/**
+	 * \brief Parametrized constructor reading a file descriptor
+	 *
+	 * \details Reads the descriptor, which may be a pipe or socket, until end of file and encodes it incrementally as
+	 * the stream constructor does. The descriptor is left open. Throws a std::runtime_error if a read fails.
+	 *
+	 * \param[in] fileName The name of the attachment
+	 * \param[in] mimeType The MIME type of the attachment
+	 * \param[in] fileDescriptor The descriptor to read
+	 *
+	 * \return void
+	 */
+	EmailAttachment(const std::string &fileName, const std::string &mimeType, int fileDescriptor);
+
 	/**
 	 * \brief Copy constructor
 	 *
@@ -62,15 +172,43 @@ public:
 	 */
 	~EmailAttachment();
 
+	/**
+	 * \brief Creates attachments for several files concurrently
+	 *
+	 * \details Reads every file on the given pool and base 64 encodes them in chunks of PARALLEL_CHUNK_SIZE, so both
+	 * many small files and a few very large files use every worker. The attachments are returned in the order of the
+	 * given paths. If any file cannot be read the exception is rethrown once every task has finished. Must not be
+	 * called from a task running on the same pool.
+	 *
+	 * \param[in] fileAddresses The paths of the files to be encoded
+	 * \param[in] pool The pool to read and encode the files on
+	 *
+	 * \return std::vector<EmailAttachment> The encoded attachments
+	 */
+	static std::vector<EmailAttachment> encodeFiles(const std::vector<std::string> &fileAddresses, SimplyEmail::ThreadPool &pool);
+
+	static const std::size_t PARALLEL_CHUNK_SIZE;		/// Bytes of input encoded by each task; a multiple of Base64::LINE_INPUT
+	static const std::size_t STREAM_BLOCK_SIZE;			/// Bytes read at a time from streams and descriptors; a multiple of Base64::LINE_INPUT
+
 	//TODO Document getters and setters
 	const std::string getData() const;
-	const std::string getFileName() const;
-	const std::string getMimeType() const;
+	const char* getDataPointer() const;
+	std::size_t getDataLength() const;
+	const std::string& getFileName() const;
+	const std::string& getMimeType() const;
+
+	/**
+	 * \brief Gets the encoded data with shared ownership
+	 *
+	 * \return const std::shared_ptr<const char>& The encoded data, which stays valid while the pointer is held
+	 */
+	const std::shared_ptr<const char>& getSharedData() const;
 
 private:
 	std::string mimeType;								/// The MIME type of the attachment
 	std::string fileName;								/// The name of the attachment
-	std::string data;									/// The encoded data of the attachment
+	std::shared_ptr<const char> data;					/// The encoded data of the attachment, shared between copies
+	std::size_t dataLength;								/// The length of the encoded data
 
 	/**
 	 * \brief Finds MIME type based on file extension
@@ -85,6 +223,15 @@ private:
 	 */
 	void findMIMEType(std::string filePath);
 
+	/**
+	 * \brief Sets the file name and MIME type from a file path
+	 *
+	 * \param[in] fileAddress The path of the file
+	 *
+	 * \return void
+	 */
+	void setFileDetails(const std::string &fileAddress);
+
 	/**
 	 * \brief Encodes a file into base 64
 	 *
@@ -92,35 +239,66 @@ private:
 	 * The file path must be the full path to the file and the file must be readable.
 	 *
 	 * \param[in] filePath The full path to the file to be encoded.
+	 * \param[in] pool The pool to encode large files on, or NULL to encode on the calling thread
 	 *
 	 * \return void
 	 */
-	void encodeFile(std::string filePath);
+	void encodeFile(const std::string &filePath, SimplyEmail::ThreadPool *pool);
 
 	/**
-	 * \brief Encodes three bytes represented as a std::string into four bytes represented as an std::string
+	 * \brief Encodes raw data and waits for it to finish
 	 *
-	 * \details Takes a three character string representing three bytes and converts it into a four character string
-	 * representing the base 64 conversion.
+	 * \param[in] raw The data to encode
+	 * \param[in] pool The pool to encode large data on, or NULL to encode on the calling thread
 	 *
-	 * \param[in] toEncode A three character string to be encoded
+	 * \return std::shared_ptr<std::string> The encoded data
+	 */
+	static std::shared_ptr<std::string> encodeAndWait(const std::shared_ptr<const std::string> &raw, SimplyEmail::ThreadPool *pool);
+
+	/**
+	 * \brief Sets the data member to an encoded string
+	 *
+	 * \param[in] encoded The encoded data
 	 *
-	 * \return std::string A four character string containing the base 64 encoding of the input string
+	 * \return void
 	 */
-	std::string encodeBytes(std::string toEncode);
+	void setData(const std::shared_ptr<std::string> &encoded);
 
 	/**
-	 * \brief Encodes three bytes represented as a char array into four bytes represented as an std::string
+	 * \brief Reads a whole file into memory
 	 *
-	 * \details Takes a three character string representing three bytes and converts it into a four character string
-	 * representing the base 64 conversion.
+	 * \param[in] filePath The full path to the file to be read
 	 *
-	 * \param[in] toEncode A three character string to be encoded
+	 * \return std::shared_ptr<const std::string> The contents of the file
+	 */
+	static std::shared_ptr<const std::string> readFile(const std::string &filePath);
+
+	/**
+	 * \brief Reads and encodes a stream block by block
+	 *
+	 * \details Calls the reader until it returns 0 and encodes every whole line of input as soon as it is read,
+	 * carrying any remainder over to the next block.
 	 *
-	 * \return std::string A four character string containing the base 64 encoding of the input string
+	 * \param[in] read Reads at most the given number of bytes into the buffer and returns how many it read
+	 *
+	 * \return void
 	 */
-	std::string encodeBytes(char* toEncode);
+	void encodeStream(const std::function<std::size_t(char*, std::size_t)> &read);
 
+	/**
+	 * \brief Base 64 encodes raw data into a buffer
+	 *
+	 * \details Sizes the output buffer then encodes the input into it. With a pool, the input is split into chunks of
+	 * PARALLEL_CHUNK_SIZE which are submitted as separate tasks; the returned futures complete when each chunk has been
+	 * written. The tasks keep the input alive. Without a pool the data is encoded before returning.
+	 *
+	 * \param[in] raw The data to encode
+	 * \param[out] output The buffer to encode into
+	 * \param[in] pool The pool to encode on, or NULL
+	 *
+	 * \return std::vector<std::future<void> > One future per submitted chunk
+	 */
+	static std::vector<std::future<void> > encodeData(const std::shared_ptr<const std::string> &raw, const std::shared_ptr<std::string> &output, SimplyEmail::ThreadPool *pool);
 
 };
 
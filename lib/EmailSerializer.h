@@ -0,0 +1,152 @@
+/**
+ * \file EmailSerializer.h
+ *
+ * \brief Header file for the binary form of emails passed between processes
+ */
+
+#ifndef EMAILSERIALIZER_H_
+#define EMAILSERIALIZER_H_
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+#include "./Email.h"
+
+namespace SimplyEmail {
+
+/**
+ * \brief A string held elsewhere, usually inside a serialized email
+ */
+struct StringRef {
+	const char *data;									/// The first character; not null terminated
+	std::size_t length;									/// The number of characters
+
+	std::string str() const;
+	bool operator==(const std::string &other) const;
+};
+
+/**
+ * \brief Writes emails in a compact binary form
+ *
+ * \details The format is versioned and written in native byte order, with a byte order mark the reader checks, as it
+ * is meant for handing messages between processes on one host. A 48 byte header is followed by a table with one
+ * 16 byte entry (offset and length) per field in the order from, reply to, subject, body, recipients, CCs, BCCs,
+ * for each attachment its file name, MIME type and encoded data, and for each additional header field its name and
+ * value. The field bytes follow the table; attachment data starts on 8 byte boundaries so that it can be used in
+ * place. Attachments are stored already base 64 encoded in lines of 76 characters, so the reader never encodes them
+ * again. Versions 1 and 2 stored them as a single line and are rejected; serialize such emails again.
+ */
+class EmailSerializer {
+public:
+	static const std::uint32_t FORMAT_VERSION;			/// The version written by serialize()
+
+	/**
+	 * \brief Calculates the size of an email's binary form
+	 *
+	 * \param[in] email The email
+	 *
+	 * \return std::size_t The number of bytes serialize() writes
+	 */
+	static std::size_t serializedSize(const SimplyEmail::Email &email);
+
+	/**
+	 * \brief Writes an email's binary form to a buffer
+	 *
+	 * \param[in] email The email
+	 * \param[out] output Receives serializedSize(email) bytes; should be 8 byte aligned
+	 *
+	 * \return std::size_t The number of bytes written
+	 */
+	static std::size_t serialize(const SimplyEmail::Email &email, char *output);
+
+	/**
+	 * \brief Gets an email's binary form
+	 *
+	 * \param[in] email The email
+	 *
+	 * \return std::string The binary form
+	 */
+	static std::string serialize(const SimplyEmail::Email &email);
+
+private:
+	EmailSerializer();
+};
+
+/**
+ * \brief Reads a serialized email in place
+ *
+ * \details Parsing checks the header and that every field lies inside the buffer, then every accessor returns a view
+ * into the buffer; nothing is copied or allocated. The buffer, for example a memory mapped file or shared memory,
+ * must outlive the view and every StringRef taken from it.
+ */
+class EmailView {
+public:
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \details Throws a std::runtime_error if the buffer does not hold a valid serialized email.
+	 *
+	 * \param[in] data The serialized email; must be 8 byte aligned
+	 * \param[in] length The length of the buffer
+	 *
+	 * \return void
+	 */
+	EmailView(const char *data, std::size_t length);
+
+	SimplyEmail::StringRef getFrom() const;
+	SimplyEmail::StringRef getReplyTo() const;
+	SimplyEmail::StringRef getSubject() const;
+	SimplyEmail::StringRef getBody() const;
+
+	std::size_t getRecipientNumber() const;
+	SimplyEmail::StringRef getRecipient(std::size_t recipientNumber) const;
+	std::size_t getCCNumber() const;
+	SimplyEmail::StringRef getCC(std::size_t ccNumber) const;
+	std::size_t getBCCNumber() const;
+	SimplyEmail::StringRef getBCC(std::size_t bccNumber) const;
+
+	std::size_t getAttachmentNumber() const;
+	SimplyEmail::StringRef getAttachmentFileName(std::size_t attachmentNumber) const;
+	SimplyEmail::StringRef getAttachmentMimeType(std::size_t attachmentNumber) const;
+
+	/**
+	 * \brief Gets the base 64 encoded data of an attachment
+	 *
+	 * \return StringRef The encoded data, 8 byte aligned within the buffer
+	 */
+	SimplyEmail::StringRef getAttachmentData(std::size_t attachmentNumber) const;
+
+	std::size_t getHeaderNumber() const;
+	SimplyEmail::StringRef getHeaderName(std::size_t headerNumber) const;
+	SimplyEmail::StringRef getHeaderValue(std::size_t headerNumber) const;
+
+	/**
+	 * \brief Builds an email from the view
+	 *
+	 * \details Addresses and text are copied. Attachment data is shared with the buffer, without copying, when an
+	 * owner of the buffer is given; the attachments then keep the owner alive. Otherwise it is copied.
+	 *
+	 * \param[in] owner Keeps the buffer alive, or NULL to copy attachment data
+	 *
+	 * \return Email The email
+	 */
+	SimplyEmail::Email toEmail(const std::shared_ptr<const char> &owner = std::shared_ptr<const char>()) const;
+
+private:
+	const char *data;									/// The serialized email
+	std::size_t length;									/// The length of the serialized email
+	std::size_t recipientCount;							/// The number of recipients
+	std::size_t ccCount;								/// The number of CCs
+	std::size_t bccCount;								/// The number of BCCs
+	std::size_t attachmentCount;						/// The number of attachments
+	std::size_t headerCount;							/// The number of additional header fields
+
+	SimplyEmail::StringRef field(std::size_t index) const;
+	std::size_t headerStart() const;
+	SimplyEmail::StringRef listField(std::size_t first, std::size_t count, std::size_t index, const char *name) const;
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* EMAILSERIALIZER_H_ */
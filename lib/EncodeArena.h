@@ -0,0 +1,172 @@
+/**
+ * \file EncodeArena.h
+ *
+ * \brief Header file for the encoding arena and its standard allocator adapter
+ *
+ * \details Declares a monotonic memory arena that message encoding can draw its strings from instead of the global
+ * allocator, and an allocator adapter so that standard strings and containers can use it.
+ */
+
+#ifndef ENCODEARENA_H_
+#define ENCODEARENA_H_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <new>
+
+namespace SimplyEmail {
+
+/**
+ * \brief Monotonic memory arena for message encoding
+ *
+ * \details Hands out memory by bumping a pointer through large blocks obtained from the global allocator. Individual
+ * deallocations are ignored; all memory is reclaimed at once by reset(). reset() keeps the largest block so that an
+ * arena reused for similar messages, for example one arena per sending thread reset after each send, stops touching
+ * the global allocator once it has grown to fit the largest message.
+ *
+ * An arena is not thread safe. Use one arena per thread.
+ */
+class EncodeArena {
+public:
+	static const std::size_t DEFAULT_BLOCK_SIZE;		/// The size of the first block when none is given
+
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \details Creates an arena. No memory is allocated until the first request.
+	 *
+	 * \param[in] initialBlockSize The size of the first block to allocate
+	 *
+	 * \return void
+	 */
+	explicit EncodeArena(std::size_t initialBlockSize = DEFAULT_BLOCK_SIZE);
+
+	/**
+	 * \brief Default destructor
+	 *
+	 * \details Returns every block to the global allocator
+	 */
+	~EncodeArena();
+
+	/**
+	 * \brief Allocates memory from the arena
+	 *
+	 * \details Returns suitably aligned memory from the current block, growing the arena by a block at least twice
+	 * the size of the previous one if the request does not fit.
+	 *
+	 * \param[in] bytes The number of bytes required
+	 * \param[in] alignment The required alignment; must be a power of two
+	 *
+	 * \return void* The allocated memory
+	 */
+	void* allocate(std::size_t bytes, std::size_t alignment);
+
+	/**
+	 * \brief Releases everything allocated from the arena
+	 *
+	 * \details Every pointer previously returned becomes invalid. The largest block is kept for reuse and the others
+	 * are returned to the global allocator.
+	 *
+	 * \return void
+	 */
+	void reset();
+
+	/**
+	 * \brief Gets the number of bytes handed out since the last reset
+	 *
+	 * \return std::size_t The number of bytes in use
+	 */
+	std::size_t getBytesUsed() const;
+
+	/**
+	 * \brief Gets the number of bytes held from the global allocator
+	 *
+	 * \return std::size_t The total size of every block
+	 */
+	std::size_t getBytesReserved() const;
+
+private:
+	struct Block {
+		char* memory;									/// The start of the block
+		std::size_t size;								/// The size of the block in bytes
+	};
+
+	std::vector<Block> blocks;							/// Every block held by the arena, the current one last
+	std::size_t nextBlockSize;							/// The minimum size of the next block to allocate
+	std::size_t offset;									/// The first free byte in the current block
+	std::size_t used;									/// Bytes handed out since the last reset
+
+	EncodeArena(const EncodeArena&);
+	EncodeArena& operator=(const EncodeArena&);
+};
+
+/**
+ * \brief Standard allocator drawing from an EncodeArena
+ *
+ * \details Allows standard strings and containers to be backed by an arena. An allocator without an arena falls back
+ * to the global allocator so that default constructed containers still work.
+ */
+template <class T>
+class ArenaAllocator {
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef std::size_t size_type;
+	typedef std::ptrdiff_t difference_type;
+
+	template <class U>
+	struct rebind {
+		typedef ArenaAllocator<U> other;
+	};
+
+	ArenaAllocator() : arena(NULL) {}
+	ArenaAllocator(EncodeArena &_arena) : arena(&_arena) {}
+
+	template <class U>
+	ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.getArena()) {}
+
+	T* allocate(std::size_t count) {
+		if(this->arena) {
+			return static_cast<T*>(this->arena->allocate(count * sizeof(T), alignof(T)));
+		}
+
+		return static_cast<T*>(::operator new(count * sizeof(T)));
+	}
+
+	void deallocate(T* memory, std::size_t) {
+		// Arena memory is reclaimed in bulk by EncodeArena::reset()
+		if(!this->arena) {
+			::operator delete(memory);
+		}
+	}
+
+	EncodeArena* getArena() const {
+		return this->arena;
+	}
+
+private:
+	EncodeArena* arena;									/// The arena to draw from, or NULL for the global allocator
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T> &lhs, const ArenaAllocator<U> &rhs) {
+	return lhs.getArena() == rhs.getArena();
+}
+
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T> &lhs, const ArenaAllocator<U> &rhs) {
+	return lhs.getArena() != rhs.getArena();
+}
+
+/**
+ * \brief A string whose storage comes from an EncodeArena
+ */
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char> > ArenaString;
+
+} /* namespace SimplyEmail */
+
+#endif /* ENCODEARENA_H_ */
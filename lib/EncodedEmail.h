@@ -0,0 +1,107 @@
+/**
+ * \file EncodedEmail.h
+ *
+ * \brief Header file for an encoded message held as a list of segments
+ */
+
+#ifndef ENCODEDEMAIL_H_
+#define ENCODEDEMAIL_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+namespace SimplyEmail {
+
+/**
+ * \brief An encoded message made of segments that live elsewhere
+ *
+ * \details Lets an encoded message be assembled from pieces without copying them into one string: a freshly rendered
+ * header, sections cached by the email and attachment data shared with its attachments. Every owned segment is kept
+ * alive by the message, so it stays valid when the email it came from is changed or destroyed. Borrowed segments must
+ * outlive the message.
+ */
+class EncodedEmail {
+public:
+	/**
+	 * \brief A run of bytes within the message
+	 */
+	struct Segment {
+		const char *data;								/// The first byte
+		std::size_t length;								/// The number of bytes
+	};
+
+	/**
+	 * \brief Default constructor
+	 *
+	 * \details Creates an empty message
+	 *
+	 * \return void
+	 */
+	EncodedEmail();
+
+	/**
+	 * \brief Appends bytes the message does not own
+	 *
+	 * \param[in] data The bytes, which must outlive the message
+	 * \param[in] length The number of bytes
+	 *
+	 * \return void
+	 */
+	void append(const char *data, std::size_t length);
+
+	/**
+	 * \brief Appends a shared string
+	 *
+	 * \param[in] text The string, kept alive by the message
+	 *
+	 * \return void
+	 */
+	void append(const std::shared_ptr<const std::string> &text);
+
+	/**
+	 * \brief Appends shared bytes
+	 *
+	 * \param[in] data The bytes, kept alive by the message
+	 * \param[in] length The number of bytes
+	 *
+	 * \return void
+	 */
+	void append(const std::shared_ptr<const char> &data, std::size_t length);
+
+	std::size_t getSize() const;
+	std::size_t getSegmentCount() const;
+	const Segment& getSegment(std::size_t segmentNumber) const;
+
+	/**
+	 * \brief Copies part of the message
+	 *
+	 * \details Finds the starting segment by binary search, so an upload reading the message block by block does not
+	 * walk the segments from the start each time. May be called from several threads at once.
+	 *
+	 * \param[in] offset The first byte to copy
+	 * \param[out] output Receives the bytes
+	 * \param[in] length The most bytes to copy
+	 *
+	 * \return std::size_t The number of bytes copied; less than length only at the end of the message
+	 */
+	std::size_t read(std::size_t offset, char *output, std::size_t length) const;
+
+	/**
+	 * \brief Joins the segments into one string
+	 *
+	 * \return std::string The whole message
+	 */
+	std::string str() const;
+
+private:
+	std::vector<Segment> segments;						/// The segments in order
+	std::vector<std::size_t> starts;					/// The message offset at which each segment starts
+	std::vector<std::shared_ptr<const void> > owners;	/// Keeps owned segments alive
+	std::size_t size;									/// The total length of the segments
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* ENCODEDEMAIL_H_ */
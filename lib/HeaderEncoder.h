@@ -0,0 +1,83 @@
+/**
+ * \file HeaderEncoder.h
+ *
+ * \brief Header file for the RFC 2047 encoder of header text
+ *
+ * \details Declares the encoder that writes header values outside 7 bit ASCII as encoded words.
+ */
+
+#ifndef HEADERENCODER_H_
+#define HEADERENCODER_H_
+
+#include <string>
+#include <cstddef>
+
+namespace SimplyEmail {
+
+/**
+ * \brief Encoder of unstructured header text such as the subject, as described by RFC 2047
+ *
+ * \details Header fields may only hold 7 bit ASCII, so text with any other characters is written as encoded words of
+ * the form =?UTF-8?B?...?= or =?UTF-8?Q?...?=. Only the words that need it are encoded, along with the white space
+ * between neighbouring encoded words, which decoders drop; the rest of the text is written as it is. All the encoded
+ * words of a value use whichever of the B (base 64) and Q (quoted printable) encodings is shorter for that value.
+ *
+ * Values are taken to be UTF-8. Encoded words are split only between characters, are at most MAX_WORD_LENGTH
+ * characters long and are folded onto lines of at most MAX_LINE_LENGTH characters. Plain words are folded at white
+ * space to keep within FOLD_COLUMN where they can be.
+ *
+ * Almost every value is plain ASCII. needsEncoding() tells such values apart sixteen bytes at a time with SSE2 and
+ * eight bytes at a time without it, so that callers can write them straight out and only call encode() for the rest.
+ * All members are static and reentrant.
+ */
+class HeaderEncoder {
+public:
+	static const std::size_t MAX_WORD_LENGTH;			/// The longest encoded word RFC 2047 allows
+	static const std::size_t MAX_LINE_LENGTH;			/// The longest line holding an encoded word RFC 2047 allows
+	static const std::size_t FOLD_COLUMN;				/// The line length folding keeps plain words within
+
+	/**
+	 * \brief Checks whether a header value must be encoded
+	 *
+	 * \details A value must be encoded if it holds characters outside 7 bit ASCII, or if it holds "=?" and so could be
+	 * mistaken for an encoded word when decoded.
+	 *
+	 * \param[in] value The value
+	 * \param[in] length The length of the value
+	 *
+	 * \return bool True if encode() would change the value
+	 */
+	static bool needsEncoding(const char *value, std::size_t length);
+
+	/**
+	 * \brief Encodes and folds a header value
+	 *
+	 * \details Appends the value with the words that need it encoded, folded with CRLF followed by white space. The
+	 * final line is not terminated.
+	 *
+	 * \param[in] value The value, in UTF-8
+	 * \param[in] length The length of the value
+	 * \param[in] column The column the value starts at, after the field name, colon and space
+	 * \param[out] output The string to append to
+	 *
+	 * \return void
+	 */
+	static void encode(const char *value, std::size_t length, std::size_t column, std::string &output);
+
+	/**
+	 * \brief Encodes and folds a header value
+	 *
+	 * \param[in] value The value, in UTF-8
+	 * \param[in] column The column the value starts at, after the field name, colon and space
+	 *
+	 * \return std::string The encoded value
+	 */
+	static std::string encode(const std::string &value, std::size_t column);
+
+private:
+	HeaderEncoder();
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* HEADERENCODER_H_ */
@@ -0,0 +1,217 @@
+/**
+ * \file HeaderList.h
+ *
+ * \brief Header file for the list of additional message header fields
+ */
+
+#ifndef HEADERLIST_H_
+#define HEADERLIST_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+
+#include "./HeaderEncoder.h"
+
+namespace SimplyEmail {
+
+/**
+ * \brief An ordered list of header fields stored in one flat buffer
+ *
+ * \details Names and values of every field share one contiguous buffer, indexed by a small table, so a message with
+ * many headers makes a handful of allocations and is written out in a single pass. Common names such as Message-ID
+ * or List-Unsubscribe are interned: they take no space in the buffer, compare by identity and are written with their
+ * canonical spelling. Names are matched without regard to case. Long values are folded at white space so that no line
+ * is longer than FOLD_COLUMN characters where the value allows.
+ *
+ * Values are taken as unstructured UTF-8 text. Those holding characters outside 7 bit ASCII are written as RFC 2047
+ * encoded words by HeaderEncoder; the rest are written as given. Values may not contain line breaks, which would let
+ * a value inject header fields of its own.
+ */
+class HeaderList {
+public:
+	static const std::size_t NOT_FOUND;					/// Returned by find() when no field has the name
+	static const std::size_t FOLD_COLUMN;				/// The line length folding keeps within
+
+	/**
+	 * \brief Default constructor
+	 *
+	 * \details Creates an empty list
+	 *
+	 * \return void
+	 */
+	HeaderList();
+
+	/**
+	 * \brief Appends a field
+	 *
+	 * \details Throws a std::runtime_error if the name is not a valid field name or the value contains a line break.
+	 *
+	 * \param[in] name The field name, without the colon
+	 * \param[in] value The field value
+	 *
+	 * \return void
+	 */
+	void add(const std::string &name, const std::string &value);
+
+	/**
+	 * \brief Sets a field, replacing any fields of the same name
+	 *
+	 * \details The first field of the name keeps its position and takes the new value; any others are removed. The
+	 * field is appended if there is none.
+	 *
+	 * \param[in] name The field name, without the colon
+	 * \param[in] value The field value
+	 *
+	 * \return void
+	 */
+	void set(const std::string &name, const std::string &value);
+
+	/**
+	 * \brief Removes every field of a name
+	 *
+	 * \param[in] name The field name
+	 *
+	 * \return std::size_t The number of fields removed
+	 */
+	std::size_t remove(const std::string &name);
+
+	/**
+	 * \brief Finds a field by name
+	 *
+	 * \param[in] name The field name
+	 * \param[in] start The first position to look at
+	 *
+	 * \return std::size_t The position of the first matching field at or after start, or NOT_FOUND
+	 */
+	std::size_t find(const std::string &name, std::size_t start = 0) const;
+
+	std::size_t getCount() const;
+	std::string getName(std::size_t fieldNumber) const;
+	std::string getValue(std::size_t fieldNumber) const;
+
+	void clear();
+
+	/**
+	 * \brief Estimates the encoded size of the fields
+	 *
+	 * \return std::size_t A slight overestimate of the bytes encodeTo() appends
+	 */
+	std::size_t encodedSizeHint() const;
+
+	/**
+	 * \brief Appends every field, folded and terminated with CRLF
+	 *
+	 * \param[out] buffer The buffer to append to; it only needs an append(const char*, std::size_t) function
+	 *
+	 * \return void
+	 */
+	template <class Buffer>
+	void encodeTo(Buffer &buffer) const;
+
+	/**
+	 * \brief Checks that a string is a valid field name
+	 *
+	 * \details A field name is one or more printable ASCII characters other than the colon.
+	 *
+	 * \param[in] name The name to check
+	 *
+	 * \return bool True if the name is valid
+	 */
+	static bool isValidName(const std::string &name);
+
+private:
+	/**
+	 * \brief Locates one field within the buffer
+	 */
+	struct Field {
+		std::uint32_t nameId;							/// The interned name, or CUSTOM_NAME
+		std::uint32_t nameOffset;						/// The offset of a custom name in the buffer
+		std::uint32_t nameLength;						/// The length of the name
+		std::uint32_t valueOffset;						/// The offset of the value in the buffer
+		std::uint32_t valueLength;						/// The length of the value
+	};
+
+	static const std::uint32_t CUSTOM_NAME;				/// The name is stored in the buffer
+
+	std::string text;									/// Custom names and every value, back to back
+	std::vector<Field> fields;							/// The fields in order
+
+	/**
+	 * \brief Looks up an interned name
+	 *
+	 * \param[in] name The name to look up, in any case
+	 *
+	 * \return std::uint32_t The interned name's identifier, or CUSTOM_NAME
+	 */
+	static std::uint32_t intern(const std::string &name);
+
+	const char* nameData(const Field &field) const;
+
+	bool matches(const Field &field, std::uint32_t nameId, const std::string &name) const;
+
+	/**
+	 * \brief Rewrites the buffer without the text of removed fields
+	 *
+	 * \return void
+	 */
+	void compact();
+
+	/**
+	 * \brief Finds where to fold a value
+	 *
+	 * \details Breaks before the last white space that keeps the line within FOLD_COLUMN, or the first one after it
+	 * if the line cannot be kept that short. The white space starts the continuation line.
+	 *
+	 * \param[in] value The value
+	 * \param[in] length The length of the value
+	 * \param[in] position Where the current line's part of the value starts
+	 * \param[in] column The column position is written at
+	 *
+	 * \return std::size_t Where the next line starts, or length if the rest fits
+	 */
+	static std::size_t nextFold(const char *value, std::size_t length, std::size_t position, std::size_t column);
+};
+
+template <class Buffer>
+void HeaderList::encodeTo(Buffer &buffer) const {
+	for(std::size_t i=0; i<this->fields.size(); i++){
+		const Field &field = this->fields[i];
+		const char *value = this->text.data() + field.valueOffset;
+
+		buffer.append(this->nameData(field), field.nameLength);
+		buffer.append(": ", 2);
+
+		std::size_t column = field.nameLength + 2;
+		std::size_t position = 0;
+
+		if(HeaderEncoder::needsEncoding(value, field.valueLength)) {
+			std::string encoded;
+			HeaderEncoder::encode(value, field.valueLength, column, encoded);
+
+			buffer.append(encoded.data(), encoded.length());
+			buffer.append("\r\n", 2);
+
+			continue;
+		}
+
+		while(true) {
+			std::size_t fold = nextFold(value, field.valueLength, position, column);
+
+			buffer.append(value + position, fold - position);
+			buffer.append("\r\n", 2);
+
+			if(fold == field.valueLength) {
+				break;
+			}
+
+			position = fold;
+			column = 0;
+		}
+	}
+}
+
+} /* namespace SimplyEmail */
+
+#endif /* HEADERLIST_H_ */
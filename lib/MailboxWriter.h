@@ -0,0 +1,186 @@
+/**
+ * \file MailboxWriter.h
+ *
+ * \brief Header file for writing encoded emails to a Maildir or mbox instead of sending them
+ */
+
+#ifndef MAILBOXWRITER_H_
+#define MAILBOXWRITER_H_
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "./Email.h"
+
+namespace SimplyEmail {
+
+/**
+ * \brief A copy of the counters of a mailbox writer
+ */
+struct MailboxStats {
+	std::uint64_t messages;								/// Messages written; in MAILDIR format, delivered into new
+	std::uint64_t bytes;								/// Bytes written
+	std::uint64_t discarded;							/// Maildir messages removed from tmp because their batch failed
+	std::uint64_t syncs;								/// Batches flushed to stable storage
+	double seconds;										/// The time since the first write
+	double messagesPerSecond;							/// Messages written per second since the first write
+};
+
+/**
+ * \brief Writes encoded emails to disk in place of an SMTP relay
+ *
+ * \details An offline sink for disaster recovery, air gapped delivery and benchmarking without a network. In MAILDIR
+ * format each message is written to its own file in tmp and renamed into new; the directory and its tmp, new and cur
+ * subdirectories are created if missing. Files keep the CRLF line ends of the encoded message, which is written
+ * straight from its segments without being joined. In MBOX format messages are appended to one file under an
+ * exclusive lock held for the writer's lifetime, with LF line ends, a From line giving the envelope sender and
+ * mboxrd escaping of body lines that start with "From " after any number of '>'.
+ *
+ * Durability is batched: every syncBatch messages are flushed to stable storage together, and in MAILDIR format only
+ * then renamed into new, so a message is never visible before it is durable and one directory sync covers the whole
+ * batch. Each Maildir message of a batch keeps its file open until the batch is synced, so batches are capped at
+ * MAX_SYNC_BATCH. If a batch cannot be synced or delivered, its messages still in tmp are removed and counted as
+ * discarded, and the writer that completed the batch throws. A syncBatch of 0 never syncs, for benchmarking.
+ *
+ * write() may be called from several threads at once. Maildir messages are written fully in parallel; mbox messages
+ * are formatted in parallel and appended one at a time.
+ */
+class MailboxWriter {
+public:
+	static const int MAILDIR;							/// One file per message in a Maildir
+	static const int MBOX;								/// One append only mbox file
+
+	static const unsigned int DEFAULT_SYNC_BATCH;		/// Messages flushed to stable storage together when none is given
+	static const unsigned int MAX_SYNC_BATCH;			/// The largest batch, which bounds the open Maildir files
+
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \details Throws a std::runtime_error if the Maildir cannot be created, or the mbox cannot be opened or is locked
+	 * by another writer.
+	 *
+	 * \param[in] path The Maildir directory or the mbox file
+	 * \param[in] format MAILDIR or MBOX
+	 * \param[in] syncBatch Messages flushed to stable storage together, at most MAX_SYNC_BATCH; 0 never flushes
+	 *
+	 * \return void
+	 */
+	MailboxWriter(const std::string &path, int format = MAILDIR, unsigned int syncBatch = DEFAULT_SYNC_BATCH);
+
+	/**
+	 * \brief Default destructor
+	 *
+	 * \details Flushes any unsynced messages, ignoring errors, and closes the mbox.
+	 */
+	~MailboxWriter();
+
+	/**
+	 * \brief Encodes and writes an email
+	 *
+	 * \details Throws a std::runtime_error if the message cannot be written.
+	 *
+	 * \param[in] email A reference to the email to write
+	 *
+	 * \return void
+	 */
+	void write(const SimplyEmail::Email &email);
+
+	/**
+	 * \brief Writes several emails on a pool of threads, then flushes
+	 *
+	 * \details If any email cannot be written the first error is rethrown once every other has been tried.
+	 *
+	 * \param[in] emails The emails to write
+	 * \param[in] threads The number of writer threads; 0 uses one thread per hardware thread
+	 *
+	 * \return void
+	 */
+	void writeAll(const std::vector<SimplyEmail::Email> &emails, unsigned int threads = 0);
+
+	/**
+	 * \brief Flushes every written message to stable storage
+	 *
+	 * \details In MAILDIR format also moves the flushed messages into new.
+	 *
+	 * \return void
+	 */
+	void flush();
+
+	SimplyEmail::MailboxStats getStats() const;
+	const std::string& getPath() const;
+	int getFormat() const;
+
+private:
+	/**
+	 * \brief A Maildir message written to tmp and waiting for its batch to be synced
+	 */
+	struct PendingFile {
+		int descriptor;									/// The open file
+		std::string name;								/// The file name within tmp
+		std::uint64_t size;								/// The length of the message
+	};
+
+	std::string path;									/// The Maildir directory or the mbox file
+	int format;											/// MAILDIR or MBOX
+	unsigned int syncBatch;								/// Messages flushed together, or 0
+	std::string hostName;								/// The host part of Maildir file names
+
+	mutable std::mutex mutex;							/// Guards the members below
+	std::vector<PendingFile> pending;					/// Maildir messages not yet synced
+	int mbox;											/// The mbox file, or -1
+	unsigned int unsynced;								/// Mbox messages not yet synced
+	bool started;										/// Whether anything has been written
+	std::chrono::steady_clock::time_point firstWrite;	/// When the first message was written
+
+	std::atomic<std::uint64_t> messages;				/// Messages written
+	std::atomic<std::uint64_t> bytes;					/// Bytes written
+	std::atomic<std::uint64_t> discarded;				/// Maildir messages removed after their batch failed
+	std::atomic<std::uint64_t> syncs;					/// Batches flushed
+	std::atomic<std::uint64_t> sequence;				/// Makes Maildir file names unique within the process
+
+	MailboxWriter(const MailboxWriter &other);
+	MailboxWriter& operator=(const MailboxWriter &other);
+
+	void writeMaildir(const SimplyEmail::Email &email);
+	void writeMbox(const SimplyEmail::Email &email);
+
+	/**
+	 * \brief Syncs a batch of Maildir messages and moves them into new
+	 *
+	 * \details Throws a std::runtime_error after removing the messages left in tmp if the batch cannot be synced or
+	 * delivered.
+	 *
+	 * \param[in] batch The messages, whose descriptors are closed
+	 *
+	 * \return void
+	 */
+	void syncMaildir(std::vector<PendingFile> &batch);
+
+	/**
+	 * \brief Creates a unique Maildir file name
+	 *
+	 * \return std::string The name, in the usual time.MmicrosPpidQsequence.host form
+	 */
+	std::string uniqueName();
+
+	/**
+	 * \brief Converts an encoded message to an mbox entry
+	 *
+	 * \param[in] from The envelope sender
+	 * \param[in] message The encoded message
+	 * \param[out] output Receives the From line and the escaped message with LF line ends
+	 *
+	 * \return void
+	 */
+	static void formatMbox(const std::string &from, const std::string &message, std::string &output);
+
+	void recordStart();
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* MAILBOXWRITER_H_ */
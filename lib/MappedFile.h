@@ -0,0 +1,55 @@
+/**
+ * \file MappedFile.h
+ *
+ * \brief Header file for read only memory mapped files
+ */
+
+#ifndef MAPPEDFILE_H_
+#define MAPPEDFILE_H_
+
+#include <string>
+#include <cstddef>
+#include <stdexcept>
+
+namespace SimplyEmail {
+
+/**
+ * \brief Read only memory mapping of a whole file
+ *
+ * \details Maps a file into memory for the lifetime of the object. The mapping is private and read only, so the
+ * contents may be shared between threads without locking.
+ */
+class MappedFile {
+public:
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \details Opens and maps the given file. Empty files are valid and have a NULL data pointer.
+	 *
+	 * \param[in] filePath The path of the file to map
+	 *
+	 * \return void
+	 */
+	explicit MappedFile(const std::string &filePath);
+
+	/**
+	 * \brief Default destructor
+	 *
+	 * \details Unmaps the file
+	 */
+	~MappedFile();
+
+	const char* getData() const;
+	std::size_t getSize() const;
+
+private:
+	char* data;											/// The start of the mapping
+	std::size_t size;									/// The length of the mapping in bytes
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* MAPPEDFILE_H_ */
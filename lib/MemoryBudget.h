@@ -0,0 +1,136 @@
+/**
+ * \file MemoryBudget.h
+ *
+ * \brief Header file for the byte budget of queued messages
+ */
+
+#ifndef MEMORYBUDGET_H_
+#define MEMORYBUDGET_H_
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+namespace SimplyEmail {
+
+/**
+ * \brief Holds message data that can be moved out of memory on request
+ */
+class Spillable {
+public:
+	virtual ~Spillable() {}
+
+	/**
+	 * \brief Moves held data out of memory
+	 *
+	 * \details Implementations spill whole messages, the least urgent first, until at least the requested number of
+	 * bytes has been released back to the budget or nothing more can be spilled.
+	 *
+	 * \param[in] bytes The number of bytes wanted
+	 *
+	 * \return std::size_t The number of bytes released
+	 */
+	virtual std::size_t spill(std::size_t bytes) = 0;
+};
+
+/**
+ * \brief Limits the memory held by queued and in flight messages
+ *
+ * \details Queues charge the encoded size of each message they hold to a budget, usually one shared by the whole
+ * process. Once the charged bytes pass the soft limit, the budget asks the registered queues to spill messages to the
+ * scratch directory; spilled messages are memory mapped back when they are sent. A charge that would pass the hard
+ * limit first tries spilling, then either waits for memory to be released or fails, depending on the overflow policy.
+ *
+ * All member functions may be called from any thread. Queues must unregister before they are destroyed.
+ */
+class MemoryBudget {
+public:
+	static const int BLOCK;								/// Wait for memory when the hard limit would be passed
+	static const int FAIL;								/// Throw when the hard limit would be passed
+
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \param[in] softLimit The bytes above which queued messages are spilled to disk
+	 * \param[in] hardLimit The bytes that may never be passed
+	 * \param[in] scratchDirectory The directory spilled messages are written to; empty disables spilling
+	 * \param[in] overflow BLOCK or FAIL
+	 *
+	 * \return void
+	 */
+	MemoryBudget(std::size_t softLimit, std::size_t hardLimit, const std::string &scratchDirectory, int overflow = BLOCK);
+
+	/**
+	 * \brief Charges bytes to the budget
+	 *
+	 * \details Spills queued messages if the charge passes the soft limit. If it would pass the hard limit even after
+	 * spilling, waits for other charges to be released or throws a std::runtime_error, depending on the overflow
+	 * policy. Charges larger than the hard limit always throw.
+	 *
+	 * \param[in] bytes The number of bytes to charge
+	 *
+	 * \return void
+	 */
+	void acquire(std::size_t bytes);
+
+	/**
+	 * \brief Returns bytes to the budget
+	 *
+	 * \param[in] bytes The number of bytes previously charged
+	 *
+	 * \return void
+	 */
+	void release(std::size_t bytes);
+
+	/**
+	 * \brief Records bytes that were spilled to disk
+	 *
+	 * \details Called by queues after they spill a message and release its charge.
+	 *
+	 * \param[in] bytes The number of bytes written to disk
+	 *
+	 * \return void
+	 */
+	void recordSpill(std::size_t bytes);
+
+	void registerSpillable(SimplyEmail::Spillable *spillable);
+	void unregisterSpillable(SimplyEmail::Spillable *spillable);
+
+	std::size_t getUsed() const;
+	std::size_t getSoftLimit() const;
+	std::size_t getHardLimit() const;
+	const std::string& getScratchDirectory() const;
+	std::uint64_t getSpilledBytes() const;
+	std::uint64_t getSpilledMessages() const;
+
+private:
+	std::size_t softLimit;								/// The bytes above which messages are spilled
+	std::size_t hardLimit;								/// The bytes that may never be passed
+	std::string scratchDirectory;						/// Where spilled messages are written
+	int overflow;										/// BLOCK or FAIL
+
+	mutable std::mutex mutex;							/// Guards every member below
+	std::condition_variable released;					/// Signalled when bytes are released
+	std::size_t used;									/// The bytes charged
+	std::uint64_t spilledBytes;							/// Bytes spilled since construction
+	std::uint64_t spilledMessages;						/// Messages spilled since construction
+	std::vector<SimplyEmail::Spillable*> spillables;	/// The queues that can spill
+
+	MemoryBudget(const MemoryBudget &other);
+	MemoryBudget& operator=(const MemoryBudget &other);
+
+	/**
+	 * \brief Asks every registered queue to spill until the given bytes are released
+	 *
+	 * \details Must be called without the mutex held, as queues release their charges while spilling.
+	 *
+	 * \return std::size_t The bytes released
+	 */
+	std::size_t spillQueues(std::size_t bytes);
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* MEMORYBUDGET_H_ */
@@ -0,0 +1,177 @@
+/**
+ * \file Metrics.h
+ *
+ * \brief Header file for the library wide metrics registry.
+ *
+ * \details Declares cheap, lock free counters, gauges and latency histograms that are updated by the library as it
+ * encodes and sends mail, together with a snapshot type that can be rendered in the Prometheus text exposition
+ * format. The library never serves the metrics itself; callers expose the rendered text however they see fit.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+namespace SimplyEmail {
+
+/**
+ * \brief Fixed bucket latency histogram
+ *
+ * \details Records durations in microseconds into a fixed set of cumulative buckets. Recording is a handful of
+ * relaxed atomic increments so it can be used on the hot sending path from any number of threads.
+ */
+class LatencyHistogram {
+public:
+	static const unsigned int BUCKET_COUNT = 14;			/// Number of finite buckets; an implicit +Inf bucket follows
+	static const std::uint64_t BUCKET_BOUNDS[BUCKET_COUNT];	/// Upper bounds of the finite buckets in microseconds
+
+	/**
+	 * \brief Default constructor
+	 *
+	 * \details Creates an empty histogram
+	 *
+	 * \return void
+	 */
+	LatencyHistogram();
+
+	/**
+	 * \brief Records a single observation
+	 *
+	 * \param[in] micros The observed duration in microseconds
+	 *
+	 * \return void
+	 */
+	void observe(std::uint64_t micros);
+
+	/**
+	 * \brief Copies the current histogram values
+	 *
+	 * \param[out] buckets Receives the non-cumulative count of each bucket, including the final +Inf bucket
+	 * \param[out] count Receives the total number of observations
+	 * \param[out] sum Receives the sum of all observations in microseconds
+	 *
+	 * \return void
+	 */
+	void read(std::vector<std::uint64_t> &buckets, std::uint64_t &count, std::uint64_t &sum) const;
+
+	/**
+	 * \brief Discards every observation
+	 *
+	 * \return void
+	 */
+	void reset();
+
+private:
+	std::atomic<std::uint64_t> buckets[BUCKET_COUNT + 1];	/// Per bucket observation counts, the last being +Inf
+	std::atomic<std::uint64_t> sum;							/// Sum of all observations in microseconds
+
+	LatencyHistogram(const LatencyHistogram&);
+	LatencyHistogram& operator=(const LatencyHistogram&);
+};
+
+/**
+ * \brief Point in time copy of a latency histogram
+ */
+struct HistogramSnapshot {
+	std::vector<std::uint64_t> buckets;						/// Non-cumulative bucket counts, the last being +Inf
+	std::uint64_t count;									/// Total number of observations
+	std::uint64_t sum;										/// Sum of all observations in microseconds
+};
+
+/**
+ * \brief Point in time copy of every library metric
+ *
+ * \details Returned by Metrics::snapshot(). The values are read individually with relaxed ordering, so a snapshot
+ * taken while mail is being sent is consistent per metric but not necessarily across metrics.
+ */
+struct MetricsSnapshot {
+	std::vector<std::uint64_t> messagesFailed;				/// Failed sends indexed by Metrics::FailureClass
+	std::uint64_t messagesSent;								/// Messages accepted by the SMTP server
+	std::uint64_t bytesEncoded;								/// Bytes produced by Email::encode
+	std::uint64_t bytesSent;								/// Payload bytes uploaded to SMTP servers
+	std::uint64_t attachmentCacheHits;						/// Attachments served from a cache instead of being re-encoded
+	std::int64_t queueDepth;								/// Messages currently waiting in library queues
+	std::int64_t activeConnections;							/// SMTP connections currently initialized
+
+	HistogramSnapshot encodeLatency;						/// Time spent in Email::encode
+	HistogramSnapshot sendLatency;							/// Time spent transferring a message to the SMTP server
+
+	/**
+	 * \brief Renders the snapshot in the Prometheus text exposition format
+	 *
+	 * \details Produces version 0.0.4 of the text format with HELP and TYPE lines. Metric names are prefixed with
+	 * "simplyemail_" and durations are exported in seconds as is conventional for Prometheus.
+	 *
+	 * \return std::string The rendered metrics
+	 */
+	std::string toPrometheus() const;
+};
+
+/**
+ * \brief Library wide metrics registry
+ *
+ * \details All members are static; the registry is shared by every Email and SMTPConnection in the process. Updates
+ * are relaxed atomic operations and never block.
+ */
+class Metrics {
+public:
+	/**
+	 * \brief Broad classes of send failures
+	 *
+	 * \details CURL error codes are folded into these classes so that the exported metrics have a small, stable set
+	 * of label values.
+	 */
+	enum FailureClass {
+		FAILURE_CONNECT = 0,								/// DNS, TCP or TLS failures reaching the server
+		FAILURE_AUTH,										/// The server refused the supplied credentials
+		FAILURE_TIMEOUT,									/// The operation did not complete in time
+		FAILURE_REJECTED,									/// The server rejected the sender, a recipient or the data
+		FAILURE_TRANSFER,									/// The connection failed while data was being exchanged
+		FAILURE_OTHER,										/// Anything not covered above
+		FAILURE_CLASS_COUNT
+	};
+
+	/**
+	 * \brief Gets the label used for a failure class
+	 *
+	 * \param[in] failureClass The failure class
+	 *
+	 * \return const char* The label; "other" if the class is out of range
+	 */
+	static const char* failureClassName(int failureClass);
+
+	static void recordSent(std::uint64_t bytes, std::uint64_t micros);
+	static void recordFailed(int failureClass, std::uint64_t micros);
+	static void recordEncoded(std::uint64_t bytes, std::uint64_t micros);
+	static void recordAttachmentCacheHit();
+	static void adjustQueueDepth(std::int64_t delta);
+	static void adjustActiveConnections(std::int64_t delta);
+
+	/**
+	 * \brief Copies the current value of every metric
+	 *
+	 * \return MetricsSnapshot The copied values
+	 */
+	static MetricsSnapshot snapshot();
+
+	/**
+	 * \brief Resets every counter and histogram to zero
+	 *
+	 * \details Gauges are left untouched since they track live objects. Intended for benchmarks that want to measure
+	 * a single run.
+	 *
+	 * \return void
+	 */
+	static void reset();
+
+private:
+	Metrics();
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* METRICS_H_ */
@@ -0,0 +1,500 @@
+/**
+ * \file NativeSMTPConnection.h
+ *
+ * \brief Header file for the SMTP client that pipelines commands over a non-blocking socket
+ */
+
+#ifndef NATIVESMTPCONNECTION_H_
+#define NATIVESMTPCONNECTION_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <sys/socket.h>
+
+#include "./Email.h"
+#include "./EncodedEmail.h"
+#include "./SMTPConnection.h"
+#include "./SMTPEventLoop.h"
+#include "./TimerWheel.h"
+
+typedef struct ssl_st SSL;
+typedef struct ssl_session_st SSL_SESSION;
+
+namespace SimplyEmail {
+
+/**
+ * \brief Sends email over one SMTP session that an SMTPEventLoop drives, pipelining the envelope
+ *
+ * \details An alternative to SMTPConnection that speaks SMTP itself instead of through CURL. When the server
+ * advertises PIPELINING (RFC 2920), MAIL FROM, every RCPT TO and DATA go out in a single write and their replies are
+ * read back together, so a message costs two round trips however many recipients it has, where CURL spends one per
+ * command. Without PIPELINING the commands are sent one at a time.
+ *
+ * The session is kept open between messages and reopened when needed. An smtps:// address uses TLS from the start;
+ * an smtp:// address upgrades with STARTTLS as set by setStartTLS(). Servers are verified against the trusted
+ * certificates and the host name of the address, and TLS sessions are resumed on reconnection. A username selects
+ * AUTH PLAIN, or AUTH LOGIN where PLAIN is not offered.
+ *
+ * Failures are reported as by SMTPConnection: an SMTPError carrying the equivalent CURL result, the last SMTP reply and
+ * the failure class, or an SMTPTimeout. A message is only sent if every recipient is accepted.
+ *
+ * send() and sendAsync() may be called from any thread, and messages are sent in the order they were submitted. The
+ * host name is resolved by the constructor, so the loop thread never blocks on DNS.
+ */
+class NativeSMTPConnection {
+	friend class SMTPEventLoop;
+
+public:
+	static const int STARTTLS_NEVER;					/// Never upgrade an smtp:// session
+	static const int STARTTLS_IF_OFFERED;				/// Upgrade an smtp:// session when the server offers STARTTLS
+	static const int STARTTLS_REQUIRED;					/// Fail every send unless an smtp:// session can be upgraded
+
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \details Resolves the server's address but does not connect until the first send. Throws a std::runtime_error if
+	 * the address is not an smtp:// or smtps:// URL or cannot be resolved.
+	 *
+	 * \param[in] address The server, such as smtp://relay.example.com:587; the port defaults to 25, or 465 for smtps://
+	 * \param[in] username The username to authenticate with, or empty for none
+	 * \param[in] password The password to authenticate with
+	 * \param[in] loop The loop that drives the session, which must outlive the connection
+	 *
+	 * \return void
+	 */
+	NativeSMTPConnection(const std::string &address, const std::string &username, const std::string &password, SimplyEmail::SMTPEventLoop &loop);
+
+	/**
+	 * \brief Default destructor
+	 *
+	 * \details Sends every submitted message, then quits the session.
+	 */
+	~NativeSMTPConnection();
+
+	/**
+	 * \brief Sends an email
+	 *
+	 * \details Blocks until the server has accepted or refused the message. Throws an SMTPError if it was not sent,
+	 * and a std::runtime_error if every recipient is suppressed.
+	 *
+	 * \param[in] email A reference to the email to be sent
+	 *
+	 * \return void
+	 */
+	void send(const SimplyEmail::Email &email);
+
+	/**
+	 * \brief Sends an email, giving up at a deadline
+	 *
+	 * \details As send(), but throws an SMTPTimeout if the message has not been accepted by the deadline, which also
+	 * shortens the total timeout.
+	 *
+	 * \param[in] email A reference to the email to be sent
+	 * \param[in] deadline When to give up
+	 *
+	 * \return void
+	 */
+	void send(const SimplyEmail::Email &email, std::chrono::steady_clock::time_point deadline);
+
+	/**
+	 * \brief Queues an email to be sent
+	 *
+	 * \details Encodes the email before returning, so it need not outlive the call.
+	 *
+	 * \param[in] email A reference to the email to be sent
+	 *
+	 * \return std::future<void> Becomes ready once the email is sent; rethrows the SMTPError if it was not
+	 */
+	std::future<void> sendAsync(const SimplyEmail::Email &email);
+	std::future<void> sendAsync(const SimplyEmail::Email &email, std::chrono::steady_clock::time_point deadline);
+
+	/**
+	 * \brief Waits until every submitted email has been sent or has failed
+	 *
+	 * \return void
+	 */
+	void flush();
+
+	/**
+	 * \brief Sets the limits on each send
+	 *
+	 * \details The connect timeout covers connecting, TLS, the greeting and authentication; the total timeout one
+	 * message from the start of its transaction; and a transfer is stalled when no bytes move for lowSpeedTime. Must
+	 * not be called while sending.
+	 *
+	 * \param[in] timeouts The limits
+	 *
+	 * \return void
+	 */
+	void setTimeouts(const SimplyEmail::SendTimeouts &timeouts);
+	const SimplyEmail::SendTimeouts& getTimeouts() const;
+
+	/**
+	 * \brief Sets when an smtp:// session is upgraded to TLS
+	 *
+	 * \details Defaults to STARTTLS_IF_OFFERED. Must not be called while sending.
+	 *
+	 * \param[in] mode STARTTLS_NEVER, STARTTLS_IF_OFFERED or STARTTLS_REQUIRED
+	 *
+	 * \return void
+	 */
+	void setStartTLS(int mode);
+	int getStartTLS() const;
+
+	/**
+	 * \brief Sets whether the commands and replies are printed to stderr
+	 *
+	 * \details Message data is never printed. Off by default. Must not be called while sending.
+	 *
+	 * \param[in] verbose True to print the conversation
+	 *
+	 * \return void
+	 */
+	void setVerbose(bool verbose);
+	bool getVerbose() const;
+
+	/**
+	 * \brief Sets the list of addresses that must not be sent to
+	 *
+	 * \details As SMTPConnection::setSuppressionList(). Must not be called while sending.
+	 *
+	 * \param[in] list The list, which must outlive the connection, or NULL to send to every recipient
+	 *
+	 * \return void
+	 */
+	void setSuppressionList(const SimplyEmail::SuppressionList *list);
+	const SimplyEmail::SuppressionList* getSuppressionList() const;
+
+	/**
+	 * \brief Checks whether the server advertised PIPELINING
+	 *
+	 * \return bool True if the last session's EHLO reply offered PIPELINING
+	 */
+	bool isPipelining() const;
+
+	/**
+	 * \brief Checks whether the session is encrypted
+	 *
+	 * \return bool True if the last session used TLS
+	 */
+	bool isEncrypted() const;
+
+	/**
+	 * \brief Gets the largest message the server accepts
+	 *
+	 * \details Learned from the SIZE extension (RFC 1870) in the server's EHLO reply. A message over the limit fails
+	 * with an SMTPError carrying CURLE_FILESIZE_EXCEEDED before its MAIL command is sent. Messages within it declare
+	 * their size in the MAIL command.
+	 *
+	 * \return std::uint64_t The limit in bytes from the last session, or 0 if it is unknown or the server sets none
+	 */
+	std::uint64_t getSizeLimit() const;
+
+	const std::string& getAddress() const;
+	const std::string& getUsername() const;
+
+private:
+	/**
+	 * \brief A message waiting for or in its transaction
+	 */
+	struct Job {
+		std::string from;								/// The envelope sender
+		std::vector<std::string> recipients;			/// The envelope recipients
+		SimplyEmail::EncodedEmail payload;				/// The encoded message
+		std::promise<void> done;						/// Reports the outcome
+		std::chrono::steady_clock::time_point started;	/// When its transaction started
+		std::chrono::steady_clock::time_point deadline;	/// When its total timeout runs out
+	};
+
+	/**
+	 * \brief The states of the session
+	 */
+	enum State {
+		CLOSED,											/// No socket
+		CONNECTING,										/// Waiting for the TCP connection
+		HANDSHAKE,										/// Negotiating TLS
+		GREETING,										/// Waiting for the 220 greeting
+		EHLO,											/// Waiting for the reply to EHLO
+		HELO,											/// Waiting for the reply to HELO, after EHLO was refused
+		STARTTLS,										/// Waiting for the reply to STARTTLS
+		AUTH,											/// Authenticating
+		READY,											/// Waiting for a message
+		ENVELOPE,										/// Waiting for the replies to MAIL, RCPT and DATA
+		DATA,											/// Uploading the message
+		DATA_REPLY,										/// Waiting for the reply to the end of the data
+		RSET											/// Waiting for the reply to RSET after a refused envelope
+	};
+
+	std::string address;								/// The server URL
+	std::string username;								/// The username, or empty
+	std::string password;								/// The password
+	std::string host;									/// The host name from the URL
+	bool implicitTLS;									/// The URL was smtps://
+	std::vector<struct sockaddr_storage> addresses;		/// The resolved addresses of the host
+	std::vector<socklen_t> addressLengths;				/// The length of each resolved address
+	std::string localName;								/// The name sent with EHLO
+
+	SimplyEmail::SMTPEventLoop &loop;					/// The loop driving the session
+	SimplyEmail::SendTimeouts timeouts;					/// The limits on each send
+	int startTLS;										/// When to upgrade with STARTTLS
+	bool verbose;										/// Whether the conversation is printed
+	const SimplyEmail::SuppressionList *suppression;	/// The addresses left out of every envelope, or NULL
+	std::atomic<bool> pipelining;						/// The server offered PIPELINING
+	std::atomic<bool> encrypted;						/// The session uses TLS
+	std::atomic<std::uint64_t> sizeLimit;				/// The server's advertised SIZE limit, or 0
+
+	std::mutex mutex;									/// Guards queue and outstanding
+	std::condition_variable idle;						/// Signalled when outstanding reaches zero
+	std::deque<std::unique_ptr<Job> > queue;			/// Messages waiting for the session
+	std::size_t outstanding;							/// Messages submitted but not yet finished
+
+	//Only used on the loop thread
+	State state;										/// The state of the session
+	int socket;											/// The socket, or -1
+	SSL *tls;											/// The TLS session, or NULL
+	SSL_SESSION *resumable;								/// The last TLS session, kept for resumption
+	std::uint32_t events;								/// The epoll events the socket is watched for, or 0
+	bool tlsWantsWrite;									/// OpenSSL is waiting for the socket to take more bytes
+	std::size_t addressIndex;							/// The resolved address being connected to
+	std::string input;									/// Received bytes not yet parsed into replies
+	std::string replyText;								/// The lines of the reply being received
+	std::string output;									/// Bytes waiting to be written
+	std::size_t outputOffset;							/// The bytes of output already written
+	bool offersPipelining;								/// The EHLO reply offered PIPELINING
+	bool offersStartTLS;								/// The EHLO reply offered STARTTLS
+	bool offersSize;									/// The EHLO reply offered SIZE
+	std::uint64_t offeredSize;							/// The limit the SIZE extension named, or 0 for none
+	bool offersAuth;									/// The EHLO reply offered AUTH
+	bool offersPlain;									/// The EHLO reply offered AUTH PLAIN
+	bool offersLogin;									/// The EHLO reply offered AUTH LOGIN
+	bool authenticated;									/// AUTH has succeeded on this session
+	unsigned int authStep;								/// 0 for AUTH PLAIN, or the step of AUTH LOGIN from 1 to 3
+	std::unique_ptr<Job> current;						/// The message being sent, or NULL
+	std::size_t repliesRead;							/// Replies to the MAIL, RCPT and DATA of the current message received
+	int refusedCode;									/// The first refusing reply of the current envelope, or 0
+	std::string refusedText;							/// What that reply refused
+	int lastReplyCode;									/// The last reply received for the current message
+	std::size_t dataOffset;								/// The bytes of the payload already stuffed into output
+	char lastBytes[2];									/// The last two payload bytes stuffed
+	std::chrono::steady_clock::time_point phaseDeadline;	/// When the session must be ready by
+	std::chrono::steady_clock::time_point lastActivity;	/// When bytes last moved
+	TimerWheel::Handle timer;							/// The session's timeout
+
+	NativeSMTPConnection(const NativeSMTPConnection &other);
+	NativeSMTPConnection& operator=(const NativeSMTPConnection &other);
+
+	/**
+	 * \brief Takes the next message and moves the session towards sending it
+	 *
+	 * \return void
+	 */
+	void pump();
+
+	/**
+	 * \brief Opens a session for the current message
+	 *
+	 * \return void
+	 */
+	void connect();
+
+	/**
+	 * \brief Connects to the next resolved address, failing the message once none are left
+	 *
+	 * \param[in] lastError The errno of the last attempt, or 0
+	 *
+	 * \return void
+	 */
+	void connectNext(int lastError);
+
+	void beginHandshake();
+	void continueHandshake();
+
+	/**
+	 * \brief Handles the events of the socket
+	 *
+	 * \param[in] ready The epoll events that occurred
+	 *
+	 * \return void
+	 */
+	void handleEvents(std::uint32_t ready);
+
+	/**
+	 * \brief Handles the session's timer falling due
+	 *
+	 * \return void
+	 */
+	void handleTimeout();
+
+	/**
+	 * \brief Reads what has arrived and acts on each complete reply
+	 *
+	 * \return bool False if the session was closed
+	 */
+	bool receive();
+
+	/**
+	 * \brief Writes as much pending output as the socket takes
+	 *
+	 * \return bool False if the session was closed
+	 */
+	bool transmit();
+
+	/**
+	 * \brief Reads from the socket, through TLS if it is on
+	 *
+	 * \return long The bytes read, 0 if none were ready, or -1 if the connection is closed or broken
+	 */
+	long readSome(char *buffer, std::size_t length);
+
+	/**
+	 * \brief Writes to the socket, through TLS if it is on
+	 *
+	 * \return long The bytes written, 0 if the socket is full, or -1 if the connection is broken
+	 */
+	long writeSome(const char *data, std::size_t length);
+
+	/**
+	 * \brief Acts on a complete reply
+	 *
+	 * \param[in] code The reply code
+	 * \param[in] text The reply lines, without their codes
+	 *
+	 * \return bool False if the session was closed
+	 */
+	bool handleReply(int code, const std::string &text);
+
+	/**
+	 * \brief Handles the reply to EHLO or HELO
+	 *
+	 * \return bool False if the session was closed
+	 */
+	bool handleGreeted(int code, const std::string &text);
+
+	/**
+	 * \brief Authenticates if needed, then starts sending the current message
+	 *
+	 * \return bool False if the session was closed
+	 */
+	bool afterGreeted();
+
+	/**
+	 * \brief Handles a reply to MAIL, RCPT or DATA
+	 *
+	 * \return bool False if the session was closed
+	 */
+	bool handleEnvelopeReply(int code, const std::string &text);
+
+	void startTransaction();
+
+	/**
+	 * \brief Dot stuffs the next part of the message into the output, and the end of data after the last
+	 *
+	 * \return void
+	 */
+	void fillData();
+
+	/**
+	 * \brief Queues a command
+	 *
+	 * \param[in] line The command without its line ending
+	 * \param[in] secret Whether verbose output leaves the line out
+	 *
+	 * \return void
+	 */
+	void command(const std::string &line, bool secret = false);
+
+	/**
+	 * \brief Watches the socket for the events the session is waiting for
+	 *
+	 * \return bool False if the session was closed
+	 */
+	bool updateEvents();
+
+	void updateTimer();
+
+	/**
+	 * \brief Finishes the current message
+	 *
+	 * \param[in] error The reason it was not sent, or NULL if it was
+	 * \param[in] failureClass The metrics failure class of the error
+	 *
+	 * \return void
+	 */
+	void finish(std::exception_ptr error, int failureClass);
+
+	/**
+	 * \brief Fails the current message with an SMTPError
+	 *
+	 * \param[in] message What went wrong
+	 * \param[in] curlCode The equivalent CURL result
+	 * \param[in] replyCode The reply that caused it, or 0
+	 *
+	 * \return void
+	 */
+	void reject(const std::string &message, int curlCode, int replyCode);
+
+	/**
+	 * \brief Fails the current message, if there is one, with an SMTPTimeout and closes the session
+	 *
+	 * \return void
+	 */
+	void timeOut(const std::string &message);
+
+	/**
+	 * \brief Fails the current message, if there is one, and closes the session
+	 *
+	 * \details The next message opens a new session.
+	 *
+	 * \param[in] message What went wrong
+	 * \param[in] curlCode The equivalent CURL result
+	 * \param[in] replyCode The reply that caused it, or 0
+	 *
+	 * \return void
+	 */
+	void fail(const std::string &message, int curlCode, int replyCode);
+
+	/**
+	 * \brief Has the loop call pump() once the current events are handled
+	 *
+	 * \return void
+	 */
+	void next();
+
+	/**
+	 * \brief Closes the socket
+	 *
+	 * \return void
+	 */
+	void close();
+
+	/**
+	 * \brief Keeps a TLS session the server has issued, to resume on the next connection
+	 *
+	 * \details Called by OpenSSL on the loop thread.
+	 *
+	 * \param[in] tls The connection the session belongs to
+	 * \param[in] session The session
+	 *
+	 * \return int 0, as OpenSSL keeps its own reference
+	 */
+	static int keepSession(SSL *tls, SSL_SESSION *session);
+
+	/**
+	 * \brief Quits the session and releases the TLS session, for the destructor
+	 *
+	 * \return void
+	 */
+	void shutdown();
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* NATIVESMTPCONNECTION_H_ */
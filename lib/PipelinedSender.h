@@ -0,0 +1,117 @@
+/**
+ * \file PipelinedSender.h
+ *
+ * \brief Header file for overlapping message encoding with sending
+ */
+
+#ifndef PIPELINEDSENDER_H_
+#define PIPELINEDSENDER_H_
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <cstdint>
+
+#include "./Email.h"
+#include "./EncodeArena.h"
+#include "./SMTPConnection.h"
+
+namespace SimplyEmail {
+
+/**
+ * \brief Sends messages over one connection while the next ones are encoded
+ *
+ * \details A plain send() encodes a message then uploads it, so encoding and network time add up. A pipelined
+ * sender runs the two as separate stages: an encoding thread prepares upcoming messages into a bounded ring of
+ * payloads while a sending thread uploads the oldest ready one. Throughput approaches the slower of the two stages
+ * instead of their sum. Each ring slot encodes into an arena of its own, so once the slots have grown to fit the
+ * messages no further allocations are made. Messages are sent in the order they were submitted.
+ *
+ * submit() and flush() may be called from any thread. The connection must not be used by anything else while the
+ * sender exists.
+ */
+class PipelinedSender {
+public:
+	static const std::size_t DEFAULT_DEPTH;				/// Ring slots when none is given
+
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \details Starts the encoding and sending threads.
+	 *
+	 * \param[in] connection The connection to send over
+	 * \param[in] depth The number of messages that may be submitted but not yet sent; at least 2
+	 *
+	 * \return void
+	 */
+	explicit PipelinedSender(SimplyEmail::SMTPConnection &connection, std::size_t depth = DEFAULT_DEPTH);
+
+	/**
+	 * \brief Default destructor
+	 *
+	 * \details Sends every submitted message then stops the threads.
+	 */
+	~PipelinedSender();
+
+	/**
+	 * \brief Queues an email to be encoded and sent
+	 *
+	 * \details Blocks while the ring is full. The email is not copied and must stay unchanged until the returned
+	 * future is ready.
+	 *
+	 * \param[in] email A reference to the email to be sent.
+	 *
+	 * \return std::future<void> Becomes ready once the email is sent; rethrows the SMTPError or encoding error if
+	 * it was not
+	 */
+	std::future<void> submit(const SimplyEmail::Email &email);
+
+	/**
+	 * \brief Waits until every submitted email has been sent or has failed
+	 *
+	 * \return void
+	 */
+	void flush();
+
+	std::size_t getDepth() const;
+
+private:
+	/**
+	 * \brief A message moving through the pipeline
+	 */
+	struct Slot {
+		const SimplyEmail::Email *email;				/// The message, or NULL if the slot is free
+		SimplyEmail::EncodeArena arena;					/// Storage for the encoded message
+		SimplyEmail::ArenaString payload;				/// The encoded message
+		std::promise<void> done;						/// Reports the outcome
+		bool failed;									/// Whether encoding failed and the promise is already set
+
+		Slot();
+	};
+
+	SimplyEmail::SMTPConnection &connection;			/// The connection to send over
+
+	std::mutex mutex;									/// Guards the positions below
+	std::condition_variable changed;					/// Signalled whenever a position moves
+	std::vector<std::unique_ptr<Slot> > ring;			/// The slots, used in turn
+	std::uint64_t submitted;							/// Messages submitted so far
+	std::uint64_t encoded;								/// Messages encoded so far
+	std::uint64_t sent;									/// Messages sent so far
+	bool stopping;										/// Set when the threads should exit
+
+	std::thread encoder;								/// Runs the encoding stage
+	std::thread sender;									/// Runs the sending stage
+
+	PipelinedSender(const PipelinedSender &other);
+	PipelinedSender& operator=(const PipelinedSender &other);
+
+	void encodeLoop();
+	void sendLoop();
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* PIPELINEDSENDER_H_ */
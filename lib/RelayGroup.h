@@ -0,0 +1,242 @@
+/**
+ * \file RelayGroup.h
+ *
+ * \brief Header file for load balancing sends over several SMTP relays
+ */
+
+#ifndef RELAYGROUP_H_
+#define RELAYGROUP_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+
+#include "./Email.h"
+#include "./SMTPConnection.h"
+
+namespace SimplyEmail {
+
+/**
+ * \brief Controls how a relay group picks relays and ejects unhealthy ones
+ */
+struct RelayGroupPolicy {
+	int selection;										/// RelayGroup::LEAST_OUTSTANDING or RelayGroup::EWMA_LATENCY
+	double ewmaWeight;									/// The weight of the newest latency sample, from 0 to 1
+	unsigned int failureThreshold;						/// Consecutive transient failures that open a relay's circuit
+	std::chrono::milliseconds openDuration;				/// How long a circuit first stays open before a probe is allowed
+	std::chrono::milliseconds maxOpenDuration;			/// The longest a circuit stays open after repeated failed probes
+	unsigned int maxAttempts;							/// Relays tried per send, including the first; 0 tries every relay
+
+	/**
+	 * \brief Default constructor
+	 *
+	 * \details Least outstanding selection, circuits opening after three consecutive failures for five seconds,
+	 * doubling up to five minutes while probes keep failing, and every relay tried before a send fails.
+	 *
+	 * \return void
+	 */
+	RelayGroupPolicy();
+};
+
+/**
+ * \brief A copy of the counters and state of one relay
+ */
+struct RelayStats {
+	std::string address;								/// The address of the relay
+	int circuit;										/// RelayGroup::CIRCUIT_CLOSED, CIRCUIT_OPEN or CIRCUIT_HALF_OPEN
+	unsigned int outstanding;							/// Sends in progress
+	double latencyMicros;								/// The moving average of successful send latency, or 0 before the first
+	unsigned int consecutiveFailures;					/// Transient failures since the last success
+	std::uint64_t selected;								/// Times the relay was chosen for a send
+	std::uint64_t sent;									/// Messages the relay accepted
+	std::uint64_t failed;								/// Sends that failed on the relay
+	std::uint64_t failovers;							/// Sends moved from the relay to another after a transient failure
+	std::uint64_t ejections;							/// Times the relay's circuit opened
+	std::uint64_t probes;								/// Sends let through a half open circuit
+};
+
+/**
+ * \brief Spreads sends over several SMTP relays
+ *
+ * \details Each send goes to the relay chosen by the selection policy among those whose circuit is closed: the one with
+ * the fewest sends in progress, or the one with the lowest moving average latency weighted by its sends in progress.
+ * A transient failure (see SMTPError::isTransient) moves the send to the next best relay, and a relay that fails
+ * transiently failureThreshold times in a row is ejected by opening its circuit. Once the open duration has passed a
+ * single probe send is let through; success closes the circuit again and failure reopens it for twice as long. No
+ * relay is tried before its circuit's open duration has passed, so a send made while every relay is ejected fails with
+ * a transient SMTPError. Permanent failures say nothing about the relay's health and are thrown straight away.
+ *
+ * Each relay keeps a pool of idle connections so that sends from several threads proceed in parallel. All member
+ * functions may be called from any thread, but relays must be added before sending starts.
+ */
+class RelayGroup {
+public:
+	static const int LEAST_OUTSTANDING;					/// Pick the relay with the fewest sends in progress
+	static const int EWMA_LATENCY;						/// Pick the relay with the lowest latency times (sends in progress + 1)
+
+	static const int CIRCUIT_CLOSED;					/// The relay receives sends
+	static const int CIRCUIT_OPEN;						/// The relay is ejected
+	static const int CIRCUIT_HALF_OPEN;					/// A probe send is in progress
+
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \param[in] policy The selection and ejection policy
+	 *
+	 * \return void
+	 */
+	explicit RelayGroup(const RelayGroupPolicy &policy = RelayGroupPolicy());
+
+	/**
+	 * \brief Default destructor
+	 *
+	 * \details Closes every pooled connection. No send may be in progress.
+	 */
+	~RelayGroup();
+
+	/**
+	 * \brief Adds a relay
+	 *
+	 * \param[in] address The address of the SMTP server. Must be preceded by smtp:// and should include port number.
+	 * \param[in] username The username to access the SMTP server with
+	 * \param[in] password The password to access the SMTP server with
+	 *
+	 * \return void
+	 */
+	void addRelay(const std::string &address, const std::string &username, const std::string &password);
+
+	/**
+	 * \brief Sends an email through the group
+	 *
+	 * \details Tries relays in order of preference until one accepts the message, at most maxAttempts of them. Throws
+	 * the SMTPError of the last relay tried if none accepted it, or straight away on a permanent failure. Throws a
+	 * transient SMTPError without trying any relay if every relay is ejected or already being probed.
+	 *
+	 * \param[in] email A reference to the email to be sent.
+	 *
+	 * \return std::size_t The index of the relay that accepted the message
+	 */
+	std::size_t send(const SimplyEmail::Email &email);
+
+	/**
+	 * \brief Sends an email through the group by a deadline
+	 *
+	 * \details As above, with every attempt sharing the time left before the deadline; no relay is tried once it has
+	 * passed. Throws an SMTPTimeout if the deadline passed before any relay could be tried.
+	 *
+	 * \param[in] email A reference to the email to be sent.
+	 * \param[in] deadline The time by which the send must have finished
+	 *
+	 * \return std::size_t The index of the relay that accepted the message
+	 */
+	std::size_t send(const SimplyEmail::Email &email, std::chrono::steady_clock::time_point deadline);
+
+	/**
+	 * \brief Sets whether the SMTP conversations are printed
+	 *
+	 * \details Applies to every pooled connection. Off by default.
+	 *
+	 * \param[in] verbose True to print the conversations
+	 *
+	 * \return void
+	 */
+	void setVerbose(bool verbose);
+
+	/**
+	 * \brief Sets the list of addresses that must not be sent to
+	 *
+	 * \details Applies to every pooled connection; see SMTPConnection::setSuppressionList().
+	 *
+	 * \param[in] list The list, which must outlive the group, or NULL to send to every recipient
+	 *
+	 * \return void
+	 */
+	void setSuppressionList(const SimplyEmail::SuppressionList *list);
+
+	/**
+	 * \brief Sets the limits on how long each attempt may take
+	 *
+	 * \details Applies to every pooled connection; see SMTPConnection::setTimeouts().
+	 *
+	 * \param[in] timeouts The limits
+	 *
+	 * \return void
+	 */
+	void setTimeouts(const SimplyEmail::SendTimeouts &timeouts);
+
+	/**
+	 * \brief Copies the counters and state of every relay
+	 *
+	 * \return std::vector<RelayStats> One entry per relay, in the order they were added
+	 */
+	std::vector<SimplyEmail::RelayStats> getStats() const;
+
+	std::size_t getRelayCount() const;
+
+private:
+	/**
+	 * \brief A relay, its pooled connections and its health
+	 */
+	struct Relay {
+		std::string address;							/// The address of the SMTP server
+		std::string username;							/// The username to connect with
+		std::string password;							/// The password to connect with
+
+		std::vector<std::unique_ptr<SimplyEmail::SMTPConnection> > connections;	/// Every connection made to the relay
+		std::vector<SimplyEmail::SMTPConnection*> idle;	/// The connections not sending
+
+		SimplyEmail::RelayStats stats;					/// Counters and state
+		std::chrono::steady_clock::time_point reopen;	/// When an open circuit allows a probe
+		std::chrono::milliseconds openDuration;			/// How long the circuit stays open the next time it opens
+	};
+
+	RelayGroupPolicy policy;							/// The selection and ejection policy
+	bool verbose;										/// Whether pooled connections print their conversation
+	const SimplyEmail::SuppressionList *suppression;	/// The addresses pooled connections leave out, or NULL
+	SimplyEmail::SendTimeouts timeouts;					/// The limits on each attempt of pooled connections
+
+	mutable std::mutex mutex;							/// Guards every relay
+	std::vector<std::unique_ptr<Relay> > relays;		/// The relays in the order they were added
+	std::size_t rotation;								/// Where the next search for the cheapest relay starts
+
+	RelayGroup(const RelayGroup &other);
+	RelayGroup& operator=(const RelayGroup &other);
+
+	/**
+	 * \brief Picks the relay for the next attempt and reserves a connection to it
+	 *
+	 * \param[in] tried Whether each relay was already tried for this send
+	 * \param[in] failedOver The relay the send is moving away from, or the number of relays on the first attempt
+	 * \param[out] connection Receives the connection to send over
+	 *
+	 * \return std::size_t The chosen relay, or the number of relays if none is left to try
+	 */
+	std::size_t acquire(const std::vector<bool> &tried, std::size_t failedOver, SimplyEmail::SMTPConnection *&connection);
+
+	/**
+	 * \brief Returns a connection and records the outcome of the send
+	 *
+	 * \param[in] index The relay sent to
+	 * \param[in] connection The connection sent over
+	 * \param[in] healthy False if the send failed transiently
+	 * \param[in] delivered True if the relay accepted the message
+	 * \param[in] micros The duration of the send
+	 *
+	 * \return void
+	 */
+	void release(std::size_t index, SimplyEmail::SMTPConnection *connection, bool healthy, bool delivered, std::uint64_t micros);
+
+	/**
+	 * \brief Ranks a relay for selection; lower is better
+	 *
+	 * \return double The relay's cost
+	 */
+	double cost(const Relay &relay) const;
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* RELAYGROUP_H_ */
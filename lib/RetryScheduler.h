@@ -0,0 +1,197 @@
+/**
+ * \file RetryScheduler.h
+ *
+ * \brief Header file for the deferred message retry scheduler
+ */
+
+#ifndef RETRYSCHEDULER_H_
+#define RETRYSCHEDULER_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <random>
+#include <chrono>
+#include <cstdint>
+
+#include "./SMTPError.h"
+#include "./TimerWheel.h"
+
+namespace SimplyEmail {
+
+/**
+ * \brief Controls how deferred messages are retried
+ */
+struct RetryPolicy {
+	unsigned int maxAttempts;							/// Attempts, including the first, before a message is given up
+	std::chrono::milliseconds initialDelay;				/// The delay before the first retry
+	std::chrono::milliseconds maxDelay;					/// The longest delay between attempts
+	double multiplier;									/// The factor the delay grows by after each attempt
+	double jitter;										/// The fraction of each delay that is randomized, from 0 to 1
+
+	/**
+	 * \brief Default constructor
+	 *
+	 * \details Five attempts starting one minute apart, doubling up to one hour, with half of each delay randomized.
+	 *
+	 * \return void
+	 */
+	RetryPolicy();
+};
+
+/**
+ * \brief A single failed attempt to send a message
+ */
+struct AttemptRecord {
+	std::chrono::system_clock::time_point time;			/// When the attempt failed
+	int curlCode;										/// The CURL result of the attempt
+	int replyCode;										/// The last SMTP reply of the attempt, or 0
+	int failureClass;									/// The metrics failure class of the attempt
+	bool transient;										/// Whether the failure was classed as transient
+	std::string message;								/// The error message
+};
+
+/**
+ * \brief Schedules retries of messages that failed to send
+ *
+ * \details Messages are identified by a caller chosen 64 bit id; the caller keeps the messages themselves. Each
+ * failure is recorded in the message's attempt history and classified: permanent failures, and messages that have
+ * used every attempt, are given up, while transient failures are deferred with exponential backoff and jitter.
+ * Deferred messages are kept on a hierarchical timer wheel, so deferring, cancelling and expiring are constant time
+ * however many messages are waiting.
+ *
+ * All member functions may be called from any thread.
+ */
+class RetryScheduler {
+public:
+	static const int DEFERRED;							/// The message will be retried
+	static const int GAVE_UP;							/// The message will not be retried
+
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \param[in] policy The retry policy
+	 * \param[in] resolution The granularity of retry times
+	 *
+	 * \return void
+	 */
+	explicit RetryScheduler(const RetryPolicy &policy = RetryPolicy(), std::chrono::milliseconds resolution = std::chrono::milliseconds(100));
+
+	/**
+	 * \brief Default destructor
+	 *
+	 * \details Forgets every deferred message
+	 */
+	~RetryScheduler();
+
+	/**
+	 * \brief Records a failed attempt and schedules the next one
+	 *
+	 * \details Adds the failure to the message's history. If the failure is transient and attempts remain, the
+	 * message is deferred until its backoff has passed. Otherwise its history is kept for inspection and it is not
+	 * scheduled again. Deferring a message that is already waiting reschedules it.
+	 *
+	 * \param[in] messageId The message that failed
+	 * \param[in] error The failure
+	 *
+	 * \return int DEFERRED or GAVE_UP
+	 */
+	int defer(std::uint64_t messageId, const SimplyEmail::SMTPError &error);
+
+	/**
+	 * \brief Records a failed attempt using the given time as now
+	 *
+	 * \return int DEFERRED or GAVE_UP
+	 */
+	int defer(std::uint64_t messageId, const SimplyEmail::SMTPError &error, std::chrono::steady_clock::time_point now);
+
+	/**
+	 * \brief Collects the messages whose retry is due
+	 *
+	 * \details Due messages are removed from the schedule but keep their history until succeeded() or forget() is
+	 * called, so a further failure continues the backoff.
+	 *
+	 * \param[in] now The current time
+	 *
+	 * \return std::vector<std::uint64_t> The messages to send again
+	 */
+	std::vector<std::uint64_t> due(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+	/**
+	 * \brief Records that a message was sent and forgets its history
+	 *
+	 * \param[in] messageId The message that was sent
+	 *
+	 * \return void
+	 */
+	void succeeded(std::uint64_t messageId);
+
+	/**
+	 * \brief Stops retrying a message and forgets its history
+	 *
+	 * \param[in] messageId The message to forget
+	 *
+	 * \return void
+	 */
+	void forget(std::uint64_t messageId);
+
+	/**
+	 * \brief Gets the attempt history of a message
+	 *
+	 * \param[in] messageId The message
+	 *
+	 * \return std::vector<AttemptRecord> Every recorded failure, oldest first; empty for unknown messages
+	 */
+	std::vector<SimplyEmail::AttemptRecord> getHistory(std::uint64_t messageId) const;
+
+	/**
+	 * \brief Gets the number of messages waiting for a retry
+	 *
+	 * \return std::size_t The number of deferred messages
+	 */
+	std::size_t getDeferredCount() const;
+
+	/**
+	 * \brief Calculates the delay before the given attempt
+	 *
+	 * \details The delay before attempt n (n >= 2) is initialDelay * multiplier^(n-2), capped at maxDelay, with the
+	 * jitter fraction of it replaced by a uniformly random amount.
+	 *
+	 * \param[in] attempt The attempt about to be scheduled, counting the first attempt as 1
+	 *
+	 * \return std::chrono::milliseconds The delay
+	 */
+	std::chrono::milliseconds backoff(unsigned int attempt);
+
+private:
+	/**
+	 * \brief Everything known about a message that has failed
+	 */
+	struct Entry {
+		std::vector<SimplyEmail::AttemptRecord> history;	/// Every failure, oldest first
+		SimplyEmail::TimerWheel::Handle timer;			/// The scheduled retry, or INVALID_HANDLE once it is due
+		bool waiting;									/// Whether the message is deferred and not yet returned by due()
+	};
+
+	RetryPolicy policy;									/// The retry policy
+	std::chrono::milliseconds resolution;				/// The length of one wheel tick
+	std::chrono::steady_clock::time_point epoch;		/// The time of tick zero
+
+	mutable std::mutex mutex;							/// Guards every member below
+	SimplyEmail::TimerWheel wheel;						/// Deferred messages by retry time
+	std::unordered_map<std::uint64_t, Entry> entries;	/// Messages with a failure history
+	std::vector<std::uint64_t> expired;					/// Timers that fired but have not been returned by due()
+	std::size_t deferredCount;							/// The number of waiting messages
+	std::mt19937_64 random;								/// Source of jitter
+
+	std::uint64_t toTick(std::chrono::steady_clock::time_point time) const;
+	std::chrono::milliseconds backoffLocked(unsigned int attempt);
+	void advanceLocked(std::uint64_t nowTick);
+	void setWaiting(Entry &entry, bool waiting);
+	void forgetLocked(std::uint64_t messageId);
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* RETRYSCHEDULER_H_ */
@@ -13,14 +13,82 @@
 #include <stdexcept>
 #include <stdio.h>
 #include <fstream>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
 #include <curl/curl.h>
 #include "Email.h"
+#include "SMTPTranscript.h"
+#include "SMTPError.h"
+#include "ConnectionShare.h"
+#include "SuppressionList.h"
 
 namespace SimplyEmail {
 
-//TODO Create a debug function to take advantage of the CURLOPT_DEBUGFUNCTION option.
+class SpooledMessage;
 
+/**
+ * \brief The outcome of sending to a single recipient
+ */
+struct RecipientResult {
+	std::string address;								/// The envelope recipient
+	int replyCode;										/// The server's reply to the RCPT command, or 0 if it was never sent
+	int curlCode;										/// The CURL result of the transaction the recipient was part of
+	bool accepted;										/// True if the recipient was accepted and the transaction completed
+	bool transient;										/// True if the recipient was not accepted but a later retry may succeed
+};
+
+/**
+ * \brief The outcome of a bulk send
+ */
+struct BulkSendReport {
+	std::vector<RecipientResult> recipients;			/// One result per envelope recipient, in envelope order
+	unsigned int transactions;							/// The number of SMTP transactions used
+	unsigned int failedTransactions;					/// The number of transactions that did not complete
+	unsigned int acceptedRecipients;					/// The number of recipients that were delivered to
+	std::size_t suppressedRecipients;					/// The number of recipients left out because they are on the suppression list
+};
+
+/**
+ * \brief Limits on how long a connection may spend on one send
+ *
+ * \details A zero duration, or a zero lowSpeedLimit, leaves that limit off. The low speed limit aborts a transfer
+ * that moves fewer than lowSpeedLimit bytes per second for lowSpeedTime, which catches a relay that has stopped
+ * answering without closing the connection. It also counts time spent waiting for replies, so lowSpeedTime should stay
+ * above the longest reply a relay may legitimately take; RFC 5321 allows up to ten minutes after the end of the data.
+ * CURL measures the rate over the last few seconds, so a stall straight after the message is sent may take up to six
+ * seconds longer than lowSpeedTime to be noticed.
+ */
+struct SendTimeouts {
+	std::chrono::milliseconds connect;					/// The longest time to connect, including the TLS handshake; zero uses CURL's five minutes
+	std::chrono::milliseconds total;					/// The longest time for a whole transaction
+	long lowSpeedLimit;									/// Bytes per second below which a transfer counts as stalled
+	std::chrono::seconds lowSpeedTime;					/// How long a transfer may stay stalled before it is aborted
+
+	/**
+	 * \brief Default constructor
+	 *
+	 * \details Thirty seconds to connect, no total limit and no low speed limit. lowSpeedTime is ten minutes, the
+	 * longest RFC 5321 lets a server take to reply after the data, so setting only lowSpeedLimit is safe.
+	 *
+	 * \return void
+	 */
+	SendTimeouts();
+};
+
+/**
+ * \brief Sends email through an SMTP server using CURL
+ *
+ * \details Thread safety: a connection sends one message at a time. initialize(), disconnect() and send() must not be
+ * called concurrently on the same connection; use one connection per sending thread. getStatus() and cancel() may be
+ * called from any thread at any time, for example by a monitor, while another thread is sending.
+ */
 class SMTPConnection {
+	friend class PipelinedSender;
+	friend class NativeSMTPConnection;
+
 public:
 	static const int OPENING_CONNECTION;				/// Status indicating that the object is attempting to open a connection to the SMTP server
 	static const int CONNECTION_OPEN;					/// Status indication that the object has connected to the SMTP server
@@ -29,6 +97,13 @@ public:
 	static const int CLOSING_CONNECTION;				/// Status indicating that the object is attempting to close the connection to the SMTP server
 	static const int CONNECTION_CLOSED;					/// Status indicating that the object has closed the connection
 
+	static const unsigned int DEFAULT_RECIPIENTS_PER_TRANSACTION;	/// RCPT commands per transaction when bulk sending without a limit
+
+	/**
+	 * \brief Receives the bytes of the message uploaded so far and the size of the message
+	 */
+	typedef std::function<void(std::uint64_t sent, std::uint64_t total)> ProgressCallback;
+
 	/**
 	 * \brief Creates a default connection to an SMTP server
 	 *
@@ -90,22 +165,212 @@ public:
 	/**
 	 * \brief Sends an email
 	 *
-	 * \details Sends the email whos reference is passed. Updates the send status bit.
+	 * \details Sends the email whos reference is passed. Updates the send status bit. The email is only read, so the
+	 * same email may be sent by several connections on different threads at once. Throws an SMTPError, which tells
+	 * transient failures from permanent ones, if the server could not be reached or did not accept the message.
 	 *
 	 * \param[in] email A reference to the email to be sent.
 	 *
 	 * \return void
 	 */
-	void send(SimplyEmail::Email &email);
+	void send(const SimplyEmail::Email &email);
+
+	/**
+	 * \brief Sends an email encoded into an arena
+	 *
+	 * \details Behaves like send() but encodes the message into the given arena instead of the global allocator.
+	 * The encoded message is only needed for the duration of the call, so the caller may reset the arena as soon as
+	 * send returns, typically keeping one arena per sending thread.
+	 *
+	 * \param[in] email A reference to the email to be sent.
+	 * \param[in] arena The arena to encode the message into
+	 *
+	 * \return void
+	 */
+	void send(const SimplyEmail::Email &email, SimplyEmail::EncodeArena &arena);
+
+	/**
+	 * \brief Sends an email that must be delivered by a deadline
+	 *
+	 * \details The connect and total timeouts are shortened to the time left before the deadline. Throws an
+	 * SMTPTimeout without contacting the server if the deadline has already passed, and also if it passes during the
+	 * send.
+	 *
+	 * \param[in] email A reference to the email to be sent.
+	 * \param[in] deadline The time by which the send must have finished
+	 *
+	 * \return void
+	 */
+	void send(const SimplyEmail::Email &email, std::chrono::steady_clock::time_point deadline);
+
+	/**
+	 * \brief Sends a message taken from a spool queue
+	 *
+	 * \details Uploads the already encoded message to its envelope. A message spilled to disk is memory mapped and
+	 * streamed from the page cache rather than read back into memory.
+	 *
+	 * \param[in] message The message to send
+	 *
+	 * \return void
+	 */
+	void send(const SimplyEmail::SpooledMessage &message);
+
+	/**
+	 * \brief Sends an email to a large recipient list
+	 *
+	 * \details Encodes the email once then splits its envelope (To, CC and BCC) into transactions of at most
+	 * recipientsPerTransaction RCPT commands, uploading the same payload in each transaction over this connection.
+	 * Recipients the server rejects are reported rather than failing their transaction, and a failed transaction does
+	 * not stop the remaining ones.
+	 *
+	 * \param[in] email A reference to the email to be sent.
+	 * \param[in] recipientsPerTransaction The relay's RCPT limit; 0 uses DEFAULT_RECIPIENTS_PER_TRANSACTION
+	 *
+	 * \return BulkSendReport The outcome for every recipient
+	 */
+	SimplyEmail::BulkSendReport sendBulk(const SimplyEmail::Email &email, unsigned int recipientsPerTransaction = 0);
+
+	/**
+	 * \brief Sends an email to a large recipient list over several connections
+	 *
+	 * \details Behaves like sendBulk(email, recipientsPerTransaction) but sends the transactions in parallel, one
+	 * thread per connection, each taking the next unsent transaction until none are left. The payload is still encoded
+	 * once and shared by every connection. The connections must not be used by other threads during the call.
+	 *
+	 * \param[in] email A reference to the email to be sent.
+	 * \param[in] connections The connections to send over
+	 * \param[in] recipientsPerTransaction The relay's RCPT limit; 0 uses DEFAULT_RECIPIENTS_PER_TRANSACTION
+	 *
+	 * \return BulkSendReport The outcome for every recipient
+	 */
+	static SimplyEmail::BulkSendReport sendBulk(const SimplyEmail::Email &email, const std::vector<SMTPConnection*> &connections, unsigned int recipientsPerTransaction = 0);
 
 	/**
 	 * \brief Gets the current staus of sending
 	 *
-	 * \details Gets the current status of the sending process. //TODO Document possible return variables defined above.
+	 * \details Gets the current status of the sending process, one of the status constants defined above. Safe to call
+	 * from any thread.
 	 *
 	 * \return int The status of the SMTP connection.
 	 */
-	int getStatus();
+	int getStatus() const;
+
+	/**
+	 * \brief Sets whether the SMTP conversation is printed
+	 *
+	 * \details When set, the conversation with the server is written to stderr in the same form as CURL's verbose
+	 * mode. On by default.
+	 *
+	 * \param[in] verbose True to print the conversation
+	 *
+	 * \return void
+	 */
+	void setVerbose(bool verbose);
+	bool getVerbose() const;
+
+	/**
+	 * \brief Gets the transcript of the last transaction
+	 *
+	 * \details Holds the reply to each RCPT command of the last transaction and the extensions advertised by the
+	 * server. Only meaningful on the thread that sends.
+	 *
+	 * \return const SMTPTranscript& The transcript
+	 */
+	const SimplyEmail::SMTPTranscript& getTranscript() const;
+
+	/**
+	 * \brief Sets the caches the connection shares with others
+	 *
+	 * \details Connections start attached to ConnectionShare::getDefault(), so they resume TLS sessions and reuse
+	 * DNS results of every other connection in the process. Pass NULL to give the connection caches of its own. Must
+	 * not be called while sending.
+	 *
+	 * \param[in] share The share to attach to, which must outlive the connection, or NULL
+	 *
+	 * \return void
+	 */
+	void setShare(SimplyEmail::ConnectionShare *share);
+	SimplyEmail::ConnectionShare* getShare() const;
+
+	/**
+	 * \brief Sets the limits on how long each send may take
+	 *
+	 * \details A send that runs out of time throws an SMTPTimeout. Must not be called while sending.
+	 *
+	 * \param[in] timeouts The limits
+	 *
+	 * \return void
+	 */
+	void setTimeouts(const SimplyEmail::SendTimeouts &timeouts);
+	const SimplyEmail::SendTimeouts& getTimeouts() const;
+
+	/**
+	 * \brief Sets the function told of the progress of each upload
+	 *
+	 * \details Called on the sending thread whenever more of the message has been uploaded, and once the whole message
+	 * is, so it should return quickly. Each transaction of a bulk send reports its own upload. Must not be called
+	 * while sending.
+	 *
+	 * \param[in] callback The function, or an empty function for none
+	 *
+	 * \return void
+	 */
+	void setProgressCallback(const ProgressCallback &callback);
+	const ProgressCallback& getProgressCallback() const;
+
+	/**
+	 * \brief Stops the send in progress
+	 *
+	 * \details May be called from any thread. The send throws an SMTPCancelled: at once while the message is being
+	 * uploaded, or within about a second while waiting on the server. A bulk send starts no further transactions and
+	 * reports the recipients of those it did not send as failed.
+	 * If no send is in progress, the call has no effect; a later send is not cancelled by it.
+	 *
+	 * \return void
+	 */
+	void cancel();
+
+	/**
+	 * \brief Sets the list of addresses that must not be sent to
+	 *
+	 * \details Listed addresses are left out of the envelope of every message sent, even if they were added to the
+	 * email before they were listed. send() throws a std::runtime_error if every recipient is listed; sendBulk()
+	 * counts them in the report instead. Must not be called while sending.
+	 *
+	 * \param[in] list The list, which must outlive the connection, or NULL to send to every recipient
+	 *
+	 * \return void
+	 */
+	void setSuppressionList(const SimplyEmail::SuppressionList *list);
+	const SimplyEmail::SuppressionList* getSuppressionList() const;
+
+	/**
+	 * \brief Gets the largest message the server accepts
+	 *
+	 * \details Learned from the SIZE extension (RFC 1870) in the server's EHLO reply, so it is only known once a
+	 * send has greeted the server. Until then each send declares the message size in its MAIL command, and a server
+	 * with a limit refuses an oversized message there instead of after the upload. Once the limit is known, send()
+	 * checks each message against it before encoding, and a PipelinedSender before uploading, and throws an SMTPError
+	 * with CURLE_FILESIZE_EXCEEDED, or hands the message to the oversize fallback, without contacting the server.
+	 *
+	 * \return std::uint64_t The limit in bytes, or 0 if it is unknown or the server sets none
+	 */
+	std::uint64_t getSizeLimit() const;
+
+	/**
+	 * \brief Sets the connection that sends messages over the server's size limit
+	 *
+	 * \details send() and PipelinedSender pass a message the server would refuse for its size to the fallback, for
+	 * example a relay that accepts large messages, which checks it against its own limit in turn. Bulk sends do not
+	 * use the fallback; their transactions fail instead. Must not be called while sending.
+	 *
+	 * \param[in] fallback The connection, which must outlive this one and must not lead back to it, or NULL to reject
+	 * oversized messages
+	 *
+	 * \return void
+	 */
+	void setOversizeFallback(SMTPConnection *fallback);
+	SMTPConnection* getOversizeFallback() const;
 
 	//TODO Document getteres and setters
 	std::string getAddress();
@@ -114,14 +379,206 @@ public:
 
 private:
 	CURL* curl;				/// The connection to the CURL interface
-	int res;				/// The current status of CURL
+	std::atomic<int> res;	/// The current status of CURL; read by monitors while the sending thread writes it
 
 	std::string address;	/// The address of the SMTP server
 	std::string username;	/// The username to connect to the SMTP server
 	std::string password;	/// The password to connect to the SMTP server
 
+	bool verbose;							/// Whether the conversation is printed to stderr
+	SimplyEmail::ConnectionShare *share;	/// The caches shared with other connections, or NULL
+	const SimplyEmail::SuppressionList *suppression;	/// The addresses left out of every envelope, or NULL
+
+	SimplyEmail::SendTimeouts timeouts;					/// The limits on each send
+	bool hasDeadline;									/// Whether the current send has a deadline
+	std::chrono::steady_clock::time_point deadline;		/// The deadline of the current send
+	std::chrono::milliseconds lastElapsed;				/// How long the last transfer ran
+	ProgressCallback progress;							/// Told of the progress of each upload, or empty
+	std::uint64_t sendCount;							/// The number of sends started, which numbers each of them
+	std::atomic<std::uint64_t> activeSend;				/// The number of the send in progress, or 0
+	std::atomic<std::uint64_t> cancelledSend;			/// The number of the last send cancel() found in progress
+	std::uint64_t lastUploaded;							/// The bytes of the message the last transfer uploaded
+	std::uint64_t sizeLimit;							/// The server's advertised SIZE limit, or 0
+	SMTPConnection *oversizeFallback;					/// Sends the messages over sizeLimit, or NULL
+	SimplyEmail::SMTPTranscript transcript;	/// The parsed conversation of the current transaction
+
+	/**
+	 * \brief Source of an in memory upload, either a segmented message or a single buffer
+	 */
+	struct PayloadReader {
+		const SimplyEmail::EncodedEmail *segments;	/// The segmented message, or NULL to upload data
+		const char *data;					/// The message when it is a single buffer
+		std::uint64_t size;					/// The length of the message
+		std::size_t offset;					/// The number of bytes already handed to CURL
+		SMTPConnection *connection;			/// The connection uploading it
+		std::uint64_t reported;				/// The bytes last reported to the progress callback
+	};
+
+	/**
+	 * \brief Throws if a transfer failed
+	 *
+	 * \details Throws an SMTPError carrying the CURL result, the last SMTP reply and the failure class, so that
+	 * callers can tell transient failures from permanent ones; an SMTPTimeout if the transfer ran out of time.
+	 *
+	 * \param[in] toCheck The CURL result of the transfer
+	 *
+	 * \return void
+	 */
 	void checkConnection(unsigned int toCheck);
 
+	/**
+	 * \brief Checks a message against the server's size limit
+	 *
+	 * \details Throws an SMTPError if the message is over the limit and there is no fallback.
+	 *
+	 * \param[in] size The size of the encoded message
+	 *
+	 * \return SMTPConnection* The fallback if it should send the message instead, else NULL
+	 */
+	SMTPConnection* admit(std::uint64_t size);
+
+	/**
+	 * \brief Updates the size limit from the extensions of the last EHLO reply
+	 *
+	 * \return void
+	 */
+	void learnSizeLimit();
+
+	/**
+	 * \brief Numbers a new send in progress, which cancel() may then stop
+	 *
+	 * \details A send started while another is in progress, such as a transaction of a bulk send, is part of it.
+	 *
+	 * \return std::uint64_t The number of the new send for endSend(), or 0 if it is part of the one in progress
+	 */
+	std::uint64_t beginSend();
+
+	/**
+	 * \brief Ends the send in progress, so that cancel() no longer affects it
+	 *
+	 * \param[in] sendNumber The number beginSend() returned
+	 *
+	 * \return void
+	 */
+	void endSend(std::uint64_t sendNumber);
+
+	/**
+	 * \brief Checks whether cancel() was called during the send in progress
+	 *
+	 * \return bool True if the send should stop
+	 */
+	bool isCancelled() const;
+
+	/**
+	 * \brief Sends an encoded message to every envelope recipient of an email
+	 *
+	 * \param[in] email The email supplying the envelope sender and recipients
+	 * \param[in] payload The encoded message
+	 * \param[in] payloadLength The length of the encoded message
+	 *
+	 * \return void
+	 */
+	void sendPayload(const SimplyEmail::Email &email, const char *payload, std::size_t payloadLength);
+
+	/**
+	 * \brief Sends a segmented encoded message to every envelope recipient of an email
+	 *
+	 * \param[in] email The email supplying the envelope sender and recipients
+	 * \param[in] payload The encoded message
+	 *
+	 * \return void
+	 */
+	void sendPayload(const SimplyEmail::Email &email, const SimplyEmail::EncodedEmail &payload);
+
+	/**
+	 * \brief Sends the message of an upload source to every envelope recipient of an email
+	 *
+	 * \details Both sendPayload() overloads end here, so a single buffer is uploaded without being wrapped in
+	 * segments. Hands the message to the oversize fallback if it is over the server's SIZE limit.
+	 *
+	 * \param[in] email The email supplying the envelope sender and recipients
+	 * \param[in] reader The upload source of the encoded message
+	 *
+	 * \return void
+	 */
+	void sendPayload(const SimplyEmail::Email &email, PayloadReader &reader);
+
+	/**
+	 * \brief Sends a message already checked against the server's SIZE limit
+	 *
+	 * \param[in] email The email supplying the envelope sender and recipients
+	 * \param[in] reader The upload source of the encoded message
+	 *
+	 * \return void
+	 */
+	void sendAdmitted(const SimplyEmail::Email &email, PayloadReader &reader);
+
+	/**
+	 * \brief Collects the To, CC and BCC addresses of an email without copying them
+	 *
+	 * \param[in] email The email
+	 * \param[in] suppression The addresses to leave out, or NULL
+	 * \param[out] envelope Receives a pointer to each address
+	 *
+	 * \return std::size_t The number of addresses left out
+	 */
+	static std::size_t buildEnvelope(const SimplyEmail::Email &email, const SimplyEmail::SuppressionList *suppression, std::vector<const std::string*> &envelope);
+
+	/**
+	 * \brief Runs a single SMTP transaction
+	 *
+	 * \details Uploads an encoded message to the given recipients. Updates the status and metrics but does not
+	 * throw on CURL errors; the caller decides how to report them. Returns CURLE_OPERATION_TIMEDOUT without
+	 * contacting the server if the deadline of the current send has passed.
+	 *
+	 * \param[in] from The envelope sender
+	 * \param[in] recipients The envelope recipients
+	 * \param[in] recipientCount The number of envelope recipients
+	 * \param[in] payload The encoded message
+	 * \param[in] payloadLength The length of the encoded message
+	 * \param[in] allowRecipientFailures True to continue the transaction when some recipients are rejected
+	 *
+	 * \return CURLcode The result of the transfer
+	 */
+	CURLcode transfer(const std::string &from, const std::string *const *recipients, std::size_t recipientCount, const char *payload, std::size_t payloadLength, bool allowRecipientFailures);
+
+	/**
+	 * \brief Runs a single SMTP transaction uploading a segmented message
+	 *
+	 * \details As above, reading the message segment by segment without joining it.
+	 *
+	 * \return CURLcode The result of the transfer
+	 */
+	CURLcode transfer(const std::string &from, const std::string *const *recipients, std::size_t recipientCount, const SimplyEmail::EncodedEmail &payload, bool allowRecipientFailures);
+
+	/**
+	 * \brief Runs a single SMTP transaction uploading the message of an upload source
+	 *
+	 * \details As above; both overloads end here. Resets the read position and progress of the source.
+	 *
+	 * \return CURLcode The result of the transfer
+	 */
+	CURLcode transfer(const std::string &from, const std::string *const *recipients, std::size_t recipientCount, PayloadReader &reader, bool allowRecipientFailures);
+
+	/**
+	 * \brief Builds per recipient results from the transcript of the last transaction
+	 *
+	 * \return std::vector<RecipientResult> One result per recipient
+	 */
+	std::vector<SimplyEmail::RecipientResult> recipientResults(const std::string *const *recipients, std::size_t recipientCount, CURLcode result) const;
+
+	static size_t readPayload(char *buffer, size_t size, size_t count, void *userData);
+	static int progressCallback(void *userData, curl_off_t downloadTotal, curl_off_t downloaded, curl_off_t uploadTotal, curl_off_t uploaded);
+	static int debugCallback(CURL *handle, curl_infotype type, char *data, size_t size, void *userData);
+
+	/**
+	 * \brief Folds a CURL error code into a metrics failure class
+	 *
+	 * \param[in] code The code returned by CURL
+	 *
+	 * \return int One of the Metrics::FailureClass values
+	 */
+	static int classifyFailure(CURLcode code);
 
 };
 
@@ -0,0 +1,124 @@
+/**
+ * \file SMTPError.h
+ *
+ * \brief Header file for the SMTP send error
+ */
+
+#ifndef SMTPERROR_H_
+#define SMTPERROR_H_
+
+#include <string>
+#include <stdexcept>
+#include <chrono>
+#include <cstdint>
+
+namespace SimplyEmail {
+
+/**
+ * \brief Error thrown when a message could not be sent
+ *
+ * \details Derives from std::runtime_error, so existing handlers keep working, and adds what is needed to decide
+ * whether the send is worth retrying: the CURL result, the last SMTP reply code and the failure class used by the
+ * library metrics.
+ */
+class SMTPError : public std::runtime_error {
+public:
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \param[in] message The error message
+	 * \param[in] curlCode The CURL result of the send
+	 * \param[in] replyCode The last SMTP reply code received, or 0 if there was none
+	 * \param[in] failureClass One of the Metrics::FailureClass values
+	 *
+	 * \return void
+	 */
+	SMTPError(const std::string &message, int curlCode, int replyCode, int failureClass);
+
+	int getCurlCode() const;
+	int getReplyCode() const;
+	int getFailureClass() const;
+
+	/**
+	 * \brief Decides whether the failure is transient
+	 *
+	 * \details A 4xx reply is transient and a 5xx reply is permanent, as defined by RFC 5321. Without a reply the
+	 * failure class decides: connection, timeout and transfer failures are transient; everything else is permanent.
+	 *
+	 * \return bool True if sending again later may succeed
+	 */
+	bool isTransient() const;
+
+	/**
+	 * \brief Decides whether a failure with the given reply and class is transient
+	 *
+	 * \param[in] replyCode The SMTP reply code, or 0 if there was none
+	 * \param[in] failureClass One of the Metrics::FailureClass values
+	 *
+	 * \return bool True if sending again later may succeed
+	 */
+	static bool isTransient(int replyCode, int failureClass);
+
+private:
+	int curlCode;										/// The CURL result of the send
+	int replyCode;										/// The last SMTP reply code, or 0
+	int failureClass;									/// The metrics failure class
+};
+
+/**
+ * \brief Error thrown when a send ran out of time
+ *
+ * \details Thrown instead of a plain SMTPError when the connect timeout, the total timeout, the low speed limit or
+ * the deadline of the message ran out, so callers can tell a stuck or slow relay from one that answered. The failure
+ * class is always Metrics::FAILURE_TIMEOUT, so the failure is transient unless the server replied with a 5xx code
+ * first.
+ */
+class SMTPTimeout : public SMTPError {
+public:
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \param[in] message The error message
+	 * \param[in] curlCode The CURL result of the send
+	 * \param[in] replyCode The last SMTP reply code received, or 0 if there was none
+	 * \param[in] elapsed How long the send ran before it was abandoned; zero if the deadline had passed before it began
+	 *
+	 * \return void
+	 */
+	SMTPTimeout(const std::string &message, int curlCode, int replyCode, std::chrono::milliseconds elapsed);
+
+	std::chrono::milliseconds getElapsed() const;
+
+private:
+	std::chrono::milliseconds elapsed;					/// How long the send ran
+};
+
+/**
+ * \brief Error thrown when a send was stopped by SMTPConnection::cancel()
+ *
+ * \details The failure class is Metrics::FAILURE_OTHER, so the failure is permanent: a relay group does not move a
+ * cancelled send to another relay. The server discards a message whose data was cut off.
+ */
+class SMTPCancelled : public SMTPError {
+public:
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \param[in] message The error message
+	 * \param[in] curlCode The CURL result of the send
+	 * \param[in] replyCode The last SMTP reply code received, or 0 if there was none
+	 * \param[in] bytesSent The bytes of the message uploaded before the send stopped
+	 *
+	 * \return void
+	 */
+	SMTPCancelled(const std::string &message, int curlCode, int replyCode, std::uint64_t bytesSent);
+
+	std::uint64_t getBytesSent() const;
+
+private:
+	std::uint64_t bytesSent;							/// The bytes uploaded before the send stopped
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* SMTPERROR_H_ */
@@ -0,0 +1,132 @@
+/**
+ * \file SMTPEventLoop.h
+ *
+ * \brief Header file for the thread driving native SMTP connections
+ */
+
+#ifndef SMTPEVENTLOOP_H_
+#define SMTPEVENTLOOP_H_
+
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "./TimerWheel.h"
+
+typedef struct ssl_ctx_st SSL_CTX;
+
+namespace SimplyEmail {
+
+class NativeSMTPConnection;
+
+/**
+ * \brief A thread that runs the SMTP sessions of many NativeSMTPConnection objects over non-blocking sockets
+ *
+ * \details The thread waits on every session's socket at once with epoll and moves each session along as its socket
+ * becomes ready, so one loop can keep hundreds of sessions busy. Timeouts are kept on a timer wheel with a resolution
+ * of TICK. The loop also holds the TLS settings its sessions share, and verifies servers against the system's trusted
+ * certificates, or those named by the SSL_CERT_FILE and SSL_CERT_DIR environment variables.
+ *
+ * The loop must outlive every connection that uses it.
+ */
+class SMTPEventLoop {
+	friend class NativeSMTPConnection;
+
+public:
+	static const std::chrono::milliseconds TICK;		/// The resolution of timeouts
+
+	/**
+	 * \brief Default constructor
+	 *
+	 * \details Starts the thread. Throws a std::runtime_error if epoll or TLS cannot be set up.
+	 *
+	 * \return void
+	 */
+	SMTPEventLoop();
+
+	/**
+	 * \brief Default destructor
+	 *
+	 * \details Stops the thread. Every connection using the loop must have been destroyed.
+	 */
+	~SMTPEventLoop();
+
+	std::size_t getConnectionCount() const;
+
+private:
+	int epoll;											/// The epoll instance watching every socket
+	int wakeup;											/// An eventfd that interrupts the wait when work is posted
+	SSL_CTX *tls;										/// The TLS settings shared by every session
+
+	std::mutex mutex;									/// Guards tasks and stopping
+	std::vector<std::function<void()> > tasks;			/// Work posted from other threads, run on the loop thread
+	bool stopping;										/// Set when the thread should exit
+
+	std::atomic<std::size_t> connections;				/// Connections using the loop
+
+	TimerWheel wheel;									/// The timeouts of every session; only used on the loop thread
+	std::chrono::steady_clock::time_point started;		/// The time of tick 0
+	std::vector<std::uint64_t> expired;					/// Reused for the timers that fall due
+
+	std::thread thread;									/// Runs run()
+
+	SMTPEventLoop(const SMTPEventLoop &other);
+	SMTPEventLoop& operator=(const SMTPEventLoop &other);
+
+	/**
+	 * \brief Runs a function on the loop thread
+	 *
+	 * \details May be called from any thread, including the loop thread.
+	 *
+	 * \param[in] task The function
+	 *
+	 * \return void
+	 */
+	void post(const std::function<void()> &task);
+
+	/**
+	 * \brief Starts, changes or stops watching a socket for a connection
+	 *
+	 * \details Must be called on the loop thread.
+	 *
+	 * \param[in] socket The socket
+	 * \param[in] events The epoll events to wait for, or 0 to stop watching
+	 * \param[in] connection The connection the events are handed to
+	 * \param[in] watched Whether the socket is already watched
+	 *
+	 * \return bool False if epoll refused the change
+	 */
+	bool watch(int socket, std::uint32_t events, NativeSMTPConnection *connection, bool watched);
+
+	/**
+	 * \brief Schedules a connection's timeout, replacing the one it had
+	 *
+	 * \details Must be called on the loop thread.
+	 *
+	 * \param[in] connection The connection to hand the timeout to
+	 * \param[in,out] handle The connection's timer, or TimerWheel::INVALID_HANDLE
+	 * \param[in] when When the timeout falls due
+	 *
+	 * \return void
+	 */
+	void schedule(NativeSMTPConnection *connection, TimerWheel::Handle &handle, std::chrono::steady_clock::time_point when);
+
+	/**
+	 * \brief Cancels a connection's timeout
+	 *
+	 * \param[in,out] handle The connection's timer, set to TimerWheel::INVALID_HANDLE
+	 *
+	 * \return void
+	 */
+	void unschedule(TimerWheel::Handle &handle);
+
+	void run();
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* SMTPEVENTLOOP_H_ */
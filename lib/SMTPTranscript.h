@@ -0,0 +1,119 @@
+/**
+ * \file SMTPTranscript.h
+ *
+ * \brief Header file for the SMTP conversation transcript
+ *
+ * \details Declares a parser for the commands and replies exchanged with an SMTP server, fed from the CURL debug
+ * callback, that recovers information CURL does not report itself such as the reply to each RCPT command.
+ */
+
+#ifndef SMTPTRANSCRIPT_H_
+#define SMTPTRANSCRIPT_H_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace SimplyEmail {
+
+/**
+ * \brief Parses the SMTP conversation of a connection
+ *
+ * \details Commands are matched with the replies that follow them, which holds because CURL waits for the reply to
+ * each envelope command before sending the next one.
+ */
+class SMTPTranscript {
+public:
+	/**
+	 * \brief The reply to a single RCPT command
+	 */
+	struct RecipientReply {
+		std::string address;							/// The recipient address as sent in the RCPT command
+		int replyCode;									/// The SMTP reply code, for example 250 or 550
+	};
+
+	/**
+	 * \brief Default constructor
+	 *
+	 * \details Creates an empty transcript
+	 *
+	 * \return void
+	 */
+	SMTPTranscript();
+
+	/**
+	 * \brief Forgets the replies of the previous transaction
+	 *
+	 * \details Recipient replies and the last reply code are cleared. Server capabilities are kept, since a reused
+	 * connection does not repeat its EHLO.
+	 *
+	 * \return void
+	 */
+	void clear();
+
+	/**
+	 * \brief Records text sent to the server
+	 *
+	 * \param[in] text The command text, possibly several CRLF terminated lines
+	 * \param[in] length The length of the text
+	 *
+	 * \return void
+	 */
+	void command(const char *text, std::size_t length);
+
+	/**
+	 * \brief Records text received from the server
+	 *
+	 * \param[in] text The reply text, possibly several CRLF terminated lines
+	 * \param[in] length The length of the text
+	 *
+	 * \return void
+	 */
+	void reply(const char *text, std::size_t length);
+
+	const std::vector<RecipientReply>& getRecipientReplies() const;
+
+	/**
+	 * \brief Gets the extensions advertised in the last EHLO reply
+	 *
+	 * \details Each entry is one EHLO keyword line without the reply code, for example "SIZE 35882577" or
+	 * "PIPELINING".
+	 *
+	 * \return const std::vector<std::string>& The advertised extensions
+	 */
+	const std::vector<std::string>& getCapabilities() const;
+
+	/**
+	 * \brief Gets the code of the last final reply
+	 *
+	 * \details The reply to QUIT is ignored, so after a failed transaction this is the reply that failed it.
+	 *
+	 * \return int The reply code, or 0 if there was none
+	 */
+	int getLastReplyCode() const;
+
+private:
+	/**
+	 * \brief The kinds of command whose replies are tracked
+	 */
+	enum Pending {
+		PENDING_NONE,
+		PENDING_EHLO,
+		PENDING_RCPT,
+		PENDING_QUIT
+	};
+
+	Pending pending;									/// The command awaiting its reply
+	std::string pendingAddress;							/// The address of a pending RCPT command
+	std::vector<RecipientReply> recipientReplies;		/// Replies to the RCPT commands of the transaction
+	std::vector<std::string> capabilities;				/// Extensions from the last EHLO reply
+	std::vector<std::string> pendingCapabilities;		/// Extensions of an EHLO reply still being received
+	int lastReplyCode;									/// The code of the last complete reply
+
+	void commandLine(const std::string &line);
+	void replyLine(const std::string &line);
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* SMTPTRANSCRIPT_H_ */
@@ -0,0 +1,203 @@
+/**
+ * \file SendScheduler.h
+ *
+ * \brief Header file for sharing connections between classes of mail by priority
+ */
+
+#ifndef SENDSCHEDULER_H_
+#define SENDSCHEDULER_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <cstdint>
+
+#include "./Email.h"
+#include "./Metrics.h"
+#include "./SMTPConnection.h"
+
+namespace SimplyEmail {
+
+/**
+ * \brief A class of mail sharing the scheduler's connections, such as transactional or bulk
+ */
+struct PriorityClass {
+	std::string name;									/// The name reported in statistics
+	unsigned int weight;								/// The class's share of the shared connections relative to the other classes
+	unsigned int reserved;								/// Connections that send only this class
+	std::size_t maxQueued;								/// Messages that may wait before submit() blocks, or 0 for no limit
+	std::chrono::milliseconds budget;					/// The time from submit() by which each message must be sent, or 0 for no limit
+
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \param[in] name The name reported in statistics
+	 * \param[in] weight The class's share of the shared connections; at least 1
+	 * \param[in] reserved Connections that send only this class
+	 * \param[in] maxQueued Messages that may wait before submit() blocks, or 0 for no limit
+	 * \param[in] budget The time from submit() by which each message must be sent, or 0 for no limit
+	 *
+	 * \return void
+	 */
+	PriorityClass(const std::string &name, unsigned int weight, unsigned int reserved = 0, std::size_t maxQueued = 0, std::chrono::milliseconds budget = std::chrono::milliseconds(0));
+};
+
+/**
+ * \brief A copy of the counters of one priority class
+ */
+struct PriorityClassStats {
+	std::string name;									/// The class name
+	std::size_t queued;									/// Messages waiting to be sent
+	std::size_t sending;								/// Messages being sent
+	std::uint64_t sent;									/// Messages sent
+	std::uint64_t failed;								/// Messages that could not be sent
+	std::uint64_t timedOut;								/// Messages among the failed that ran out of their budget or a timeout
+	std::uint64_t maxQueueMicros;						/// The longest any message waited between submit() and being sent
+	std::uint64_t p50QueueMicros;						/// The upper bound of the wait histogram bucket holding the median
+	std::uint64_t p99QueueMicros;						/// The upper bound of the wait histogram bucket holding the 99th percentile
+	SimplyEmail::HistogramSnapshot queueLatency;		/// The time messages waited between submit() and being sent
+};
+
+/**
+ * \brief Sends mail of several priority classes over a set of connections, so that bulk mail cannot hold up urgent mail
+ *
+ * \details Each connection is driven by a thread of its own. Messages wait in one queue per class, and whenever a
+ * connection is free it takes the next message by weighted fair queuing: over time each class with messages waiting
+ * is given a share of the sends in proportion to its weight, however many messages the other classes have queued.
+ * A class of weight 9 waiting beside a class of weight 1 takes nine sends in ten, and takes every send while the
+ * other has nothing queued. Shares are counted in messages, not bytes.
+ *
+ * A class may also reserve connections, which send only that class and sit idle when it has nothing queued. The
+ * rest are shared by every class. A reservation bounds the wait of urgent mail by the time to send the messages
+ * queued ahead of it in its own class, even while every shared connection is busy with a long bulk send.
+ *
+ * A class with a budget gives each message a deadline that long after submit(). Time spent queued counts against
+ * it, and what is left bounds the connect and total timeouts of the send; a message whose deadline passes while it
+ * is queued fails with an SMTPTimeout without being sent.
+ *
+ * The time each message waits between submit() and the start of its send is recorded per class; see getStats().
+ *
+ * submit() and flush() may be called from any thread. The connections must be initialized and must not be used by
+ * anything else while the scheduler exists.
+ */
+class SendScheduler {
+public:
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \details Starts one thread per connection. Throws a std::runtime_error if there are no connections or no
+	 * classes, a class has a weight of 0, or the reservations leave no connection shared.
+	 *
+	 * \param[in] connections The connections to send over, which must outlive the scheduler
+	 * \param[in] classes The priority classes, numbered in the order given
+	 *
+	 * \return void
+	 */
+	SendScheduler(const std::vector<SimplyEmail::SMTPConnection*> &connections, const std::vector<SimplyEmail::PriorityClass> &classes);
+
+	/**
+	 * \brief Default destructor
+	 *
+	 * \details Sends every submitted message then stops the threads.
+	 */
+	~SendScheduler();
+
+	/**
+	 * \brief Queues an email to be sent
+	 *
+	 * \details Blocks while the class has maxQueued messages waiting. The email is not copied and must stay
+	 * unchanged until the returned future is ready. Throws a std::out_of_range if there is no such class.
+	 *
+	 * \param[in] email A reference to the email to be sent
+	 * \param[in] priorityClass The number of the class to send it in
+	 *
+	 * \return std::future<void> Becomes ready once the email is sent; rethrows the SMTPError if it was not
+	 */
+	std::future<void> submit(const SimplyEmail::Email &email, std::size_t priorityClass);
+
+	/**
+	 * \brief Waits until every submitted email has been sent or has failed
+	 *
+	 * \return void
+	 */
+	void flush();
+
+	/**
+	 * \brief Copies the counters of every class
+	 *
+	 * \return std::vector<PriorityClassStats> One entry per class, in class order
+	 */
+	std::vector<SimplyEmail::PriorityClassStats> getStats() const;
+
+	std::size_t getClassCount() const;
+	std::size_t getConnectionCount() const;
+
+private:
+	static const std::size_t NO_CLASS;					/// Marks a shared connection, or that no class has work
+
+	/**
+	 * \brief A message waiting to be sent
+	 */
+	struct Item {
+		const SimplyEmail::Email *email;				/// The message
+		std::promise<void> done;						/// Reports the outcome
+		std::chrono::steady_clock::time_point submitted;	/// When submit() was called
+		double finish;									/// The virtual time by which fair queuing should have sent it
+	};
+
+	/**
+	 * \brief The queue and counters of a priority class
+	 */
+	struct ClassState {
+		SimplyEmail::PriorityClass config;				/// The class as given
+		std::deque<Item> queue;							/// Messages waiting, oldest first
+		double lastFinish;								/// The finish time of the last message queued
+		std::size_t sending;							/// Messages being sent
+		std::uint64_t sent;								/// Messages sent
+		std::uint64_t failed;							/// Messages that could not be sent
+		std::uint64_t timedOut;							/// Messages that ran out of time
+		std::uint64_t maxQueueMicros;					/// The longest wait
+		SimplyEmail::LatencyHistogram queueLatency;		/// Every wait
+
+		explicit ClassState(const SimplyEmail::PriorityClass &config);
+	};
+
+	std::vector<SimplyEmail::SMTPConnection*> connections;	/// The connections to send over
+	std::vector<std::size_t> dedicated;					/// The class each connection is reserved for, or NO_CLASS
+
+	mutable std::mutex mutex;							/// Guards every member below
+	std::condition_variable changed;					/// Signalled when a message is queued or finishes
+	std::vector<std::unique_ptr<ClassState> > classes;	/// The priority classes
+	double virtualTime;									/// The latest finish time of the messages taken
+	std::uint64_t submitted;							/// Messages submitted so far
+	std::uint64_t completed;							/// Messages sent or failed so far
+	bool stopping;										/// Set when the threads should exit
+
+	std::vector<std::thread> workers;					/// One thread per connection
+
+	SendScheduler(const SendScheduler &other);
+	SendScheduler& operator=(const SendScheduler &other);
+
+	/**
+	 * \brief Chooses the class a connection should send next
+	 *
+	 * \details Must be called with the mutex held.
+	 *
+	 * \param[in] reservedFor The class the connection is reserved for, or NO_CLASS if it is shared
+	 *
+	 * \return std::size_t The class whose oldest message has the earliest finish time, or NO_CLASS if none is waiting
+	 */
+	std::size_t choose(std::size_t reservedFor) const;
+
+	void workerLoop(std::size_t connectionNumber);
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* SENDSCHEDULER_H_ */
@@ -0,0 +1,156 @@
+/**
+ * \file SpoolQueue.h
+ *
+ * \brief Header file for the queue of encoded messages governed by a memory budget
+ */
+
+#ifndef SPOOLQUEUE_H_
+#define SPOOLQUEUE_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+#include "./Email.h"
+#include "./MemoryBudget.h"
+
+namespace SimplyEmail {
+
+/**
+ * \brief An encoded message with its envelope, held in memory or spilled to disk
+ *
+ * \details Charges its size to a memory budget while in memory and returns the charge when spilled or destroyed.
+ * A spilled message deletes its file when destroyed. Send it with SMTPConnection::send(const SpooledMessage&).
+ */
+class SpooledMessage {
+	friend class SpoolQueue;
+
+public:
+	/**
+	 * \brief Default destructor
+	 *
+	 * \details Returns the message's charge to the budget and deletes its spill file.
+	 */
+	~SpooledMessage();
+
+	const std::string& getFrom() const;
+	const std::vector<std::string>& getEnvelope() const;
+	std::size_t getSize() const;
+	bool isSpilled() const;
+
+	/**
+	 * \brief Gets the encoded message while it is in memory
+	 *
+	 * \return const std::string& The encoded message; empty once spilled
+	 */
+	const std::string& getPayload() const;
+
+	/**
+	 * \brief Gets the file holding a spilled message
+	 *
+	 * \return const std::string& The path of the spill file; empty while in memory
+	 */
+	const std::string& getSpillPath() const;
+
+private:
+	SimplyEmail::MemoryBudget &budget;					/// The budget the message is charged to
+	std::string from;									/// The envelope sender
+	std::vector<std::string> envelope;					/// The envelope recipients
+	std::string payload;								/// The encoded message while in memory
+	std::size_t size;									/// The length of the encoded message
+	std::string spillPath;								/// The spill file, or empty
+	bool charged;										/// Whether the size is charged to the budget
+
+	SpooledMessage(SimplyEmail::MemoryBudget &budget, const SimplyEmail::Email &email);
+
+	SpooledMessage(const SpooledMessage &other);
+	SpooledMessage& operator=(const SpooledMessage &other);
+
+	/**
+	 * \brief Writes the payload to a new file in the scratch directory and frees it
+	 *
+	 * \return bool True if the message was spilled
+	 */
+	bool spill();
+};
+
+/**
+ * \brief A first in, first out queue of encoded messages within a memory budget
+ *
+ * \details Producers push emails, which are encoded straight away so that their attachments need not be kept, and
+ * senders pop encoded messages. Every queued message is charged to the budget. When the budget passes its soft
+ * limit the queue spills the messages that will be sent last, newest first, to the budget's scratch directory; when
+ * it would pass its hard limit push() blocks or throws, as the budget's overflow policy says. A popped message keeps
+ * its charge until it is destroyed, so in flight messages count too.
+ *
+ * All member functions may be called from any thread.
+ */
+class SpoolQueue : public Spillable {
+public:
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \param[in] budget The budget to charge, which must outlive the queue
+	 *
+	 * \return void
+	 */
+	explicit SpoolQueue(SimplyEmail::MemoryBudget &budget);
+
+	/**
+	 * \brief Default destructor
+	 *
+	 * \details Discards any queued messages.
+	 */
+	~SpoolQueue();
+
+	/**
+	 * \brief Encodes and queues an email
+	 *
+	 * \details Blocks, or throws a std::runtime_error, while the budget is exhausted. The message's size is counted
+	 * and charged before it is encoded, so a blocked or refused push holds no encoded payload. Throws if the queue is
+	 * closed.
+	 *
+	 * \param[in] email A reference to the email to queue
+	 *
+	 * \return void
+	 */
+	void push(const SimplyEmail::Email &email);
+
+	/**
+	 * \brief Takes the oldest message
+	 *
+	 * \details Waits for a message if the queue is empty and open.
+	 *
+	 * \return std::unique_ptr<SpooledMessage> The message, or NULL once the queue is closed and empty
+	 */
+	std::unique_ptr<SimplyEmail::SpooledMessage> pop();
+
+	/**
+	 * \brief Stops the queue accepting messages and wakes waiting senders
+	 *
+	 * \return void
+	 */
+	void close();
+
+	std::size_t getSize() const;
+
+	std::size_t spill(std::size_t bytes);
+
+private:
+	SimplyEmail::MemoryBudget &budget;					/// The budget messages are charged to
+
+	mutable std::mutex mutex;							/// Guards the members below
+	std::condition_variable available;					/// Signalled when a message is pushed or the queue closes
+	std::deque<std::unique_ptr<SimplyEmail::SpooledMessage> > messages;	/// The queued messages, oldest first
+	bool closed;										/// Whether the queue accepts messages
+
+	SpoolQueue(const SpoolQueue &other);
+	SpoolQueue& operator=(const SpoolQueue &other);
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* SPOOLQUEUE_H_ */
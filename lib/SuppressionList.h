@@ -0,0 +1,158 @@
+/**
+ * \file SuppressionList.h
+ *
+ * \brief Header file for lists of bounced or unsubscribed addresses that must not be sent to
+ */
+
+#ifndef SUPPRESSIONLIST_H_
+#define SUPPRESSIONLIST_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstddef>
+#include <cstdint>
+
+namespace SimplyEmail {
+
+/**
+ * \brief A read only set of addresses loaded from a sorted file
+ *
+ * \details The file holds one address per line in lower case, sorted bytewise (as by LC_ALL=C sort) and without
+ * blank lines. It is memory mapped rather than read, so its contents live in the page cache and are shared with
+ * every other process using the same list.
+ *
+ * Lookups first probe a blocked Bloom filter, which touches a single 64 byte cache line and rules out almost every
+ * address that is not listed. The few that pass are confirmed against the file, so there are no false positives: a
+ * sparse index of every 32nd address narrows the search to 32 consecutive lines. The filter costs bitsPerEntry bits
+ * per address and the index half a byte; together, reported by getMemoryUsage(), they are the only memory used
+ * outside the page cache. The default of 12 bits lets about one unlisted address in 300 through to the file.
+ *
+ * Addresses are compared without surrounding whitespace or angle brackets and ignoring ASCII case.
+ *
+ * reload() and reloadIfChanged() build the new list alongside the old one and swap it in, so lookups never wait for a
+ * reload. Each lookup, or each filter() batch, holds a reference to the version it started on, and an old version is
+ * unmapped as soon as the last lookup using it returns. Replace the file by renaming a new one over it, never by
+ * rewriting it in place. Every method may be called from any thread.
+ */
+class SuppressionList {
+public:
+	static const unsigned int DEFAULT_BITS_PER_ENTRY;	/// Filter bits per address when none is given
+
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \details Throws a std::runtime_error if the file cannot be mapped or is not sorted, lower case and free of
+	 * blank lines.
+	 *
+	 * \param[in] filePath The path of the sorted address file
+	 * \param[in] bitsPerEntry Filter bits per address, trading memory for fewer binary searches
+	 *
+	 * \return void
+	 */
+	explicit SuppressionList(const std::string &filePath, unsigned int bitsPerEntry = DEFAULT_BITS_PER_ENTRY);
+
+	/**
+	 * \brief Checks whether an address is suppressed
+	 *
+	 * \param[in] address The address to look up
+	 *
+	 * \return bool True if the address is listed
+	 */
+	bool contains(const std::string &address) const;
+
+	/**
+	 * \brief Removes every suppressed address from a list
+	 *
+	 * \details Looks every address up against the same version of the list, and keeps the others in order.
+	 *
+	 * \param[in,out] addresses The addresses to filter
+	 * \param[out] suppressed If not NULL, receives the addresses removed
+	 *
+	 * \return std::size_t The number of addresses removed
+	 */
+	std::size_t filter(std::vector<std::string> &addresses, std::vector<std::string> *suppressed = NULL) const;
+
+	/**
+	 * \brief Loads the file again
+	 *
+	 * \details Throws a std::runtime_error and keeps the current list if the file cannot be loaded.
+	 *
+	 * \return void
+	 */
+	void reload();
+
+	/**
+	 * \brief Loads the file again if it has been replaced or modified since it was last loaded
+	 *
+	 * \details Cheap enough to call before every batch. Throws a std::runtime_error and keeps the current list if the
+	 * new file cannot be loaded.
+	 *
+	 * \return bool True if the file was loaded again
+	 */
+	bool reloadIfChanged();
+
+	/**
+	 * \brief Lower cases an address and strips surrounding whitespace and angle brackets
+	 *
+	 * \param[in] address The address
+	 *
+	 * \return std::string The address in the form it is listed
+	 */
+	static std::string normalize(const std::string &address);
+
+	const std::string& getPath() const;
+	std::size_t getEntryCount() const;
+	std::size_t getMemoryUsage() const;
+
+private:
+	struct Snapshot;
+
+	std::string path;									/// The address file
+	unsigned int bitsPerEntry;							/// Filter bits per address
+	std::shared_ptr<const Snapshot> current;			/// The loaded list; only accessed with std::atomic_load and std::atomic_store
+	std::mutex reloadMutex;								/// Serializes reloads
+
+	SuppressionList(const SuppressionList &other);
+	SuppressionList& operator=(const SuppressionList &other);
+
+	/**
+	 * \brief Gets the loaded list
+	 *
+	 * \return std::shared_ptr<const Snapshot> The list, kept loaded for as long as the reference is held
+	 */
+	std::shared_ptr<const Snapshot> snapshot() const;
+
+	/**
+	 * \brief Maps, checks and indexes the address file
+	 *
+	 * \return std::shared_ptr<const Snapshot> The loaded list
+	 */
+	std::shared_ptr<const Snapshot> load() const;
+
+	/**
+	 * \brief Looks a normalized address up in a loaded list
+	 *
+	 * \param[in] list The loaded list
+	 * \param[in] key The normalized address
+	 * \param[in] length The length of the normalized address
+	 *
+	 * \return bool True if the address is listed
+	 */
+	static bool lookup(const Snapshot &list, const char *key, std::size_t length);
+
+	/**
+	 * \brief Looks an address up in a loaded list, normalizing it without allocating when it is of usual length
+	 *
+	 * \param[in] list The loaded list
+	 * \param[in] address The address
+	 *
+	 * \return bool True if the address is listed
+	 */
+	static bool lookupAddress(const Snapshot &list, const std::string &address);
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* SUPPRESSIONLIST_H_ */
@@ -0,0 +1,77 @@
+/**
+ * \file ThreadPool.h
+ *
+ * \brief Header file for the bounded worker thread pool
+ */
+
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+
+namespace SimplyEmail {
+
+/**
+ * \brief Fixed size pool of worker threads
+ *
+ * \details Runs submitted tasks on a bounded number of threads. Tasks are run in submission order. A task must not
+ * block waiting for another task submitted to the same pool, since every worker could end up waiting.
+ */
+class ThreadPool {
+public:
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \details Starts the worker threads.
+	 *
+	 * \param[in] threads The number of worker threads; 0 uses one thread per hardware thread
+	 *
+	 * \return void
+	 */
+	explicit ThreadPool(unsigned int threads = 0);
+
+	/**
+	 * \brief Default destructor
+	 *
+	 * \details Runs every task already submitted then stops the worker threads.
+	 */
+	~ThreadPool();
+
+	/**
+	 * \brief Submits a task
+	 *
+	 * \param[in] task The task to run
+	 *
+	 * \return std::future<void> Becomes ready when the task finishes and rethrows anything the task threw
+	 */
+	std::future<void> submit(const std::function<void()> &task);
+
+	unsigned int getThreadCount() const;
+
+private:
+	std::vector<std::thread> workers;					/// The worker threads
+	std::deque<std::packaged_task<void()> > tasks;		/// Tasks waiting for a worker
+	std::mutex mutex;									/// Guards tasks and stopping
+	std::condition_variable available;					/// Signalled when a task is submitted or the pool stops
+	bool stopping;										/// Set when the pool is being destroyed
+
+	/**
+	 * \brief Worker thread loop
+	 *
+	 * \return void
+	 */
+	void run();
+
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* THREADPOOL_H_ */
@@ -0,0 +1,119 @@
+/**
+ * \file TimerWheel.h
+ *
+ * \brief Header file for the hierarchical timer wheel
+ */
+
+#ifndef TIMERWHEEL_H_
+#define TIMERWHEEL_H_
+
+#include <vector>
+#include <cstdint>
+
+namespace SimplyEmail {
+
+/**
+ * \brief Hierarchical timer wheel
+ *
+ * \details Keeps a large number of timers, each identified by a 64 bit value, with constant time insertion and
+ * cancellation. Time is measured in ticks chosen by the caller. The wheel has four levels of 256 slots; the first level
+ * holds timers due in the next 256 ticks and each further level covers 256 times the span of the one below it. As time
+ * advances, the timers in a higher level slot are redistributed to the levels below, so each timer is touched at most
+ * once per level, and stretches of time with nothing to redistribute or expire are skipped. Timers further away than
+ * the wheel spans (2^32 ticks) wait in the last slot and are redistributed until they are due.
+ *
+ * The wheel is not thread safe.
+ */
+class TimerWheel {
+public:
+	typedef std::uint32_t Handle;						/// Identifies a scheduled timer until it fires or is cancelled
+
+	static const Handle INVALID_HANDLE;					/// Never returned by schedule()
+
+	/**
+	 * \brief Parametrized constructor
+	 *
+	 * \details Creates an empty wheel.
+	 *
+	 * \param[in] startTick The current time in ticks
+	 *
+	 * \return void
+	 */
+	explicit TimerWheel(std::uint64_t startTick = 0);
+
+	/**
+	 * \brief Schedules a timer
+	 *
+	 * \details Timers already due fire on the next tick.
+	 *
+	 * \param[in] id The value returned when the timer fires
+	 * \param[in] expiryTick The tick the timer is due at
+	 *
+	 * \return Handle The handle for cancelling the timer
+	 */
+	Handle schedule(std::uint64_t id, std::uint64_t expiryTick);
+
+	/**
+	 * \brief Cancels a timer
+	 *
+	 * \details The handle must have been returned by schedule() and its timer must not have fired or been cancelled.
+	 *
+	 * \param[in] handle The timer to cancel
+	 *
+	 * \return void
+	 */
+	void cancel(Handle handle);
+
+	/**
+	 * \brief Advances the wheel and collects the timers that are due
+	 *
+	 * \details Moves the current time forward to the given tick, appending the identifier of every timer that fell
+	 * due. Moving backwards has no effect.
+	 *
+	 * \param[in] nowTick The current time in ticks
+	 * \param[out] expired Receives the identifiers of the expired timers
+	 *
+	 * \return void
+	 */
+	void advance(std::uint64_t nowTick, std::vector<std::uint64_t> &expired);
+
+	std::uint64_t getCurrentTick() const;
+	std::size_t getSize() const;
+
+private:
+	static const unsigned int LEVELS = 4;				/// The number of levels
+	static const unsigned int SLOT_BITS = 8;			/// log2 of the number of slots per level
+	static const unsigned int SLOTS = 1 << SLOT_BITS;	/// The number of slots per level
+
+	/**
+	 * \brief A timer, linked into the list of its slot
+	 */
+	struct Node {
+		std::uint64_t id;								/// The value returned when the timer fires
+		std::uint64_t expiry;							/// The tick the timer is due at
+		std::int32_t previous;							/// The previous node in the slot, or -1
+		std::int32_t next;								/// The next node in the slot or free list, or -1
+		std::int32_t slot;								/// The slot holding the node, or -1 if the node is free
+	};
+
+	std::vector<Node> nodes;							/// Storage for every timer, including free nodes
+	std::int32_t freeList;								/// The first free node, or -1
+	std::int32_t heads[LEVELS * SLOTS];					/// The first node of each slot, or -1
+	std::size_t levelSizes[LEVELS];						/// The number of timers in each level
+	std::uint64_t currentTick;							/// The current time
+	std::size_t size;									/// The number of scheduled timers
+
+	void link(std::int32_t index);
+	void unlink(std::int32_t index);
+
+	/**
+	 * \brief Moves every timer in a slot to the slot matching its expiry
+	 *
+	 * \return void
+	 */
+	void cascade(unsigned int level, unsigned int slot);
+};
+
+} /* namespace SimplyEmail */
+
+#endif /* TIMERWHEEL_H_ */
@@ -0,0 +1,235 @@
+/**
+ * \file AttachmentStore.cpp
+ *
+ * \brief Implementation file for the persisted store of encoded attachments
+ */
+
+#include "../lib/AttachmentStore.h"
+#include "../lib/MappedFile.h"
+#include "../lib/Metrics.h"
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace SimplyEmail {
+
+const std::uint32_t AttachmentStore::FORMAT_VERSION = 2;
+
+namespace {
+
+const char entryMagic[8] = {'S', 'E', 'A', 'T', 'T', 'A', 'C', 'H'};
+
+/**
+ * \brief Fixed part of an entry header
+ *
+ * \details Stored in native byte order; entries are a local cache and are not meant to be moved between machines.
+ * The variable length source path, MIME type and file name follow, then padding to eight bytes, then the payload.
+ */
+struct EntryHeader {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t headerLength;
+	std::uint64_t sourceSize;
+	std::int64_t modifiedSeconds;
+	std::int64_t modifiedNanoseconds;
+	std::uint64_t checksum;
+	std::uint64_t payloadLength;
+	std::uint32_t pathLength;
+	std::uint32_t mimeTypeLength;
+	std::uint32_t fileNameLength;
+	std::uint32_t reserved;
+};
+
+} /* namespace */
+
+AttachmentStore::AttachmentStore(const std::string &_directory) {
+	this->directory = _directory;
+	this->verifyChecksums = false;
+
+	if((mkdir(this->directory.c_str(), 0755) != 0) && (errno != EEXIST)) {
+		throw std::runtime_error("Error creating attachment store: could not create directory " + this->directory);
+	}
+}
+
+AttachmentStore::~AttachmentStore() {
+	// Nothing to destroy :(
+}
+
+EmailAttachment AttachmentStore::load(const std::string &fileAddress, SimplyEmail::ThreadPool *pool) const {
+	SourceInfo source = describe(fileAddress);
+	std::string entry = this->entryPath(source.path);
+
+	//Try the stored entry first
+	std::shared_ptr<MappedFile> mapping;
+	try {
+		mapping = std::make_shared<MappedFile>(entry);
+	}
+	catch (const std::runtime_error& e) {
+		// No usable entry; fall through and build one
+	}
+
+	if(mapping && (mapping->getSize() >= sizeof(EntryHeader))) {
+		EntryHeader header;
+		std::memcpy(&header, mapping->getData(), sizeof(header));
+
+		bool valid = (std::memcmp(header.magic, entryMagic, sizeof(entryMagic)) == 0)
+				&& (header.version == FORMAT_VERSION)
+				&& (header.headerLength <= mapping->getSize())
+				&& (header.payloadLength == mapping->getSize() - header.headerLength)
+				&& ((std::uint64_t)sizeof(header) + header.pathLength + header.mimeTypeLength + header.fileNameLength <= header.headerLength)
+				&& (header.sourceSize == source.size)
+				&& (header.modifiedSeconds == source.modifiedSeconds)
+				&& (header.modifiedNanoseconds == source.modifiedNanoseconds);
+
+		if(valid) {
+			const char *strings = mapping->getData() + sizeof(header);
+			valid = (source.path.compare(0, std::string::npos, strings, header.pathLength) == 0);
+
+			if(valid && this->verifyChecksums) {
+				MappedFile sourceMapping(source.path);
+				valid = (checksum(sourceMapping.getData(), sourceMapping.getSize()) == header.checksum);
+			}
+
+			if(valid) {
+				std::string mimeType(strings + header.pathLength, header.mimeTypeLength);
+				std::string fileName(strings + header.pathLength + header.mimeTypeLength, header.fileNameLength);
+
+				Metrics::recordAttachmentCacheHit();
+
+				//Point straight into the mapping; the attachment keeps the mapping alive
+				return EmailAttachment(fileName, mimeType, std::shared_ptr<const char>(mapping, mapping->getData() + header.headerLength), header.payloadLength);
+			}
+		}
+	}
+
+	mapping.reset();
+
+	//Encode the file and store it for next time
+	std::shared_ptr<const std::string> raw = EmailAttachment::readFile(fileAddress);
+
+	EmailAttachment toReturn;
+	toReturn.setData(EmailAttachment::encodeAndWait(raw, pool));
+	toReturn.setFileDetails(fileAddress);
+
+	//The store is only a cache; failing to write an entry must not fail the attachment
+	try {
+		this->write(source, checksum(raw->data(), raw->length()), toReturn);
+	}
+	catch (const std::runtime_error& e) {
+		// Nothing to do; the file will be encoded again next time
+	}
+
+	return toReturn;
+}
+
+bool AttachmentStore::invalidate(const std::string &fileAddress) const {
+	return (remove(this->entryPath(describe(fileAddress).path).c_str()) == 0);
+}
+
+void AttachmentStore::setVerifyChecksums(bool verify) {
+	this->verifyChecksums = verify;
+}
+
+bool AttachmentStore::getVerifyChecksums() const {
+	return this->verifyChecksums;
+}
+
+const std::string& AttachmentStore::getDirectory() const {
+	return this->directory;
+}
+
+AttachmentStore::SourceInfo AttachmentStore::describe(const std::string &fileAddress) {
+	SourceInfo toReturn;
+
+	char canonical[PATH_MAX];
+	if(realpath(fileAddress.c_str(), canonical) == NULL) {
+		throw std::runtime_error("Error creating attachment: could not open file.");
+	}
+
+	struct stat status;
+	if(stat(canonical, &status) != 0) {
+		throw std::runtime_error("Error creating attachment: could not open file.");
+	}
+
+	toReturn.path = canonical;
+	toReturn.size = (std::uint64_t)status.st_size;
+	toReturn.modifiedSeconds = (std::int64_t)status.st_mtim.tv_sec;
+	toReturn.modifiedNanoseconds = (std::int64_t)status.st_mtim.tv_nsec;
+
+	return toReturn;
+}
+
+std::string AttachmentStore::entryPath(const std::string &canonicalPath) const {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.att", (unsigned long long)checksum(canonicalPath.data(), canonicalPath.length()));
+
+	return this->directory + "/" + name;
+}
+
+void AttachmentStore::write(const SourceInfo &source, std::uint64_t sourceChecksum, const EmailAttachment &attachment) const {
+	static std::atomic<unsigned int> sequence(0);
+
+	EntryHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, entryMagic, sizeof(entryMagic));
+
+	std::uint64_t stringLength = source.path.length() + attachment.getMimeType().length() + attachment.getFileName().length();
+
+	header.version = FORMAT_VERSION;
+	header.headerLength = (std::uint32_t)(((sizeof(header) + stringLength) + 7) & ~(std::uint64_t)7);
+	header.sourceSize = source.size;
+	header.modifiedSeconds = source.modifiedSeconds;
+	header.modifiedNanoseconds = source.modifiedNanoseconds;
+	header.checksum = sourceChecksum;
+	header.payloadLength = attachment.getDataLength();
+	header.pathLength = source.path.length();
+	header.mimeTypeLength = attachment.getMimeType().length();
+	header.fileNameLength = attachment.getFileName().length();
+
+	//Write to a unique temporary file and rename it into place so that readers never see a partial entry
+	std::string entry = this->entryPath(source.path);
+
+	char suffix[48];
+	snprintf(suffix, sizeof(suffix), ".tmp.%ld.%u", (long)getpid(), sequence.fetch_add(1));
+	std::string temporary = entry + suffix;
+
+	std::ofstream output(temporary.c_str(), std::ofstream::binary | std::ofstream::trunc);
+	if(!output.is_open()) {
+		throw std::runtime_error("Error writing attachment store: could not create " + temporary);
+	}
+
+	static const char padding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+	output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	output.write(source.path.data(), source.path.length());
+	output.write(attachment.getMimeType().data(), attachment.getMimeType().length());
+	output.write(attachment.getFileName().data(), attachment.getFileName().length());
+	output.write(padding, header.headerLength - (sizeof(header) + stringLength));
+	output.write(attachment.getDataPointer(), attachment.getDataLength());
+	output.close();
+
+	if(output.fail() || (rename(temporary.c_str(), entry.c_str()) != 0)) {
+		remove(temporary.c_str());
+		throw std::runtime_error("Error writing attachment store: could not write " + entry);
+	}
+}
+
+std::uint64_t AttachmentStore::checksum(const char *data, std::size_t length) {
+	std::uint64_t toReturn = 0xcbf29ce484222325ULL;
+
+	for(std::size_t i=0; i<length; i++){
+		toReturn = (toReturn ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+	}
+
+	return toReturn;
+}
+
+} /* namespace SimplyEmail */
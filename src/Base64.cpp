@@ -0,0 +1,198 @@
+/**
+ * \file Base64.cpp
+ *
+ * \brief Implementation file for the base 64 encoder
+ */
+
+#include "../lib/Base64.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace SimplyEmail {
+
+const std::size_t Base64::LINE_LENGTH = 76;
+const std::size_t Base64::LINE_INPUT = 57;
+
+namespace {
+
+const char baseChars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * \brief The two characters encoding each 12 bit value
+ *
+ * \details Halves the table lookups per group of three bytes compared with one lookup per character.
+ */
+struct PairTable {
+	char pairs[4096][2];
+
+	PairTable() {
+		for(unsigned int i=0; i<4096; i++){
+			this->pairs[i][0] = baseChars[i >> 6];
+			this->pairs[i][1] = baseChars[i & 0x3f];
+		}
+	}
+};
+
+const PairTable& pairTable() {
+	static const PairTable table;
+	return table;
+}
+
+#if defined(__SSE2__)
+/**
+ * \brief Encodes twelve bytes into sixteen characters
+ *
+ * \details Reads thirteen bytes, so at least one more than is encoded must be readable.
+ *
+ * \param[in] in The bytes to encode
+ * \param[out] output Receives sixteen characters
+ *
+ * \return void
+ */
+inline void encodeBlock(const unsigned char *in, char *output) {
+	//SSE2 has no byte shuffle to spread the four groups of three bytes over the four 32 bit lanes, and four
+	//overlapping loads beat building them from one load with byte shifts and masks
+	std::uint32_t words[4];
+	std::memcpy(&words[0], in, 4);
+	std::memcpy(&words[1], in + 3, 4);
+	std::memcpy(&words[2], in + 6, 4);
+	std::memcpy(&words[3], in + 9, 4);
+
+	__m128i groups = _mm_set_epi32((int)words[3], (int)words[2], (int)words[1], (int)words[0]);
+
+	//Each lane holds a, b and c in its low three bytes; move the four 6 bit values into its four bytes in order
+	__m128i values = _mm_and_si128(_mm_srli_epi32(groups, 2), _mm_set1_epi32(0x0000003f));
+	values = _mm_or_si128(values, _mm_and_si128(_mm_slli_epi32(groups, 12), _mm_set1_epi32(0x00003000)));
+	values = _mm_or_si128(values, _mm_and_si128(_mm_srli_epi32(groups, 4), _mm_set1_epi32(0x00000f00)));
+	values = _mm_or_si128(values, _mm_and_si128(_mm_slli_epi32(groups, 10), _mm_set1_epi32(0x003c0000)));
+	values = _mm_or_si128(values, _mm_and_si128(_mm_srli_epi32(groups, 6), _mm_set1_epi32(0x00030000)));
+	values = _mm_or_si128(values, _mm_and_si128(_mm_slli_epi32(groups, 8), _mm_set1_epi32(0x3f000000)));
+
+	//Map each value to its character by adding the offset of the range it falls in: A-Z, a-z, 0-9, '+' and '/'
+	__m128i characters = _mm_add_epi8(values, _mm_set1_epi8('A'));
+	characters = _mm_add_epi8(characters, _mm_and_si128(_mm_cmpgt_epi8(values, _mm_set1_epi8(25)), _mm_set1_epi8('a' - 'A' - 26)));
+	characters = _mm_add_epi8(characters, _mm_and_si128(_mm_cmpgt_epi8(values, _mm_set1_epi8(51)), _mm_set1_epi8('0' - 'a' - 26)));
+	characters = _mm_add_epi8(characters, _mm_and_si128(_mm_cmpgt_epi8(values, _mm_set1_epi8(61)), _mm_set1_epi8('+' - '0' - 10)));
+	characters = _mm_add_epi8(characters, _mm_and_si128(_mm_cmpgt_epi8(values, _mm_set1_epi8(62)), _mm_set1_epi8('/' - '+' - 1)));
+
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(output), characters);
+}
+#endif
+
+/**
+ * \brief Encodes whole groups of three bytes
+ *
+ * \param[in] in The bytes to encode; length must be a multiple of three
+ * \param[in] length The number of bytes
+ * \param[out] output Receives (length / 3) * 4 characters
+ * \param[in] table The pair table
+ *
+ * \return char* The position after the last character written
+ */
+inline char* encodeGroups(const unsigned char *in, std::size_t length, char *output, const PairTable &table) {
+	std::size_t i = 0;
+
+#if defined(__SSE2__)
+	//Twelve bytes at a time while thirteen can be read, which leaves the last block to the table
+	for(; i+13<=length; i+=12){
+		encodeBlock(in + i, output);
+		output += 16;
+	}
+#endif
+
+	for(; i<length; i+=3){
+		unsigned int value = (in[i] << 16) | (in[i+1] << 8) | in[i+2];
+
+		std::memcpy(output, table.pairs[value >> 12], 2);
+		std::memcpy(output + 2, table.pairs[value & 0xfff], 2);
+		output += 4;
+	}
+
+	return output;
+}
+
+/**
+ * \brief Encodes the last one or two bytes of the input with padding
+ *
+ * \return void
+ */
+inline void encodeTail(const unsigned char *in, std::size_t length, char *output) {
+	unsigned int value = in[0] << 16;
+	if(length > 1) {
+		value = value | (in[1] << 8);
+	}
+
+	output[0] = baseChars[(value >> 18) & 0x3f];
+	output[1] = baseChars[(value >> 12) & 0x3f];
+	output[2] = (length > 1) ? baseChars[(value >> 6) & 0x3f] : '=';
+	output[3] = '=';
+}
+
+} /* namespace */
+
+std::size_t Base64::encodedLength(std::size_t inputLength) {
+	return ((inputLength + 2) / 3) * 4;
+}
+
+std::size_t Base64::wrappedLength(std::size_t inputLength) {
+	std::size_t encoded = encodedLength(inputLength);
+
+	//A CRLF between each pair of lines
+	return (encoded == 0) ? 0 : encoded + (2 * ((encoded - 1) / LINE_LENGTH));
+}
+
+void Base64::encode(const char *input, std::size_t inputLength, char *output) {
+	const unsigned char *in = reinterpret_cast<const unsigned char*>(input);
+	std::size_t whole = inputLength - (inputLength % 3);
+
+	//Encode all the groups of 3, then the last remaining 1 or 2 bytes, padding the missing bits with zeros
+	output = encodeGroups(in, whole, output, pairTable());
+
+	if(inputLength > whole) {
+		encodeTail(in + whole, inputLength - whole, output);
+	}
+}
+
+void Base64::encodeWrapped(const char *input, std::size_t inputLength, char *output) {
+	const unsigned char *in = reinterpret_cast<const unsigned char*>(input);
+	const PairTable &table = pairTable();
+
+	//Full lines, each followed by a line break unless it ends the input
+	std::size_t offset = 0;
+
+	while(inputLength - offset >= LINE_INPUT) {
+		output = encodeGroups(in + offset, LINE_INPUT, output, table);
+		offset += LINE_INPUT;
+
+		if(offset < inputLength) {
+			output[0] = '\r';
+			output[1] = '\n';
+			output += 2;
+		}
+	}
+
+	//The last, shorter line
+	std::size_t whole = (inputLength - offset) - ((inputLength - offset) % 3);
+	output = encodeGroups(in + offset, whole, output, table);
+
+	if(inputLength > offset + whole) {
+		encodeTail(in + offset + whole, inputLength - offset - whole, output);
+	}
+}
+
+std::string Base64::encode(const std::string &input) {
+	std::string toReturn(encodedLength(input.length()), '\0');
+
+	if(!input.empty()) {
+		encode(input.data(), input.length(), &toReturn[0]);
+	}
+
+	return toReturn;
+}
+
+} /* namespace SimplyEmail */
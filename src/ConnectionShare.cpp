@@ -0,0 +1,65 @@
+/**
+ * \file ConnectionShare.cpp
+ *
+ * \brief Implementation file for state shared between SMTP connections
+ */
+
+#include "../lib/ConnectionShare.h"
+
+#include <stdexcept>
+
+namespace SimplyEmail {
+
+ConnectionShare::ConnectionShare(bool shareConnections) {
+	this->share = curl_share_init();
+
+	if(!this->share) {
+		throw std::runtime_error("Error creating connection share: CURL did not start");
+	}
+
+	curl_share_setopt(this->share, CURLSHOPT_LOCKFUNC, lock);
+	curl_share_setopt(this->share, CURLSHOPT_UNLOCKFUNC, unlock);
+	curl_share_setopt(this->share, CURLSHOPT_USERDATA, this);
+
+	curl_share_setopt(this->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);	// Resume TLS sessions
+	curl_share_setopt(this->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);			// Skip repeated lookups
+
+#if LIBCURL_VERSION_NUM >= 0x073900
+	//CURL's connection cache is not safe to share between transfers on different threads, so it is opt in
+	if(shareConnections) {
+		curl_share_setopt(this->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);	// Reuse idle connections across handles
+	}
+#else
+	(void)shareConnections;
+#endif
+}
+
+ConnectionShare::~ConnectionShare() {
+	curl_share_cleanup(this->share);
+}
+
+ConnectionShare& ConnectionShare::getDefault() {
+	//Deliberately leaked; connections destroyed during static destruction may still be attached
+	static ConnectionShare *instance = new ConnectionShare();
+
+	return *instance;
+}
+
+CURLSH* ConnectionShare::getHandle() const {
+	return this->share;
+}
+
+void ConnectionShare::lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userData) {
+	(void)handle;
+	(void)access;
+
+	static_cast<ConnectionShare*>(userData)->locks[data].lock();
+}
+
+void ConnectionShare::unlock(CURL *handle, curl_lock_data data, void *userData) {
+	(void)handle;
+
+	static_cast<ConnectionShare*>(userData)->locks[data].unlock();
+}
+
+} /* namespace SimplyEmail */
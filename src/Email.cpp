@@ -8,15 +8,91 @@
  */
 
 #include "../lib/Email.h"
+#include "../lib/Metrics.h"
+
+#include <algorithm>
+#include <cstring>
+#include <strings.h>
 
 namespace SimplyEmail {
 
+namespace {
+
+/**
+ * \brief Appends encoded text to a string of any allocator
+ *
+ * \details Lets the encoding functions append std::string members to both std::string and ArenaString outputs,
+ * whose append overloads only accept strings with their own allocator.
+ */
+template <class String>
+class EncodeBuffer {
+public:
+	explicit EncodeBuffer(String &_output) : output(_output) {}
+
+	EncodeBuffer& append(const std::string &text) {
+		this->output.append(text.data(), text.size());
+		return *this;
+	}
+
+	EncodeBuffer& append(const char *text) {
+		this->output.append(text);
+		return *this;
+	}
+
+	EncodeBuffer& append(const char *text, std::size_t length) {
+		this->output.append(text, length);
+		return *this;
+	}
+
+	std::size_t size() const {
+		return this->output.size();
+	}
+
+private:
+	String &output;
+};
+
+/**
+ * \brief Counts the bytes the encoding functions would append without storing them
+ */
+class SizeCounter {
+public:
+	SizeCounter() : length(0) {}
+
+	SizeCounter& append(const std::string &text) {
+		this->length += text.size();
+		return *this;
+	}
+
+	SizeCounter& append(const char *text) {
+		this->length += std::strlen(text);
+		return *this;
+	}
+
+	SizeCounter& append(const char *text, std::size_t textLength) {
+		(void)text;
+		this->length += textLength;
+		return *this;
+	}
+
+	std::size_t size() const {
+		return this->length;
+	}
+
+private:
+	std::size_t length;
+};
+
+} /* namespace */
+
 const std::string Email::bodyType = "text/plain";
 const std::string Email::bodyCharSet = "UTF-8";
 const std::string Email::boundryText = "gc0p4Jq0M2Yt08jU534c0p";
 const std::string Email::endLineText = "\r\n";
 
 Email::Email() {
+	this->suppression = NULL;
+	this->sectionsReady = false;
 
 	this->recipients = std::vector<std::string> (0);
 	this->cc = std::vector<std::string> (0);
@@ -30,6 +106,9 @@ Email::Email() {
 }
 
 Email::Email(const std::string &recipient, const std::string &_cc, const std::string &_bcc, const std::string &_from, const std::string &_replyTo, const std::string &_subject, const std::string &_body){
+	this->suppression = NULL;
+	this->sectionsReady = false;
+
 	this->recipients = std::vector<std::string> (0);
 	this->addRecipient(recipient);
 
@@ -49,6 +128,9 @@ Email::Email(const std::string &recipient, const std::string &_cc, const std::st
 
 
 Email::Email(const std::vector<std::string> &_recipients, const std::vector<std::string> &_cc, const std::vector<std::string> &_bcc, const std::string &_from, const std::string &_replyTo, const std::string &_subject, const std::string &_body){
+	this->suppression = NULL;
+	this->sectionsReady = false;
+
 	this->recipients = _recipients;
 	this->cc = _cc;
 	this->bcc = _bcc;
@@ -61,7 +143,32 @@ Email::Email(const std::vector<std::string> &_recipients, const std::vector<std:
 }
 
 
-Email::Email(Email& other){
+Email::Email(const Email& other){
+
+	this->recipients = other.getRecipients();
+	this->cc = other.getCCs();
+	this->bcc = other.getBCCs();
+	this->from = other.getFrom();
+	this->replyTo = other.getReplyTo();
+	this->subject = other.getSubject();
+	this->body = other.getBody();
+
+	this->attachments = other.getAttachments();
+	this->headers = other.getHeaders();
+
+	this->suppression = other.getSuppressionList();
+	this->suppressed = other.getSuppressed();
+
+	std::lock_guard<std::mutex> lock(other.cacheMutex);
+	this->bodySection = other.bodySection;
+	this->attachmentSections = other.attachmentSections;
+	this->sectionsReady = false;
+}
+
+Email& Email::operator=(const Email& other){
+	if(this == &other) {
+		return *this;
+	}
 
 	this->recipients = other.getRecipients();
 	this->cc = other.getCCs();
@@ -72,38 +179,219 @@ Email::Email(Email& other){
 	this->body = other.getBody();
 
 	this->attachments = other.getAttachments();
+	this->headers = other.getHeaders();
+
+	this->suppression = other.getSuppressionList();
+	this->suppressed = other.getSuppressed();
+
+	std::lock_guard<std::mutex> lock(other.cacheMutex);
+	this->bodySection = other.bodySection;
+	this->attachmentSections = other.attachmentSections;
+	this->sectionsReady = false;
+
+	return *this;
 }
 
 Email::~Email() {
 	// Nothing to destroy :(
 }
 
-std::string Email::encode() {
+std::string Email::encode() const {
+	std::string toReturn;
+	toReturn.reserve(this->encodedSizeHint());
+
+	EncodeBuffer<std::string> buffer(toReturn);
+	this->encodeTo(buffer);
+
+	return toReturn;
+}
+
+ArenaString Email::encode(EncodeArena &arena) const {
+	ArenaString toReturn((ArenaAllocator<char>(arena)));
+	toReturn.reserve(this->encodedSizeHint());
+
+	EncodeBuffer<ArenaString> buffer(toReturn);
+	this->encodeTo(buffer);
+
+	return toReturn;
+}
+
+template <class Buffer>
+void Email::encodeTo(Buffer &buffer) const {
 
 	//Check to make sure recipients are listed
 	if(this->recipients.size() < 1){
 		throw std::runtime_error("Error generating email: no recipients listed");
 	}
 
-	std::stringstream stream;
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	std::size_t startSize = buffer.size();
+
+	this->encodeHeader(buffer);
+	buffer.append("--").append(this->boundryText).append(this->endLineText);
 
-	stream 	<< this->encodeHeader()
-			<< "--" << this->boundryText
-			<< this->endLineText;
+	//Read the cached sections in place; nothing can replace them while a const call runs
+	this->renderSections();
 
-	stream  << this->encodeBody();
+	buffer.append(*this->bodySection);
 
 	if(this->getAttachmentNumber() > 0) {
-		stream 	<< this->encodeAttachments()
-				<< this->endLineText
-				<< "--" << this->boundryText << "--";
+		for(unsigned int i=0; i<this->attachments.size(); i++){
+			buffer.append(*this->attachmentSections[i]);
+			buffer.append(this->attachments[i].getDataPointer(), this->attachments[i].getDataLength())
+					.append(this->endLineText).append(this->endLineText);
+		}
+
+		buffer.append(this->endLineText).append("--").append(this->boundryText).append("--");
+	}
+
+	Metrics::recordEncoded(buffer.size() - startSize, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+}
+
+EncodedEmail Email::encodeSegments() const {
+
+	//Check to make sure recipients are listed
+	if(this->recipients.size() < 1){
+		throw std::runtime_error("Error generating email: no recipients listed");
+	}
+
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+	std::shared_ptr<std::string> header = std::make_shared<std::string>();
+	header->reserve(512 + this->headers.encodedSizeHint());
+
+	EncodeBuffer<std::string> buffer(*header);
+	this->encodeHeader(buffer);
+	buffer.append("--").append(this->boundryText).append(this->endLineText);
+
+	std::shared_ptr<const std::string> bodyPart;
+	std::vector<std::shared_ptr<const std::string> > parts;
+	this->cachedSections(bodyPart, parts);
+
+	EncodedEmail toReturn;
+	toReturn.append(std::shared_ptr<const std::string>(header));
+	toReturn.append(bodyPart);
+
+	//The separators are static, so they can be borrowed
+	static const char partEnd[] = "\r\n\r\n";
+
+	if(this->getAttachmentNumber() > 0) {
+		for(unsigned int i=0; i<parts.size(); i++){
+			toReturn.append(parts[i]);
+			toReturn.append(this->attachments[i].getSharedData(), this->attachments[i].getDataLength());
+			toReturn.append(partEnd, sizeof(partEnd) - 1);
+		}
+
+		toReturn.append(this->endLineText.data(), this->endLineText.length());
+		toReturn.append("--", 2);
+		toReturn.append(this->boundryText.data(), this->boundryText.length());
+		toReturn.append("--", 2);
+	}
+
+	Metrics::recordEncoded(toReturn.getSize(), std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+
+	return toReturn;
+}
+
+void Email::cachedSections(std::shared_ptr<const std::string> &bodyPart, std::vector<std::shared_ptr<const std::string> > &parts) const {
+	this->renderSections();
+
+	bodyPart = this->bodySection;
+	parts.assign(this->attachmentSections.begin(), this->attachmentSections.begin() + this->attachments.size());
+}
+
+void Email::renderSections() const {
+	//Only non-const calls, which have the email to themselves, add or invalidate sections, so once every section is
+	//rendered the cache is read without locking
+	if(this->sectionsReady.load(std::memory_order_acquire)) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(this->cacheMutex);
+
+	if(!this->bodySection) {
+		std::shared_ptr<std::string> section = std::make_shared<std::string>();
+		section->reserve(this->body.length() + 64);
+
+		EncodeBuffer<std::string> buffer(*section);
+		this->encodeBody(buffer);
+
+		this->bodySection = section;
+	}
+
+	//Attachments are only ever appended, so only the new ones need rendering
+	while(this->attachmentSections.size() < this->attachments.size()) {
+		const SimplyEmail::EmailAttachment &attachment = this->attachments[this->attachmentSections.size()];
+
+		std::shared_ptr<std::string> section = std::make_shared<std::string>();
+		section->reserve(256 + (2 * attachment.getFileName().length()) + attachment.getMimeType().length());
+
+		EncodeBuffer<std::string> buffer(*section);
+		this->encodeAttachmentHeader(buffer, attachment);
+
+		this->attachmentSections.push_back(section);
 	}
 
-	return stream.str();
+	this->sectionsReady.store(true, std::memory_order_release);
 }
 
-const std::string Email::getRecipient(unsigned int recipientNumber) {
-	if(recipientNumber > this->recipients.size()){
+std::uint64_t Email::encodedSize() const {
+	//Check to make sure recipients are listed, as encoding would
+	if(this->recipients.size() < 1){
+		throw std::runtime_error("Error generating email: no recipients listed");
+	}
+
+	SizeCounter counter;
+
+	this->encodeHeader(counter);
+	counter.append("--").append(this->boundryText).append(this->endLineText);
+	this->encodeBody(counter);
+
+	std::uint64_t toReturn = counter.size();
+
+	if(this->getAttachmentNumber() > 0) {
+		for(unsigned int i=0; i<this->attachments.size(); i++){
+			SizeCounter part;
+			this->encodeAttachmentHeader(part, this->attachments[i]);
+
+			//The data is held base 64 encoded, so its length is already that of the encoded file
+			toReturn += part.size() + this->attachments[i].getDataLength() + (2 * this->endLineText.length());
+		}
+
+		toReturn += this->endLineText.length() + 2 + this->boundryText.length() + 2;
+	}
+
+	return toReturn;
+}
+
+std::size_t Email::encodedSizeHint() const {
+	//Fixed header lines, boundaries and the timestamp
+	std::size_t toReturn = 512;
+
+	for(unsigned int i=0; i<this->recipients.size(); i++){
+		toReturn += this->recipients[i].length() + 4;
+	}
+
+	for(unsigned int i=0; i<this->cc.size(); i++){
+		toReturn += this->cc[i].length() + 4;
+	}
+
+	for(unsigned int i=0; i<this->bcc.size(); i++){
+		toReturn += this->bcc[i].length() + 4;
+	}
+
+	toReturn += this->from.length() + this->subject.length() + this->body.length() + this->headers.encodedSizeHint();
+
+	//Each attachment part has about 200 bytes of headers around its name and data
+	for(unsigned int i=0; i<this->attachments.size(); i++){
+		toReturn += 256 + (2 * this->attachments[i].getFileName().length()) + this->attachments[i].getMimeType().length() + this->attachments[i].getDataLength();
+	}
+
+	return toReturn;
+}
+
+const std::string Email::getRecipient(unsigned int recipientNumber) const {
+	if(recipientNumber >= this->recipients.size()){
 		throw std::out_of_range("Error getting email recipient: recipient number out of range");
 	}
 	else {
@@ -112,17 +400,22 @@ const std::string Email::getRecipient(unsigned int recipientNumber) {
 
 }
 
-const std::vector<std::string> Email::getRecipients(){
+const std::vector<std::string>& Email::getRecipients() const {
 	return this->recipients;
 }
 
-unsigned int Email::getRecipientNumber(){
+unsigned int Email::getRecipientNumber() const {
 	return this->recipients.size();
 }
 
 void Email::addRecipient(const std::string &recipient){
 
 	if(this->isAddress(recipient)){
+		if(this->suppression && this->suppression->contains(recipient)) {
+			this->suppressed.push_back(recipient);
+			return;
+		}
+
 		this->recipients.push_back(recipient);
 	}
 	else {
@@ -130,8 +423,8 @@ void Email::addRecipient(const std::string &recipient){
 	}
 }
 
-const std::string Email::getCC(unsigned int ccNumber){
-	if(ccNumber > this->cc.size()){
+const std::string Email::getCC(unsigned int ccNumber) const {
+	if(ccNumber >= this->cc.size()){
 		throw std::out_of_range("Error getting email cc: cc number out of range");
 	}
 	else{
@@ -140,16 +433,21 @@ const std::string Email::getCC(unsigned int ccNumber){
 
 }
 
-const std::vector<std::string>Email::getCCs(){
+const std::vector<std::string>& Email::getCCs() const {
 	return this->cc;
 }
 
-unsigned int Email::getCCNumber(){
+unsigned int Email::getCCNumber() const {
 	return this->cc.size();
 }
 
 void Email::addCC(const std::string& recipient){
 	if(this->isAddress(recipient)){
+		if(this->suppression && this->suppression->contains(recipient)) {
+			this->suppressed.push_back(recipient);
+			return;
+		}
+
 		this->cc.push_back(recipient);
 	}
 	else {
@@ -157,8 +455,8 @@ void Email::addCC(const std::string& recipient){
 	}
 }
 
-const std::string Email::getBCC(unsigned int bccNumber){
-	if(bccNumber > this->bcc.size()){
+const std::string Email::getBCC(unsigned int bccNumber) const {
+	if(bccNumber >= this->bcc.size()){
 		throw std::out_of_range("Error getting bcc: bcc number out of range");
 	}
 	else {
@@ -166,16 +464,21 @@ const std::string Email::getBCC(unsigned int bccNumber){
 	}
 }
 
-const std::vector<std::string> Email::getBCCs(){
+const std::vector<std::string>& Email::getBCCs() const {
 	return this->bcc;
 }
 
-unsigned int Email::getBCCNumber(){
+unsigned int Email::getBCCNumber() const {
 	return this->bcc.size();
 }
 
 void Email::addBCC(const std::string& recipient){
 	if(this->isAddress(recipient)){
+		if(this->suppression && this->suppression->contains(recipient)) {
+			this->suppressed.push_back(recipient);
+			return;
+		}
+
 		this->bcc.push_back(recipient);
 	}
 	else {
@@ -183,12 +486,32 @@ void Email::addBCC(const std::string& recipient){
 	}
 }
 
+void Email::setSuppressionList(const SimplyEmail::SuppressionList *list){
+	this->suppression = list;
+
+	if(this->suppression) {
+		this->suppression->filter(this->recipients, &this->suppressed);
+		this->suppression->filter(this->cc, &this->suppressed);
+		this->suppression->filter(this->bcc, &this->suppressed);
+	}
+}
+
+const SimplyEmail::SuppressionList* Email::getSuppressionList() const {
+	return this->suppression;
+}
+
+const std::vector<std::string>& Email::getSuppressed() const {
+	return this->suppressed;
+}
+
 const std::string Email::getBody() const {
 	return body;
 }
 
 void Email::setBody(const std::string& _body) {
 	this->body = _body;
+	this->bodySection.reset();
+	this->sectionsReady = false;
 }
 
 const std::string Email::getFrom() const {
@@ -215,8 +538,8 @@ void Email::setSubject(const std::string& _subject) {
 	this->subject = _subject;
 }
 
-const SimplyEmail::EmailAttachment Email::getAttachment(unsigned int attachmentNumber){
-	if(attachmentNumber > this->attachments.size()){
+const SimplyEmail::EmailAttachment Email::getAttachment(unsigned int attachmentNumber) const {
+	if(attachmentNumber >= this->attachments.size()){
 		throw std::out_of_range("Error getting attachment: attachment number out of range");
 	}
 	else {
@@ -224,11 +547,11 @@ const SimplyEmail::EmailAttachment Email::getAttachment(unsigned int attachmentN
 	}
 }
 
-const std::vector<SimplyEmail::EmailAttachment> Email::getAttachments(){
+const std::vector<SimplyEmail::EmailAttachment> Email::getAttachments() const {
 	return this->attachments;
 }
 
-unsigned int Email::getAttachmentNumber(){
+unsigned int Email::getAttachmentNumber() const {
 	return this->attachments.size();
 }
 
@@ -238,176 +561,278 @@ void Email::addAttachment(const std::string& fileLocation){
 		SimplyEmail::EmailAttachment tempAttachment(fileLocation);
 
 		this->attachments.push_back(tempAttachment);
+		this->sectionsReady = false;
 	}
 	catch(std::runtime_error& e) {
 		throw;
 	}
 }
 
-std::string Email::encodeHeader(){
+void Email::addAttachment(const SimplyEmail::EmailAttachment& attachment){
+	this->attachments.push_back(attachment);
+	this->sectionsReady = false;
+}
+
+void Email::addHeader(const std::string &name, const std::string &value) {
+	checkHeaderName(name);
+	this->headers.add(name, value);
+}
+
+void Email::setHeader(const std::string &name, const std::string &value) {
+	checkHeaderName(name);
+	this->headers.set(name, value);
+}
+
+void Email::removeHeader(const std::string &name) {
+	this->headers.remove(name);
+}
+
+const SimplyEmail::HeaderList& Email::getHeaders() const {
+	return this->headers;
+}
+
+void Email::addAttachments(const std::vector<std::string>& fileLocations, SimplyEmail::ThreadPool& pool){
+	std::vector<SimplyEmail::EmailAttachment> encoded = SimplyEmail::EmailAttachment::encodeFiles(fileLocations, pool);
+
+	this->attachments.insert(this->attachments.end(), encoded.begin(), encoded.end());
+	this->sectionsReady = false;
+}
+
+void Email::addAttachments(const std::vector<std::string>& fileLocations, unsigned int threads){
+	SimplyEmail::ThreadPool pool(threads);
+
+	this->addAttachments(fileLocations, pool);
+}
+
+template <class Buffer>
+void Email::encodeHeader(Buffer &buffer) const {
 	//NOTE The format for this message was taken from sample GMail messages. The order may not matter but best to do it like a large, multinational, technology firm.
-	std::stringstream stream;
 
 	//Add from
-	stream 	<< "From: " << "<" << this->from << ">" << this->endLineText;
+	buffer.append("From: <").append(this->from).append(">").append(this->endLineText);
 
 	//Add to
-	stream << "To: " << this->encodeVector(this->recipients) << this->endLineText;
+	buffer.append("To: ");
+	this->encodeVector(buffer, this->recipients, 4);
+	buffer.append(this->endLineText);
 
 	//Add cc
 	if (this->getCCNumber() > 0) {
-		stream << "Cc: " << this->encodeVector(this->cc) << this->endLineText;
+		buffer.append("Cc: ");
+		this->encodeVector(buffer, this->cc, 4);
+		buffer.append(this->endLineText);
 	}
 
 	//Add BCC
 	if(this->getBCCNumber() > 0) {
-		stream << "Bcc: " << this->encodeVector(this->bcc) << this->endLineText;
+		buffer.append("Bcc: ");
+		this->encodeVector(buffer, this->bcc, 5);
+		buffer.append(this->endLineText);
 	}
 
-	//Add subject
-	stream 	<< "Subject: " << this->subject	<< this->endLineText;
+	//Add subject, straight through when it is short plain ASCII, else as encoded words and folded
+	buffer.append("Subject: ");
+	if((this->subject.length() + 9 <= HeaderEncoder::FOLD_COLUMN) && !HeaderEncoder::needsEncoding(this->subject.data(), this->subject.length())) {
+		buffer.append(this->subject);
+	}
+	else {
+		buffer.append(HeaderEncoder::encode(this->subject, 9));
+	}
+	buffer.append(this->endLineText);
 
 	//Add date
-	stream 	<< this->createTimestamp() << this->endLineText;
+	char timestamp[64];
+	buffer.append(timestamp, this->createTimestamp(timestamp, sizeof(timestamp))).append(this->endLineText);
+
+	//Add custom headers, straight into the output
+	this->headers.encodeTo(buffer);
 
 	//Add MIME Line
-	stream	<< "MIME-Version: 1.0"<<this->endLineText;
+	buffer.append("MIME-Version: 1.0").append(this->endLineText);
 
 	//Add content type
 	if(this->getAttachmentNumber() > 0) {
-		stream 	<< "Content-Type: multipart/mixed; ";
+		buffer.append("Content-Type: multipart/mixed; ");
 	}
 	else {
-		stream 	<< "Content-Type: text/plain; ";
+		buffer.append("Content-Type: text/plain; ");
 	}
 
-	stream << "boundary=\"" << this->boundryText << "\"" << this->endLineText;
-
-	return stream.str();
+	buffer.append("boundary=\"").append(this->boundryText).append("\"").append(this->endLineText);
 }
 
-std::string Email::encodeBody(){
-	std::stringstream stream;
-
+template <class Buffer>
+void Email::encodeBody(Buffer &buffer) const {
 	//Add content type
-	stream	<< "Content-Type: " << this->bodyType << "; charset=" << this->bodyCharSet 	<< this->endLineText<< this->endLineText;
+	buffer.append("Content-Type: ").append(this->bodyType).append("; charset=").append(this->bodyCharSet).append(this->endLineText).append(this->endLineText);
 
 	//Add body text
-	stream 	<< this->body << this->endLineText;
-
-	return stream.str();
+	this->encodeText(buffer, this->body);
+	buffer.append(this->endLineText);
 }
 
-std::string Email::encodeAttachments(){
-
-	//Create constants and return variables for ID generation
-	static const std::string lookup = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
-	std::stringstream stream;
+template <class Buffer>
+void Email::encodeText(Buffer &buffer, const std::string &text) const {
+	const char *data = text.data();
+	std::size_t length = text.length();
 
-	//For each attachment add a boundry and its data
-	for(unsigned int i=0; i<this->getAttachmentNumber(); i++){
+	std::size_t runStart = 0;		//The first character not yet appended
+	std::size_t lineStart = 0;		//The first character of the current line
 
-		//Add the boundry line
-		stream 	<< "--" << this->boundryText << this->endLineText;
+	for(std::size_t i=0; i<length; i++){
+		char character = data[i];
 
-		//Add the content type
-		stream 	<< "Content-Type: " << this->getAttachment(i).getMimeType() << "; name=\""
-				<< this->getAttachment(i).getFileName() << "\"" << this->endLineText;
+		if((character == '\n') || (character == '\r')) {
+			//Append the line without its break, then a CRLF in place of whichever break it had
+			buffer.append(data + runStart, i - runStart).append(this->endLineText);
 
-		//Add content disposition
-		stream 	<< "Content-Disposition: attachment; filename=\""
-				<< this->getAttachment(i).getFileName()
-				<< "\""
-				<< this->endLineText;
+			if((character == '\r') && (i + 1 < length) && (data[i+1] == '\n')) {
+				i++;
+			}
 
-		//Add encoding informatione
-		stream 	<< "Content-Transfer-Encoding: base64"
-				<< this->endLineText;
+			runStart = i + 1;
+			lineStart = i + 1;
+		}
+		else if(i - lineStart == MAX_LINE_LENGTH) {
+			//Break before a UTF-8 lead byte rather than between the bytes of one character
+			std::size_t split = i;
+			while((split > lineStart + MAX_LINE_LENGTH - 4) && (((unsigned char)data[split] & 0xC0) == 0x80)) {
+				split--;
+			}
 
-		//Add attachment id
-		stream	<< "X-Attachment-Id: ";
+			buffer.append(data + runStart, split - runStart).append(this->endLineText);
 
-		for(int j=0; j<11; j++){
-			stream << lookup[rand() % (lookup.length()-1)];
+			runStart = split;
+			lineStart = split;
 		}
+	}
 
-		stream 	<< this->endLineText
-				<< this->endLineText;
+	buffer.append(data + runStart, length - runStart);
+}
 
-		//Add the data
-		stream	<< this->getAttachment(i).getData()
-				<< this->endLineText << this->endLineText;
+template <class Buffer>
+void Email::encodeAttachmentHeader(Buffer &buffer, const SimplyEmail::EmailAttachment &attachment) const {
 
-	}
+	//Add the boundry line
+	buffer.append("--").append(this->boundryText).append(this->endLineText);
 
-	return stream.str();
-}
+	//Add the content type
+	buffer.append("Content-Type: ").append(attachment.getMimeType()).append("; name=\"")
+			.append(attachment.getFileName()).append("\"").append(this->endLineText);
+
+	//Add content disposition
+	buffer.append("Content-Disposition: attachment; filename=\"")
+			.append(attachment.getFileName())
+			.append("\"")
+			.append(this->endLineText);
 
-std::string Email::createTimestamp(){
-	std::stringstream stream;
+	//Add encoding informatione
+	buffer.append("Content-Transfer-Encoding: base64").append(this->endLineText);
 
-	std::time_t generationTime;
-	struct std::tm * timeInfo;
-	time(&generationTime);
-	timeInfo = gmtime(&generationTime);
+	//Add attachment id
+	char attachmentId[ATTACHMENT_ID_LENGTH];
+	createAttachmentId(attachmentId);
 
-	std::string dayNames[7] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
-	std::string monNames[12] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	buffer.append("X-Attachment-Id: ").append(attachmentId, ATTACHMENT_ID_LENGTH)
+			.append(this->endLineText)
+			.append(this->endLineText);
+}
 
-	int timeZone = timeInfo->tm_hour;
+std::size_t Email::createTimestamp(char *buffer, std::size_t bufferSize) const {
+	static const char* dayNames[7] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+	static const char* monNames[12] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
 
-	stream 	<< "Date: "
-			<< dayNames[timeInfo->tm_wday]
-			<< ", "
-			<< timeInfo->tm_mday
-			<< ' '
-			<< monNames[timeInfo->tm_mon]
-			<< ' '
-			<< (timeInfo->tm_year + 1900)
-			<< ' '
-			<< (timeInfo->tm_hour)
-			<< ':'
-			<< (timeInfo->tm_min)
-			<< ':'
-			<< (timeInfo->tm_sec)
-			<< ' ';
+	std::time_t generationTime = time(NULL);
 
-	timeInfo = localtime(&generationTime);
-	timeZone = ((timeZone - timeInfo->tm_hour) * 100);
+	//Use the reentrant conversions; gmtime and localtime share a static buffer between threads
+	struct std::tm universalTime;
+	struct std::tm localTime;
+	gmtime_r(&generationTime, &universalTime);
+	localtime_r(&generationTime, &localTime);
 
-	if(timeZone > 0) {
-		stream << '+';
+	//Work out the offset from UTC in minutes, allowing for the local date being a day either side of UTC
+	int dayDifference = localTime.tm_yday - universalTime.tm_yday;
+	if(dayDifference > 1) {
+		dayDifference = -1;
 	}
-	else
-	{
-		stream << '-';
+	else if(dayDifference < -1) {
+		dayDifference = 1;
+	}
+
+	int offset = (dayDifference * 24 * 60)
+			+ ((localTime.tm_hour - universalTime.tm_hour) * 60)
+			+ (localTime.tm_min - universalTime.tm_min);
+
+	char sign = '+';
+	if(offset < 0) {
+		sign = '-';
+		offset = -offset;
 	}
 
-	stream	<< timeZone;
+	int length = snprintf(buffer, bufferSize, "Date: %s, %d %s %d %02d:%02d:%02d %c%02d%02d",
+			dayNames[localTime.tm_wday],
+			localTime.tm_mday,
+			monNames[localTime.tm_mon],
+			(localTime.tm_year + 1900),
+			localTime.tm_hour,
+			localTime.tm_min,
+			localTime.tm_sec,
+			sign,
+			(offset / 60),
+			(offset % 60));
+
+	if(length < 0) {
+		throw std::runtime_error("Error generating email: could not format timestamp");
+	}
 
-	return stream.str();
+	return std::min((std::size_t)length, bufferSize - 1);
 }
 
-std::string Email::encodeVector(std::vector<std::string> toEncode){
-	std::stringstream stream;
+void Email::createAttachmentId(char *buffer) {
+	static const char lookup[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+	static const unsigned int lookupLength = sizeof(lookup) - 1;
 
-	for(unsigned int i=0; i<toEncode.size(); i++){
+	//Seed the sequence once from the clock; every call then takes a unique value without locking
+	static std::atomic<std::uint64_t> sequence(
+			(std::uint64_t)std::chrono::high_resolution_clock::now().time_since_epoch().count());
+
+	//Scramble the sequence value with the splitmix64 finalizer
+	std::uint64_t value = sequence.fetch_add(0x9E3779B97F4A7C15ULL, std::memory_order_relaxed);
+	value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+	value = value ^ (value >> 31);
+
+	for(unsigned int i=0; i<ATTACHMENT_ID_LENGTH; i++){
+		buffer[i] = lookup[value % lookupLength];
+		value = value / lookupLength;
+	}
+}
 
-		stream << "<";
+template <class Buffer>
+void Email::encodeVector(Buffer &buffer, const std::vector<std::string> &toEncode, std::size_t column) const {
 
+	for(unsigned int i=0; i<toEncode.size(); i++){
+
+		//Separate the addresses with a comma, folding before the next if it and its own comma would overrun the line
 		if( i > 0){
-			stream << ",";
-		}
+			buffer.append(",");
+			column++;
 
-		stream<<toEncode[i];
+			if(column + toEncode[i].length() + 4 > HeaderEncoder::FOLD_COLUMN) {
+				buffer.append(this->endLineText);
+				column = 0;
+			}
 
-		stream << ">";
-	}
+			buffer.append(" ");
+			column++;
+		}
 
-	return stream.str();
+		buffer.append("<").append(toEncode[i]).append(">");
+		column += toEncode[i].length() + 2;
+	}
 }
 
-bool Email::isAddress(const std::string& addressToTest){
+bool Email::isAddress(const std::string& addressToTest) const {
 
 	//Create a return variable
 	bool toReturn = true;
@@ -469,4 +894,14 @@ bool Email::isAddress(const std::string& addressToTest){
 
 	return toReturn;
 }
+
+void Email::checkHeaderName(const std::string &name) {
+	static const char* reserved[] = {"From", "To", "Cc", "Bcc", "Subject", "Date", "MIME-Version", "Content-Type"};
+
+	for(unsigned int i=0; i<sizeof(reserved) / sizeof(reserved[0]); i++){
+		if((name.length() == std::strlen(reserved[i])) && (strncasecmp(name.c_str(), reserved[i], name.length()) == 0)) {
+			throw std::runtime_error("Error adding header: " + name + " is written by the email itself");
+		}
+	}
+}
 } /* namespace SimplyEmail */
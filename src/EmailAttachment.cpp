@@ -7,63 +7,238 @@
  * \copyright Neale Petrillo, 2015
  */
 #include "../lib/EmailAttachment.h"
+#include "../lib/Base64.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <unistd.h>
 
 namespace SimplyEmail {
 
+const std::size_t EmailAttachment::PARALLEL_CHUNK_SIZE = 57 * 56 * 1024;
+const std::size_t EmailAttachment::STREAM_BLOCK_SIZE = 57 * 4 * 1024;
+
 EmailAttachment::EmailAttachment() {
 	this->mimeType = "";
 	this->fileName = "";
-	this->data = "";
+	this->dataLength = 0;
 }
 
 EmailAttachment::EmailAttachment(std::string fileAddress){
 	// Try to encode the file
 	try {
-		this->encodeFile(fileAddress);
+		this->encodeFile(fileAddress, NULL);
 	}
 	catch (const std::runtime_error& e){
 		throw;
 	}
 
-	// Try to detect mime type
-	try  {
-		this->findMIMEType(fileAddress);
-	}
-	catch (const std::runtime_error& e){
-		throw;
-	}
+	this->setFileDetails(fileAddress);
+}
 
-	// Get the name of the file from the address
-	int i=fileAddress.length() - 1;
-	while((i > -1) && (fileAddress.compare(i,1,"/"))){
-		i = i-1;
+EmailAttachment::EmailAttachment(const std::string &fileAddress, SimplyEmail::ThreadPool &pool){
+	this->encodeFile(fileAddress, &pool);
+
+	this->setFileDetails(fileAddress);
+}
+
+EmailAttachment::EmailAttachment(const std::string &_fileName, const std::string &_mimeType, const std::shared_ptr<const char> &encodedData, std::size_t encodedLength){
+	this->fileName = _fileName;
+	this->mimeType = _mimeType;
+	this->data = encodedData;
+	this->dataLength = encodedLength;
+}
+
+EmailAttachment::EmailAttachment(const std::string &_fileName, const std::string &_mimeType, const char *rawData, std::size_t rawLength){
+	this->fileName = _fileName;
+	this->mimeType = _mimeType;
+
+	std::shared_ptr<std::string> output = std::make_shared<std::string>(Base64::wrappedLength(rawLength), '\0');
+
+	if(rawLength > 0) {
+		Base64::encodeWrapped(rawData, rawLength, &(*output)[0]);
 	}
 
-	this->fileName = fileAddress.substr((unsigned)(i+1),std::string::npos);
+	this->setData(output);
+}
+
+EmailAttachment::EmailAttachment(const std::string &_fileName, const std::string &_mimeType, std::string &&rawData){
+	this->fileName = _fileName;
+	this->mimeType = _mimeType;
+
+	this->setData(encodeAndWait(std::make_shared<const std::string>(std::move(rawData)), NULL));
+}
+
+EmailAttachment::EmailAttachment(const std::string &_fileName, const std::string &_mimeType, std::string &&rawData, SimplyEmail::ThreadPool &pool){
+	this->fileName = _fileName;
+	this->mimeType = _mimeType;
+
+	this->setData(encodeAndWait(std::make_shared<const std::string>(std::move(rawData)), &pool));
+}
+
+EmailAttachment::EmailAttachment(const std::string &_fileName, const std::string &_mimeType, std::istream &input){
+	this->fileName = _fileName;
+	this->mimeType = _mimeType;
+
+	this->encodeStream([&input](char *buffer, std::size_t length) -> std::size_t {
+		input.read(buffer, length);
+
+		if(input.bad() || (input.fail() && !input.eof())) {
+			throw std::runtime_error("Error creating attachment: could not read stream.");
+		}
+
+		return (std::size_t)input.gcount();
+	});
+}
+
+EmailAttachment::EmailAttachment(const std::string &_fileName, const std::string &_mimeType, int fileDescriptor){
+	this->fileName = _fileName;
+	this->mimeType = _mimeType;
+
+	this->encodeStream([fileDescriptor](char *buffer, std::size_t length) -> std::size_t {
+		//Pipes return short reads, so keep reading until the block is full or the writer is done
+		std::size_t total = 0;
+
+		while(total < length) {
+			ssize_t result = read(fileDescriptor, buffer + total, length - total);
+
+			if(result == 0) {
+				break;
+			}
+
+			if(result < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+
+				throw std::runtime_error(std::string("Error creating attachment: could not read descriptor: ") + std::strerror(errno));
+			}
+
+			total += result;
+		}
+
+		return total;
+	});
 }
 
 EmailAttachment::EmailAttachment(const EmailAttachment& other){
 	this->mimeType = other.getMimeType();
 	this->fileName = other.getFileName();
-	this->data = other.getData();
+	this->data = other.data;
+	this->dataLength = other.dataLength;
 }
 
 EmailAttachment::~EmailAttachment() {
 	// Nothing to destroy :(
 }
 
+std::vector<EmailAttachment> EmailAttachment::encodeFiles(const std::vector<std::string> &fileAddresses, SimplyEmail::ThreadPool &pool) {
+	std::vector<EmailAttachment> toReturn(fileAddresses.size());
+	std::vector<std::shared_ptr<std::string> > outputs(fileAddresses.size());
+
+	std::vector<std::future<void> > readFutures;
+	std::vector<std::future<void> > chunkFutures;
+	std::mutex chunkMutex;
+
+	//Read each file on the pool; as soon as a file is in memory its chunks are queued for encoding
+	for(unsigned int i=0; i<fileAddresses.size(); i++){
+		outputs[i] = std::make_shared<std::string>();
+
+		const std::string &fileAddress = fileAddresses[i];
+		std::shared_ptr<std::string> output = outputs[i];
+
+		readFutures.push_back(pool.submit([&fileAddress, output, &pool, &chunkFutures, &chunkMutex]() {
+			std::vector<std::future<void> > submitted = encodeData(readFile(fileAddress), output, &pool);
+
+			std::lock_guard<std::mutex> lock(chunkMutex);
+			for(unsigned int j=0; j<submitted.size(); j++){
+				chunkFutures.push_back(std::move(submitted[j]));
+			}
+		}));
+	}
+
+	//Wait for every task before rethrowing so that none of them outlive the locals they reference
+	std::exception_ptr error;
+
+	for(unsigned int i=0; i<readFutures.size(); i++){
+		try {
+			readFutures[i].get();
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+	}
+
+	//No more chunks can be queued once every read has finished
+	for(unsigned int i=0; i<chunkFutures.size(); i++){
+		try {
+			chunkFutures[i].get();
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+	}
+
+	if(error) {
+		std::rethrow_exception(error);
+	}
+
+	for(unsigned int i=0; i<fileAddresses.size(); i++){
+		toReturn[i].setData(outputs[i]);
+		toReturn[i].setFileDetails(fileAddresses[i]);
+	}
+
+	return toReturn;
+}
+
 const std::string EmailAttachment::getData() const {
-	return data;
+	if(this->dataLength == 0) {
+		return std::string();
+	}
+
+	return std::string(this->data.get(), this->dataLength);
+}
+
+const char* EmailAttachment::getDataPointer() const {
+	return this->data.get();
 }
 
-const std::string EmailAttachment::getFileName() const {
+std::size_t EmailAttachment::getDataLength() const {
+	return this->dataLength;
+}
+
+const std::shared_ptr<const char>& EmailAttachment::getSharedData() const {
+	return this->data;
+}
+
+const std::string& EmailAttachment::getFileName() const {
 	return fileName;
 }
 
-const std::string EmailAttachment::getMimeType() const {
+const std::string& EmailAttachment::getMimeType() const {
 	return mimeType;
 }
 
+void EmailAttachment::setFileDetails(const std::string &fileAddress) {
+	// Try to detect mime type
+	try  {
+		this->findMIMEType(fileAddress);
+	}
+	catch (const std::runtime_error& e){
+		throw;
+	}
+
+	// Get the name of the file from the address
+	int i=fileAddress.length() - 1;
+	while((i > -1) && (fileAddress.compare(i,1,"/"))){
+		i = i-1;
+	}
+
+	this->fileName = fileAddress.substr((unsigned)(i+1),std::string::npos);
+}
+
 void EmailAttachment::findMIMEType(std::string filePath){
 	/* Create a list of extensions and their MIME types
 	 * The list is incomplete but incorporates the most likely files for our types
@@ -124,99 +299,145 @@ void EmailAttachment::findMIMEType(std::string filePath){
 
 }
 
-void EmailAttachment::encodeFile(std::string filePath) {
+void EmailAttachment::encodeFile(const std::string &filePath, SimplyEmail::ThreadPool *pool) {
+	//Save the results
+	this->setData(encodeAndWait(readFile(filePath), pool));
+}
+
+std::shared_ptr<std::string> EmailAttachment::encodeAndWait(const std::shared_ptr<const std::string> &raw, SimplyEmail::ThreadPool *pool) {
+	std::shared_ptr<std::string> output = std::make_shared<std::string>();
+
+	std::vector<std::future<void> > chunks = encodeData(raw, output, pool);
+
+	//Wait for every chunk before rethrowing so that none of them outlive the output
+	std::exception_ptr error;
+	for(unsigned int i=0; i<chunks.size(); i++){
+		try {
+			chunks[i].get();
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+	}
+
+	if(error) {
+		std::rethrow_exception(error);
+	}
+
+	return output;
+}
+
+void EmailAttachment::setData(const std::shared_ptr<std::string> &encoded) {
+	//Point into the string while sharing its ownership
+	this->data = std::shared_ptr<const char>(encoded, encoded->data());
+	this->dataLength = encoded->length();
+}
 
-	//Create return variable
-	std::string toReturn;
+std::shared_ptr<const std::string> EmailAttachment::readFile(const std::string &filePath) {
 
 	//Open the file
 	std::ifstream inputStream;
 	inputStream.open(filePath.c_str(), std::fstream::binary);
 
-	//NOTE The following section relies on the internal file stream pointer. It may be more reliable to use seekg and an absolute position.
-	if(inputStream.is_open()){
+	if(!inputStream.is_open()){
+		throw std::runtime_error("Error creating attachment: could not open file.");
+	}
 
-		//Calculate the size of the file
-		inputStream.seekg(0, inputStream.end);
-		int fileLength = inputStream.tellg();
+	//Calculate the size of the file
+	inputStream.seekg(0, inputStream.end);
+	std::streamoff fileLength = inputStream.tellg();
+	inputStream.seekg(0, inputStream.beg);
+
+	if(fileLength < 0) {
+		throw std::runtime_error("Error creating attachment: could not read file.");
+	}
 
-		//Return to the beginning of the file
-		inputStream.seekg(inputStream.beg);
+	//Read the whole file at once
+	std::shared_ptr<std::string> toReturn = std::make_shared<std::string>((std::size_t)fileLength, '\0');
 
-		//Read all the groups of 3
-		for(int i=0; i < (int)(fileLength/3); i++){
-			char* tempChars = new char [3];
-			inputStream.read(tempChars,3);
+	if(fileLength > 0) {
+		inputStream.read(&(*toReturn)[0], fileLength);
 
-			toReturn = toReturn + encodeBytes(tempChars);
+		if(inputStream.gcount() != fileLength) {
+			throw std::runtime_error("Error creating attachment: could not read file.");
 		}
+	}
 
-		//Read last remaining 1 or 2 and pad with zeros
-		int oddCharacters = fileLength % 3;
-		if(oddCharacters > 0) {
+	//Close file
+	inputStream.close();
 
-			char* tempChars = new char [3];
-			inputStream.read(tempChars, oddCharacters);
+	return toReturn;
+}
 
-			for(int i= oddCharacters; i<3; i++){
-				tempChars[i] = '0';
-			}
+void EmailAttachment::encodeStream(const std::function<std::size_t(char*, std::size_t)> &read) {
+	std::shared_ptr<std::string> output = std::make_shared<std::string>();
+	std::vector<char> block(STREAM_BLOCK_SIZE);
 
-			//Convert the padded string then remove unnecesary padding
-			toReturn = toReturn + encodeBytes(tempChars).substr(0,(oddCharacters + 1));
+	//Bytes at the front of the block left over from the last read, less than a line
+	std::size_t carried = 0;
 
-			char padChar = '=';
-			for(int i = 0; i<(3-oddCharacters); i++){
-				toReturn = toReturn + padChar;
-			}
-		}
+	while(true) {
+		std::size_t length = read(&block[carried], block.size() - carried);
+		std::size_t available = carried + length;
 
-		//Close file
-		inputStream.close();
+		//Encode whole lines only; a short line and padding may only come at the very end
+		std::size_t whole = (length == 0) ? available : available - (available % Base64::LINE_INPUT);
 
-		//Save the results
-		this->data = toReturn;
-	}
-	else {
-		throw std::runtime_error("Error creating attachment: could not open file.");
-	}
+		if(whole > 0) {
+			std::size_t offset = output->length();
+			std::size_t separator = (offset > 0) ? 2 : 0;
 
-}
+			output->resize(offset + separator + Base64::wrappedLength(whole));
+			if(separator > 0) {
+				(*output)[offset] = '\r';
+				(*output)[offset + 1] = '\n';
+			}
+			Base64::encodeWrapped(&block[0], whole, &(*output)[offset + separator]);
+		}
 
-std::string EmailAttachment::encodeBytes(char* toEncode) {
-	std::string tempString(toEncode, 3);
+		if(length == 0) {
+			break;
+		}
 
-	return encodeBytes((std::string)tempString);
+		carried = available - whole;
+		std::memmove(&block[0], &block[whole], carried);
+	}
 
+	this->setData(output);
 }
 
-std::string EmailAttachment::encodeBytes(std::string toEncode){
+std::vector<std::future<void> > EmailAttachment::encodeData(const std::shared_ptr<const std::string> &raw, const std::shared_ptr<std::string> &output, SimplyEmail::ThreadPool *pool) {
+	std::vector<std::future<void> > toReturn;
 
-	//Create return variable
-	std::string toReturn (4, ' '); // Return string must be four characters long for proper encoding
+	output->assign(Base64::wrappedLength(raw->length()), '\0');
 
-	if(toEncode.length() == 3) {
-		//Build encoder table
-		static const std::string baseChars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	if(raw->empty()) {
+		return toReturn;
+	}
 
-		//Combine the characters to form a number
-		int encodedValue[4] = {0,0,0,0};
+	//Small files are not worth the scheduling overhead
+	if((pool == NULL) || (raw->length() <= PARALLEL_CHUNK_SIZE)) {
+		Base64::encodeWrapped(raw->data(), raw->length(), &(*output)[0]);
+		return toReturn;
+	}
 
-		encodedValue[0] = ((toEncode[0] & 0xfc) >> 2);
-		encodedValue[1] = ((toEncode[0] & 0x03) << 4) + ((toEncode[1] & 0xf0) >> 4);
-		encodedValue[2] = ((toEncode[1] & 0x0f) << 2) + ((toEncode[2] & 0xc0) >> 6);
-		encodedValue[3] = (toEncode[2] & 0x3f);
+	//Every chunk but the last is a whole number of lines, so each one encodes to a fixed slice of the output
+	for(std::size_t offset=0; offset<raw->length(); offset+=PARALLEL_CHUNK_SIZE){
+		std::size_t length = std::min(PARALLEL_CHUNK_SIZE, raw->length() - offset);
+		bool last = (offset + length == raw->length());
 
-		//Lookup corresponding values and add them to the return variable
-		for(unsigned int i = 0; i<4; i++){
-			toReturn[i] = baseChars[encodedValue[i]];
-		}
+		toReturn.push_back(pool->submit([raw, output, offset, length, last]() {
+			char *start = &(*output)[(offset / Base64::LINE_INPUT) * (Base64::LINE_LENGTH + 2)];
+			Base64::encodeWrapped(raw->data() + offset, length, start);
 
-	}
-	else {
-		throw std::runtime_error("Error creating attachment: could not encode byte.");
+			//The line break joining this chunk to the next
+			if(!last) {
+				std::memcpy(start + Base64::wrappedLength(length), "\r\n", 2);
+			}
+		}));
 	}
 
 	return toReturn;
 }
+
 } /* namespace SimplyEmail */
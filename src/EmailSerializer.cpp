@@ -0,0 +1,411 @@
+/**
+ * \file EmailSerializer.cpp
+ *
+ * \brief Implementation file for the binary form of emails passed between processes
+ */
+
+#include "../lib/EmailSerializer.h"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace SimplyEmail {
+
+const std::uint32_t EmailSerializer::FORMAT_VERSION = 3;
+
+namespace {
+
+const char serializedMagic[8] = {'S', 'E', 'M', 'A', 'I', 'L', 0, 0};
+const std::uint32_t byteOrderMark = 0x01020304;
+
+/**
+ * \brief The start of a serialized email
+ */
+struct SerializedHeader {
+	char magic[8];										/// Identifies the format
+	std::uint32_t version;								/// The format version
+	std::uint32_t byteOrder;							/// byteOrderMark as written by the writer
+	std::uint64_t totalLength;							/// The length of the whole serialized email
+	std::uint32_t recipientCount;						/// The number of recipients
+	std::uint32_t ccCount;								/// The number of CCs
+	std::uint32_t bccCount;								/// The number of BCCs
+	std::uint32_t attachmentCount;						/// The number of attachments
+	std::uint64_t fieldCount;							/// The number of entries in the field table
+};
+
+/**
+ * \brief Locates one field within a serialized email
+ */
+struct FieldEntry {
+	std::uint64_t offset;								/// The offset of the field from the start of the email
+	std::uint64_t length;								/// The length of the field
+};
+
+const std::size_t FIXED_FIELDS = 4;						/// From, reply to, subject and body
+const std::size_t ATTACHMENT_FIELDS = 3;				/// File name, MIME type and data
+const std::size_t HEADER_FIELDS = 2;					/// Name and value
+
+std::size_t alignTo8(std::size_t value) {
+	return (value + 7) & ~(std::size_t)7;
+}
+
+/**
+ * \brief Writes fields one after another while filling in the field table
+ */
+class FieldWriter {
+public:
+	FieldWriter(char *_output, std::size_t _fieldCount) : output(_output), entry(0) {
+		this->offset = sizeof(SerializedHeader) + (_fieldCount * sizeof(FieldEntry));
+	}
+
+	void write(const char *text, std::size_t textLength) {
+		this->set(this->entry++, text, textLength);
+	}
+
+	void write(const std::string &text) {
+		this->write(text.data(), text.length());
+	}
+
+	void writeAll(const std::vector<std::string> &texts) {
+		for(std::size_t i=0; i<texts.size(); i++){
+			this->write(texts[i]);
+		}
+	}
+
+	//Zero the gap up to the next 8 byte boundary so that the output is deterministic
+	void align() {
+		std::size_t aligned = alignTo8(this->offset);
+		std::memset(this->output + this->offset, 0, aligned - this->offset);
+		this->offset = aligned;
+	}
+
+	//Leave a table entry to be filled in by set() later
+	std::size_t skip() {
+		return this->entry++;
+	}
+
+	void set(std::size_t index, const char *text, std::size_t textLength) {
+		FieldEntry field;
+		field.offset = this->offset;
+		field.length = textLength;
+
+		std::memcpy(this->output + sizeof(SerializedHeader) + (index * sizeof(FieldEntry)), &field, sizeof(field));
+
+		if(textLength > 0) {
+			std::memcpy(this->output + this->offset, text, textLength);
+		}
+
+		this->offset += textLength;
+	}
+
+	std::size_t getOffset() const {
+		return this->offset;
+	}
+
+private:
+	char *output;										/// The serialized email
+	std::size_t entry;									/// The next table entry
+	std::size_t offset;									/// The next free byte
+};
+
+std::size_t textLength(const std::vector<std::string> &texts) {
+	std::size_t toReturn = 0;
+
+	for(std::size_t i=0; i<texts.size(); i++){
+		toReturn += texts[i].length();
+	}
+
+	return toReturn;
+}
+
+} /* namespace */
+
+std::string StringRef::str() const {
+	return std::string(this->data, this->length);
+}
+
+bool StringRef::operator==(const std::string &other) const {
+	return (other.length() == this->length) && (std::memcmp(other.data(), this->data, this->length) == 0);
+}
+
+std::size_t EmailSerializer::serializedSize(const Email &email) {
+	std::size_t fieldCount = FIXED_FIELDS + email.recipients.size() + email.cc.size() + email.bcc.size() + (ATTACHMENT_FIELDS * email.attachments.size()) + (HEADER_FIELDS * email.headers.getCount());
+
+	std::size_t text = email.from.length() + email.replyTo.length() + email.subject.length() + email.body.length();
+	text += textLength(email.recipients) + textLength(email.cc) + textLength(email.bcc);
+
+	for(std::size_t i=0; i<email.headers.getCount(); i++){
+		text += email.headers.getName(i).length() + email.headers.getValue(i).length();
+	}
+
+	std::size_t payload = 0;
+
+	for(std::size_t i=0; i<email.attachments.size(); i++){
+		text += email.attachments[i].getFileName().length() + email.attachments[i].getMimeType().length();
+		payload += alignTo8(email.attachments[i].getDataLength());
+	}
+
+	return alignTo8(sizeof(SerializedHeader) + (fieldCount * sizeof(FieldEntry)) + text) + payload;
+}
+
+std::size_t EmailSerializer::serialize(const Email &email, char *output) {
+	std::size_t fieldCount = FIXED_FIELDS + email.recipients.size() + email.cc.size() + email.bcc.size() + (ATTACHMENT_FIELDS * email.attachments.size()) + (HEADER_FIELDS * email.headers.getCount());
+
+	FieldWriter writer(output, fieldCount);
+
+	writer.write(email.from);
+	writer.write(email.replyTo);
+	writer.write(email.subject);
+	writer.write(email.body);
+	writer.writeAll(email.recipients);
+	writer.writeAll(email.cc);
+	writer.writeAll(email.bcc);
+
+	//Names first so that every data block can follow on an 8 byte boundary
+	std::vector<std::size_t> dataEntries(email.attachments.size());
+
+	for(std::size_t i=0; i<email.attachments.size(); i++){
+		writer.write(email.attachments[i].getFileName());
+		writer.write(email.attachments[i].getMimeType());
+		dataEntries[i] = writer.skip();
+	}
+
+	for(std::size_t i=0; i<email.headers.getCount(); i++){
+		writer.write(email.headers.getName(i));
+		writer.write(email.headers.getValue(i));
+	}
+
+	for(std::size_t i=0; i<email.attachments.size(); i++){
+		writer.align();
+		writer.set(dataEntries[i], email.attachments[i].getDataPointer(), email.attachments[i].getDataLength());
+	}
+
+	writer.align();
+
+	SerializedHeader header;
+	std::memcpy(header.magic, serializedMagic, sizeof(header.magic));
+	header.version = FORMAT_VERSION;
+	header.byteOrder = byteOrderMark;
+	header.totalLength = writer.getOffset();
+	header.recipientCount = email.recipients.size();
+	header.ccCount = email.cc.size();
+	header.bccCount = email.bcc.size();
+	header.attachmentCount = email.attachments.size();
+	header.fieldCount = fieldCount;
+
+	std::memcpy(output, &header, sizeof(header));
+
+	return header.totalLength;
+}
+
+std::string EmailSerializer::serialize(const Email &email) {
+	std::string toReturn(serializedSize(email), '\0');
+	serialize(email, &toReturn[0]);
+
+	return toReturn;
+}
+
+EmailView::EmailView(const char *_data, std::size_t _length) {
+	SerializedHeader header;
+
+	if((_data == NULL) || (_length < sizeof(header))) {
+		throw std::runtime_error("Error reading serialized email: buffer too short");
+	}
+
+	std::memcpy(&header, _data, sizeof(header));
+
+	if(std::memcmp(header.magic, serializedMagic, sizeof(header.magic)) != 0) {
+		throw std::runtime_error("Error reading serialized email: not a serialized email");
+	}
+
+	if(header.byteOrder != byteOrderMark) {
+		throw std::runtime_error("Error reading serialized email: written with a different byte order");
+	}
+
+	//Versions 1 and 2 stored attachments as one unwrapped base 64 line, which strict relays reject
+	if((header.version == 1) || (header.version == 2)) {
+		throw std::runtime_error("Error reading serialized email: written by an older version with unwrapped attachments");
+	}
+
+	if(header.version != EmailSerializer::FORMAT_VERSION) {
+		throw std::runtime_error("Error reading serialized email: unsupported version");
+	}
+
+	if(header.totalLength > _length) {
+		throw std::runtime_error("Error reading serialized email: truncated");
+	}
+
+	//The header must lie within the email it describes, or the table bound below would wrap around
+	if(header.totalLength < sizeof(header)) {
+		throw std::runtime_error("Error reading serialized email: corrupt length");
+	}
+
+	std::uint64_t fieldCount = (std::uint64_t)FIXED_FIELDS + header.recipientCount + header.ccCount + header.bccCount + ((std::uint64_t)ATTACHMENT_FIELDS * header.attachmentCount);
+
+	//Header fields take up the rest of the table
+	if((header.fieldCount < fieldCount) || (((header.fieldCount - fieldCount) % HEADER_FIELDS) != 0)) {
+		throw std::runtime_error("Error reading serialized email: corrupt field table");
+	}
+
+	std::uint64_t headerCount = (header.fieldCount - fieldCount) / HEADER_FIELDS;
+	fieldCount = header.fieldCount;
+
+	if(fieldCount > (header.totalLength - sizeof(header)) / sizeof(FieldEntry)) {
+		throw std::runtime_error("Error reading serialized email: corrupt field table");
+	}
+
+	this->data = _data;
+	this->length = header.totalLength;
+	this->recipientCount = header.recipientCount;
+	this->ccCount = header.ccCount;
+	this->bccCount = header.bccCount;
+	this->attachmentCount = header.attachmentCount;
+	this->headerCount = headerCount;
+
+	//Check every field once so that the accessors need not
+	for(std::size_t i=0; i<fieldCount; i++){
+		FieldEntry field;
+		std::memcpy(&field, this->data + sizeof(header) + (i * sizeof(FieldEntry)), sizeof(field));
+
+		if((field.offset > this->length) || (field.length > this->length - field.offset)) {
+			throw std::runtime_error("Error reading serialized email: field outside the buffer");
+		}
+	}
+}
+
+StringRef EmailView::getFrom() const {
+	return this->field(0);
+}
+
+StringRef EmailView::getReplyTo() const {
+	return this->field(1);
+}
+
+StringRef EmailView::getSubject() const {
+	return this->field(2);
+}
+
+StringRef EmailView::getBody() const {
+	return this->field(3);
+}
+
+std::size_t EmailView::getRecipientNumber() const {
+	return this->recipientCount;
+}
+
+StringRef EmailView::getRecipient(std::size_t recipientNumber) const {
+	return this->listField(FIXED_FIELDS, this->recipientCount, recipientNumber, "recipient");
+}
+
+std::size_t EmailView::getCCNumber() const {
+	return this->ccCount;
+}
+
+StringRef EmailView::getCC(std::size_t ccNumber) const {
+	return this->listField(FIXED_FIELDS + this->recipientCount, this->ccCount, ccNumber, "cc");
+}
+
+std::size_t EmailView::getBCCNumber() const {
+	return this->bccCount;
+}
+
+StringRef EmailView::getBCC(std::size_t bccNumber) const {
+	return this->listField(FIXED_FIELDS + this->recipientCount + this->ccCount, this->bccCount, bccNumber, "bcc");
+}
+
+std::size_t EmailView::getAttachmentNumber() const {
+	return this->attachmentCount;
+}
+
+StringRef EmailView::getAttachmentFileName(std::size_t attachmentNumber) const {
+	return this->listField(FIXED_FIELDS + this->recipientCount + this->ccCount + this->bccCount, this->attachmentCount * ATTACHMENT_FIELDS, attachmentNumber * ATTACHMENT_FIELDS, "attachment");
+}
+
+StringRef EmailView::getAttachmentMimeType(std::size_t attachmentNumber) const {
+	return this->listField(FIXED_FIELDS + this->recipientCount + this->ccCount + this->bccCount, this->attachmentCount * ATTACHMENT_FIELDS, (attachmentNumber * ATTACHMENT_FIELDS) + 1, "attachment");
+}
+
+StringRef EmailView::getAttachmentData(std::size_t attachmentNumber) const {
+	return this->listField(FIXED_FIELDS + this->recipientCount + this->ccCount + this->bccCount, this->attachmentCount * ATTACHMENT_FIELDS, (attachmentNumber * ATTACHMENT_FIELDS) + 2, "attachment");
+}
+
+std::size_t EmailView::getHeaderNumber() const {
+	return this->headerCount;
+}
+
+StringRef EmailView::getHeaderName(std::size_t headerNumber) const {
+	return this->listField(this->headerStart(), this->headerCount * HEADER_FIELDS, headerNumber * HEADER_FIELDS, "header");
+}
+
+StringRef EmailView::getHeaderValue(std::size_t headerNumber) const {
+	return this->listField(this->headerStart(), this->headerCount * HEADER_FIELDS, (headerNumber * HEADER_FIELDS) + 1, "header");
+}
+
+Email EmailView::toEmail(const std::shared_ptr<const char> &owner) const {
+	Email toReturn;
+
+	toReturn.setFrom(this->getFrom().str());
+	toReturn.setReplyTo(this->getReplyTo().str());
+	toReturn.setSubject(this->getSubject().str());
+	toReturn.setBody(this->getBody().str());
+
+	for(std::size_t i=0; i<this->recipientCount; i++){
+		toReturn.addRecipient(this->getRecipient(i).str());
+	}
+
+	for(std::size_t i=0; i<this->ccCount; i++){
+		toReturn.addCC(this->getCC(i).str());
+	}
+
+	for(std::size_t i=0; i<this->bccCount; i++){
+		toReturn.addBCC(this->getBCC(i).str());
+	}
+
+	for(std::size_t i=0; i<this->headerCount; i++){
+		toReturn.addHeader(this->getHeaderName(i).str(), this->getHeaderValue(i).str());
+	}
+
+	for(std::size_t i=0; i<this->attachmentCount; i++){
+		StringRef encoded = this->getAttachmentData(i);
+		std::shared_ptr<const char> shared;
+
+		if(owner) {
+			//Point into the buffer while sharing ownership of it
+			shared = std::shared_ptr<const char>(owner, encoded.data);
+		}
+		else {
+			char *copy = new char[encoded.length];
+			std::memcpy(copy, encoded.data, encoded.length);
+			shared = std::shared_ptr<const char>(copy, std::default_delete<char[]>());
+		}
+
+		toReturn.addAttachment(EmailAttachment(this->getAttachmentFileName(i).str(), this->getAttachmentMimeType(i).str(), shared, encoded.length));
+	}
+
+	return toReturn;
+}
+
+StringRef EmailView::field(std::size_t index) const {
+	FieldEntry entry;
+	std::memcpy(&entry, this->data + sizeof(SerializedHeader) + (index * sizeof(FieldEntry)), sizeof(entry));
+
+	StringRef toReturn;
+	toReturn.data = this->data + entry.offset;
+	toReturn.length = entry.length;
+
+	return toReturn;
+}
+
+std::size_t EmailView::headerStart() const {
+	return FIXED_FIELDS + this->recipientCount + this->ccCount + this->bccCount + (this->attachmentCount * ATTACHMENT_FIELDS);
+}
+
+StringRef EmailView::listField(std::size_t first, std::size_t count, std::size_t index, const char *name) const {
+	if(index >= count) {
+		throw std::out_of_range(std::string("Error reading serialized email: no such ") + name);
+	}
+
+	return this->field(first + index);
+}
+
+} /* namespace SimplyEmail */
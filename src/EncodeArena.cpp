@@ -0,0 +1,87 @@
+/**
+ * \file EncodeArena.cpp
+ *
+ * \brief Implementation file for the encoding arena
+ */
+
+#include "../lib/EncodeArena.h"
+
+namespace SimplyEmail {
+
+const std::size_t EncodeArena::DEFAULT_BLOCK_SIZE = 64 * 1024;
+
+EncodeArena::EncodeArena(std::size_t initialBlockSize) {
+	this->nextBlockSize = (initialBlockSize > 0) ? initialBlockSize : DEFAULT_BLOCK_SIZE;
+	this->offset = 0;
+	this->used = 0;
+}
+
+EncodeArena::~EncodeArena() {
+	for(unsigned int i=0; i<this->blocks.size(); i++){
+		::operator delete(this->blocks[i].memory);
+	}
+}
+
+void* EncodeArena::allocate(std::size_t bytes, std::size_t alignment) {
+	if(!this->blocks.empty()) {
+		Block &current = this->blocks.back();
+		std::size_t aligned = (this->offset + alignment - 1) & ~(alignment - 1);
+
+		if(aligned + bytes <= current.size) {
+			this->offset = aligned + bytes;
+			this->used += bytes;
+			return current.memory + aligned;
+		}
+	}
+
+	//The request does not fit; start a new block big enough for it and at least double the last one
+	std::size_t size = this->nextBlockSize;
+	while(size < bytes + alignment) {
+		size = size * 2;
+	}
+
+	Block block;
+	block.memory = static_cast<char*>(::operator new(size));
+	block.size = size;
+	this->blocks.push_back(block);
+	this->nextBlockSize = size * 2;
+
+	//Memory from the global allocator is aligned for any fundamental type
+	this->offset = bytes;
+	this->used += bytes;
+	return block.memory;
+}
+
+void EncodeArena::reset() {
+	if(this->blocks.empty()) {
+		return;
+	}
+
+	//Keep only the largest block; it is the last one since every block is larger than the one before it
+	Block largest = this->blocks.back();
+	for(unsigned int i=0; i+1<this->blocks.size(); i++){
+		::operator delete(this->blocks[i].memory);
+	}
+
+	this->blocks.clear();
+	this->blocks.push_back(largest);
+	this->nextBlockSize = largest.size * 2;
+	this->offset = 0;
+	this->used = 0;
+}
+
+std::size_t EncodeArena::getBytesUsed() const {
+	return this->used;
+}
+
+std::size_t EncodeArena::getBytesReserved() const {
+	std::size_t toReturn = 0;
+
+	for(unsigned int i=0; i<this->blocks.size(); i++){
+		toReturn += this->blocks[i].size;
+	}
+
+	return toReturn;
+}
+
+} /* namespace SimplyEmail */
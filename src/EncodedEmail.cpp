@@ -0,0 +1,101 @@
+/**
+ * \file EncodedEmail.cpp
+ *
+ * \brief Implementation file for an encoded message held as a list of segments
+ */
+
+#include "../lib/EncodedEmail.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace SimplyEmail {
+
+EncodedEmail::EncodedEmail() {
+	this->size = 0;
+}
+
+void EncodedEmail::append(const char *data, std::size_t length) {
+	if(length == 0) {
+		return;
+	}
+
+	Segment segment;
+	segment.data = data;
+	segment.length = length;
+
+	this->segments.push_back(segment);
+	this->starts.push_back(this->size);
+	this->size += length;
+}
+
+void EncodedEmail::append(const std::shared_ptr<const std::string> &text) {
+	if(!text || text->empty()) {
+		return;
+	}
+
+	this->owners.push_back(text);
+	this->append(text->data(), text->length());
+}
+
+void EncodedEmail::append(const std::shared_ptr<const char> &data, std::size_t length) {
+	if(!data || (length == 0)) {
+		return;
+	}
+
+	this->owners.push_back(data);
+	this->append(data.get(), length);
+}
+
+std::size_t EncodedEmail::getSize() const {
+	return this->size;
+}
+
+std::size_t EncodedEmail::getSegmentCount() const {
+	return this->segments.size();
+}
+
+const EncodedEmail::Segment& EncodedEmail::getSegment(std::size_t segmentNumber) const {
+	if(segmentNumber >= this->segments.size()) {
+		throw std::out_of_range("Error getting segment: segment number out of range");
+	}
+
+	return this->segments[segmentNumber];
+}
+
+std::size_t EncodedEmail::read(std::size_t offset, char *output, std::size_t length) const {
+	if(offset >= this->size) {
+		return 0;
+	}
+
+	//The last segment starting at or before the offset
+	std::size_t segment = (std::upper_bound(this->starts.begin(), this->starts.end(), offset) - this->starts.begin()) - 1;
+
+	std::size_t copied = 0;
+	std::size_t within = offset - this->starts[segment];
+
+	while((copied < length) && (segment < this->segments.size())) {
+		std::size_t toCopy = std::min(length - copied, this->segments[segment].length - within);
+		std::memcpy(output + copied, this->segments[segment].data + within, toCopy);
+
+		copied += toCopy;
+		within = 0;
+		segment++;
+	}
+
+	return copied;
+}
+
+std::string EncodedEmail::str() const {
+	std::string toReturn;
+	toReturn.reserve(this->size);
+
+	for(std::size_t i=0; i<this->segments.size(); i++){
+		toReturn.append(this->segments[i].data, this->segments[i].length);
+	}
+
+	return toReturn;
+}
+
+} /* namespace SimplyEmail */
@@ -0,0 +1,322 @@
+/**
+ * \file HeaderEncoder.cpp
+ *
+ * \brief Implementation file for the RFC 2047 encoder of header text
+ */
+
+#include "../lib/HeaderEncoder.h"
+#include "../lib/Base64.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace SimplyEmail {
+
+const std::size_t HeaderEncoder::MAX_WORD_LENGTH = 75;
+const std::size_t HeaderEncoder::MAX_LINE_LENGTH = 76;
+const std::size_t HeaderEncoder::FOLD_COLUMN = 78;
+
+namespace {
+
+const char hexDigits[] = "0123456789ABCDEF";
+
+//"=?UTF-8?B?" and "?="
+const std::size_t WORD_OVERHEAD = 12;
+
+/**
+ * \brief A word of a value and the white space before it
+ */
+struct Word {
+	std::size_t space;									/// Where the white space before the word starts
+	std::size_t start;									/// Where the word starts
+	std::size_t end;									/// Where the word ends
+	bool encoded;										/// The word must be encoded
+};
+
+bool isSpace(char c) {
+	return (c == ' ') || (c == '\t');
+}
+
+//Characters Q may leave as they are anywhere an encoded word is allowed (RFC 2047 section 5, rule 3)
+bool isQSafe(unsigned char c) {
+	return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) ||
+			(c == '!') || (c == '*') || (c == '+') || (c == '-') || (c == '/');
+}
+
+std::size_t qLength(unsigned char c) {
+	return (isQSafe(c) || (c == ' ')) ? 1 : 3;
+}
+
+//The end of the UTF-8 character starting at position; stray continuation bytes are taken one at a time
+std::size_t characterEnd(const char *value, std::size_t position, std::size_t end) {
+	std::size_t toReturn = position + 1;
+
+	while((toReturn < end) && (toReturn - position < 4) && ((value[toReturn] & 0xc0) == 0x80)) {
+		toReturn++;
+	}
+
+	return toReturn;
+}
+
+//The end of the longest run of whole characters from position that encodes into room characters
+std::size_t fit(const char *value, std::size_t position, std::size_t end, std::size_t room, bool useBase64) {
+	std::size_t toReturn = position;
+	std::size_t cost = 0;
+
+	while(toReturn < end) {
+		std::size_t next = characterEnd(value, toReturn, end);
+		std::size_t nextCost = cost;
+
+		if(useBase64) {
+			nextCost = Base64::encodedLength(next - position);
+		}
+		else {
+			for(std::size_t i=toReturn; i<next; i++){
+				nextCost += qLength((unsigned char)value[i]);
+			}
+		}
+
+		if(nextCost > room) {
+			break;
+		}
+
+		toReturn = next;
+		cost = nextCost;
+	}
+
+	return toReturn;
+}
+
+void appendWord(const char *text, std::size_t length, bool useBase64, std::string &output) {
+	output.append(useBase64 ? "=?UTF-8?B?" : "=?UTF-8?Q?");
+
+	if(useBase64) {
+		char encoded[HeaderEncoder::MAX_WORD_LENGTH];
+		Base64::encode(text, length, encoded);
+		output.append(encoded, Base64::encodedLength(length));
+	}
+	else {
+		for(std::size_t i=0; i<length; i++){
+			unsigned char c = (unsigned char)text[i];
+
+			if(isQSafe(c)) {
+				output.push_back((char)c);
+			}
+			else if(c == ' ') {
+				output.push_back('_');
+			}
+			else {
+				output.push_back('=');
+				output.push_back(hexDigits[c >> 4]);
+				output.push_back(hexDigits[c & 0x0f]);
+			}
+		}
+	}
+
+	output.append("?=");
+}
+
+} /* namespace */
+
+bool HeaderEncoder::needsEncoding(const char *value, std::size_t length) {
+	std::size_t i = 0;
+	bool question = false;
+
+#if defined(__SSE2__)
+	//Gather the high bits and any question marks in the same pass, as most values have neither
+	__m128i highBits = _mm_setzero_si128();
+	__m128i questions = _mm_setzero_si128();
+	const __m128i questionMark = _mm_set1_epi8('?');
+
+	for(; i+16<=length; i+=16){
+		__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(value + i));
+		highBits = _mm_or_si128(highBits, bytes);
+		questions = _mm_or_si128(questions, _mm_cmpeq_epi8(bytes, questionMark));
+	}
+
+	//Cover the tail with one last block overlapping the one before
+	if((i < length) && (length >= 16)) {
+		__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(value + length - 16));
+		highBits = _mm_or_si128(highBits, bytes);
+		questions = _mm_or_si128(questions, _mm_cmpeq_epi8(bytes, questionMark));
+		i = length;
+	}
+
+	if(_mm_movemask_epi8(highBits) != 0) {
+		return true;
+	}
+
+	question = (_mm_movemask_epi8(questions) != 0);
+#endif
+
+	//Without SSE2, or for a value too short for a block, test eight bytes at a time the same way
+	std::uint64_t highWords = 0;
+
+	for(; i+8<=length; i+=8){
+		std::uint64_t word;
+		std::memcpy(&word, value + i, sizeof(word));
+		highWords |= word;
+
+		//A byte of the word is a question mark if the word XORed with them has a zero byte
+		std::uint64_t marks = word ^ 0x3f3f3f3f3f3f3f3fULL;
+		question = question || (((marks - 0x0101010101010101ULL) & ~marks & 0x8080808080808080ULL) != 0);
+	}
+
+	if((highWords & 0x8080808080808080ULL) != 0) {
+		return true;
+	}
+
+	for(; i<length; i++){
+		if((value[i] & 0x80) != 0) {
+			return true;
+		}
+
+		question = question || (value[i] == '?');
+	}
+
+	if(!question) {
+		return false;
+	}
+
+	//Look for "=?" only in the few values with a question mark
+	for(i=1; i<length; i++){
+		if((value[i] == '?') && (value[i - 1] == '=')) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void HeaderEncoder::encode(const char *value, std::size_t length, std::size_t column, std::string &output) {
+	//Split the value into words, each with the white space before it
+	std::vector<Word> words;
+	std::size_t position = 0;
+
+	while(position < length) {
+		Word word;
+		word.space = position;
+
+		while((position < length) && isSpace(value[position])) {
+			position++;
+		}
+
+		word.start = position;
+
+		while((position < length) && !isSpace(value[position])) {
+			position++;
+		}
+
+		word.end = position;
+		word.encoded = needsEncoding(value + word.start, word.end - word.start);
+
+		words.push_back(word);
+	}
+
+	//Choose the shorter encoding for the runs of words to encode, counting each run as one encoded word
+	std::size_t base64Length = 0;
+	std::size_t qEncodedLength = 0;
+
+	for(std::size_t i=0; i<words.size(); i++){
+		if(!words[i].encoded) {
+			continue;
+		}
+
+		std::size_t last = i;
+		while((last + 1 < words.size()) && words[last + 1].encoded) {
+			last++;
+		}
+
+		base64Length += Base64::encodedLength(words[last].end - words[i].start);
+		for(std::size_t j=words[i].start; j<words[last].end; j++){
+			qEncodedLength += qLength((unsigned char)value[j]);
+		}
+
+		i = last;
+	}
+
+	bool useBase64 = (base64Length < qEncodedLength);
+	bool lineHasText = false;
+	bool lineHasWord = false;
+
+	for(std::size_t i=0; i<words.size(); i++){
+		const Word &word = words[i];
+
+		if(!word.encoded) {
+			//Fold before the white space if the word would overrun the line; lines with an encoded word are shorter
+			std::size_t limit = lineHasWord ? MAX_LINE_LENGTH : FOLD_COLUMN;
+
+			if(lineHasText && (word.start > word.space) && (column + word.end - word.space > limit)) {
+				output.append("\r\n");
+				column = 0;
+				lineHasWord = false;
+			}
+
+			output.append(value + word.space, word.end - word.space);
+			column += word.end - word.space;
+			lineHasText = true;
+
+			continue;
+		}
+
+		//Encode the run of words, with the white space inside it, as few encoded words as the lines allow
+		std::size_t last = i;
+		while((last + 1 < words.size()) && words[last + 1].encoded) {
+			last++;
+		}
+
+		std::string gap(value + word.space, word.start - word.space);
+		std::size_t start = word.start;
+
+		while(start < words[last].end) {
+			std::size_t room = (column + gap.length() < MAX_LINE_LENGTH) ? MAX_LINE_LENGTH - column - gap.length() : 0;
+			room = std::min(room, MAX_WORD_LENGTH);
+
+			std::size_t end = (room > WORD_OVERHEAD) ? fit(value, start, words[last].end, room - WORD_OVERHEAD, useBase64) : start;
+
+			//Nothing fits on this line, so start the next; folding needs white space
+			if(end == start) {
+				output.append("\r\n");
+				column = 0;
+
+				if(gap.empty()) {
+					gap = " ";
+				}
+
+				end = fit(value, start, words[last].end, std::min(MAX_LINE_LENGTH - gap.length(), MAX_WORD_LENGTH) - WORD_OVERHEAD, useBase64);
+			}
+
+			std::size_t before = output.length();
+
+			output.append(gap);
+			appendWord(value + start, end - start, useBase64, output);
+
+			column += output.length() - before;
+			start = end;
+			lineHasWord = true;
+
+			//Decoders drop the white space between encoded words
+			gap = " ";
+		}
+
+		lineHasText = true;
+		i = last;
+	}
+}
+
+std::string HeaderEncoder::encode(const std::string &value, std::size_t column) {
+	std::string toReturn;
+	toReturn.reserve(value.length() * 2);
+
+	encode(value.data(), value.length(), column, toReturn);
+
+	return toReturn;
+}
+
+} /* namespace SimplyEmail */
@@ -0,0 +1,320 @@
+/**
+ * \file HeaderList.cpp
+ *
+ * \brief Implementation file for the list of additional message header fields
+ */
+
+#include "../lib/HeaderList.h"
+
+#include <cstring>
+
+namespace SimplyEmail {
+
+const std::size_t HeaderList::NOT_FOUND = (std::size_t)-1;
+const std::size_t HeaderList::FOLD_COLUMN = 78;
+const std::uint32_t HeaderList::CUSTOM_NAME = 0xffffffff;
+
+namespace {
+
+/**
+ * \brief The interned field names in their canonical spelling
+ */
+const char* const internedNames[] = {
+	"Message-ID",
+	"In-Reply-To",
+	"References",
+	"Reply-To",
+	"Sender",
+	"Return-Path",
+	"List-Id",
+	"List-Unsubscribe",
+	"List-Unsubscribe-Post",
+	"List-Help",
+	"List-Subscribe",
+	"List-Post",
+	"List-Owner",
+	"List-Archive",
+	"Precedence",
+	"Auto-Submitted",
+	"Feedback-ID",
+	"Organization",
+	"Importance",
+	"Priority",
+	"X-Priority",
+	"X-Mailer",
+	"Keywords",
+	"Comments"
+};
+
+const std::size_t internedCount = sizeof(internedNames) / sizeof(internedNames[0]);
+
+/// The lengths of the interned names, worked out once
+struct InternedLengths {
+	std::uint32_t lengths[internedCount];
+
+	InternedLengths() {
+		for(std::size_t i=0; i<internedCount; i++){
+			this->lengths[i] = std::strlen(internedNames[i]);
+		}
+	}
+};
+
+const InternedLengths internedLengths;
+
+bool equalsIgnoreCase(const char *first, const char *second, std::size_t length) {
+	for(std::size_t i=0; i<length; i++){
+		char a = first[i];
+		char b = second[i];
+
+		if((a >= 'A') && (a <= 'Z')) {
+			a += 'a' - 'A';
+		}
+
+		if((b >= 'A') && (b <= 'Z')) {
+			b += 'a' - 'A';
+		}
+
+		if(a != b) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool isFoldSpace(char c) {
+	return (c == ' ') || (c == '\t');
+}
+
+} /* namespace */
+
+HeaderList::HeaderList() {
+}
+
+void HeaderList::add(const std::string &name, const std::string &value) {
+	if(!isValidName(name)) {
+		throw std::runtime_error("Error adding header: Invalid header name \"" + name + "\"");
+	}
+
+	if(value.find_first_of("\r\n") != std::string::npos) {
+		throw std::runtime_error("Error adding header: Header values may not contain line breaks");
+	}
+
+	if(this->text.length() + name.length() + value.length() > 0xffffffffUL) {
+		throw std::runtime_error("Error adding header: Headers too large");
+	}
+
+	Field field;
+	field.nameId = intern(name);
+	field.nameOffset = 0;
+	field.nameLength = name.length();
+
+	if(field.nameId == CUSTOM_NAME) {
+		field.nameOffset = this->text.length();
+		this->text.append(name);
+	}
+
+	field.valueOffset = this->text.length();
+	field.valueLength = value.length();
+	this->text.append(value);
+
+	this->fields.push_back(field);
+}
+
+void HeaderList::set(const std::string &name, const std::string &value) {
+	std::size_t first = this->find(name);
+
+	if(first == NOT_FOUND) {
+		this->add(name, value);
+		return;
+	}
+
+	//Append the new field, then move it into the first one's place
+	this->add(name, value);
+
+	this->fields[first] = this->fields.back();
+	this->fields.pop_back();
+
+	std::uint32_t nameId = intern(name);
+	std::size_t kept = first + 1;
+
+	for(std::size_t i=first+1; i<this->fields.size(); i++){
+		if(!this->matches(this->fields[i], nameId, name)) {
+			this->fields[kept++] = this->fields[i];
+		}
+	}
+
+	this->fields.resize(kept);
+	this->compact();
+}
+
+std::size_t HeaderList::remove(const std::string &name) {
+	std::uint32_t nameId = intern(name);
+	std::size_t kept = 0;
+
+	for(std::size_t i=0; i<this->fields.size(); i++){
+		if(!this->matches(this->fields[i], nameId, name)) {
+			this->fields[kept++] = this->fields[i];
+		}
+	}
+
+	std::size_t toReturn = this->fields.size() - kept;
+
+	if(toReturn > 0) {
+		this->fields.resize(kept);
+		this->compact();
+	}
+
+	return toReturn;
+}
+
+std::size_t HeaderList::find(const std::string &name, std::size_t start) const {
+	std::uint32_t nameId = intern(name);
+
+	for(std::size_t i=start; i<this->fields.size(); i++){
+		if(this->matches(this->fields[i], nameId, name)) {
+			return i;
+		}
+	}
+
+	return NOT_FOUND;
+}
+
+std::size_t HeaderList::getCount() const {
+	return this->fields.size();
+}
+
+std::string HeaderList::getName(std::size_t fieldNumber) const {
+	if(fieldNumber >= this->fields.size()) {
+		throw std::out_of_range("Error getting header: header number out of range");
+	}
+
+	return std::string(this->nameData(this->fields[fieldNumber]), this->fields[fieldNumber].nameLength);
+}
+
+std::string HeaderList::getValue(std::size_t fieldNumber) const {
+	if(fieldNumber >= this->fields.size()) {
+		throw std::out_of_range("Error getting header: header number out of range");
+	}
+
+	return this->text.substr(this->fields[fieldNumber].valueOffset, this->fields[fieldNumber].valueLength);
+}
+
+void HeaderList::clear() {
+	this->text.clear();
+	this->fields.clear();
+}
+
+std::size_t HeaderList::encodedSizeHint() const {
+	std::size_t toReturn = 0;
+
+	for(std::size_t i=0; i<this->fields.size(); i++){
+		const Field &field = this->fields[i];
+
+		//The separator and line end, plus a line end for each fold
+		toReturn += field.nameLength + field.valueLength + 4 + (2 * ((field.nameLength + field.valueLength) / (FOLD_COLUMN / 2)));
+	}
+
+	return toReturn;
+}
+
+bool HeaderList::isValidName(const std::string &name) {
+	if(name.empty()) {
+		return false;
+	}
+
+	for(std::size_t i=0; i<name.length(); i++){
+		char c = name[i];
+
+		if((c < 33) || (c > 126) || (c == ':')) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+std::uint32_t HeaderList::intern(const std::string &name) {
+	for(std::size_t i=0; i<internedCount; i++){
+		if((internedLengths.lengths[i] == name.length()) && equalsIgnoreCase(internedNames[i], name.data(), name.length())) {
+			return i;
+		}
+	}
+
+	return CUSTOM_NAME;
+}
+
+const char* HeaderList::nameData(const Field &field) const {
+	if(field.nameId == CUSTOM_NAME) {
+		return this->text.data() + field.nameOffset;
+	}
+
+	return internedNames[field.nameId];
+}
+
+bool HeaderList::matches(const Field &field, std::uint32_t nameId, const std::string &name) const {
+	//Interned names compare by identity; a name is interned whatever its case, so they never match custom ones
+	if(nameId != CUSTOM_NAME) {
+		return field.nameId == nameId;
+	}
+
+	return (field.nameId == CUSTOM_NAME) && (field.nameLength == name.length()) && equalsIgnoreCase(this->text.data() + field.nameOffset, name.data(), name.length());
+}
+
+void HeaderList::compact() {
+	std::string compacted;
+	compacted.reserve(this->text.length());
+
+	for(std::size_t i=0; i<this->fields.size(); i++){
+		Field &field = this->fields[i];
+
+		if(field.nameId == CUSTOM_NAME) {
+			std::uint32_t offset = compacted.length();
+			compacted.append(this->text, field.nameOffset, field.nameLength);
+			field.nameOffset = offset;
+		}
+
+		std::uint32_t offset = compacted.length();
+		compacted.append(this->text, field.valueOffset, field.valueLength);
+		field.valueOffset = offset;
+	}
+
+	this->text.swap(compacted);
+}
+
+std::size_t HeaderList::nextFold(const char *value, std::size_t length, std::size_t position, std::size_t column) {
+	if(column + (length - position) <= FOLD_COLUMN) {
+		return length;
+	}
+
+	//A line may not be only white space, so never break after the last word
+	std::size_t end = length;
+	while((end > position) && isFoldSpace(value[end - 1])) {
+		end--;
+	}
+
+	std::size_t limit = position + ((column < FOLD_COLUMN) ? (FOLD_COLUMN - column) : 0);
+
+	//Break at the start of a run of white space, so the line written ends in a word
+	std::size_t toReturn = length;
+
+	for(std::size_t i=position+1; i<end; i++){
+		if(isFoldSpace(value[i]) && !isFoldSpace(value[i - 1])) {
+			if(i <= limit) {
+				toReturn = i;
+			}
+			else {
+				//Nothing fitted; an overlong line is better than a break inside a word
+				if(toReturn == length) {
+					toReturn = i;
+				}
+
+				break;
+			}
+		}
+	}
+
+	return toReturn;
+}
+
+} /* namespace SimplyEmail */
@@ -0,0 +1,494 @@
+/**
+ * \file MailboxWriter.cpp
+ *
+ * \brief Implementation file for writing encoded emails to a Maildir or mbox instead of sending them
+ */
+
+#include "../lib/MailboxWriter.h"
+#include "../lib/ThreadPool.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace SimplyEmail {
+
+const int MailboxWriter::MAILDIR = 0;
+const int MailboxWriter::MBOX = 1;
+
+const unsigned int MailboxWriter::DEFAULT_SYNC_BATCH = 64;
+const unsigned int MailboxWriter::MAX_SYNC_BATCH = 256;
+
+namespace {
+
+std::runtime_error writeError(const std::string &doing) {
+	return std::runtime_error("Error writing mailbox: " + doing + ": " + std::strerror(errno));
+}
+
+void makeDirectory(const std::string &path) {
+	if((mkdir(path.c_str(), 0700) != 0) && (errno != EEXIST)) {
+		throw writeError("could not create " + path);
+	}
+}
+
+void writeFully(int descriptor, const char *data, std::size_t length) {
+	while(length > 0) {
+		ssize_t written = ::write(descriptor, data, length);
+
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			throw writeError("could not write");
+		}
+
+		data += written;
+		length -= written;
+	}
+}
+
+//Writes every segment of a message with as few system calls as possible
+void writeSegments(int descriptor, const EncodedEmail &message) {
+	std::vector<struct iovec> vectors(message.getSegmentCount());
+
+	for(std::size_t i=0; i<vectors.size(); i++){
+		const EncodedEmail::Segment &segment = message.getSegment(i);
+		vectors[i].iov_base = const_cast<char*>(segment.data);
+		vectors[i].iov_len = segment.length;
+	}
+
+	std::size_t first = 0;
+
+	while(first < vectors.size()) {
+		int count = (int)std::min<std::size_t>(vectors.size() - first, IOV_MAX);
+		ssize_t written = writev(descriptor, &vectors[first], count);
+
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			throw writeError("could not write");
+		}
+
+		//Skip what was written, which may end part way through a segment
+		std::size_t remaining = written;
+		while((first < vectors.size()) && (remaining >= vectors[first].iov_len)) {
+			remaining -= vectors[first].iov_len;
+			first++;
+		}
+
+		if(remaining > 0) {
+			vectors[first].iov_base = static_cast<char*>(vectors[first].iov_base) + remaining;
+			vectors[first].iov_len -= remaining;
+		}
+	}
+}
+
+bool startsWithFrom(const char *line, std::size_t length) {
+	std::size_t i = 0;
+	while((i < length) && (line[i] == '>')) {
+		i++;
+	}
+
+	return (length - i >= 5) && (std::memcmp(line + i, "From ", 5) == 0);
+}
+
+} /* namespace */
+
+MailboxWriter::MailboxWriter(const std::string &_path, int _format, unsigned int _syncBatch) : path(_path), format(_format), syncBatch(_syncBatch) {
+	if((this->format != MAILDIR) && (this->format != MBOX)) {
+		throw std::runtime_error("Error opening mailbox: Unknown format");
+	}
+
+	if(this->syncBatch > MAX_SYNC_BATCH) {
+		this->syncBatch = MAX_SYNC_BATCH;
+	}
+
+	this->mbox = -1;
+	this->unsynced = 0;
+	this->started = false;
+	this->messages = 0;
+	this->bytes = 0;
+	this->discarded = 0;
+	this->syncs = 0;
+	this->sequence = 0;
+
+	if(this->format == MAILDIR) {
+		makeDirectory(this->path);
+		makeDirectory(this->path + "/tmp");
+		makeDirectory(this->path + "/new");
+		makeDirectory(this->path + "/cur");
+
+		//Maildir reserves '/' and ':' in file names
+		char name[256];
+		if(gethostname(name, sizeof(name)) != 0) {
+			std::strcpy(name, "localhost");
+		}
+		name[sizeof(name) - 1] = '\0';
+
+		this->hostName = name;
+		for(std::size_t i=0; i<this->hostName.length(); i++){
+			if((this->hostName[i] == '/') || (this->hostName[i] == ':')) {
+				this->hostName[i] = '_';
+			}
+		}
+	}
+	else {
+		this->mbox = open(this->path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+		if(this->mbox < 0) {
+			throw writeError("could not open " + this->path);
+		}
+
+		if(flock(this->mbox, LOCK_EX | LOCK_NB) != 0) {
+			int error = errno;
+			close(this->mbox);
+			errno = error;
+			throw writeError("could not lock " + this->path);
+		}
+	}
+}
+
+MailboxWriter::~MailboxWriter() {
+	try {
+		this->flush();
+	}
+	catch(...) {
+		//Nothing can be reported from a destructor
+	}
+
+	if(this->mbox >= 0) {
+		close(this->mbox);
+	}
+}
+
+void MailboxWriter::write(const Email &email) {
+	this->recordStart();
+
+	if(this->format == MAILDIR) {
+		this->writeMaildir(email);
+	}
+	else {
+		this->writeMbox(email);
+	}
+}
+
+void MailboxWriter::writeAll(const std::vector<Email> &emails, unsigned int threads) {
+	std::exception_ptr error;
+
+	{
+		SimplyEmail::ThreadPool pool(threads);
+		std::vector<std::future<void> > results;
+		results.reserve(emails.size());
+
+		for(std::size_t i=0; i<emails.size(); i++){
+			const Email *email = &emails[i];
+			results.push_back(pool.submit([this, email]() { this->write(*email); }));
+		}
+
+		for(std::size_t i=0; i<results.size(); i++){
+			try {
+				results[i].get();
+			}
+			catch(...) {
+				if(!error) {
+					error = std::current_exception();
+				}
+			}
+		}
+	}
+
+	this->flush();
+
+	if(error) {
+		std::rethrow_exception(error);
+	}
+}
+
+void MailboxWriter::flush() {
+	if(this->format == MAILDIR) {
+		std::vector<PendingFile> batch;
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			batch.swap(this->pending);
+		}
+
+		if(!batch.empty()) {
+			this->syncMaildir(batch);
+		}
+	}
+	else {
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		if(this->unsynced > 0) {
+			if(fdatasync(this->mbox) != 0) {
+				throw writeError("could not sync " + this->path);
+			}
+
+			this->unsynced = 0;
+			this->syncs++;
+		}
+	}
+}
+
+MailboxStats MailboxWriter::getStats() const {
+	MailboxStats toReturn;
+	toReturn.messages = this->messages;
+	toReturn.bytes = this->bytes;
+	toReturn.discarded = this->discarded;
+	toReturn.syncs = this->syncs;
+	toReturn.seconds = 0;
+	toReturn.messagesPerSecond = 0;
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if(this->started) {
+		toReturn.seconds = std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::steady_clock::now() - this->firstWrite).count();
+
+		if(toReturn.seconds > 0) {
+			toReturn.messagesPerSecond = toReturn.messages / toReturn.seconds;
+		}
+	}
+
+	return toReturn;
+}
+
+const std::string& MailboxWriter::getPath() const {
+	return this->path;
+}
+
+int MailboxWriter::getFormat() const {
+	return this->format;
+}
+
+void MailboxWriter::writeMaildir(const Email &email) {
+	EncodedEmail message = email.encodeSegments();
+
+	std::string name = this->uniqueName();
+	std::string temporary = this->path + "/tmp/" + name;
+
+	int descriptor = open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if(descriptor < 0) {
+		throw writeError("could not create " + temporary);
+	}
+
+	try {
+		writeSegments(descriptor, message);
+	}
+	catch(...) {
+		close(descriptor);
+		unlink(temporary.c_str());
+		throw;
+	}
+
+	if(this->syncBatch == 0) {
+		close(descriptor);
+
+		if(rename(temporary.c_str(), (this->path + "/new/" + name).c_str()) != 0) {
+			int error = errno;
+			unlink(temporary.c_str());
+			errno = error;
+			throw writeError("could not deliver " + name);
+		}
+
+		this->messages++;
+		this->bytes += message.getSize();
+
+		return;
+	}
+
+	PendingFile file;
+	file.descriptor = descriptor;
+	file.name = name;
+	file.size = message.getSize();
+
+	//The writer that completes a batch syncs it, outside the lock so the others carry on
+	std::vector<PendingFile> batch;
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->pending.push_back(file);
+
+		if(this->pending.size() >= this->syncBatch) {
+			batch.swap(this->pending);
+		}
+	}
+
+	if(!batch.empty()) {
+		this->syncMaildir(batch);
+	}
+}
+
+void MailboxWriter::writeMbox(const Email &email) {
+	std::string entry;
+	formatMbox(email.getFrom(), email.encode(), entry);
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	//A partly written entry would run into the next one, so cut the file back to where the entry began
+	off_t start = lseek(this->mbox, 0, SEEK_END);
+	if(start < 0) {
+		throw writeError("could not seek in " + this->path);
+	}
+
+	try {
+		writeFully(this->mbox, entry.data(), entry.length());
+	}
+	catch(...) {
+		if(ftruncate(this->mbox, start) != 0) {
+			//The entry stays cut short; the original error is the one to report
+		}
+		throw;
+	}
+
+	this->messages++;
+	this->bytes += entry.length();
+
+	if(this->syncBatch == 0) {
+		return;
+	}
+
+	if(++this->unsynced >= this->syncBatch) {
+		if(fdatasync(this->mbox) != 0) {
+			throw writeError("could not sync " + this->path);
+		}
+
+		this->unsynced = 0;
+		this->syncs++;
+	}
+}
+
+void MailboxWriter::syncMaildir(std::vector<PendingFile> &batch) {
+	int error = 0;
+	std::string failure;
+
+	for(std::size_t i=0; i<batch.size(); i++){
+		if((fsync(batch[i].descriptor) != 0) && (error == 0)) {
+			error = errno;
+			failure = "could not sync " + this->path + "/tmp/" + batch[i].name;
+		}
+
+		close(batch[i].descriptor);
+	}
+
+	//Only a wholly durable batch is delivered
+	std::size_t delivered = 0;
+
+	if(error == 0) {
+		for(; delivered<batch.size(); delivered++){
+			if(rename((this->path + "/tmp/" + batch[delivered].name).c_str(), (this->path + "/new/" + batch[delivered].name).c_str()) != 0) {
+				error = errno;
+				failure = "could not deliver " + batch[delivered].name;
+				break;
+			}
+		}
+	}
+
+	//Nothing would ever move what is left in tmp into new, so remove it
+	for(std::size_t i=delivered; i<batch.size(); i++){
+		unlink((this->path + "/tmp/" + batch[i].name).c_str());
+	}
+
+	this->discarded += batch.size() - delivered;
+
+	if(delivered > 0) {
+		std::uint64_t size = 0;
+		for(std::size_t i=0; i<delivered; i++){
+			size += batch[i].size;
+		}
+
+		this->messages += delivered;
+		this->bytes += size;
+
+		//One directory sync makes every rename in the batch durable
+		int directory = open((this->path + "/new").c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		int result = (directory < 0) ? -1 : fsync(directory);
+
+		if((result != 0) && (error == 0)) {
+			error = errno;
+			failure = "could not sync " + this->path + "/new";
+		}
+
+		if(directory >= 0) {
+			close(directory);
+		}
+
+		if(result == 0) {
+			this->syncs++;
+		}
+	}
+
+	if(error != 0) {
+		errno = error;
+		throw writeError(failure + " (" + std::to_string(batch.size() - delivered) + " messages of the batch discarded)");
+	}
+}
+
+std::string MailboxWriter::uniqueName() {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	char name[128];
+	snprintf(name, sizeof(name), "%ld.M%ldP%ldQ%llu.", (long)now.tv_sec, (long)now.tv_usec, (long)getpid(), (unsigned long long)this->sequence++);
+
+	return name + this->hostName;
+}
+
+void MailboxWriter::formatMbox(const std::string &from, const std::string &message, std::string &output) {
+	std::time_t now = time(NULL);
+	struct std::tm universalTime;
+	gmtime_r(&now, &universalTime);
+
+	char date[64];
+	std::size_t dateLength = strftime(date, sizeof(date), "%a %b %e %H:%M:%S %Y", &universalTime);
+
+	output.reserve(message.length() + (message.length() / 64) + from.length() + 64);
+	output.append("From ").append(from.empty() ? std::string("MAILER-DAEMON") : from).append(" ").append(date, dateLength).append("\n");
+
+	//Copy line by line, dropping the CR of each CRLF and escaping lines that would read as a From line
+	std::size_t start = 0;
+
+	while(start < message.length()) {
+		std::size_t end = message.find('\n', start);
+		std::size_t next = (end == std::string::npos) ? message.length() : end + 1;
+
+		if(end == std::string::npos) {
+			end = message.length();
+		}
+
+		std::size_t lineEnd = end;
+		if((lineEnd > start) && (message[lineEnd - 1] == '\r')) {
+			lineEnd--;
+		}
+
+		if(startsWithFrom(message.data() + start, lineEnd - start)) {
+			output.append(">");
+		}
+
+		output.append(message, start, lineEnd - start).append("\n");
+
+		start = next;
+	}
+
+	//A blank line separates messages
+	output.append("\n");
+}
+
+void MailboxWriter::recordStart() {
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if(!this->started) {
+		this->started = true;
+		this->firstWrite = std::chrono::steady_clock::now();
+	}
+}
+
+} /* namespace SimplyEmail */
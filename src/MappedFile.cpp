@@ -0,0 +1,62 @@
+/**
+ * \file MappedFile.cpp
+ *
+ * \brief Implementation file for read only memory mapped files
+ */
+
+#include "../lib/MappedFile.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace SimplyEmail {
+
+MappedFile::MappedFile(const std::string &filePath) {
+	this->data = NULL;
+	this->size = 0;
+
+	int descriptor = open(filePath.c_str(), O_RDONLY);
+	if(descriptor < 0) {
+		throw std::runtime_error("Error mapping file: could not open " + filePath);
+	}
+
+	struct stat status;
+	if(fstat(descriptor, &status) != 0) {
+		close(descriptor);
+		throw std::runtime_error("Error mapping file: could not stat " + filePath);
+	}
+
+	this->size = (std::size_t)status.st_size;
+
+	if(this->size > 0) {
+		void *mapping = mmap(NULL, this->size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+
+		if(mapping == MAP_FAILED) {
+			close(descriptor);
+			throw std::runtime_error("Error mapping file: could not map " + filePath);
+		}
+
+		this->data = static_cast<char*>(mapping);
+	}
+
+	//The mapping stays valid once the descriptor is closed
+	close(descriptor);
+}
+
+MappedFile::~MappedFile() {
+	if(this->data) {
+		munmap(this->data, this->size);
+	}
+}
+
+const char* MappedFile::getData() const {
+	return this->data;
+}
+
+std::size_t MappedFile::getSize() const {
+	return this->size;
+}
+
+} /* namespace SimplyEmail */
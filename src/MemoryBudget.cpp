@@ -0,0 +1,146 @@
+/**
+ * \file MemoryBudget.cpp
+ *
+ * \brief Implementation file for the byte budget of queued messages
+ */
+
+#include "../lib/MemoryBudget.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+namespace SimplyEmail {
+
+const int MemoryBudget::BLOCK = 0;
+const int MemoryBudget::FAIL = 1;
+
+MemoryBudget::MemoryBudget(std::size_t _softLimit, std::size_t _hardLimit, const std::string &_scratchDirectory, int _overflow) {
+	if(_softLimit > _hardLimit) {
+		_softLimit = _hardLimit;
+	}
+
+	this->softLimit = _softLimit;
+	this->hardLimit = _hardLimit;
+	this->scratchDirectory = _scratchDirectory;
+	this->overflow = _overflow;
+
+	this->used = 0;
+	this->spilledBytes = 0;
+	this->spilledMessages = 0;
+}
+
+void MemoryBudget::acquire(std::size_t bytes) {
+	if(bytes > this->hardLimit) {
+		throw std::runtime_error("Error queueing message: The message is larger than the memory budget's hard limit");
+	}
+
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while(this->used + bytes > this->hardLimit) {
+		std::size_t wanted = (this->used + bytes) - this->softLimit;
+
+		lock.unlock();
+		std::size_t freed = this->spillQueues(wanted);
+		lock.lock();
+
+		if(this->used + bytes <= this->hardLimit) {
+			break;
+		}
+
+		if(this->overflow == FAIL) {
+			throw std::runtime_error("Error queueing message: The memory budget is exhausted");
+		}
+
+		//Nothing left to spill, so wait for a send to finish; wake periodically as new messages may become spillable
+		if(freed == 0) {
+			this->released.wait_for(lock, std::chrono::milliseconds(100));
+		}
+	}
+
+	this->used += bytes;
+
+	if(this->used <= this->softLimit) {
+		return;
+	}
+
+	std::size_t excess = this->used - this->softLimit;
+	lock.unlock();
+
+	this->spillQueues(excess);
+}
+
+void MemoryBudget::release(std::size_t bytes) {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->used -= std::min(bytes, this->used);
+	}
+
+	this->released.notify_all();
+}
+
+void MemoryBudget::recordSpill(std::size_t bytes) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	this->spilledBytes += bytes;
+	this->spilledMessages++;
+}
+
+void MemoryBudget::registerSpillable(Spillable *spillable) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->spillables.push_back(spillable);
+}
+
+void MemoryBudget::unregisterSpillable(Spillable *spillable) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->spillables.erase(std::remove(this->spillables.begin(), this->spillables.end(), spillable), this->spillables.end());
+}
+
+std::size_t MemoryBudget::getUsed() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->used;
+}
+
+std::size_t MemoryBudget::getSoftLimit() const {
+	return this->softLimit;
+}
+
+std::size_t MemoryBudget::getHardLimit() const {
+	return this->hardLimit;
+}
+
+const std::string& MemoryBudget::getScratchDirectory() const {
+	return this->scratchDirectory;
+}
+
+std::uint64_t MemoryBudget::getSpilledBytes() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->spilledBytes;
+}
+
+std::uint64_t MemoryBudget::getSpilledMessages() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->spilledMessages;
+}
+
+std::size_t MemoryBudget::spillQueues(std::size_t bytes) {
+	if(this->scratchDirectory.empty()) {
+		return 0;
+	}
+
+	std::vector<Spillable*> targets;
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		targets = this->spillables;
+	}
+
+	std::size_t freed = 0;
+
+	for(std::size_t i=0; (i<targets.size()) && (freed < bytes); i++){
+		freed += targets[i]->spill(bytes - freed);
+	}
+
+	return freed;
+}
+
+} /* namespace SimplyEmail */
@@ -0,0 +1,254 @@
+/**
+ * \file Metrics.cpp
+ *
+ * \brief Implementation file for the library wide metrics registry
+ */
+
+#include "../lib/Metrics.h"
+
+#include <cstdio>
+#include <sstream>
+
+namespace SimplyEmail {
+
+const std::uint64_t LatencyHistogram::BUCKET_BOUNDS[LatencyHistogram::BUCKET_COUNT] = {
+	100, 250, 500,
+	1000, 2500, 5000,
+	10000, 25000, 50000,
+	100000, 250000, 500000,
+	1000000, 5000000
+};
+
+namespace {
+
+/**
+ * \brief Storage for every registry value
+ */
+struct Registry {
+	std::atomic<std::uint64_t> messagesSent;
+	std::atomic<std::uint64_t> messagesFailed[Metrics::FAILURE_CLASS_COUNT];
+	std::atomic<std::uint64_t> bytesEncoded;
+	std::atomic<std::uint64_t> bytesSent;
+	std::atomic<std::uint64_t> attachmentCacheHits;
+	std::atomic<std::int64_t> queueDepth;
+	std::atomic<std::int64_t> activeConnections;
+
+	LatencyHistogram encodeLatency;
+	LatencyHistogram sendLatency;
+
+	Registry() {
+		this->messagesSent.store(0);
+		for(unsigned int i=0; i<Metrics::FAILURE_CLASS_COUNT; i++){
+			this->messagesFailed[i].store(0);
+		}
+		this->bytesEncoded.store(0);
+		this->bytesSent.store(0);
+		this->attachmentCacheHits.store(0);
+		this->queueDepth.store(0);
+		this->activeConnections.store(0);
+	}
+};
+
+Registry& registry() {
+	// Constructed on first use so that metrics can be recorded from other static initializers
+	static Registry instance;
+	return instance;
+}
+
+HistogramSnapshot readHistogram(const LatencyHistogram &histogram) {
+	HistogramSnapshot toReturn;
+	histogram.read(toReturn.buckets, toReturn.count, toReturn.sum);
+	return toReturn;
+}
+
+/**
+ * \brief Writes microseconds as seconds, exactly and without trailing zeros
+ */
+void writeSeconds(std::ostringstream &stream, std::uint64_t micros) {
+	//A double streamed at the default six significant digits would round any sum past ten seconds
+	stream << (micros / 1000000);
+
+	std::uint64_t fraction = micros % 1000000;
+
+	if(fraction != 0) {
+		char digits[8];
+		std::snprintf(digits, sizeof(digits), ".%06u", (unsigned int)fraction);
+
+		std::size_t length = 7;
+		while(digits[length - 1] == '0') {
+			length--;
+		}
+
+		stream.write(digits, length);
+	}
+}
+
+void writeHistogram(std::ostringstream &stream, const std::string &name, const std::string &help, const HistogramSnapshot &histogram) {
+	stream	<< "# HELP " << name << ' ' << help << '\n'
+			<< "# TYPE " << name << " histogram\n";
+
+	std::uint64_t cumulative = 0;
+	for(unsigned int i=0; i<LatencyHistogram::BUCKET_COUNT; i++){
+		cumulative += histogram.buckets[i];
+		stream << name << "_bucket{le=\"";
+		writeSeconds(stream, LatencyHistogram::BUCKET_BOUNDS[i]);
+		stream << "\"} " << cumulative << '\n';
+	}
+
+	stream	<< name << "_bucket{le=\"+Inf\"} " << histogram.count << '\n'
+			<< name << "_sum ";
+	writeSeconds(stream, histogram.sum);
+	stream	<< '\n'
+			<< name << "_count " << histogram.count << '\n';
+}
+
+void writeScalar(std::ostringstream &stream, const std::string &name, const std::string &type, const std::string &help, long long value) {
+	stream	<< "# HELP " << name << ' ' << help << '\n'
+			<< "# TYPE " << name << ' ' << type << '\n'
+			<< name << ' ' << value << '\n';
+}
+
+} /* namespace */
+
+LatencyHistogram::LatencyHistogram() {
+	for(unsigned int i=0; i<=BUCKET_COUNT; i++){
+		this->buckets[i].store(0);
+	}
+	this->sum.store(0);
+}
+
+void LatencyHistogram::observe(std::uint64_t micros) {
+	unsigned int i = 0;
+	while((i < BUCKET_COUNT) && (micros > BUCKET_BOUNDS[i])){
+		i++;
+	}
+
+	this->buckets[i].fetch_add(1, std::memory_order_relaxed);
+	this->sum.fetch_add(micros, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::read(std::vector<std::uint64_t> &_buckets, std::uint64_t &_count, std::uint64_t &_sum) const {
+	_buckets.assign(BUCKET_COUNT + 1, 0);
+
+	// Derive the count from the buckets so that the +Inf bucket always equals the count
+	_count = 0;
+	for(unsigned int i=0; i<=BUCKET_COUNT; i++){
+		_buckets[i] = this->buckets[i].load(std::memory_order_relaxed);
+		_count += _buckets[i];
+	}
+
+	_sum = this->sum.load(std::memory_order_relaxed);
+}
+
+void LatencyHistogram::reset() {
+	for(unsigned int i=0; i<=BUCKET_COUNT; i++){
+		this->buckets[i].store(0, std::memory_order_relaxed);
+	}
+	this->sum.store(0, std::memory_order_relaxed);
+}
+
+const char* Metrics::failureClassName(int failureClass) {
+	static const char* names[FAILURE_CLASS_COUNT] = {"connect", "auth", "timeout", "rejected", "transfer", "other"};
+
+	if((failureClass < 0) || (failureClass >= FAILURE_CLASS_COUNT)){
+		return names[FAILURE_OTHER];
+	}
+
+	return names[failureClass];
+}
+
+void Metrics::recordSent(std::uint64_t bytes, std::uint64_t micros) {
+	registry().messagesSent.fetch_add(1, std::memory_order_relaxed);
+	registry().bytesSent.fetch_add(bytes, std::memory_order_relaxed);
+	registry().sendLatency.observe(micros);
+}
+
+void Metrics::recordFailed(int failureClass, std::uint64_t micros) {
+	if((failureClass < 0) || (failureClass >= FAILURE_CLASS_COUNT)){
+		failureClass = FAILURE_OTHER;
+	}
+
+	registry().messagesFailed[failureClass].fetch_add(1, std::memory_order_relaxed);
+	registry().sendLatency.observe(micros);
+}
+
+void Metrics::recordEncoded(std::uint64_t bytes, std::uint64_t micros) {
+	registry().bytesEncoded.fetch_add(bytes, std::memory_order_relaxed);
+	registry().encodeLatency.observe(micros);
+}
+
+void Metrics::recordAttachmentCacheHit() {
+	registry().attachmentCacheHits.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::adjustQueueDepth(std::int64_t delta) {
+	registry().queueDepth.fetch_add(delta, std::memory_order_relaxed);
+}
+
+void Metrics::adjustActiveConnections(std::int64_t delta) {
+	registry().activeConnections.fetch_add(delta, std::memory_order_relaxed);
+}
+
+MetricsSnapshot Metrics::snapshot() {
+	Registry &values = registry();
+	MetricsSnapshot toReturn;
+
+	toReturn.messagesSent = values.messagesSent.load(std::memory_order_relaxed);
+
+	toReturn.messagesFailed.resize(FAILURE_CLASS_COUNT);
+	for(unsigned int i=0; i<FAILURE_CLASS_COUNT; i++){
+		toReturn.messagesFailed[i] = values.messagesFailed[i].load(std::memory_order_relaxed);
+	}
+
+	toReturn.bytesEncoded = values.bytesEncoded.load(std::memory_order_relaxed);
+	toReturn.bytesSent = values.bytesSent.load(std::memory_order_relaxed);
+	toReturn.attachmentCacheHits = values.attachmentCacheHits.load(std::memory_order_relaxed);
+	toReturn.queueDepth = values.queueDepth.load(std::memory_order_relaxed);
+	toReturn.activeConnections = values.activeConnections.load(std::memory_order_relaxed);
+
+	toReturn.encodeLatency = readHistogram(values.encodeLatency);
+	toReturn.sendLatency = readHistogram(values.sendLatency);
+
+	return toReturn;
+}
+
+void Metrics::reset() {
+	Registry &values = registry();
+
+	values.messagesSent.store(0, std::memory_order_relaxed);
+	for(unsigned int i=0; i<FAILURE_CLASS_COUNT; i++){
+		values.messagesFailed[i].store(0, std::memory_order_relaxed);
+	}
+	values.bytesEncoded.store(0, std::memory_order_relaxed);
+	values.bytesSent.store(0, std::memory_order_relaxed);
+	values.attachmentCacheHits.store(0, std::memory_order_relaxed);
+
+	values.encodeLatency.reset();
+	values.sendLatency.reset();
+}
+
+std::string MetricsSnapshot::toPrometheus() const {
+	std::ostringstream stream;
+
+	writeScalar(stream, "simplyemail_messages_sent_total", "counter", "Messages accepted by the SMTP server.", this->messagesSent);
+
+	stream	<< "# HELP simplyemail_messages_failed_total Messages that could not be sent, by failure class.\n"
+			<< "# TYPE simplyemail_messages_failed_total counter\n";
+	for(unsigned int i=0; i<this->messagesFailed.size(); i++){
+		stream	<< "simplyemail_messages_failed_total{class=\"" << Metrics::failureClassName(i) << "\"} "
+				<< this->messagesFailed[i] << '\n';
+	}
+
+	writeScalar(stream, "simplyemail_encoded_bytes_total", "counter", "Bytes produced by message encoding.", this->bytesEncoded);
+	writeScalar(stream, "simplyemail_sent_bytes_total", "counter", "Payload bytes uploaded to SMTP servers.", this->bytesSent);
+	writeScalar(stream, "simplyemail_attachment_cache_hits_total", "counter", "Attachments served without re-encoding.", this->attachmentCacheHits);
+	writeScalar(stream, "simplyemail_queue_depth", "gauge", "Messages waiting in library queues.", this->queueDepth);
+	writeScalar(stream, "simplyemail_active_connections", "gauge", "SMTP connections currently initialized.", this->activeConnections);
+
+	writeHistogram(stream, "simplyemail_encode_duration_seconds", "Time spent encoding a message.", this->encodeLatency);
+	writeHistogram(stream, "simplyemail_send_duration_seconds", "Time spent transferring a message.", this->sendLatency);
+
+	return stream.str();
+}
+
+} /* namespace SimplyEmail */
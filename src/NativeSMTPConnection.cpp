@@ -0,0 +1,1258 @@
+/**
+ * \file NativeSMTPConnection.cpp
+ *
+ * \brief Implementation file for the SMTP client that pipelines commands over a non-blocking socket
+ */
+
+#include "../lib/NativeSMTPConnection.h"
+#include "../lib/Base64.h"
+#include "../lib/Metrics.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+namespace SimplyEmail {
+
+const int NativeSMTPConnection::STARTTLS_NEVER = 0;
+const int NativeSMTPConnection::STARTTLS_IF_OFFERED = 1;
+const int NativeSMTPConnection::STARTTLS_REQUIRED = 2;
+
+namespace {
+
+//Bytes of the message dot stuffed into the output at a time
+const std::size_t DATA_CHUNK = 16384;
+
+//How much output is buffered before the message stops being read
+const std::size_t OUTPUT_LIMIT = 65536;
+
+//CURL's default when no connect timeout is set
+const std::chrono::milliseconds DEFAULT_CONNECT_TIMEOUT(300000);
+
+bool startsWithNoCase(const std::string &text, std::size_t position, const char *prefix) {
+	std::size_t i = 0;
+
+	while(prefix[i] != '\0') {
+		if((position + i >= text.length()) || (std::toupper((unsigned char)text[position + i]) != prefix[i])) {
+			return false;
+		}
+		i++;
+	}
+
+	return true;
+}
+
+//Wraps an address in angle brackets unless it already has them, as CURL does
+std::string bracket(const std::string &address) {
+	if(!address.empty() && (address[0] == '<')) {
+		return address;
+	}
+
+	return "<" + address + ">";
+}
+
+//The first line of a reply, for error messages
+std::string firstLine(const std::string &text) {
+	return text.substr(0, text.find('\n'));
+}
+
+} /* namespace */
+
+NativeSMTPConnection::NativeSMTPConnection(const std::string &_address, const std::string &_username, const std::string &_password, SimplyEmail::SMTPEventLoop &_loop) : address(_address), username(_username), password(_password), loop(_loop) {
+	//Split smtp[s]://host[:port][/name] into its parts; IPv6 addresses are written in brackets
+	std::string rest;
+	std::string port;
+
+	if(startsWithNoCase(this->address, 0, "SMTPS://")) {
+		this->implicitTLS = true;
+		rest = this->address.substr(8);
+		port = "465";
+	}
+	else if(startsWithNoCase(this->address, 0, "SMTP://")) {
+		this->implicitTLS = false;
+		rest = this->address.substr(7);
+		port = "25";
+	}
+	else {
+		throw std::runtime_error("Error creating SMTP connection: Address must start with smtp:// or smtps://");
+	}
+
+	std::size_t slash = rest.find('/');
+	std::string authority = rest.substr(0, slash);
+
+	//CURL sends the path as the EHLO name, or localhost without one
+	this->localName = ((slash != std::string::npos) && (slash + 1 < rest.length())) ? rest.substr(slash + 1) : "localhost";
+
+	std::size_t colon;
+
+	if(!authority.empty() && (authority[0] == '[')) {
+		std::size_t close = authority.find(']');
+		if(close == std::string::npos) {
+			throw std::runtime_error("Error creating SMTP connection: Unterminated IPv6 address in " + this->address);
+		}
+
+		this->host = authority.substr(1, close - 1);
+		colon = (close + 1 < authority.length()) ? close + 1 : std::string::npos;
+
+		if((colon != std::string::npos) && (authority[colon] != ':')) {
+			throw std::runtime_error("Error creating SMTP connection: Malformed address " + this->address);
+		}
+	}
+	else {
+		colon = authority.find(':');
+		this->host = authority.substr(0, colon);
+	}
+
+	if(colon != std::string::npos) {
+		port = authority.substr(colon + 1);
+
+		if(port.empty() || (port.find_first_not_of("0123456789") != std::string::npos) || (std::atoi(port.c_str()) > 65535)) {
+			throw std::runtime_error("Error creating SMTP connection: Invalid port in " + this->address);
+		}
+	}
+
+	if(this->host.empty()) {
+		throw std::runtime_error("Error creating SMTP connection: No host in " + this->address);
+	}
+
+	//Resolve here, as the loop thread must never block
+	struct addrinfo hints;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo *results = NULL;
+	int resolved = getaddrinfo(this->host.c_str(), port.c_str(), &hints, &results);
+
+	if(resolved != 0) {
+		throw std::runtime_error("Error creating SMTP connection: Unable to resolve " + this->host + ": " + gai_strerror(resolved));
+	}
+
+	for(struct addrinfo *result = results; result != NULL; result = result->ai_next){
+		struct sockaddr_storage storage;
+		std::memset(&storage, 0, sizeof(storage));
+		std::memcpy(&storage, result->ai_addr, result->ai_addrlen);
+
+		this->addresses.push_back(storage);
+		this->addressLengths.push_back(result->ai_addrlen);
+	}
+
+	freeaddrinfo(results);
+
+	this->startTLS = STARTTLS_IF_OFFERED;
+	this->verbose = false;
+	this->suppression = NULL;
+	this->pipelining = false;
+	this->encrypted = false;
+	this->sizeLimit = 0;
+	this->outstanding = 0;
+
+	this->state = CLOSED;
+	this->socket = -1;
+	this->tls = NULL;
+	this->resumable = NULL;
+	this->events = 0;
+	this->tlsWantsWrite = false;
+	this->addressIndex = 0;
+	this->outputOffset = 0;
+	this->offersPipelining = false;
+	this->offersStartTLS = false;
+	this->offersSize = false;
+	this->offeredSize = 0;
+	this->offersAuth = false;
+	this->offersPlain = false;
+	this->offersLogin = false;
+	this->authenticated = false;
+	this->authStep = 0;
+	this->repliesRead = 0;
+	this->refusedCode = 0;
+	this->lastReplyCode = 0;
+	this->dataOffset = 0;
+	this->lastBytes[0] = '\0';
+	this->lastBytes[1] = '\0';
+	this->timer = TimerWheel::INVALID_HANDLE;
+
+	this->loop.connections++;
+	Metrics::adjustActiveConnections(1);
+}
+
+NativeSMTPConnection::~NativeSMTPConnection() {
+	this->flush();
+
+	//Quit on the loop thread, which is the only one touching the session. A message that finished just before flush()
+	//returned may still have its follow up pump() queued, so the connection is only released by a task queued after it
+	std::promise<void> finished;
+	this->loop.post([this, &finished]() {
+		this->shutdown();
+
+		this->loop.post([&finished]() {
+			finished.set_value();
+		});
+	});
+
+	finished.get_future().wait();
+
+	this->loop.connections--;
+	Metrics::adjustActiveConnections(-1);
+}
+
+void NativeSMTPConnection::send(const SimplyEmail::Email &email) {
+	this->sendAsync(email).get();
+}
+
+void NativeSMTPConnection::send(const SimplyEmail::Email &email, std::chrono::steady_clock::time_point deadline) {
+	this->sendAsync(email, deadline).get();
+}
+
+std::future<void> NativeSMTPConnection::sendAsync(const SimplyEmail::Email &email) {
+	return this->sendAsync(email, std::chrono::steady_clock::time_point::max());
+}
+
+std::future<void> NativeSMTPConnection::sendAsync(const SimplyEmail::Email &email, std::chrono::steady_clock::time_point deadline) {
+	std::vector<const std::string*> envelope;
+	SMTPConnection::buildEnvelope(email, this->suppression, envelope);
+
+	if(envelope.empty()) {
+		throw std::runtime_error("Error sending email: Every recipient is suppressed");
+	}
+
+	std::unique_ptr<Job> job(new Job());
+	job->from = email.getFrom();
+	job->deadline = deadline;
+
+	job->recipients.reserve(envelope.size());
+	for(std::size_t i=0; i<envelope.size(); i++){
+		job->recipients.push_back(*envelope[i]);
+	}
+
+	//Encode on the caller's thread, so the loop only moves bytes
+	job->payload = email.encodeSegments();
+
+	std::future<void> toReturn = job->done.get_future();
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->queue.push_back(std::move(job));
+		this->outstanding++;
+	}
+
+	this->loop.post([this]() {
+		this->pump();
+	});
+
+	return toReturn;
+}
+
+void NativeSMTPConnection::flush() {
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while(this->outstanding > 0) {
+		this->idle.wait(lock);
+	}
+}
+
+void NativeSMTPConnection::setTimeouts(const SimplyEmail::SendTimeouts &_timeouts) {
+	this->timeouts = _timeouts;
+}
+
+const SimplyEmail::SendTimeouts& NativeSMTPConnection::getTimeouts() const {
+	return this->timeouts;
+}
+
+void NativeSMTPConnection::setStartTLS(int mode) {
+	this->startTLS = mode;
+}
+
+int NativeSMTPConnection::getStartTLS() const {
+	return this->startTLS;
+}
+
+void NativeSMTPConnection::setVerbose(bool _verbose) {
+	this->verbose = _verbose;
+}
+
+bool NativeSMTPConnection::getVerbose() const {
+	return this->verbose;
+}
+
+void NativeSMTPConnection::setSuppressionList(const SimplyEmail::SuppressionList *list) {
+	this->suppression = list;
+}
+
+const SimplyEmail::SuppressionList* NativeSMTPConnection::getSuppressionList() const {
+	return this->suppression;
+}
+
+bool NativeSMTPConnection::isPipelining() const {
+	return this->pipelining.load();
+}
+
+bool NativeSMTPConnection::isEncrypted() const {
+	return this->encrypted.load();
+}
+
+std::uint64_t NativeSMTPConnection::getSizeLimit() const {
+	return this->sizeLimit.load();
+}
+
+const std::string& NativeSMTPConnection::getAddress() const {
+	return this->address;
+}
+
+const std::string& NativeSMTPConnection::getUsername() const {
+	return this->username;
+}
+
+void NativeSMTPConnection::pump() {
+	//A message is already being sent or the session opened for one, or the last is being reset
+	if(this->current || ((this->state != READY) && (this->state != CLOSED))) {
+		return;
+	}
+
+	//Notice a server that closed the idle session before sending on it
+	if((this->state == READY) && !this->receive()) {
+		if(this->current) {
+			return;
+		}
+	}
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	while(true) {
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+
+			if(this->queue.empty()) {
+				return;
+			}
+
+			this->current = std::move(this->queue.front());
+			this->queue.pop_front();
+		}
+
+		this->current->started = now;
+		this->lastReplyCode = 0;
+
+		if(this->timeouts.total.count() > 0) {
+			this->current->deadline = std::min(this->current->deadline, now + this->timeouts.total);
+		}
+
+		if(this->current->deadline > now) {
+			break;
+		}
+
+		this->finish(std::make_exception_ptr(SMTPTimeout("Error sending email: Deadline passed before sending started (timed out after 0 ms)", CURLE_OPERATION_TIMEDOUT, 0, std::chrono::milliseconds(0))), Metrics::FAILURE_TIMEOUT);
+	}
+
+	if(this->state == CLOSED) {
+		this->connect();
+	}
+	else {
+		this->startTransaction();
+	}
+}
+
+void NativeSMTPConnection::connect() {
+	std::chrono::milliseconds limit = (this->timeouts.connect.count() > 0) ? this->timeouts.connect : DEFAULT_CONNECT_TIMEOUT;
+
+	this->phaseDeadline = std::chrono::steady_clock::now() + limit;
+	this->addressIndex = 0;
+	this->offersPipelining = false;
+	this->offersStartTLS = false;
+	this->offersSize = false;
+	this->offeredSize = 0;
+	this->offersAuth = false;
+	this->offersPlain = false;
+	this->offersLogin = false;
+	this->authenticated = false;
+	this->encrypted = false;
+
+	this->connectNext(0);
+}
+
+void NativeSMTPConnection::connectNext(int lastError) {
+	while(this->addressIndex < this->addresses.size()) {
+		const struct sockaddr_storage &target = this->addresses[this->addressIndex];
+
+		int descriptor = ::socket(target.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+		if(descriptor >= 0) {
+			//Commands are written whole, so there is nothing for Nagle's algorithm to gather
+			int on = 1;
+			setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+			if((::connect(descriptor, reinterpret_cast<const struct sockaddr*>(&target), this->addressLengths[this->addressIndex]) == 0) || (errno == EINPROGRESS)) {
+				this->socket = descriptor;
+				this->state = CONNECTING;
+				this->lastActivity = std::chrono::steady_clock::now();
+
+				if(!this->updateEvents()) {
+					return;
+				}
+
+				this->updateTimer();
+				return;
+			}
+
+			lastError = errno;
+			::close(descriptor);
+		}
+		else {
+			lastError = errno;
+		}
+
+		this->addressIndex++;
+	}
+
+	this->fail("Unable to connect to " + this->host + ((lastError != 0) ? std::string(": ") + std::strerror(lastError) : std::string()), CURLE_COULDNT_CONNECT, 0);
+}
+
+void NativeSMTPConnection::beginHandshake() {
+	this->tls = SSL_new(this->loop.tls);
+
+	if(!this->tls || (SSL_set_fd(this->tls, this->socket) != 1)) {
+		this->fail("Unable to start TLS", CURLE_SSL_CONNECT_ERROR, this->lastReplyCode);
+		return;
+	}
+
+	//Check the certificate against the host name, or the address when the host is one
+	unsigned char binary[sizeof(struct in6_addr)];
+	bool numeric = (inet_pton(AF_INET, this->host.c_str(), binary) == 1) || (inet_pton(AF_INET6, this->host.c_str(), binary) == 1);
+
+	if(numeric) {
+		X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(this->tls), this->host.c_str());
+	}
+	else {
+		SSL_set_tlsext_host_name(this->tls, this->host.c_str());
+		SSL_set1_host(this->tls, this->host.c_str());
+	}
+
+	if(this->resumable) {
+		SSL_set_session(this->tls, this->resumable);
+	}
+
+	SSL_set_app_data(this->tls, this);
+
+	SSL_set_connect_state(this->tls);
+
+	this->state = HANDSHAKE;
+	this->continueHandshake();
+}
+
+void NativeSMTPConnection::continueHandshake() {
+	int result = SSL_do_handshake(this->tls);
+
+	if(result == 1) {
+		this->encrypted = true;
+		this->tlsWantsWrite = false;
+		this->lastActivity = std::chrono::steady_clock::now();
+
+		//After STARTTLS the client greets again, and forgets what it learned before (RFC 3207 section 4.2)
+		if(this->implicitTLS) {
+			this->state = GREETING;
+		}
+		else {
+			this->offersPipelining = false;
+			this->offersStartTLS = false;
+			this->offersSize = false;
+			this->offeredSize = 0;
+			this->offersAuth = false;
+			this->offersPlain = false;
+			this->offersLogin = false;
+
+			this->command("EHLO " + this->localName);
+			this->state = EHLO;
+		}
+
+		//The greeting may have arrived with the end of the handshake, and OpenSSL may hold it already
+		if(this->receive()) {
+			this->transmit();
+		}
+		return;
+	}
+
+	int error = SSL_get_error(this->tls, result);
+
+	if((error == SSL_ERROR_WANT_READ) || (error == SSL_ERROR_WANT_WRITE)) {
+		this->tlsWantsWrite = (error == SSL_ERROR_WANT_WRITE);
+		this->updateEvents();
+		return;
+	}
+
+	long verified = SSL_get_verify_result(this->tls);
+
+	if(verified != X509_V_OK) {
+		this->fail(std::string("TLS certificate verification failed: ") + X509_verify_cert_error_string(verified), CURLE_PEER_FAILED_VERIFICATION, this->lastReplyCode);
+	}
+	else {
+		this->fail("TLS handshake failed", CURLE_SSL_CONNECT_ERROR, this->lastReplyCode);
+	}
+}
+
+void NativeSMTPConnection::handleEvents(std::uint32_t ready) {
+	if(this->state == CONNECTING) {
+		int error = 0;
+		socklen_t length = sizeof(error);
+
+		if((getsockopt(this->socket, SOL_SOCKET, SO_ERROR, &error, &length) != 0) || (error != 0)) {
+			//Try the host's next address
+			::close(this->socket);
+			this->socket = -1;
+			this->events = 0;
+			this->addressIndex++;
+
+			this->connectNext(error);
+			return;
+		}
+
+		if(this->implicitTLS) {
+			this->beginHandshake();
+		}
+		else {
+			this->state = GREETING;
+			this->updateEvents();
+		}
+
+		return;
+	}
+
+	if(this->state == HANDSHAKE) {
+		this->continueHandshake();
+		return;
+	}
+
+	if((ready & EPOLLERR) != 0) {
+		int error = 0;
+		socklen_t length = sizeof(error);
+		getsockopt(this->socket, SOL_SOCKET, SO_ERROR, &error, &length);
+
+		this->fail(std::string("Connection failed: ") + std::strerror(error), CURLE_RECV_ERROR, this->lastReplyCode);
+		return;
+	}
+
+	//Level triggered, so whichever way the socket is ready both directions are tried; TLS may need either for both
+	if(this->receive()) {
+		this->transmit();
+	}
+}
+
+void NativeSMTPConnection::handleTimeout() {
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	if(this->current && (now >= this->current->deadline)) {
+		this->timeOut("Message not sent in time");
+		return;
+	}
+
+	if((this->state != CLOSED) && (this->state < READY) && (now >= this->phaseDeadline)) {
+		this->timeOut("Session not ready in time");
+		return;
+	}
+
+	if((this->state != CLOSED) && (this->state != READY) && (this->timeouts.lowSpeedLimit > 0) && (this->timeouts.lowSpeedTime.count() > 0) && (now >= this->lastActivity + this->timeouts.lowSpeedTime)) {
+		this->timeOut("Server stalled");
+		return;
+	}
+
+	this->updateTimer();
+}
+
+bool NativeSMTPConnection::receive() {
+	char buffer[16384];
+	bool ended = false;
+
+	while(true) {
+		long received = this->readSome(buffer, sizeof(buffer));
+
+		//Act on the replies that came before the connection closed, such as the last one before a 421
+		if(received < 0) {
+			ended = true;
+			break;
+		}
+
+		if(received == 0) {
+			break;
+		}
+
+		this->input.append(buffer, received);
+		this->lastActivity = std::chrono::steady_clock::now();
+	}
+
+	std::size_t end;
+
+	while((end = this->input.find('\n')) != std::string::npos) {
+		std::size_t length = ((end > 0) && (this->input[end - 1] == '\r')) ? end - 1 : end;
+
+		if((length < 3) || !std::isdigit((unsigned char)this->input[0]) || !std::isdigit((unsigned char)this->input[1]) || !std::isdigit((unsigned char)this->input[2])) {
+			this->fail("Unexpected reply from server", CURLE_WEIRD_SERVER_REPLY, this->lastReplyCode);
+			return false;
+		}
+
+		if(this->verbose) {
+			std::fputs("< ", stderr);
+			std::fwrite(this->input.data(), 1, length, stderr);
+			std::fputc('\n', stderr);
+		}
+
+		int code = (this->input[0] - '0') * 100 + (this->input[1] - '0') * 10 + (this->input[2] - '0');
+		bool last = (length == 3) || (this->input[3] != '-');
+
+		if(length > 4) {
+			this->replyText.append(this->input, 4, length - 4);
+		}
+		this->replyText.push_back('\n');
+
+		this->input.erase(0, end + 1);
+
+		if(!last) {
+			continue;
+		}
+
+		std::string text;
+		text.swap(this->replyText);
+		this->lastReplyCode = code;
+
+		if(!this->handleReply(code, text)) {
+			return false;
+		}
+
+		//Anything sent before the TLS handshake cannot be trusted after it (RFC 3207 section 4.2)
+		if(this->state == HANDSHAKE) {
+			this->input.clear();
+			return true;
+		}
+	}
+
+	if(ended) {
+		this->fail("Connection closed by server", CURLE_RECV_ERROR, this->lastReplyCode);
+		return false;
+	}
+
+	return true;
+}
+
+bool NativeSMTPConnection::transmit() {
+	while(true) {
+		if(this->outputOffset == this->output.length()) {
+			this->output.clear();
+			this->outputOffset = 0;
+
+			if(this->state == DATA) {
+				this->fillData();
+			}
+
+			if(this->output.empty()) {
+				break;
+			}
+		}
+
+		long sent = this->writeSome(this->output.data() + this->outputOffset, this->output.length() - this->outputOffset);
+
+		if(sent < 0) {
+			this->fail("Connection lost while sending", CURLE_SEND_ERROR, this->lastReplyCode);
+			return false;
+		}
+
+		if(sent == 0) {
+			break;
+		}
+
+		this->outputOffset += sent;
+		this->lastActivity = std::chrono::steady_clock::now();
+	}
+
+	return this->updateEvents();
+}
+
+long NativeSMTPConnection::readSome(char *buffer, std::size_t length) {
+	if(this->tls) {
+		int received = SSL_read(this->tls, buffer, (int)length);
+
+		if(received > 0) {
+			return received;
+		}
+
+		int error = SSL_get_error(this->tls, received);
+
+		if(error == SSL_ERROR_WANT_READ) {
+			return 0;
+		}
+
+		if(error == SSL_ERROR_WANT_WRITE) {
+			this->tlsWantsWrite = true;
+			return 0;
+		}
+
+		return -1;
+	}
+
+	ssize_t received = ::recv(this->socket, buffer, length, 0);
+
+	if(received > 0) {
+		return received;
+	}
+
+	if((received < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) {
+		return 0;
+	}
+
+	return -1;
+}
+
+long NativeSMTPConnection::writeSome(const char *data, std::size_t length) {
+	if(this->tls) {
+		int sent = SSL_write(this->tls, data, (int)std::min<std::size_t>(length, 1 << 30));
+
+		if(sent > 0) {
+			this->tlsWantsWrite = false;
+			return sent;
+		}
+
+		int error = SSL_get_error(this->tls, sent);
+
+		if((error == SSL_ERROR_WANT_READ) || (error == SSL_ERROR_WANT_WRITE)) {
+			this->tlsWantsWrite = (error == SSL_ERROR_WANT_WRITE);
+			return 0;
+		}
+
+		return -1;
+	}
+
+	ssize_t sent = ::send(this->socket, data, length, MSG_NOSIGNAL);
+
+	if(sent >= 0) {
+		return sent;
+	}
+
+	if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+		return 0;
+	}
+
+	return -1;
+}
+
+bool NativeSMTPConnection::handleReply(int code, const std::string &text) {
+	switch(this->state) {
+	case GREETING:
+		if(code != 220) {
+			this->fail("Server refused the session with " + firstLine(text), CURLE_WEIRD_SERVER_REPLY, code);
+			return false;
+		}
+
+		this->command("EHLO " + this->localName);
+		this->state = EHLO;
+		return true;
+
+	case EHLO:
+	case HELO:
+		return this->handleGreeted(code, text);
+
+	case STARTTLS:
+		if(code == 220) {
+			this->beginHandshake();
+			return this->state != CLOSED;
+		}
+
+		if(this->startTLS == STARTTLS_REQUIRED) {
+			this->fail("Server refused STARTTLS", CURLE_USE_SSL_FAILED, code);
+			return false;
+		}
+
+		return this->afterGreeted();
+
+	case AUTH:
+		if((this->authStep == 1) && (code == 334)) {
+			this->command(Base64::encode(this->username), true);
+			this->authStep = 2;
+			return true;
+		}
+
+		if((this->authStep == 2) && (code == 334)) {
+			this->command(Base64::encode(this->password), true);
+			this->authStep = 3;
+			return true;
+		}
+
+		if(((this->authStep == 0) || (this->authStep == 3)) && (code == 235)) {
+			this->authenticated = true;
+			return this->afterGreeted();
+		}
+
+		this->fail("Authentication failed", CURLE_LOGIN_DENIED, code);
+		return false;
+
+	case ENVELOPE:
+		return this->handleEnvelopeReply(code, text);
+
+	case DATA_REPLY:
+		//The session stays usable whether or not the message was taken
+		this->state = READY;
+
+		if(code == 250) {
+			this->finish(std::exception_ptr(), 0);
+		}
+		else {
+			this->reject("Message refused with " + firstLine(text), CURLE_WEIRD_SERVER_REPLY, code);
+		}
+
+		this->next();
+		return true;
+
+	case RSET:
+		this->state = READY;
+		this->next();
+		return true;
+
+	default:
+		//A reply nothing asked for, such as a 421 closing the session or a refusal cutting the data short
+		this->fail("Unexpected reply " + firstLine(text), CURLE_WEIRD_SERVER_REPLY, code);
+		return false;
+	}
+}
+
+bool NativeSMTPConnection::handleGreeted(int code, const std::string &text) {
+	if(code / 100 != 2) {
+		//Servers without ESMTP refuse EHLO; try HELO as CURL does
+		if(this->state == EHLO) {
+			this->command("HELO " + this->localName);
+			this->state = HELO;
+			return true;
+		}
+
+		this->fail("Server refused HELO with " + firstLine(text), CURLE_REMOTE_ACCESS_DENIED, code);
+		return false;
+	}
+
+	//The first line greets; each further line names an extension
+	std::size_t position = text.find('\n');
+
+	while((position != std::string::npos) && (position + 1 < text.length())) {
+		position++;
+
+		std::size_t end = text.find('\n', position);
+		std::string line = text.substr(position, end - position);
+
+		if(startsWithNoCase(line, 0, "PIPELINING")) {
+			this->offersPipelining = true;
+		}
+		else if(startsWithNoCase(line, 0, "STARTTLS")) {
+			this->offersStartTLS = true;
+		}
+		else if(startsWithNoCase(line, 0, "SIZE") && ((line.length() == 4) || (line[4] == ' '))) {
+			//A bare SIZE, or SIZE 0, takes declared sizes without setting a limit
+			this->offersSize = true;
+			this->offeredSize = (line.length() > 5) ? std::strtoull(line.c_str() + 5, NULL, 10) : 0;
+		}
+		else if(startsWithNoCase(line, 0, "AUTH") && (line.length() > 4) && ((line[4] == ' ') || (line[4] == '='))) {
+			this->offersAuth = true;
+
+			std::istringstream mechanisms(line.substr(5));
+			std::string mechanism;
+
+			while(mechanisms >> mechanism) {
+				if(startsWithNoCase(mechanism, 0, "PLAIN") && (mechanism.length() == 5)) {
+					this->offersPlain = true;
+				}
+				else if(startsWithNoCase(mechanism, 0, "LOGIN") && (mechanism.length() == 5)) {
+					this->offersLogin = true;
+				}
+			}
+		}
+
+		position = end;
+	}
+
+	if(!this->tls && !this->implicitTLS && (this->startTLS != STARTTLS_NEVER)) {
+		if(this->offersStartTLS) {
+			this->command("STARTTLS");
+			this->state = STARTTLS;
+			return true;
+		}
+
+		if(this->startTLS == STARTTLS_REQUIRED) {
+			this->fail("Server does not offer STARTTLS", CURLE_USE_SSL_FAILED, code);
+			return false;
+		}
+	}
+
+	return this->afterGreeted();
+}
+
+bool NativeSMTPConnection::afterGreeted() {
+	if(!this->username.empty() && !this->authenticated && this->offersAuth) {
+		if(this->offersPlain) {
+			std::string credentials;
+			credentials.push_back('\0');
+			credentials.append(this->username);
+			credentials.push_back('\0');
+			credentials.append(this->password);
+
+			this->command("AUTH PLAIN " + Base64::encode(credentials), true);
+			this->authStep = 0;
+		}
+		else if(this->offersLogin) {
+			this->command("AUTH LOGIN");
+			this->authStep = 1;
+		}
+		else {
+			this->fail("Server offers no supported authentication mechanism", CURLE_LOGIN_DENIED, this->lastReplyCode);
+			return false;
+		}
+
+		this->state = AUTH;
+		return true;
+	}
+
+	this->pipelining = this->offersPipelining;
+	this->sizeLimit = this->offersSize ? this->offeredSize : 0;
+	this->state = READY;
+
+	if(this->current) {
+		this->startTransaction();
+	}
+	else {
+		this->updateTimer();
+	}
+
+	return this->state != CLOSED;
+}
+
+void NativeSMTPConnection::startTransaction() {
+	const Job &job = *this->current;
+
+	//The server would refuse the message at the end of the upload, or at MAIL, so it is not offered at all
+	if(this->offersSize && (this->offeredSize > 0) && (job.payload.getSize() > this->offeredSize)) {
+		std::ostringstream oss;
+		oss<<"Message of " << job.payload.getSize() << " bytes is over the server's SIZE limit of " << this->offeredSize << " bytes";
+
+		this->reject(oss.str(), CURLE_FILESIZE_EXCEEDED, 0);
+		this->next();
+		return;
+	}
+
+	this->state = ENVELOPE;
+	this->repliesRead = 0;
+	this->refusedCode = 0;
+	this->refusedText.clear();
+
+	//With PIPELINING the whole envelope and DATA go in one write, and the replies come back in one read
+	if(this->offersSize) {
+		std::ostringstream mail;
+		mail<<"MAIL FROM:" << bracket(job.from) << " SIZE=" << job.payload.getSize();
+		this->command(mail.str());
+	}
+	else {
+		this->command("MAIL FROM:" + bracket(job.from));
+	}
+
+	if(this->offersPipelining) {
+		for(std::size_t i=0; i<job.recipients.size(); i++){
+			this->command("RCPT TO:" + bracket(job.recipients[i]));
+		}
+
+		this->command("DATA");
+	}
+
+	this->updateTimer();
+	this->transmit();
+}
+
+bool NativeSMTPConnection::handleEnvelopeReply(int code, const std::string &text) {
+	const Job &job = *this->current;
+	std::size_t index = this->repliesRead++;
+	std::size_t recipientCount = job.recipients.size();
+
+	//MAIL, then one RCPT per recipient, then DATA
+	bool accepted = (index <= recipientCount) ? (code / 100 == 2) : (code == 354);
+
+	if(!accepted && (this->refusedCode == 0)) {
+		this->refusedCode = code;
+
+		if(index == 0) {
+			this->refusedText = "Sender " + bracket(job.from) + " refused with " + firstLine(text);
+		}
+		else if(index <= recipientCount) {
+			this->refusedText = "Recipient " + bracket(job.recipients[index - 1]) + " refused with " + firstLine(text);
+		}
+		else {
+			this->refusedText = "DATA refused with " + firstLine(text);
+		}
+	}
+
+	if(!this->offersPipelining && (this->refusedCode == 0) && (index <= recipientCount)) {
+		this->command((index < recipientCount) ? "RCPT TO:" + bracket(job.recipients[index]) : std::string("DATA"));
+		return true;
+	}
+
+	//Wait for the rest of the pipelined replies
+	if(this->offersPipelining && (index <= recipientCount)) {
+		return true;
+	}
+
+	if(this->refusedCode == 0) {
+		this->state = DATA;
+		this->dataOffset = 0;
+		this->lastBytes[0] = '\0';
+		this->lastBytes[1] = '\0';
+
+		return true;
+	}
+
+	//Like CURL, every recipient must be accepted for the message to be sent
+	this->reject(this->refusedText, CURLE_SEND_ERROR, this->refusedCode);
+
+	if(code == 354) {
+		//The server wants the message and only an end of data would stop it, which would send an empty one
+		this->close();
+		this->next();
+		return false;
+	}
+
+	this->command("RSET");
+	this->state = RSET;
+
+	return true;
+}
+
+void NativeSMTPConnection::fillData() {
+	const SimplyEmail::EncodedEmail &payload = this->current->payload;
+	char chunk[DATA_CHUNK];
+
+	while((this->output.length() < OUTPUT_LIMIT) && (this->dataOffset < payload.getSize())) {
+		std::size_t length = payload.read(this->dataOffset, chunk, sizeof(chunk));
+		this->dataOffset += length;
+
+		//Double a period that starts a line. Lines are taken to end at any LF, as many servers end them at a bare LF
+		//too, so no line of the message can end the data early
+		if((this->lastBytes[1] == '\n') || (this->dataOffset == length)) {
+			if(chunk[0] == '.') {
+				this->output.push_back('.');
+			}
+		}
+
+		std::size_t runStart = 0;
+		std::size_t position = 0;
+		const void *found;
+
+		while((found = std::memchr(chunk + position, '\n', length - position)) != NULL) {
+			position = static_cast<const char*>(found) - chunk + 1;
+
+			if((position < length) && (chunk[position] == '.')) {
+				this->output.append(chunk + runStart, position - runStart);
+				this->output.push_back('.');
+				runStart = position;
+			}
+		}
+
+		this->output.append(chunk + runStart, length - runStart);
+
+		this->lastBytes[0] = (length > 1) ? chunk[length - 2] : this->lastBytes[1];
+		this->lastBytes[1] = chunk[length - 1];
+	}
+
+	if(this->dataOffset == payload.getSize()) {
+		bool endsWithCRLF = (this->lastBytes[0] == '\r') && (this->lastBytes[1] == '\n');
+		this->output.append(endsWithCRLF ? ".\r\n" : "\r\n.\r\n");
+		this->state = DATA_REPLY;
+	}
+}
+
+void NativeSMTPConnection::command(const std::string &line, bool secret) {
+	if(this->verbose) {
+		std::fprintf(stderr, "> %s\n", secret ? "(credentials)" : line.c_str());
+	}
+
+	this->output.append(line);
+	this->output.append("\r\n");
+}
+
+bool NativeSMTPConnection::updateEvents() {
+	std::uint32_t wanted = EPOLLOUT;
+
+	if(this->state != CONNECTING) {
+		bool writing = (this->outputOffset < this->output.length()) || (this->state == DATA) || this->tlsWantsWrite;
+		wanted = EPOLLIN | (writing ? (std::uint32_t)EPOLLOUT : 0);
+	}
+
+	if(wanted == this->events) {
+		return true;
+	}
+
+	if(!this->loop.watch(this->socket, wanted, this, this->events != 0)) {
+		this->fail(std::string("Unable to watch the socket: ") + std::strerror(errno), CURLE_COULDNT_CONNECT, this->lastReplyCode);
+		return false;
+	}
+
+	this->events = wanted;
+	return true;
+}
+
+void NativeSMTPConnection::updateTimer() {
+	std::chrono::steady_clock::time_point due = std::chrono::steady_clock::time_point::max();
+
+	if(this->current) {
+		due = std::min(due, this->current->deadline);
+	}
+
+	if((this->state != CLOSED) && (this->state < READY)) {
+		due = std::min(due, this->phaseDeadline);
+	}
+
+	if((this->state != CLOSED) && (this->state != READY) && (this->timeouts.lowSpeedLimit > 0) && (this->timeouts.lowSpeedTime.count() > 0)) {
+		due = std::min(due, this->lastActivity + this->timeouts.lowSpeedTime);
+	}
+
+	if(due == std::chrono::steady_clock::time_point::max()) {
+		this->loop.unschedule(this->timer);
+	}
+	else {
+		this->loop.schedule(this, this->timer, due);
+	}
+}
+
+void NativeSMTPConnection::finish(std::exception_ptr error, int failureClass) {
+	std::unique_ptr<Job> job(std::move(this->current));
+	std::uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - job->started).count();
+
+	if(error) {
+		Metrics::recordFailed(failureClass, elapsed);
+		job->done.set_exception(error);
+	}
+	else {
+		Metrics::recordSent(job->payload.getSize(), elapsed);
+		job->done.set_value();
+	}
+
+	this->updateTimer();
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->outstanding--;
+	}
+
+	this->idle.notify_all();
+}
+
+void NativeSMTPConnection::reject(const std::string &message, int curlCode, int replyCode) {
+	std::ostringstream oss;
+	oss<<"Error sending email: " << message;
+
+	if(replyCode != 0) {
+		oss<<" (last SMTP reply " << replyCode << ")";
+	}
+
+	int failureClass = SMTPConnection::classifyFailure((CURLcode)curlCode);
+
+	this->finish(std::make_exception_ptr(SMTPError(oss.str(), curlCode, replyCode, failureClass)), failureClass);
+}
+
+void NativeSMTPConnection::timeOut(const std::string &message) {
+	//The message may already have failed, with the session stalling on the RSET after it
+	if(this->current) {
+		std::chrono::milliseconds elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - this->current->started);
+
+		std::ostringstream oss;
+		oss<<"Error sending email: " << message;
+
+		if(this->lastReplyCode != 0) {
+			oss<<" (last SMTP reply " << this->lastReplyCode << ")";
+		}
+
+		oss<<" (timed out after " << elapsed.count() << " ms)";
+
+		this->finish(std::make_exception_ptr(SMTPTimeout(oss.str(), CURLE_OPERATION_TIMEDOUT, this->lastReplyCode, elapsed)), Metrics::FAILURE_TIMEOUT);
+	}
+
+	this->close();
+	this->next();
+}
+
+void NativeSMTPConnection::fail(const std::string &message, int curlCode, int replyCode) {
+	if(this->current) {
+		this->reject(message, curlCode, replyCode);
+	}
+
+	this->close();
+	this->next();
+}
+
+void NativeSMTPConnection::next() {
+	//Posted rather than called, as the reply being handled may be part of a read that is not finished
+	this->loop.post([this]() {
+		this->pump();
+	});
+}
+
+void NativeSMTPConnection::close() {
+	this->loop.unschedule(this->timer);
+
+	if(this->tls) {
+		SSL_free(this->tls);
+		this->tls = NULL;
+	}
+
+	if(this->socket >= 0) {
+		this->loop.watch(this->socket, 0, this, this->events != 0);
+		::close(this->socket);
+		this->socket = -1;
+	}
+
+	this->state = CLOSED;
+	this->events = 0;
+	this->tlsWantsWrite = false;
+	this->input.clear();
+	this->replyText.clear();
+	this->output.clear();
+	this->outputOffset = 0;
+	this->authenticated = false;
+}
+
+int NativeSMTPConnection::keepSession(SSL *tls, SSL_SESSION *session) {
+	NativeSMTPConnection *connection = static_cast<NativeSMTPConnection*>(SSL_get_app_data(tls));
+
+	//Keep a copy, as OpenSSL stops the session it holds from being resumed if the connection breaks
+	SSL_SESSION *copy = SSL_SESSION_dup(session);
+
+	if(copy) {
+		if(connection->resumable) {
+			SSL_SESSION_free(connection->resumable);
+		}
+		connection->resumable = copy;
+	}
+
+	return 0;
+}
+
+void NativeSMTPConnection::shutdown() {
+	if((this->state == READY) && (this->socket >= 0)) {
+		//Say goodbye if the socket takes it at once; the session ends either way
+		this->command("QUIT");
+		this->writeSome(this->output.data() + this->outputOffset, this->output.length() - this->outputOffset);
+
+		if(this->tls) {
+			SSL_shutdown(this->tls);
+		}
+	}
+
+	this->close();
+
+	if(this->resumable) {
+		SSL_SESSION_free(this->resumable);
+		this->resumable = NULL;
+	}
+}
+
+} /* namespace SimplyEmail */
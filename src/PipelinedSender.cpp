@@ -0,0 +1,158 @@
+/**
+ * \file PipelinedSender.cpp
+ *
+ * \brief Implementation file for overlapping message encoding with sending
+ */
+
+#include "../lib/PipelinedSender.h"
+#include "../lib/Metrics.h"
+
+namespace SimplyEmail {
+
+const std::size_t PipelinedSender::DEFAULT_DEPTH = 4;
+
+PipelinedSender::Slot::Slot() : payload(ArenaAllocator<char>(arena)) {
+	this->email = NULL;
+	this->failed = false;
+}
+
+PipelinedSender::PipelinedSender(SMTPConnection &_connection, std::size_t depth) : connection(_connection) {
+	//One slot being sent and one being encoded is the least that overlaps the stages
+	if(depth < 2) {
+		depth = 2;
+	}
+
+	for(std::size_t i=0; i<depth; i++){
+		this->ring.push_back(std::unique_ptr<Slot>(new Slot()));
+	}
+
+	this->submitted = 0;
+	this->encoded = 0;
+	this->sent = 0;
+	this->stopping = false;
+
+	this->encoder = std::thread(&PipelinedSender::encodeLoop, this);
+	this->sender = std::thread(&PipelinedSender::sendLoop, this);
+}
+
+PipelinedSender::~PipelinedSender() {
+	this->flush();
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+
+	this->changed.notify_all();
+
+	this->encoder.join();
+	this->sender.join();
+}
+
+std::future<void> PipelinedSender::submit(const SimplyEmail::Email &email) {
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while(this->submitted - this->sent >= this->ring.size()) {
+		this->changed.wait(lock);
+	}
+
+	Slot &slot = *this->ring[this->submitted % this->ring.size()];
+	slot.email = &email;
+	slot.failed = false;
+	slot.done = std::promise<void>();
+
+	std::future<void> toReturn = slot.done.get_future();
+
+	this->submitted++;
+	Metrics::adjustQueueDepth(1);
+
+	lock.unlock();
+	this->changed.notify_all();
+
+	return toReturn;
+}
+
+void PipelinedSender::flush() {
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while(this->sent < this->submitted) {
+		this->changed.wait(lock);
+	}
+}
+
+std::size_t PipelinedSender::getDepth() const {
+	return this->ring.size();
+}
+
+void PipelinedSender::encodeLoop() {
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while(true) {
+		while(!this->stopping && (this->encoded == this->submitted)) {
+			this->changed.wait(lock);
+		}
+
+		if(this->encoded == this->submitted) {
+			return;
+		}
+
+		Slot &slot = *this->ring[this->encoded % this->ring.size()];
+		lock.unlock();
+
+		//Validate the envelope here too so that a bad message never holds up the sending stage
+		try {
+			if(slot.email->getRecipients().empty() && slot.email->getCCs().empty() && slot.email->getBCCs().empty()) {
+				throw std::runtime_error("Error sending email: The email has no recipients");
+			}
+
+			slot.payload = slot.email->encode(slot.arena);
+		}
+		catch(...) {
+			slot.done.set_exception(std::current_exception());
+			slot.failed = true;
+		}
+
+		lock.lock();
+		this->encoded++;
+		this->changed.notify_all();
+	}
+}
+
+void PipelinedSender::sendLoop() {
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while(true) {
+		while(!this->stopping && (this->sent == this->encoded)) {
+			this->changed.wait(lock);
+		}
+
+		if(this->sent == this->encoded) {
+			return;
+		}
+
+		Slot &slot = *this->ring[this->sent % this->ring.size()];
+		lock.unlock();
+
+		if(!slot.failed) {
+			try {
+				this->connection.sendPayload(*slot.email, slot.payload.data(), slot.payload.size());
+				slot.done.set_value();
+			}
+			catch(...) {
+				slot.done.set_exception(std::current_exception());
+			}
+		}
+
+		//Release the arena for the next message to use the slot
+		slot.payload = ArenaString(ArenaAllocator<char>(slot.arena));
+		slot.arena.reset();
+		slot.email = NULL;
+
+		lock.lock();
+		this->sent++;
+		Metrics::adjustQueueDepth(-1);
+		this->changed.notify_all();
+	}
+}
+
+} /* namespace SimplyEmail */
@@ -0,0 +1,331 @@
+/**
+ * \file RelayGroup.cpp
+ *
+ * \brief Implementation file for load balancing sends over several SMTP relays
+ */
+
+#include "../lib/RelayGroup.h"
+#include "../lib/Metrics.h"
+
+#include <exception>
+
+namespace SimplyEmail {
+
+const int RelayGroup::LEAST_OUTSTANDING = 0;
+const int RelayGroup::EWMA_LATENCY = 1;
+
+const int RelayGroup::CIRCUIT_CLOSED = 0;
+const int RelayGroup::CIRCUIT_OPEN = 1;
+const int RelayGroup::CIRCUIT_HALF_OPEN = 2;
+
+RelayGroupPolicy::RelayGroupPolicy() : openDuration(5000), maxOpenDuration(300000) {
+	this->selection = RelayGroup::LEAST_OUTSTANDING;
+	this->ewmaWeight = 0.2;
+	this->failureThreshold = 3;
+	this->maxAttempts = 0;
+}
+
+RelayGroup::RelayGroup(const RelayGroupPolicy &_policy) : policy(_policy) {
+	this->verbose = false;
+	this->suppression = NULL;
+	this->rotation = 0;
+}
+
+RelayGroup::~RelayGroup() {
+	//The unique pointers close every connection
+}
+
+void RelayGroup::addRelay(const std::string &address, const std::string &username, const std::string &password) {
+	std::unique_ptr<Relay> relay(new Relay());
+
+	relay->address = address;
+	relay->username = username;
+	relay->password = password;
+
+	relay->stats.address = address;
+	relay->stats.circuit = CIRCUIT_CLOSED;
+	relay->stats.outstanding = 0;
+	relay->stats.latencyMicros = 0;
+	relay->stats.consecutiveFailures = 0;
+	relay->stats.selected = 0;
+	relay->stats.sent = 0;
+	relay->stats.failed = 0;
+	relay->stats.failovers = 0;
+	relay->stats.ejections = 0;
+	relay->stats.probes = 0;
+
+	relay->openDuration = this->policy.openDuration;
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->relays.push_back(std::move(relay));
+}
+
+std::size_t RelayGroup::send(const SimplyEmail::Email &email) {
+	return this->send(email, std::chrono::steady_clock::time_point::max());
+}
+
+std::size_t RelayGroup::send(const SimplyEmail::Email &email, std::chrono::steady_clock::time_point deadline) {
+	bool limited = (deadline != std::chrono::steady_clock::time_point::max());
+	std::size_t relayCount = this->getRelayCount();
+
+	if(relayCount == 0) {
+		throw std::runtime_error("Error sending through relay group: No relays added");
+	}
+
+	std::size_t maxAttempts = relayCount;
+	if((this->policy.maxAttempts > 0) && (this->policy.maxAttempts < relayCount)) {
+		maxAttempts = this->policy.maxAttempts;
+	}
+
+	std::vector<bool> tried(relayCount, false);
+	std::size_t failedOver = relayCount;
+	std::exception_ptr lastError;
+
+	for(std::size_t attempt=0; attempt<maxAttempts; attempt++){
+		if(limited && (std::chrono::steady_clock::now() >= deadline)) {
+			if(!lastError) {
+				throw SMTPTimeout("Error sending through relay group: Deadline passed before sending", CURLE_OPERATION_TIMEDOUT, 0, std::chrono::milliseconds(0));
+			}
+
+			break;
+		}
+
+		SMTPConnection *connection = NULL;
+		std::size_t index = this->acquire(tried, failedOver, connection);
+
+		if(index == relayCount) {
+			break;
+		}
+
+		tried[index] = true;
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		try {
+			if(limited) {
+				connection->send(email, deadline);
+			}
+			else {
+				connection->send(email);
+			}
+		}
+		catch(const SMTPError &error) {
+			std::uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+			this->release(index, connection, !error.isTransient(), false, micros);
+
+			if(!error.isTransient()) {
+				throw;
+			}
+
+			lastError = std::current_exception();
+			failedOver = index;
+			continue;
+		}
+		catch(...) {
+			this->release(index, connection, true, false, 0);
+			throw;
+		}
+
+		std::uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		this->release(index, connection, true, true, micros);
+
+		return index;
+	}
+
+	if(lastError) {
+		std::rethrow_exception(lastError);
+	}
+
+	//Every relay is ejected or already being probed by another send
+	throw SMTPError("Error sending through relay group: No relay available", CURLE_COULDNT_CONNECT, 0, Metrics::FAILURE_CONNECT);
+}
+
+void RelayGroup::setVerbose(bool _verbose) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	this->verbose = _verbose;
+
+	for(std::size_t i=0; i<this->relays.size(); i++){
+		for(std::size_t j=0; j<this->relays[i]->connections.size(); j++){
+			this->relays[i]->connections[j]->setVerbose(_verbose);
+		}
+	}
+}
+
+void RelayGroup::setSuppressionList(const SimplyEmail::SuppressionList *list) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	this->suppression = list;
+
+	for(std::size_t i=0; i<this->relays.size(); i++){
+		for(std::size_t j=0; j<this->relays[i]->connections.size(); j++){
+			this->relays[i]->connections[j]->setSuppressionList(list);
+		}
+	}
+}
+
+void RelayGroup::setTimeouts(const SimplyEmail::SendTimeouts &_timeouts) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	this->timeouts = _timeouts;
+
+	for(std::size_t i=0; i<this->relays.size(); i++){
+		for(std::size_t j=0; j<this->relays[i]->connections.size(); j++){
+			this->relays[i]->connections[j]->setTimeouts(_timeouts);
+		}
+	}
+}
+
+std::vector<SimplyEmail::RelayStats> RelayGroup::getStats() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	std::vector<RelayStats> toReturn;
+	toReturn.reserve(this->relays.size());
+
+	for(std::size_t i=0; i<this->relays.size(); i++){
+		toReturn.push_back(this->relays[i]->stats);
+	}
+
+	return toReturn;
+}
+
+std::size_t RelayGroup::getRelayCount() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->relays.size();
+}
+
+std::size_t RelayGroup::acquire(const std::vector<bool> &tried, std::size_t failedOver, SMTPConnection *&connection) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::size_t count = this->relays.size();
+
+	std::size_t best = count;
+	std::size_t probe = count;
+
+	//Start the search somewhere new each time so that equally good relays share the sends
+	std::size_t start = this->rotation++;
+
+	for(std::size_t j=0; j<count; j++){
+		std::size_t i = (start + j) % count;
+
+		if(tried[i]) {
+			continue;
+		}
+
+		const Relay &relay = *this->relays[i];
+
+		if(relay.stats.circuit == CIRCUIT_CLOSED) {
+			if((best == count) || (this->cost(relay) < this->cost(*this->relays[best])) || ((this->cost(relay) == this->cost(*this->relays[best])) && (relay.stats.outstanding < this->relays[best]->stats.outstanding))) {
+				best = i;
+			}
+		}
+		else if(relay.stats.circuit == CIRCUIT_OPEN) {
+			if((probe == count) && (now >= relay.reopen)) {
+				probe = i;
+			}
+		}
+	}
+
+	//A relay due for a probe takes the next send so that it rejoins as soon as it recovers
+	std::size_t chosen = probe;
+
+	if(chosen == count) {
+		chosen = best;
+	}
+
+	//Relays whose circuits are still open are never tried early, as a failed early probe would lengthen their ejection
+	if(chosen == count) {
+		return count;
+	}
+
+	Relay &relay = *this->relays[chosen];
+
+	if(relay.stats.circuit == CIRCUIT_OPEN) {
+		relay.stats.circuit = CIRCUIT_HALF_OPEN;
+		relay.stats.probes++;
+	}
+
+	if(failedOver < count) {
+		this->relays[failedOver]->stats.failovers++;
+	}
+
+	if(relay.idle.empty()) {
+		std::unique_ptr<SMTPConnection> created(new SMTPConnection(relay.address, relay.username, relay.password));
+		created->setVerbose(this->verbose);
+		created->setSuppressionList(this->suppression);
+		created->setTimeouts(this->timeouts);
+
+		relay.idle.push_back(created.get());
+		relay.connections.push_back(std::move(created));
+	}
+
+	connection = relay.idle.back();
+	relay.idle.pop_back();
+
+	relay.stats.selected++;
+	relay.stats.outstanding++;
+
+	return chosen;
+}
+
+void RelayGroup::release(std::size_t index, SMTPConnection *connection, bool healthy, bool delivered, std::uint64_t micros) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	Relay &relay = *this->relays[index];
+
+	relay.idle.push_back(connection);
+	relay.stats.outstanding--;
+
+	if(delivered) {
+		relay.stats.sent++;
+
+		if(relay.stats.sent == 1) {
+			relay.stats.latencyMicros = (double)micros;
+		}
+		else {
+			relay.stats.latencyMicros += this->policy.ewmaWeight * ((double)micros - relay.stats.latencyMicros);
+		}
+	}
+	else {
+		relay.stats.failed++;
+	}
+
+	if(healthy) {
+		relay.stats.consecutiveFailures = 0;
+
+		if(relay.stats.circuit == CIRCUIT_HALF_OPEN) {
+			relay.stats.circuit = CIRCUIT_CLOSED;
+			relay.openDuration = this->policy.openDuration;
+		}
+
+		return;
+	}
+
+	relay.stats.consecutiveFailures++;
+
+	//A failed probe reopens the circuit at once; a closed circuit opens after enough failures in a row
+	if((relay.stats.circuit == CIRCUIT_HALF_OPEN) || ((relay.stats.circuit == CIRCUIT_CLOSED) && (relay.stats.consecutiveFailures >= this->policy.failureThreshold))) {
+		relay.stats.circuit = CIRCUIT_OPEN;
+		relay.stats.ejections++;
+		relay.reopen = std::chrono::steady_clock::now() + relay.openDuration;
+
+		relay.openDuration *= 2;
+		if(relay.openDuration > this->policy.maxOpenDuration) {
+			relay.openDuration = this->policy.maxOpenDuration;
+		}
+	}
+}
+
+double RelayGroup::cost(const Relay &relay) const {
+	double outstanding = (double)relay.stats.outstanding + 1.0;
+
+	if(this->policy.selection == EWMA_LATENCY) {
+		//Relays without a sample yet cost nothing so that they are measured
+		return relay.stats.latencyMicros * outstanding;
+	}
+
+	return outstanding;
+}
+
+} /* namespace SimplyEmail */
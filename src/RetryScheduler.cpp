@@ -0,0 +1,223 @@
+/**
+ * \file RetryScheduler.cpp
+ *
+ * \brief Implementation file for the deferred message retry scheduler
+ */
+
+#include "../lib/RetryScheduler.h"
+#include "../lib/Metrics.h"
+
+#include <cmath>
+#include <utility>
+
+namespace SimplyEmail {
+
+const int RetryScheduler::DEFERRED = 0;
+const int RetryScheduler::GAVE_UP = 1;
+
+RetryPolicy::RetryPolicy() : initialDelay(60000), maxDelay(3600000) {
+	this->maxAttempts = 5;
+	this->multiplier = 2.0;
+	this->jitter = 0.5;
+}
+
+RetryScheduler::RetryScheduler(const RetryPolicy &_policy, std::chrono::milliseconds _resolution) : policy(_policy), resolution(_resolution), random(std::random_device()()) {
+	if(this->resolution.count() <= 0) {
+		this->resolution = std::chrono::milliseconds(1);
+	}
+
+	this->epoch = std::chrono::steady_clock::now();
+	this->deferredCount = 0;
+}
+
+RetryScheduler::~RetryScheduler() {
+	Metrics::adjustQueueDepth(-(std::int64_t)this->deferredCount);
+}
+
+int RetryScheduler::defer(std::uint64_t messageId, const SMTPError &error) {
+	return this->defer(messageId, error, std::chrono::steady_clock::now());
+}
+
+int RetryScheduler::defer(std::uint64_t messageId, const SMTPError &error, std::chrono::steady_clock::time_point now) {
+	AttemptRecord record;
+	record.time = std::chrono::system_clock::now();
+	record.curlCode = error.getCurlCode();
+	record.replyCode = error.getReplyCode();
+	record.failureClass = error.getFailureClass();
+	record.transient = error.isTransient();
+	record.message = error.what();
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	//Bring the wheel up to date so the retry is measured from now
+	std::uint64_t nowTick = this->toTick(now);
+	this->advanceLocked(nowTick);
+
+	std::pair<std::unordered_map<std::uint64_t, Entry>::iterator, bool> inserted = this->entries.insert(std::make_pair(messageId, Entry()));
+	Entry &entry = inserted.first->second;
+
+	if(inserted.second) {
+		entry.timer = TimerWheel::INVALID_HANDLE;
+		entry.waiting = false;
+	}
+
+	entry.history.push_back(record);
+
+	//A message deferred again while still waiting loses its old slot
+	if(entry.timer != TimerWheel::INVALID_HANDLE) {
+		this->wheel.cancel(entry.timer);
+		entry.timer = TimerWheel::INVALID_HANDLE;
+	}
+
+	unsigned int attempts = entry.history.size();
+
+	if(!record.transient || (attempts >= this->policy.maxAttempts)) {
+		this->setWaiting(entry, false);
+		return GAVE_UP;
+	}
+
+	std::chrono::milliseconds delay = this->backoffLocked(attempts + 1);
+	std::uint64_t ticks = (delay.count() + this->resolution.count() - 1) / this->resolution.count();
+
+	entry.timer = this->wheel.schedule(messageId, nowTick + ticks);
+	this->setWaiting(entry, true);
+
+	return DEFERRED;
+}
+
+std::vector<std::uint64_t> RetryScheduler::due(std::chrono::steady_clock::time_point now) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	this->advanceLocked(this->toTick(now));
+
+	std::vector<std::uint64_t> result;
+
+	for(std::size_t i=0; i<this->expired.size(); i++){
+		std::unordered_map<std::uint64_t, Entry>::iterator it = this->entries.find(this->expired[i]);
+
+		//Skip messages forgotten or deferred again since their timer fired
+		if((it == this->entries.end()) || !it->second.waiting || (it->second.timer != TimerWheel::INVALID_HANDLE)) {
+			continue;
+		}
+
+		this->setWaiting(it->second, false);
+		result.push_back(it->first);
+	}
+
+	this->expired.clear();
+
+	return result;
+}
+
+void RetryScheduler::succeeded(std::uint64_t messageId) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->forgetLocked(messageId);
+}
+
+void RetryScheduler::forget(std::uint64_t messageId) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->forgetLocked(messageId);
+}
+
+std::vector<AttemptRecord> RetryScheduler::getHistory(std::uint64_t messageId) const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	std::unordered_map<std::uint64_t, Entry>::const_iterator it = this->entries.find(messageId);
+	if(it == this->entries.end()) {
+		return std::vector<AttemptRecord>();
+	}
+
+	return it->second.history;
+}
+
+std::size_t RetryScheduler::getDeferredCount() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->deferredCount;
+}
+
+std::chrono::milliseconds RetryScheduler::backoff(unsigned int attempt) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->backoffLocked(attempt);
+}
+
+std::uint64_t RetryScheduler::toTick(std::chrono::steady_clock::time_point time) const {
+	if(time <= this->epoch) {
+		return 0;
+	}
+
+	return std::chrono::duration_cast<std::chrono::milliseconds>(time - this->epoch).count() / this->resolution.count();
+}
+
+std::chrono::milliseconds RetryScheduler::backoffLocked(unsigned int attempt) {
+	double delay = (double)this->policy.initialDelay.count();
+
+	if(attempt > 2) {
+		delay *= std::pow(this->policy.multiplier, (double)(attempt - 2));
+	}
+
+	if(delay > (double)this->policy.maxDelay.count()) {
+		delay = (double)this->policy.maxDelay.count();
+	}
+
+	//Spread retries of messages that failed together so they do not all hit the relay at once
+	double jitter = this->policy.jitter;
+	if(jitter > 1.0) {
+		jitter = 1.0;
+	}
+
+	if(jitter > 0.0) {
+		std::uniform_real_distribution<double> distribution(0.0, delay * jitter);
+		delay = (delay * (1.0 - jitter)) + distribution(this->random);
+	}
+
+	if(delay < 0.0) {
+		delay = 0.0;
+	}
+
+	return std::chrono::milliseconds((std::chrono::milliseconds::rep)delay);
+}
+
+void RetryScheduler::advanceLocked(std::uint64_t nowTick) {
+	std::size_t first = this->expired.size();
+	this->wheel.advance(nowTick, this->expired);
+
+	for(std::size_t i=first; i<this->expired.size(); i++){
+		std::unordered_map<std::uint64_t, Entry>::iterator it = this->entries.find(this->expired[i]);
+		if(it != this->entries.end()) {
+			it->second.timer = TimerWheel::INVALID_HANDLE;
+		}
+	}
+}
+
+void RetryScheduler::setWaiting(Entry &entry, bool waiting) {
+	if(entry.waiting == waiting) {
+		return;
+	}
+
+	entry.waiting = waiting;
+
+	if(waiting) {
+		this->deferredCount++;
+		Metrics::adjustQueueDepth(1);
+	}
+	else {
+		this->deferredCount--;
+		Metrics::adjustQueueDepth(-1);
+	}
+}
+
+void RetryScheduler::forgetLocked(std::uint64_t messageId) {
+	std::unordered_map<std::uint64_t, Entry>::iterator it = this->entries.find(messageId);
+	if(it == this->entries.end()) {
+		return;
+	}
+
+	if(it->second.timer != TimerWheel::INVALID_HANDLE) {
+		this->wheel.cancel(it->second.timer);
+	}
+
+	this->setWaiting(it->second, false);
+	this->entries.erase(it);
+}
+
+} /* namespace SimplyEmail */
@@ -8,6 +8,15 @@
  */
 
 #include "../lib/SMTPConnection.h"
+#include "../lib/Metrics.h"
+#include "../lib/MappedFile.h"
+#include "../lib/SpoolQueue.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <thread>
 
 namespace SimplyEmail {
 
@@ -18,8 +27,24 @@ const int SMTPConnection::SENDING_COMPLETE = 2;
 const int SMTPConnection::CLOSING_CONNECTION = 1;
 const int SMTPConnection::CONNECTION_CLOSED = 0;
 
+const unsigned int SMTPConnection::DEFAULT_RECIPIENTS_PER_TRANSACTION = 100;
+
+SendTimeouts::SendTimeouts() : connect(30000), total(0), lowSpeedLimit(0), lowSpeedTime(600) {
+}
+
 SMTPConnection::SMTPConnection() {
 	this->curl = NULL;
+	this->verbose = true;
+	this->share = &ConnectionShare::getDefault();
+	this->suppression = NULL;
+	this->hasDeadline = false;
+	this->lastElapsed = std::chrono::milliseconds(0);
+	this->sendCount = 0;
+	this->activeSend = 0;
+	this->cancelledSend = 0;
+	this->lastUploaded = 0;
+	this->sizeLimit = 0;
+	this->oversizeFallback = NULL;
 
 	//Initialize the SMTP connection with empty strings.
 	this->initialize("","","");
@@ -28,11 +53,37 @@ SMTPConnection::SMTPConnection() {
 
 SMTPConnection::SMTPConnection(std::string address,std::string username, std::string password) {
 	this->curl = NULL;
+	this->verbose = true;
+	this->share = &ConnectionShare::getDefault();
+	this->suppression = NULL;
+	this->hasDeadline = false;
+	this->lastElapsed = std::chrono::milliseconds(0);
+	this->sendCount = 0;
+	this->activeSend = 0;
+	this->cancelledSend = 0;
+	this->lastUploaded = 0;
+	this->sizeLimit = 0;
+	this->oversizeFallback = NULL;
 
 	this->initialize(address,username,password);
 }
 
 SMTPConnection::SMTPConnection(SMTPConnection& other){
+	this->curl = NULL;
+	this->verbose = other.getVerbose();
+	this->share = other.getShare();
+	this->suppression = other.getSuppressionList();
+	this->timeouts = other.getTimeouts();
+	this->progress = other.getProgressCallback();
+	this->hasDeadline = false;
+	this->lastElapsed = std::chrono::milliseconds(0);
+	this->sendCount = 0;
+	this->activeSend = 0;
+	this->cancelledSend = 0;
+	this->lastUploaded = 0;
+	this->sizeLimit = 0;
+	this->oversizeFallback = other.getOversizeFallback();
+
 	this->initialize(other.getAddress(), other.getUsername(), other.getPassword());
 }
 
@@ -60,8 +111,13 @@ void SMTPConnection::initialize(const std::string &address, const std::string &u
 		throw std::runtime_error("Error connecting to SMTP server: CURL did not start");
 	}
 
+	Metrics::adjustActiveConnections(1);
+
 	this->res = this->CONNECTION_CLOSED;
 
+	//A new session greets the server again
+	this->sizeLimit = 0;
+
 	//Set the CURL options
 	curl_easy_setopt(this->curl,CURLOPT_URL, this->address.c_str());	// Set the address of the SMTP server. Server name must specify smtp://
 	curl_easy_setopt(this->curl, CURLOPT_USERNAME, this->username.c_str());		// Set the username for authentication
@@ -70,7 +126,18 @@ void SMTPConnection::initialize(const std::string &address, const std::string &u
 	curl_easy_setopt(this->curl,CURLOPT_SSL_VERIFYPEER, 1L);			// Force verification of peers
 	curl_easy_setopt(this->curl,CURLOPT_SSL_VERIFYHOST, 1L);			// Force verification of server
 	curl_easy_setopt(this->curl,CURLOPT_UPLOAD, 1L);					// Set the upload flag
-	curl_easy_setopt(this->curl, CURLOPT_VERBOSE, 1L);					//TODO Verbose mode is only for testing. Remove this for production.
+	curl_easy_setopt(this->curl, CURLOPT_VERBOSE, 1L);					// Needed for the debug callback; output is only printed when verbose is set
+	curl_easy_setopt(this->curl, CURLOPT_DEBUGFUNCTION, debugCallback);	// Parse the conversation for per recipient replies
+	curl_easy_setopt(this->curl, CURLOPT_DEBUGDATA, this);
+	curl_easy_setopt(this->curl, CURLOPT_NOSIGNAL, 1L);				// Time out name lookups without signals, which are unsafe with threads
+	curl_easy_setopt(this->curl, CURLOPT_LOW_SPEED_LIMIT, this->timeouts.lowSpeedLimit);	// Abort stalled transfers
+	curl_easy_setopt(this->curl, CURLOPT_LOW_SPEED_TIME, (long)this->timeouts.lowSpeedTime.count());
+	curl_easy_setopt(this->curl, CURLOPT_NOPROGRESS, 0L);				// Needed for the progress callback, which also checks for cancellation
+	curl_easy_setopt(this->curl, CURLOPT_XFERINFOFUNCTION, progressCallback);
+
+	if(this->share) {
+		curl_easy_setopt(this->curl, CURLOPT_SHARE, this->share->getHandle());	// Resume TLS sessions and reuse DNS results of other connections
+	}
 
 }
 
@@ -79,98 +146,689 @@ void SMTPConnection::disconnect(){
 
 	if(this->curl) {
 		curl_easy_cleanup(this->curl);
+		this->curl = NULL;
+
+		Metrics::adjustActiveConnections(-1);
 	}
 
 	this->res = this->CONNECTION_CLOSED;
 }
 
-void SMTPConnection::send(SimplyEmail::Email &email){
+void SMTPConnection::send(const SimplyEmail::Email &email){
+	//Check the message against the server's limit before rendering any of it
+	if(this->sizeLimit > 0) {
+		SMTPConnection *fallback = this->admit(email.encodedSize());
 
-	//Check to make sure that the connection is open
-	if(this->curl) {
+		if(fallback) {
+			if(this->hasDeadline) {
+				fallback->send(email, this->deadline);
+			}
+			else {
+				fallback->send(email);
+			}
+			return;
+		}
+	}
+
+	//Only the header is rendered; cached sections and attachment data are uploaded in place
+	SimplyEmail::EncodedEmail payload = email.encodeSegments();
+
+	PayloadReader reader;
+	reader.segments = &payload;
+	reader.data = NULL;
+	reader.size = payload.getSize();
+
+	this->sendAdmitted(email, reader);
+}
+
+void SMTPConnection::send(const SimplyEmail::Email &email, SimplyEmail::EncodeArena &arena){
+	if(this->sizeLimit > 0) {
+		SMTPConnection *fallback = this->admit(email.encodedSize());
+
+		if(fallback) {
+			fallback->send(email, arena);
+			return;
+		}
+	}
+
+	SimplyEmail::ArenaString payload = email.encode(arena);
+
+	PayloadReader reader;
+	reader.segments = NULL;
+	reader.data = payload.data();
+	reader.size = payload.size();
+
+	this->sendAdmitted(email, reader);
+}
+
+void SMTPConnection::send(const SimplyEmail::Email &email, std::chrono::steady_clock::time_point _deadline){
+	this->deadline = _deadline;
+	this->hasDeadline = true;
+
+	try {
+		this->send(email);
+	}
+	catch(...) {
+		this->hasDeadline = false;
+		throw;
+	}
+
+	this->hasDeadline = false;
+}
+
+void SMTPConnection::send(const SimplyEmail::SpooledMessage &message){
+	if(!this->curl) {
+		throw std::runtime_error("Error connection to SMTP server: Attempt to send mail failed because of closed connection");
+	}
+
+	const std::vector<std::string> &recipients = message.getEnvelope();
+
+	std::vector<const std::string*> envelope;
+	envelope.reserve(recipients.size());
+
+	for(std::size_t i=0; i<recipients.size(); i++){
+		if(!this->suppression || !this->suppression->contains(recipients[i])) {
+			envelope.push_back(&recipients[i]);
+		}
+	}
+
+	if(envelope.empty()) {
+		throw std::runtime_error("Error sending email: Every recipient is suppressed");
+	}
+
+	SMTPConnection *fallback = this->admit(message.getSize());
+
+	if(fallback) {
+		fallback->send(message);
+		return;
+	}
+
+	CURLcode result;
+
+	if(message.isSpilled()) {
+		MappedFile spilled(message.getSpillPath());
+		result = this->transfer(message.getFrom(), &envelope[0], envelope.size(), spilled.getData(), spilled.getSize(), false);
+	}
+	else {
+		result = this->transfer(message.getFrom(), &envelope[0], envelope.size(), message.getPayload().data(), message.getSize(), false);
+	}
+
+	this->checkConnection(result);
+}
+
+SimplyEmail::BulkSendReport SMTPConnection::sendBulk(const SimplyEmail::Email &email, unsigned int recipientsPerTransaction){
+	std::vector<SMTPConnection*> connections(1, this);
+
+	return sendBulk(email, connections, recipientsPerTransaction);
+}
+
+SimplyEmail::BulkSendReport SMTPConnection::sendBulk(const SimplyEmail::Email &email, const std::vector<SMTPConnection*> &connections, unsigned int recipientsPerTransaction){
+	if(connections.empty()) {
+		throw std::runtime_error("Error connecting to SMTP server: No connections given for bulk sending");
+	}
+
+	for(unsigned int i=0; i<connections.size(); i++){
+		if(!connections[i]->curl) {
+			throw std::runtime_error("Error connection to SMTP server: Attempt to send mail failed because of closed connection");
+		}
+	}
+
+	if(recipientsPerTransaction == 0) {
+		recipientsPerTransaction = DEFAULT_RECIPIENTS_PER_TRANSACTION;
+	}
 
-		//Set status
-		this->res = this->OPENING_CONNECTION;
+	std::vector<const std::string*> envelope;
+	std::size_t suppressed = buildEnvelope(email, connections[0]->suppression, envelope);
 
-		//Create an  empty recipients list
-		struct curl_slist *recipients = NULL;
+	//Encode once; every transaction uploads the same payload
+	SimplyEmail::EncodedEmail payload = email.encodeSegments();
 
-		//Set CURL options
-		curl_easy_setopt(this->curl,CURLOPT_MAIL_FROM,email.getFrom().c_str());
+	std::size_t chunkCount = (envelope.size() + recipientsPerTransaction - 1) / recipientsPerTransaction;
+	std::vector<std::vector<SimplyEmail::RecipientResult> > chunkResults(chunkCount);
+	std::vector<char> chunkFailed(chunkCount, 0);
+	std::atomic<std::size_t> nextChunk(0);
+	std::atomic<bool> stopped(false);
 
+	//Each connection takes the next unsent chunk until none are left, or fails the rest once one is cancelled
+	auto work = [&](SMTPConnection *connection) {
+		std::uint64_t sendNumber = connection->beginSend();
+		std::size_t chunk;
+		while((chunk = nextChunk.fetch_add(1)) < chunkCount) {
+			std::size_t first = chunk * recipientsPerTransaction;
+			std::size_t count = std::min((std::size_t)recipientsPerTransaction, envelope.size() - first);
 
-		//Add recipients
-		if(email.getRecipientNumber() > 0){
-			for(unsigned int i=0; i < email.getRecipientNumber(); i++){
-				recipients = curl_slist_append(recipients, email.getRecipient(i).c_str());
+			CURLcode result = CURLE_ABORTED_BY_CALLBACK;
+
+			if(stopped) {
+				connection->transcript.clear();
+			}
+			else if((connection->sizeLimit > 0) && (payload.getSize() > connection->sizeLimit)) {
+				//The server would refuse the message, so the transaction fails without uploading it
+				connection->transcript.clear();
+				Metrics::recordFailed(Metrics::FAILURE_REJECTED, 0);
+				result = CURLE_FILESIZE_EXCEEDED;
+			}
+			else if((result = connection->transfer(email.getFrom(), &envelope[first], count, payload, true)) == CURLE_ABORTED_BY_CALLBACK) {
+				stopped = true;
 			}
+
+			chunkFailed[chunk] = (result != CURLE_OK);
+			chunkResults[chunk] = connection->recipientResults(&envelope[first], count, result);
 		}
-		else {
-			throw std::runtime_error("Error connecting to SMTP server: No recipients defined in email");
+
+		connection->endSend(sendNumber);
+	};
+
+	if(connections.size() == 1) {
+		work(connections[0]);
+	}
+	else {
+		std::vector<std::thread> threads;
+		for(unsigned int i=0; i<connections.size(); i++){
+			threads.push_back(std::thread(work, connections[i]));
 		}
 
-		//Add CC
-		for(unsigned int i=0; i < email.getCCNumber(); i++){
-			recipients = curl_slist_append(recipients, email.getCC(i).c_str());
+		for(unsigned int i=0; i<threads.size(); i++){
+			threads[i].join();
 		}
+	}
 
-		//Add BCC
-		for(unsigned int i=0; i < email.getBCCNumber(); i++){
-			recipients = curl_slist_append(recipients, email.getBCC(i).c_str());
+	SimplyEmail::BulkSendReport toReturn;
+	toReturn.transactions = chunkCount;
+	toReturn.failedTransactions = 0;
+	toReturn.acceptedRecipients = 0;
+	toReturn.suppressedRecipients = suppressed;
+
+	for(std::size_t i=0; i<chunkCount; i++){
+		if(chunkFailed[i]) {
+			toReturn.failedTransactions++;
+		}
+
+		for(unsigned int j=0; j<chunkResults[i].size(); j++){
+			if(chunkResults[i][j].accepted) {
+				toReturn.acceptedRecipients++;
+			}
+			toReturn.recipients.push_back(chunkResults[i][j]);
 		}
+	}
 
+	return toReturn;
+}
 
-		//Set the recipient list
-		curl_easy_setopt(this->curl, CURLOPT_MAIL_RCPT, recipients);
+void SMTPConnection::sendPayload(const SimplyEmail::Email &email, const char *payload, std::size_t payloadLength){
+	PayloadReader reader;
+	reader.segments = NULL;
+	reader.data = payload;
+	reader.size = payloadLength;
 
-		//Dump the contents of the email to a file in an effort to avoid callback functions etc
-		//NOTE This would be much better to do via a callback function to send the payload text.
-		//NOTE The tempfile functions in stdlib.h use a binary interface which would have some undefined effects on our payload text
+	this->sendPayload(email, reader);
+}
 
-		std::string payload = email.encode();
-		std::ofstream ofs;
-		ofs.open("tempEmail.txt", std::ofstream::out);
-		ofs << payload;
-		ofs.close();
+void SMTPConnection::sendPayload(const SimplyEmail::Email &email, const SimplyEmail::EncodedEmail &payload){
+	PayloadReader reader;
+	reader.segments = &payload;
+	reader.data = NULL;
+	reader.size = payload.getSize();
 
-		FILE * pfile;
-		pfile = fopen("tempEmail.txt", "r");
+	this->sendPayload(email, reader);
+}
 
-		if(pfile == NULL) {
-			throw std::runtime_error("Error connecting to SMTP server: Unable to create temporary email container");
+void SMTPConnection::sendPayload(const SimplyEmail::Email &email, PayloadReader &reader){
+	//Callers that encode the message themselves, such as PipelinedSender, are admitted here
+	SMTPConnection *fallback = this->admit(reader.size);
+
+	if(fallback) {
+		if(this->hasDeadline) {
+			fallback->deadline = this->deadline;
+			fallback->hasDeadline = true;
+		}
+
+		try {
+			fallback->sendPayload(email, reader);
+		}
+		catch(...) {
+			fallback->hasDeadline = false;
+			throw;
 		}
 
-		curl_easy_setopt(this->curl, CURLOPT_READDATA, pfile);
+		fallback->hasDeadline = false;
+		return;
+	}
+
+	this->sendAdmitted(email, reader);
+}
+
+void SMTPConnection::sendAdmitted(const SimplyEmail::Email &email, PayloadReader &reader){
 
-		//Set status
-		this->res = this->CONNECTION_OPEN;
+	//Check to make sure that the connection is open
+	if(!this->curl) {
+		throw std::runtime_error("Error connection to SMTP server: Attempt to send mail failed because of closed connection");
+	}
 
-		//Send the temporary file via CURL
-		this->res = this->SENDING_DATA;
-		CURLcode result = curl_easy_perform(this->curl);
-		this->checkConnection(result);
+	std::vector<const std::string*> envelope;
+	buildEnvelope(email, this->suppression, envelope);
 
-		//Set status
-		this->res = this->SENDING_COMPLETE;
+	if(envelope.empty()) {
+		throw std::runtime_error("Error sending email: Every recipient is suppressed");
+	}
 
-		//Delete the recipients list
-		curl_slist_free_all(recipients);
+	CURLcode result = this->transfer(email.getFrom(), &envelope[0], envelope.size(), reader, false);
+	this->checkConnection(result);
+}
 
-		//Delete the temporary file
-		fclose(pfile);
-		remove("tempEmail.txt");
-		pfile = NULL;
+SMTPConnection* SMTPConnection::admit(std::uint64_t size){
+	if((this->sizeLimit == 0) || (size <= this->sizeLimit)) {
+		return NULL;
+	}
 
-		this->res = this->CONNECTION_OPEN;
+	if(this->oversizeFallback) {
+		return this->oversizeFallback;
+	}
+
+	this->transcript.clear();
+	this->lastElapsed = std::chrono::milliseconds(0);
+	this->lastUploaded = 0;
+	Metrics::recordFailed(Metrics::FAILURE_REJECTED, 0);
+
+	std::ostringstream oss;
+	oss<<"Error sending email: Message of " << size << " bytes is over the server's SIZE limit of " << this->sizeLimit << " bytes";
+
+	throw SimplyEmail::SMTPError(oss.str(), CURLE_FILESIZE_EXCEEDED, 0, Metrics::FAILURE_REJECTED);
+}
+
+void SMTPConnection::learnSizeLimit(){
+	const std::vector<std::string> &capabilities = this->transcript.getCapabilities();
+
+	this->sizeLimit = 0;
+
+	//"SIZE 35882577" sets a limit; a bare "SIZE" or "SIZE 0" declares sizes without one
+	for(std::size_t i=0; i<capabilities.size(); i++){
+		const std::string &capability = capabilities[i];
+
+		if((capability.length() > 5) && (strncasecmp(capability.c_str(), "SIZE ", 5) == 0)) {
+			this->sizeLimit = std::strtoull(capability.c_str() + 5, NULL, 10);
+		}
+	}
+}
+
+std::size_t SMTPConnection::buildEnvelope(const SimplyEmail::Email &email, const SimplyEmail::SuppressionList *suppression, std::vector<const std::string*> &envelope){
+	const std::vector<std::string> &recipients = email.getRecipients();
+	const std::vector<std::string> &cc = email.getCCs();
+	const std::vector<std::string> &bcc = email.getBCCs();
+
+	if(recipients.empty()) {
+		throw std::runtime_error("Error connecting to SMTP server: No recipients defined in email");
+	}
+
+	envelope.reserve(recipients.size() + cc.size() + bcc.size());
+
+	for(unsigned int i=0; i<recipients.size(); i++){
+		envelope.push_back(&recipients[i]);
+	}
+
+	for(unsigned int i=0; i<cc.size(); i++){
+		envelope.push_back(&cc[i]);
+	}
+
+	for(unsigned int i=0; i<bcc.size(); i++){
+		envelope.push_back(&bcc[i]);
+	}
+
+	if(!suppression) {
+		return 0;
+	}
+
+	//The list may have been reloaded since the addresses were added to the email
+	std::size_t kept = 0;
+
+	for(std::size_t i=0; i<envelope.size(); i++){
+		if(!suppression->contains(*envelope[i])) {
+			envelope[kept++] = envelope[i];
+		}
+	}
+
+	std::size_t removed = envelope.size() - kept;
+	envelope.resize(kept);
+
+	return removed;
+}
+
+CURLcode SMTPConnection::transfer(const std::string &from, const std::string *const *recipients, std::size_t recipientCount, const char *payload, std::size_t payloadLength, bool allowRecipientFailures){
+	PayloadReader reader;
+	reader.segments = NULL;
+	reader.data = payload;
+	reader.size = payloadLength;
+
+	return this->transfer(from, recipients, recipientCount, reader, allowRecipientFailures);
+}
+
+CURLcode SMTPConnection::transfer(const std::string &from, const std::string *const *recipients, std::size_t recipientCount, const SimplyEmail::EncodedEmail &payload, bool allowRecipientFailures){
+	PayloadReader reader;
+	reader.segments = &payload;
+	reader.data = NULL;
+	reader.size = payload.getSize();
+
+	return this->transfer(from, recipients, recipientCount, reader, allowRecipientFailures);
+}
+
+CURLcode SMTPConnection::transfer(const std::string &from, const std::string *const *recipients, std::size_t recipientCount, PayloadReader &reader, bool allowRecipientFailures){
+
+	//Shorten the timeouts to the time left before the deadline, and give up at once if there is none
+	long connectMillis = (long)this->timeouts.connect.count();
+	long totalMillis = (long)this->timeouts.total.count();
+
+	if(this->hasDeadline) {
+		long remaining = (long)std::chrono::duration_cast<std::chrono::milliseconds>(this->deadline - std::chrono::steady_clock::now()).count();
+
+		if(remaining <= 0) {
+			this->transcript.clear();
+			this->lastElapsed = std::chrono::milliseconds(0);
+			this->lastUploaded = 0;
+			Metrics::recordFailed(Metrics::FAILURE_TIMEOUT, 0);
+
+			return CURLE_OPERATION_TIMEDOUT;
+		}
+
+		connectMillis = (connectMillis > 0) ? std::min(connectMillis, remaining) : remaining;
+		totalMillis = (totalMillis > 0) ? std::min(totalMillis, remaining) : remaining;
+	}
+
+	//A bulk send cancelled between its transactions stops before the next one connects
+	std::uint64_t sendNumber = this->beginSend();
+
+	if(this->isCancelled()) {
+		this->endSend(sendNumber);
+		this->transcript.clear();
+		this->lastElapsed = std::chrono::milliseconds(0);
+		this->lastUploaded = 0;
+		Metrics::recordFailed(Metrics::FAILURE_OTHER, 0);
+
+		return CURLE_ABORTED_BY_CALLBACK;
+	}
+
+	curl_easy_setopt(this->curl, CURLOPT_CONNECTTIMEOUT_MS, connectMillis);
+	curl_easy_setopt(this->curl, CURLOPT_TIMEOUT_MS, totalMillis);
+
+	//Set status
+	this->res = this->OPENING_CONNECTION;
+
+	//Create the recipients list
+	struct curl_slist *recipientList = NULL;
+
+	for(std::size_t i=0; i < recipientCount; i++){
+		struct curl_slist *appended = curl_slist_append(recipientList, recipients[i]->c_str());
+
+		if(appended == NULL) {
+			this->endSend(sendNumber);
+			curl_slist_free_all(recipientList);
+			throw std::runtime_error("Error connecting to SMTP server: Unable to build recipient list");
+		}
+
+		recipientList = appended;
+	}
+
+	//Set CURL options
+	curl_easy_setopt(this->curl, CURLOPT_MAIL_FROM, from.c_str());
+	curl_easy_setopt(this->curl, CURLOPT_MAIL_RCPT, recipientList);
+
+#if LIBCURL_VERSION_NUM >= 0x080200
+	curl_easy_setopt(this->curl, CURLOPT_MAIL_RCPT_ALLOWFAILS, allowRecipientFailures ? 1L : 0L);
+#elif LIBCURL_VERSION_NUM >= 0x074500
+	curl_easy_setopt(this->curl, CURLOPT_MAIL_RCPT_ALLLOWFAILS, allowRecipientFailures ? 1L : 0L);
+#else
+	(void)allowRecipientFailures;
+#endif
+
+	//Upload the payload straight from memory
+	reader.offset = 0;
+	reader.connection = this;
+	reader.reported = 0;
+
+	//CURL declares the size in the MAIL command when the server offers SIZE, so an oversized message is refused there
+	curl_easy_setopt(this->curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)reader.size);
+	curl_easy_setopt(this->curl, CURLOPT_READFUNCTION, readPayload);
+	curl_easy_setopt(this->curl, CURLOPT_READDATA, &reader);
+	curl_easy_setopt(this->curl, CURLOPT_XFERINFODATA, &reader);
+
+	this->transcript.clear();
+
+	//Set status
+	this->res = this->CONNECTION_OPEN;
+
+	//Send the payload via CURL
+	this->res = this->SENDING_DATA;
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	CURLcode result = curl_easy_perform(this->curl);
+	std::uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+	this->lastElapsed = std::chrono::milliseconds(elapsed / 1000);
+	this->lastUploaded = reader.reported;
+	this->learnSizeLimit();
+
+	this->endSend(sendNumber);
+
+	if(result == CURLE_OK) {
+		//The server only accepts the message once all of it has arrived
+		if((reader.reported < reader.size) && this->progress) {
+			this->progress(reader.size, reader.size);
+		}
+		this->lastUploaded = reader.size;
+
+		Metrics::recordSent(reader.size, elapsed);
 	}
 	else {
-		throw std::runtime_error("Error connection to SMTP server: Attempt to send mail failed because of closed connection");
+		Metrics::recordFailed(this->classifyFailure(result), elapsed);
 	}
 
+	//Set status
+	this->res = this->SENDING_COMPLETE;
+
+	//Delete the recipients list once CURL no longer refers to it
+	curl_easy_setopt(this->curl, CURLOPT_MAIL_RCPT, NULL);
+	curl_easy_setopt(this->curl, CURLOPT_READDATA, NULL);
+	curl_easy_setopt(this->curl, CURLOPT_XFERINFODATA, NULL);
+	curl_slist_free_all(recipientList);
+
+	this->res = this->CONNECTION_OPEN;
+
+	return result;
 }
 
-int SMTPConnection::getStatus(){
-	return this->res;
+std::vector<SimplyEmail::RecipientResult> SMTPConnection::recipientResults(const std::string *const *recipients, std::size_t recipientCount, CURLcode result) const {
+	std::vector<SimplyEmail::RecipientResult> toReturn(recipientCount);
+	const std::vector<SMTPTranscript::RecipientReply> &replies = this->transcript.getRecipientReplies();
+
+	//Replies arrive in the order the RCPT commands were sent
+	for(std::size_t i=0; i<recipientCount; i++){
+		toReturn[i].address = *recipients[i];
+		toReturn[i].replyCode = (i < replies.size()) ? replies[i].replyCode : 0;
+		toReturn[i].curlCode = result;
+
+		//A recipient only has the message if its RCPT was accepted and the transaction completed
+		toReturn[i].accepted = (result == CURLE_OK) && (toReturn[i].replyCode / 100 == 2);
+		toReturn[i].transient = !toReturn[i].accepted && SimplyEmail::SMTPError::isTransient(toReturn[i].replyCode, (result == CURLE_OK) ? (int)Metrics::FAILURE_REJECTED : classifyFailure(result));
+	}
+
+	return toReturn;
+}
+
+size_t SMTPConnection::readPayload(char *buffer, size_t size, size_t count, void *userData){
+	PayloadReader *reader = static_cast<PayloadReader*>(userData);
+
+	if(reader->connection->isCancelled()) {
+		return CURL_READFUNC_ABORT;
+	}
+
+	std::size_t toCopy;
+
+	if(reader->segments) {
+		toCopy = reader->segments->read(reader->offset, buffer, size * count);
+	}
+	else {
+		toCopy = std::min<std::uint64_t>(size * count, reader->size - reader->offset);
+		std::memcpy(buffer, reader->data + reader->offset, toCopy);
+	}
+
+	reader->offset += toCopy;
+
+	return toCopy;
+}
+
+int SMTPConnection::progressCallback(void *userData, curl_off_t downloadTotal, curl_off_t downloaded, curl_off_t uploadTotal, curl_off_t uploaded){
+	(void)downloadTotal;
+	(void)downloaded;
+	(void)uploadTotal;
+
+	//CURL also calls this between transfers on a reused handle
+	if(userData == NULL) {
+		return 0;
+	}
+
+	PayloadReader *reader = static_cast<PayloadReader*>(userData);
+	SMTPConnection *connection = reader->connection;
+
+	if(connection->isCancelled()) {
+		return 1;
+	}
+
+	//CURL counts the bytes it sent, which dot stuffing and the final "." can make more than the message
+	std::uint64_t total = reader->size;
+	std::uint64_t sent = std::min<std::uint64_t>((uploaded > 0) ? (std::uint64_t)uploaded : 0, total);
+
+	if(sent > reader->reported) {
+		reader->reported = sent;
+
+		if(connection->progress) {
+			connection->progress(sent, total);
+		}
+	}
+
+	return 0;
+}
+
+int SMTPConnection::debugCallback(CURL *handle, curl_infotype type, char *data, size_t size, void *userData){
+	(void)handle;
+	SMTPConnection *connection = static_cast<SMTPConnection*>(userData);
+
+	switch(type) {
+	case CURLINFO_HEADER_OUT:
+		connection->transcript.command(data, size);
+		break;
+
+	case CURLINFO_HEADER_IN:
+		connection->transcript.reply(data, size);
+		break;
+
+	default:
+		break;
+	}
+
+	//Mirror CURL's own verbose output
+	if(connection->verbose) {
+		static const char* prefixes[3] = {"* ", "< ", "> "};
+
+		if((type == CURLINFO_TEXT) || (type == CURLINFO_HEADER_IN) || (type == CURLINFO_HEADER_OUT)) {
+			fputs(prefixes[type], stderr);
+			fwrite(data, 1, size, stderr);
+		}
+	}
+
+	return 0;
+}
+
+void SMTPConnection::setVerbose(bool _verbose){
+	this->verbose = _verbose;
+}
+
+bool SMTPConnection::getVerbose() const {
+	return this->verbose;
+}
+
+const SimplyEmail::SMTPTranscript& SMTPConnection::getTranscript() const {
+	return this->transcript;
+}
+
+void SMTPConnection::setShare(SimplyEmail::ConnectionShare *_share) {
+	this->share = _share;
+
+	if(this->curl) {
+		curl_easy_setopt(this->curl, CURLOPT_SHARE, this->share ? this->share->getHandle() : NULL);
+	}
+}
+
+SimplyEmail::ConnectionShare* SMTPConnection::getShare() const {
+	return this->share;
+}
+
+void SMTPConnection::setTimeouts(const SimplyEmail::SendTimeouts &_timeouts) {
+	this->timeouts = _timeouts;
+
+	if(this->curl) {
+		curl_easy_setopt(this->curl, CURLOPT_LOW_SPEED_LIMIT, this->timeouts.lowSpeedLimit);
+		curl_easy_setopt(this->curl, CURLOPT_LOW_SPEED_TIME, (long)this->timeouts.lowSpeedTime.count());
+	}
+}
+
+const SimplyEmail::SendTimeouts& SMTPConnection::getTimeouts() const {
+	return this->timeouts;
+}
+
+void SMTPConnection::setProgressCallback(const ProgressCallback &callback) {
+	this->progress = callback;
+}
+
+const SMTPConnection::ProgressCallback& SMTPConnection::getProgressCallback() const {
+	return this->progress;
+}
+
+void SMTPConnection::cancel() {
+	//Marks only the send in progress; a cancel while idle stores 0, which no send is numbered
+	this->cancelledSend = this->activeSend.load();
+}
+
+std::uint64_t SMTPConnection::beginSend() {
+	if(this->activeSend.load(std::memory_order_relaxed) != 0) {
+		return 0;
+	}
+
+	this->activeSend = ++this->sendCount;
+
+	return this->sendCount;
+}
+
+void SMTPConnection::endSend(std::uint64_t sendNumber) {
+	if(sendNumber != 0) {
+		this->activeSend = 0;
+	}
+}
+
+bool SMTPConnection::isCancelled() const {
+	std::uint64_t active = this->activeSend.load(std::memory_order_relaxed);
+
+	return (active != 0) && (this->cancelledSend.load(std::memory_order_relaxed) == active);
+}
+
+void SMTPConnection::setSuppressionList(const SimplyEmail::SuppressionList *list) {
+	this->suppression = list;
+}
+
+const SimplyEmail::SuppressionList* SMTPConnection::getSuppressionList() const {
+	return this->suppression;
+}
+
+std::uint64_t SMTPConnection::getSizeLimit() const {
+	return this->sizeLimit;
+}
+
+void SMTPConnection::setOversizeFallback(SMTPConnection *fallback) {
+	this->oversizeFallback = fallback;
+}
+
+SMTPConnection* SMTPConnection::getOversizeFallback() const {
+	return this->oversizeFallback;
+}
+
+int SMTPConnection::getStatus() const {
+	return this->res.load();
 }
 
 std::string SMTPConnection::getAddress(){
@@ -185,12 +843,65 @@ std::string SMTPConnection::getPassword(){
 	return this->password;
 }
 
+int SMTPConnection::classifyFailure(CURLcode code){
+	switch(code) {
+	case CURLE_COULDNT_RESOLVE_PROXY:
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_SSL_CONNECT_ERROR:
+	case CURLE_PEER_FAILED_VERIFICATION:
+	case CURLE_SSL_CACERT_BADFILE:
+	case CURLE_USE_SSL_FAILED:
+		return Metrics::FAILURE_CONNECT;
+
+	case CURLE_LOGIN_DENIED:
+		return Metrics::FAILURE_AUTH;
+
+	case CURLE_OPERATION_TIMEDOUT:
+		return Metrics::FAILURE_TIMEOUT;
+
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_READ_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_PARTIAL_FILE:
+		return Metrics::FAILURE_TRANSFER;
+
+	case CURLE_WEIRD_SERVER_REPLY:
+	case CURLE_QUOTE_ERROR:
+	case CURLE_UPLOAD_FAILED:
+	case CURLE_REMOTE_ACCESS_DENIED:
+	case CURLE_REMOTE_DISK_FULL:
+	case CURLE_FILESIZE_EXCEEDED:
+		return Metrics::FAILURE_REJECTED;
+
+	default:
+		return Metrics::FAILURE_OTHER;
+	}
+}
+
 void SMTPConnection::checkConnection(unsigned int toCheck){
 	//Make sure the sending completed successfully
 	if(toCheck != CURLE_OK){
 		std::ostringstream oss;
 		oss<<"Error connecting to SMTP server: CURL returned the error " <<toCheck;
-		throw std::runtime_error(oss.str());
+
+		int replyCode = this->transcript.getLastReplyCode();
+		if(replyCode != 0) {
+			oss<<" (last SMTP reply " << replyCode << ")";
+		}
+
+		if(toCheck == CURLE_OPERATION_TIMEDOUT) {
+			oss<<" (timed out after " << this->lastElapsed.count() << " ms)";
+			throw SimplyEmail::SMTPTimeout(oss.str(), toCheck, replyCode, this->lastElapsed);
+		}
+
+		if(toCheck == CURLE_ABORTED_BY_CALLBACK) {
+			oss<<" (cancelled after " << this->lastUploaded << " bytes)";
+			throw SimplyEmail::SMTPCancelled(oss.str(), toCheck, replyCode, this->lastUploaded);
+		}
+
+		throw SimplyEmail::SMTPError(oss.str(), toCheck, replyCode, this->classifyFailure((CURLcode)toCheck));
 	}
 }
 
@@ -0,0 +1,68 @@
+/**
+ * \file SMTPError.cpp
+ *
+ * \brief Implementation file for the SMTP send error
+ */
+
+#include "../lib/SMTPError.h"
+#include "../lib/Metrics.h"
+
+namespace SimplyEmail {
+
+SMTPError::SMTPError(const std::string &message, int _curlCode, int _replyCode, int _failureClass) : std::runtime_error(message) {
+	this->curlCode = _curlCode;
+	this->replyCode = _replyCode;
+	this->failureClass = _failureClass;
+}
+
+int SMTPError::getCurlCode() const {
+	return this->curlCode;
+}
+
+int SMTPError::getReplyCode() const {
+	return this->replyCode;
+}
+
+int SMTPError::getFailureClass() const {
+	return this->failureClass;
+}
+
+bool SMTPError::isTransient() const {
+	return isTransient(this->replyCode, this->failureClass);
+}
+
+bool SMTPError::isTransient(int replyCode, int failureClass) {
+	if((replyCode >= 400) && (replyCode < 500)) {
+		return true;
+	}
+
+	if((replyCode >= 500) && (replyCode < 600)) {
+		return false;
+	}
+
+	switch(failureClass) {
+	case Metrics::FAILURE_CONNECT:
+	case Metrics::FAILURE_TIMEOUT:
+	case Metrics::FAILURE_TRANSFER:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+SMTPTimeout::SMTPTimeout(const std::string &message, int _curlCode, int _replyCode, std::chrono::milliseconds _elapsed) : SMTPError(message, _curlCode, _replyCode, Metrics::FAILURE_TIMEOUT), elapsed(_elapsed) {
+}
+
+std::chrono::milliseconds SMTPTimeout::getElapsed() const {
+	return this->elapsed;
+}
+
+SMTPCancelled::SMTPCancelled(const std::string &message, int _curlCode, int _replyCode, std::uint64_t _bytesSent) : SMTPError(message, _curlCode, _replyCode, Metrics::FAILURE_OTHER), bytesSent(_bytesSent) {
+}
+
+std::uint64_t SMTPCancelled::getBytesSent() const {
+	return this->bytesSent;
+}
+
+} /* namespace SimplyEmail */
@@ -0,0 +1,194 @@
+/**
+ * \file SMTPEventLoop.cpp
+ *
+ * \brief Implementation file for the thread driving native SMTP connections
+ */
+
+#include "../lib/SMTPEventLoop.h"
+#include "../lib/NativeSMTPConnection.h"
+
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+
+namespace SimplyEmail {
+
+const std::chrono::milliseconds SMTPEventLoop::TICK(10);
+
+namespace {
+
+//The most events taken from epoll at once
+const int MAX_EVENTS = 64;
+
+} /* namespace */
+
+SMTPEventLoop::SMTPEventLoop() : stopping(false), connections(0) {
+	this->epoll = epoll_create1(EPOLL_CLOEXEC);
+
+	if(this->epoll < 0) {
+		throw std::runtime_error(std::string("Error starting event loop: Unable to create epoll instance: ") + std::strerror(errno));
+	}
+
+	this->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+
+	if((this->wakeup < 0) || (epoll_ctl(this->epoll, EPOLL_CTL_ADD, this->wakeup, &event) != 0)) {
+		std::string reason = std::strerror(errno);
+
+		if(this->wakeup >= 0) {
+			::close(this->wakeup);
+		}
+		::close(this->epoll);
+
+		throw std::runtime_error("Error starting event loop: Unable to create wakeup event: " + reason);
+	}
+
+	//Verify servers against the trusted certificates, which OpenSSL also looks for in SSL_CERT_FILE and SSL_CERT_DIR
+	this->tls = SSL_CTX_new(TLS_client_method());
+
+	if(!this->tls || (SSL_CTX_set_default_verify_paths(this->tls) != 1) || (SSL_CTX_set_min_proto_version(this->tls, TLS1_2_VERSION) != 1)) {
+		if(this->tls) {
+			SSL_CTX_free(this->tls);
+		}
+		::close(this->wakeup);
+		::close(this->epoll);
+
+		throw std::runtime_error("Error starting event loop: Unable to set up TLS");
+	}
+
+	SSL_CTX_set_verify(this->tls, SSL_VERIFY_PEER, NULL);
+	SSL_CTX_set_mode(this->tls, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	//Each connection keeps the last session it was issued instead of a cache shared by the loop
+	SSL_CTX_set_session_cache_mode(this->tls, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(this->tls, NativeSMTPConnection::keepSession);
+
+	this->started = std::chrono::steady_clock::now();
+	this->thread = std::thread(&SMTPEventLoop::run, this);
+}
+
+SMTPEventLoop::~SMTPEventLoop() {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+
+	std::uint64_t one = 1;
+	if(::write(this->wakeup, &one, sizeof(one)) < 0) {
+		//The counter is already set, so the thread wakes anyway
+	}
+
+	this->thread.join();
+
+	SSL_CTX_free(this->tls);
+	::close(this->wakeup);
+	::close(this->epoll);
+}
+
+std::size_t SMTPEventLoop::getConnectionCount() const {
+	return this->connections.load();
+}
+
+void SMTPEventLoop::post(const std::function<void()> &task) {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->tasks.push_back(task);
+	}
+
+	std::uint64_t one = 1;
+	if(::write(this->wakeup, &one, sizeof(one)) < 0) {
+		//The counter is already set, so the thread wakes anyway
+	}
+}
+
+bool SMTPEventLoop::watch(int socket, std::uint32_t events, NativeSMTPConnection *connection, bool watched) {
+	if(events == 0) {
+		return !watched || (epoll_ctl(this->epoll, EPOLL_CTL_DEL, socket, NULL) == 0);
+	}
+
+	struct epoll_event event;
+	event.events = events;
+	event.data.ptr = connection;
+
+	return epoll_ctl(this->epoll, watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, socket, &event) == 0;
+}
+
+void SMTPEventLoop::schedule(NativeSMTPConnection *connection, TimerWheel::Handle &handle, std::chrono::steady_clock::time_point when) {
+	this->unschedule(handle);
+
+	//Round up, so a timeout never falls due early
+	std::int64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(when - this->started).count();
+	std::int64_t tickMicros = std::chrono::duration_cast<std::chrono::microseconds>(TICK).count();
+	std::uint64_t tick = (micros > 0) ? (std::uint64_t)((micros + tickMicros - 1) / tickMicros) : 0;
+
+	handle = this->wheel.schedule((std::uint64_t)reinterpret_cast<std::uintptr_t>(connection), tick);
+}
+
+void SMTPEventLoop::unschedule(TimerWheel::Handle &handle) {
+	if(handle != TimerWheel::INVALID_HANDLE) {
+		this->wheel.cancel(handle);
+		handle = TimerWheel::INVALID_HANDLE;
+	}
+}
+
+void SMTPEventLoop::run() {
+	struct epoll_event ready[MAX_EVENTS];
+	std::vector<std::function<void()> > running;
+
+	while(true) {
+		//Only wake every tick while a timeout is pending
+		int timeout = (this->wheel.getSize() > 0) ? (int)TICK.count() : -1;
+		int count = epoll_wait(this->epoll, ready, MAX_EVENTS, timeout);
+
+		for(int i=0; i<count; i++){
+			if(ready[i].data.ptr == NULL) {
+				std::uint64_t value;
+				if(::read(this->wakeup, &value, sizeof(value)) < 0) {
+					//Another read already reset the counter
+				}
+				continue;
+			}
+
+			static_cast<NativeSMTPConnection*>(ready[i].data.ptr)->handleEvents(ready[i].events);
+		}
+
+		//Tasks run after the events, so a connection a task destroys has no events left to handle
+		bool stop;
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			running.swap(this->tasks);
+			stop = this->stopping;
+		}
+
+		for(std::size_t i=0; i<running.size(); i++){
+			running[i]();
+		}
+		running.clear();
+
+		if(stop) {
+			return;
+		}
+
+		if(this->wheel.getSize() > 0) {
+			std::uint64_t now = (std::uint64_t)((std::chrono::steady_clock::now() - this->started) / TICK);
+
+			this->wheel.advance(now, this->expired);
+
+			for(std::size_t i=0; i<this->expired.size(); i++){
+				NativeSMTPConnection *connection = reinterpret_cast<NativeSMTPConnection*>((std::uintptr_t)this->expired[i]);
+				connection->timer = TimerWheel::INVALID_HANDLE;
+				connection->handleTimeout();
+			}
+			this->expired.clear();
+		}
+	}
+}
+
+} /* namespace SimplyEmail */
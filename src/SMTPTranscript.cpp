@@ -0,0 +1,157 @@
+/**
+ * \file SMTPTranscript.cpp
+ *
+ * \brief Implementation file for the SMTP conversation transcript
+ */
+
+#include "../lib/SMTPTranscript.h"
+
+#include <cctype>
+
+namespace SimplyEmail {
+
+namespace {
+
+/**
+ * \brief Splits text into lines without their line endings and hands each to a function
+ */
+template <class Function>
+void forEachLine(const char *text, std::size_t length, Function function) {
+	std::size_t start = 0;
+
+	for(std::size_t i=0; i<=length; i++){
+		if((i == length) || (text[i] == '\n')) {
+			std::size_t end = i;
+			if((end > start) && (text[end-1] == '\r')) {
+				end--;
+			}
+
+			if(end > start) {
+				function(std::string(text + start, end - start));
+			}
+
+			start = i + 1;
+		}
+	}
+}
+
+bool startsWithNoCase(const std::string &text, const char *prefix) {
+	std::size_t i = 0;
+
+	while(prefix[i] != '\0') {
+		if((i >= text.length()) || (std::toupper((unsigned char)text[i]) != prefix[i])) {
+			return false;
+		}
+		i++;
+	}
+
+	return true;
+}
+
+} /* namespace */
+
+SMTPTranscript::SMTPTranscript() {
+	this->pending = PENDING_NONE;
+	this->lastReplyCode = 0;
+}
+
+void SMTPTranscript::clear() {
+	this->pending = PENDING_NONE;
+	this->pendingAddress.clear();
+	this->recipientReplies.clear();
+	this->lastReplyCode = 0;
+}
+
+void SMTPTranscript::command(const char *text, std::size_t length) {
+	forEachLine(text, length, [this](const std::string &line) { this->commandLine(line); });
+}
+
+void SMTPTranscript::reply(const char *text, std::size_t length) {
+	forEachLine(text, length, [this](const std::string &line) { this->replyLine(line); });
+}
+
+const std::vector<SMTPTranscript::RecipientReply>& SMTPTranscript::getRecipientReplies() const {
+	return this->recipientReplies;
+}
+
+const std::vector<std::string>& SMTPTranscript::getCapabilities() const {
+	return this->capabilities;
+}
+
+int SMTPTranscript::getLastReplyCode() const {
+	return this->lastReplyCode;
+}
+
+void SMTPTranscript::commandLine(const std::string &line) {
+	if(startsWithNoCase(line, "EHLO")) {
+		this->pending = PENDING_EHLO;
+		this->pendingCapabilities.clear();
+	}
+	else if(startsWithNoCase(line, "RCPT TO:")) {
+		this->pending = PENDING_RCPT;
+
+		//Take the address from between the angle brackets, ignoring any parameters after them
+		std::size_t open = line.find('<');
+		std::size_t close = line.find('>', (open == std::string::npos) ? 0 : open);
+
+		if((open != std::string::npos) && (close != std::string::npos)) {
+			this->pendingAddress = line.substr(open + 1, close - open - 1);
+		}
+		else {
+			this->pendingAddress = line.substr(8);
+		}
+	}
+	else if(startsWithNoCase(line, "QUIT")) {
+		this->pending = PENDING_QUIT;
+	}
+	else {
+		this->pending = PENDING_NONE;
+	}
+}
+
+void SMTPTranscript::replyLine(const std::string &line) {
+	if((line.length() < 3) || !std::isdigit((unsigned char)line[0]) || !std::isdigit((unsigned char)line[1]) || !std::isdigit((unsigned char)line[2])) {
+		return;
+	}
+
+	int code = ((line[0] - '0') * 100) + ((line[1] - '0') * 10) + (line[2] - '0');
+	bool final = (line.length() == 3) || (line[3] != '-');
+
+	//Every line of an EHLO reply after the greeting names an extension
+	if(this->pending == PENDING_EHLO) {
+		if(line.length() > 4) {
+			this->pendingCapabilities.push_back(line.substr(4));
+		}
+
+		if(final) {
+			if(code / 100 == 2) {
+				//The first line is the server greeting, not an extension
+				if(!this->pendingCapabilities.empty()) {
+					this->pendingCapabilities.erase(this->pendingCapabilities.begin());
+				}
+				this->capabilities.swap(this->pendingCapabilities);
+			}
+			this->pendingCapabilities.clear();
+		}
+	}
+
+	if(!final) {
+		return;
+	}
+
+	//CURL quits after a failure; the closing reply must not hide the one that failed the transaction
+	if(this->pending != PENDING_QUIT) {
+		this->lastReplyCode = code;
+	}
+
+	if(this->pending == PENDING_RCPT) {
+		RecipientReply result;
+		result.address = this->pendingAddress;
+		result.replyCode = code;
+		this->recipientReplies.push_back(result);
+	}
+
+	this->pending = PENDING_NONE;
+}
+
+} /* namespace SimplyEmail */
@@ -0,0 +1,296 @@
+/**
+ * \file SendScheduler.cpp
+ *
+ * \brief Implementation file for sharing connections between classes of mail by priority
+ */
+
+#include "../lib/SendScheduler.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace SimplyEmail {
+
+const std::size_t SendScheduler::NO_CLASS = (std::size_t)-1;
+
+namespace {
+
+//The upper bound of the bucket holding the given fraction of the observations, or the largest observation
+std::uint64_t quantile(const HistogramSnapshot &histogram, double fraction, std::uint64_t largest) {
+	if(histogram.count == 0) {
+		return 0;
+	}
+
+	std::uint64_t rank = (std::uint64_t)(fraction * histogram.count + 0.5);
+	if(rank == 0) {
+		rank = 1;
+	}
+
+	std::uint64_t seen = 0;
+
+	for(std::size_t i=0; i<LatencyHistogram::BUCKET_COUNT; i++){
+		seen += histogram.buckets[i];
+
+		if(seen >= rank) {
+			return std::min(LatencyHistogram::BUCKET_BOUNDS[i], largest);
+		}
+	}
+
+	return largest;
+}
+
+} /* namespace */
+
+PriorityClass::PriorityClass(const std::string &_name, unsigned int _weight, unsigned int _reserved, std::size_t _maxQueued, std::chrono::milliseconds _budget) : name(_name), weight(_weight), reserved(_reserved), maxQueued(_maxQueued), budget(_budget) {
+}
+
+SendScheduler::ClassState::ClassState(const PriorityClass &_config) : config(_config) {
+	this->lastFinish = 0;
+	this->sending = 0;
+	this->sent = 0;
+	this->failed = 0;
+	this->timedOut = 0;
+	this->maxQueueMicros = 0;
+}
+
+SendScheduler::SendScheduler(const std::vector<SMTPConnection*> &_connections, const std::vector<PriorityClass> &_classes) : connections(_connections) {
+	if(this->connections.empty()) {
+		throw std::runtime_error("Error creating send scheduler: No connections given");
+	}
+
+	if(_classes.empty()) {
+		throw std::runtime_error("Error creating send scheduler: No priority classes given");
+	}
+
+	std::size_t reserved = 0;
+
+	for(std::size_t i=0; i<_classes.size(); i++){
+		if(_classes[i].weight == 0) {
+			throw std::runtime_error("Error creating send scheduler: Priority class " + _classes[i].name + " has no weight");
+		}
+
+		reserved += _classes[i].reserved;
+	}
+
+	if(reserved >= this->connections.size()) {
+		throw std::runtime_error("Error creating send scheduler: Reserved connections leave none shared");
+	}
+
+	//The first connections are reserved, in class order; the rest are shared
+	for(std::size_t i=0; i<_classes.size(); i++){
+		this->classes.push_back(std::unique_ptr<ClassState>(new ClassState(_classes[i])));
+
+		for(unsigned int j=0; j<_classes[i].reserved; j++){
+			this->dedicated.push_back(i);
+		}
+	}
+
+	this->dedicated.resize(this->connections.size(), NO_CLASS);
+
+	this->virtualTime = 0;
+	this->submitted = 0;
+	this->completed = 0;
+	this->stopping = false;
+
+	for(std::size_t i=0; i<this->connections.size(); i++){
+		this->workers.push_back(std::thread(&SendScheduler::workerLoop, this, i));
+	}
+}
+
+SendScheduler::~SendScheduler() {
+	this->flush();
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+
+	this->changed.notify_all();
+
+	for(std::size_t i=0; i<this->workers.size(); i++){
+		this->workers[i].join();
+	}
+}
+
+std::future<void> SendScheduler::submit(const SimplyEmail::Email &email, std::size_t priorityClass) {
+	if(priorityClass >= this->classes.size()) {
+		throw std::out_of_range("Error submitting email: priority class out of range");
+	}
+
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	ClassState &state = *this->classes[priorityClass];
+
+	while((state.config.maxQueued > 0) && (state.queue.size() >= state.config.maxQueued)) {
+		this->changed.wait(lock);
+	}
+
+	//Self-clocked fair queuing: a message finishes one weighted step after the later of now and its class's last
+	state.queue.push_back(Item());
+
+	Item &item = state.queue.back();
+	item.email = &email;
+	item.submitted = std::chrono::steady_clock::now();
+	item.finish = std::max(this->virtualTime, state.lastFinish) + 1.0 / state.config.weight;
+
+	state.lastFinish = item.finish;
+
+	std::future<void> toReturn = item.done.get_future();
+
+	this->submitted++;
+	Metrics::adjustQueueDepth(1);
+
+	lock.unlock();
+	this->changed.notify_all();
+
+	return toReturn;
+}
+
+void SendScheduler::flush() {
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while(this->completed < this->submitted) {
+		this->changed.wait(lock);
+	}
+}
+
+std::vector<SimplyEmail::PriorityClassStats> SendScheduler::getStats() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	std::vector<PriorityClassStats> toReturn(this->classes.size());
+
+	for(std::size_t i=0; i<this->classes.size(); i++){
+		const ClassState &state = *this->classes[i];
+		PriorityClassStats &stats = toReturn[i];
+
+		stats.name = state.config.name;
+		stats.queued = state.queue.size();
+		stats.sending = state.sending;
+		stats.sent = state.sent;
+		stats.failed = state.failed;
+		stats.timedOut = state.timedOut;
+		stats.maxQueueMicros = state.maxQueueMicros;
+
+		state.queueLatency.read(stats.queueLatency.buckets, stats.queueLatency.count, stats.queueLatency.sum);
+		stats.p50QueueMicros = quantile(stats.queueLatency, 0.50, stats.maxQueueMicros);
+		stats.p99QueueMicros = quantile(stats.queueLatency, 0.99, stats.maxQueueMicros);
+	}
+
+	return toReturn;
+}
+
+std::size_t SendScheduler::getClassCount() const {
+	return this->classes.size();
+}
+
+std::size_t SendScheduler::getConnectionCount() const {
+	return this->connections.size();
+}
+
+std::size_t SendScheduler::choose(std::size_t reservedFor) const {
+	if(reservedFor != NO_CLASS) {
+		return this->classes[reservedFor]->queue.empty() ? NO_CLASS : reservedFor;
+	}
+
+	std::size_t toReturn = NO_CLASS;
+
+	for(std::size_t i=0; i<this->classes.size(); i++){
+		if(this->classes[i]->queue.empty()) {
+			continue;
+		}
+
+		if((toReturn == NO_CLASS) || (this->classes[i]->queue.front().finish < this->classes[toReturn]->queue.front().finish)) {
+			toReturn = i;
+		}
+	}
+
+	return toReturn;
+}
+
+void SendScheduler::workerLoop(std::size_t connectionNumber) {
+	SMTPConnection &connection = *this->connections[connectionNumber];
+	std::size_t reservedFor = this->dedicated[connectionNumber];
+
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while(true) {
+		std::size_t chosen;
+
+		while(((chosen = this->choose(reservedFor)) == NO_CLASS) && !this->stopping) {
+			this->changed.wait(lock);
+		}
+
+		if(chosen == NO_CLASS) {
+			return;
+		}
+
+		ClassState &state = *this->classes[chosen];
+
+		Item item = std::move(state.queue.front());
+		state.queue.pop_front();
+		state.sending++;
+
+		//A dedicated connection may take a message out of finish order; never move the clock back
+		this->virtualTime = std::max(this->virtualTime, item.finish);
+
+		std::uint64_t waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - item.submitted).count();
+		state.maxQueueMicros = std::max(state.maxQueueMicros, waited);
+		state.queueLatency.observe(waited);
+
+		Metrics::adjustQueueDepth(-1);
+
+		//Wake a submitter waiting for room in the queue
+		lock.unlock();
+		this->changed.notify_all();
+
+		std::exception_ptr error;
+		bool timedOut = false;
+
+		try {
+			if(state.config.budget.count() > 0) {
+				connection.send(*item.email, item.submitted + state.config.budget);
+			}
+			else {
+				connection.send(*item.email);
+			}
+		}
+		catch(const SMTPTimeout&) {
+			error = std::current_exception();
+			timedOut = true;
+		}
+		catch(...) {
+			error = std::current_exception();
+		}
+
+		//Count the outcome before reporting it, so the statistics agree with every future that is ready
+		lock.lock();
+
+		state.sending--;
+		if(error) {
+			state.failed++;
+		}
+		else {
+			state.sent++;
+		}
+
+		if(timedOut) {
+			state.timedOut++;
+		}
+
+		this->completed++;
+
+		lock.unlock();
+		this->changed.notify_all();
+
+		if(error) {
+			item.done.set_exception(error);
+		}
+		else {
+			item.done.set_value();
+		}
+
+		lock.lock();
+	}
+}
+
+} /* namespace SimplyEmail */
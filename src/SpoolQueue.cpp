@@ -0,0 +1,232 @@
+/**
+ * \file SpoolQueue.cpp
+ *
+ * \brief Implementation file for the queue of encoded messages governed by a memory budget
+ */
+
+#include "../lib/SpoolQueue.h"
+#include "../lib/Metrics.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace SimplyEmail {
+
+SpooledMessage::SpooledMessage(MemoryBudget &_budget, const Email &email) : budget(_budget) {
+	this->from = email.getFrom();
+
+	const std::vector<std::string> &recipients = email.getRecipients();
+	const std::vector<std::string> &cc = email.getCCs();
+	const std::vector<std::string> &bcc = email.getBCCs();
+
+	if(recipients.empty()) {
+		throw std::runtime_error("Error queueing message: No recipients defined in email");
+	}
+
+	this->envelope.reserve(recipients.size() + cc.size() + bcc.size());
+	this->envelope.insert(this->envelope.end(), recipients.begin(), recipients.end());
+	this->envelope.insert(this->envelope.end(), cc.begin(), cc.end());
+	this->envelope.insert(this->envelope.end(), bcc.begin(), bcc.end());
+
+	this->payload = email.encode();
+	this->size = this->payload.size();
+	this->charged = false;
+}
+
+SpooledMessage::~SpooledMessage() {
+	if(this->charged) {
+		this->budget.release(this->size);
+	}
+
+	if(!this->spillPath.empty()) {
+		unlink(this->spillPath.c_str());
+	}
+}
+
+const std::string& SpooledMessage::getFrom() const {
+	return this->from;
+}
+
+const std::vector<std::string>& SpooledMessage::getEnvelope() const {
+	return this->envelope;
+}
+
+std::size_t SpooledMessage::getSize() const {
+	return this->size;
+}
+
+bool SpooledMessage::isSpilled() const {
+	return !this->spillPath.empty();
+}
+
+const std::string& SpooledMessage::getPayload() const {
+	return this->payload;
+}
+
+const std::string& SpooledMessage::getSpillPath() const {
+	return this->spillPath;
+}
+
+bool SpooledMessage::spill() {
+	if(this->isSpilled() || (this->size == 0)) {
+		return false;
+	}
+
+	std::string path = this->budget.getScratchDirectory() + "/spool.XXXXXX";
+	std::vector<char> name(path.begin(), path.end());
+	name.push_back('\0');
+
+	int descriptor = mkstemp(&name[0]);
+	if(descriptor < 0) {
+		return false;
+	}
+
+	//Write the whole payload; on any failure keep the message in memory
+	std::size_t written = 0;
+	while(written < this->size) {
+		ssize_t result = write(descriptor, this->payload.data() + written, this->size - written);
+
+		if(result < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			break;
+		}
+
+		if(result == 0) {
+			break;
+		}
+
+		written += result;
+	}
+
+	if((close(descriptor) != 0) || (written != this->size)) {
+		unlink(&name[0]);
+		return false;
+	}
+
+	this->spillPath = &name[0];
+
+	std::string().swap(this->payload);
+
+	if(this->charged) {
+		this->budget.release(this->size);
+		this->charged = false;
+	}
+
+	this->budget.recordSpill(this->size);
+
+	return true;
+}
+
+SpoolQueue::SpoolQueue(MemoryBudget &_budget) : budget(_budget) {
+	this->closed = false;
+	this->budget.registerSpillable(this);
+}
+
+SpoolQueue::~SpoolQueue() {
+	this->budget.unregisterSpillable(this);
+
+	Metrics::adjustQueueDepth(-(std::int64_t)this->messages.size());
+}
+
+void SpoolQueue::push(const Email &email) {
+	//Charge the budget before encoding, so a push that has to wait or fail holds no payload while it does
+	std::size_t reserved = email.encodedSize();
+	this->budget.acquire(reserved);
+
+	std::unique_ptr<SpooledMessage> message;
+
+	try {
+		message.reset(new SpooledMessage(this->budget, email));
+
+		//The Date field may have changed length between counting and encoding
+		if(message->getSize() > reserved) {
+			this->budget.acquire(message->getSize() - reserved);
+		}
+	}
+	catch(...) {
+		this->budget.release(reserved);
+		throw;
+	}
+
+	if(message->getSize() < reserved) {
+		this->budget.release(reserved - message->getSize());
+	}
+
+	message->charged = true;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		if(this->closed) {
+			throw std::runtime_error("Error queueing message: The queue is closed");
+		}
+
+		this->messages.push_back(std::move(message));
+		Metrics::adjustQueueDepth(1);
+	}
+
+	this->available.notify_one();
+}
+
+std::unique_ptr<SpooledMessage> SpoolQueue::pop() {
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while(this->messages.empty() && !this->closed) {
+		this->available.wait(lock);
+	}
+
+	std::unique_ptr<SpooledMessage> toReturn;
+
+	if(!this->messages.empty()) {
+		toReturn = std::move(this->messages.front());
+		this->messages.pop_front();
+		Metrics::adjustQueueDepth(-1);
+	}
+
+	return toReturn;
+}
+
+void SpoolQueue::close() {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->closed = true;
+	}
+
+	this->available.notify_all();
+}
+
+std::size_t SpoolQueue::getSize() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->messages.size();
+}
+
+std::size_t SpoolQueue::spill(std::size_t bytes) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	std::size_t freed = 0;
+
+	//The newest messages will be sent last, so they are the coldest
+	for(std::size_t i=this->messages.size(); (i>0) && (freed < bytes); i--){
+		SpooledMessage &message = *this->messages[i-1];
+
+		if(message.isSpilled()) {
+			continue;
+		}
+
+		if(!message.spill()) {
+			break;
+		}
+
+		freed += message.getSize();
+	}
+
+	return freed;
+}
+
+} /* namespace SimplyEmail */
@@ -0,0 +1,424 @@
+/**
+ * \file SuppressionList.cpp
+ *
+ * \brief Implementation file for lists of bounced or unsubscribed addresses that must not be sent to
+ */
+
+#include "../lib/SuppressionList.h"
+#include "../lib/MappedFile.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace SimplyEmail {
+
+const unsigned int SuppressionList::DEFAULT_BITS_PER_ENTRY = 12;
+
+namespace {
+
+const std::size_t BLOCK_WORDS = 8;						//One 64 byte cache line of filter bits per block
+const std::size_t BLOCK_BITS = BLOCK_WORDS * 64;
+const std::size_t MAX_STACK_KEY = 256;					//Longer addresses are normalized on the heap
+const std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+const std::size_t SAMPLE_INTERVAL = 32;					//Lines between entries of the sparse index
+
+//MurmurHash64A
+std::uint64_t hashKey(const char *key, std::size_t length) {
+	const std::uint64_t multiplier = 0xc6a4a7935bd1e995ULL;
+	const int shift = 47;
+
+	std::uint64_t hash = 0x9e3779b97f4a7c15ULL ^ (length * multiplier);
+
+	while(length >= 8) {
+		std::uint64_t word;
+		std::memcpy(&word, key, 8);
+
+		word *= multiplier;
+		word ^= word >> shift;
+		word *= multiplier;
+
+		hash ^= word;
+		hash *= multiplier;
+
+		key += 8;
+		length -= 8;
+	}
+
+	if(length > 0) {
+		std::uint64_t word = 0;
+		std::memcpy(&word, key, length);
+
+		hash ^= word;
+		hash *= multiplier;
+	}
+
+	hash ^= hash >> shift;
+	hash *= multiplier;
+	hash ^= hash >> shift;
+
+	return hash;
+}
+
+//The high half of the hash picks the block, a remix of it picks one bit in each of the block's words
+inline std::uint64_t blockOf(std::uint64_t hash, std::uint64_t blockCount) {
+	return ((hash >> 32) * blockCount) >> 32;
+}
+
+inline std::uint64_t bitsOf(std::uint64_t hash) {
+	return (hash ^ (hash >> 29)) * 0xbf58476d1ce4e5b9ULL;
+}
+
+inline bool isTrimmed(char character) {
+	return (character == ' ') || (character == '\t') || (character == '\r') || (character == '\n') || (character == '<') || (character == '>');
+}
+
+inline char lowerCase(char character) {
+	return ((character >= 'A') && (character <= 'Z')) ? (char)(character - 'A' + 'a') : character;
+}
+
+//The first eight bytes of a key as a number that sorts like the key, padded with zeros
+inline std::uint64_t prefixOf(const char *key, std::size_t length) {
+	std::uint64_t prefix = 0;
+
+	for(std::size_t i=0; i<8; i++){
+		prefix = (prefix << 8) | ((i < length) ? (unsigned char)key[i] : 0);
+	}
+
+	return prefix;
+}
+
+//Compares like std::string::compare
+inline int compareKeys(const char *left, std::size_t leftLength, const char *right, std::size_t rightLength) {
+	int result = std::memcmp(left, right, std::min(leftLength, rightLength));
+
+	if(result != 0) {
+		return result;
+	}
+
+	return (leftLength < rightLength) ? -1 : ((leftLength > rightLength) ? 1 : 0);
+}
+
+} /* namespace */
+
+/**
+ * \brief One loaded version of the list
+ */
+struct SuppressionList::Snapshot {
+	std::unique_ptr<MappedFile> file;					/// The sorted addresses
+	std::vector<std::uint64_t> storage;					/// The filter, with room to align it to a cache line
+	const std::uint64_t *blocks;						/// The first filter block within storage
+	std::uint64_t blockCount;							/// The number of filter blocks
+	std::vector<std::uint64_t> prefixes;				/// The prefix of every SAMPLE_INTERVAL'th address
+	std::vector<std::uint64_t> offsets;					/// The file offset of every SAMPLE_INTERVAL'th address
+	std::size_t entries;								/// The number of addresses
+	struct stat status;									/// The file as it was when loaded
+};
+
+SuppressionList::SuppressionList(const std::string &filePath, unsigned int _bitsPerEntry) : path(filePath), bitsPerEntry(_bitsPerEntry) {
+	if(this->bitsPerEntry == 0) {
+		this->bitsPerEntry = DEFAULT_BITS_PER_ENTRY;
+	}
+
+	this->current = this->load();
+}
+
+bool SuppressionList::contains(const std::string &address) const {
+	return lookupAddress(*this->snapshot(), address);
+}
+
+std::size_t SuppressionList::filter(std::vector<std::string> &addresses, std::vector<std::string> *suppressed) const {
+	//One reference for the whole batch keeps every lookup on the same version and the reference count off the hot path
+	std::shared_ptr<const Snapshot> loaded = this->snapshot();
+	const Snapshot &list = *loaded;
+
+	std::size_t kept = 0;
+
+	for(std::size_t i=0; i<addresses.size(); i++){
+		if(lookupAddress(list, addresses[i])) {
+			if(suppressed) {
+				suppressed->push_back(addresses[i]);
+			}
+		}
+		else {
+			if(kept != i) {
+				addresses[kept].swap(addresses[i]);
+			}
+			kept++;
+		}
+	}
+
+	std::size_t removed = addresses.size() - kept;
+	addresses.resize(kept);
+
+	return removed;
+}
+
+void SuppressionList::reload() {
+	std::lock_guard<std::mutex> lock(this->reloadMutex);
+
+	std::shared_ptr<const Snapshot> loaded = this->load();
+	std::atomic_store(&this->current, loaded);
+}
+
+bool SuppressionList::reloadIfChanged() {
+	std::lock_guard<std::mutex> lock(this->reloadMutex);
+
+	struct stat status;
+	if(stat(this->path.c_str(), &status) != 0) {
+		throw std::runtime_error("Error loading suppression list: could not stat " + this->path);
+	}
+
+	const struct stat loaded = this->snapshot()->status;
+
+	if((status.st_dev == loaded.st_dev) && (status.st_ino == loaded.st_ino) && (status.st_size == loaded.st_size)
+			&& (status.st_mtim.tv_sec == loaded.st_mtim.tv_sec) && (status.st_mtim.tv_nsec == loaded.st_mtim.tv_nsec)) {
+		return false;
+	}
+
+	std::shared_ptr<const Snapshot> replacement = this->load();
+	std::atomic_store(&this->current, replacement);
+
+	return true;
+}
+
+std::string SuppressionList::normalize(const std::string &address) {
+	std::size_t start = 0;
+	std::size_t end = address.length();
+
+	while((start < end) && isTrimmed(address[start])) {
+		start++;
+	}
+
+	while((end > start) && isTrimmed(address[end - 1])) {
+		end--;
+	}
+
+	std::string toReturn(address, start, end - start);
+
+	for(std::size_t i=0; i<toReturn.length(); i++){
+		toReturn[i] = lowerCase(toReturn[i]);
+	}
+
+	return toReturn;
+}
+
+const std::string& SuppressionList::getPath() const {
+	return this->path;
+}
+
+std::size_t SuppressionList::getEntryCount() const {
+	return this->snapshot()->entries;
+}
+
+std::size_t SuppressionList::getMemoryUsage() const {
+	std::shared_ptr<const Snapshot> list = this->snapshot();
+
+	return (list->storage.size() + list->prefixes.size() + list->offsets.size()) * sizeof(std::uint64_t);
+}
+
+std::shared_ptr<const SuppressionList::Snapshot> SuppressionList::snapshot() const {
+	return std::atomic_load(&this->current);
+}
+
+std::shared_ptr<const SuppressionList::Snapshot> SuppressionList::load() const {
+	std::shared_ptr<Snapshot> toReturn = std::make_shared<Snapshot>();
+
+	//Stat before mapping, so a file replaced in between is seen as changed by the next check
+	if(stat(this->path.c_str(), &toReturn->status) != 0) {
+		throw std::runtime_error("Error loading suppression list: could not stat " + this->path);
+	}
+
+	toReturn->file.reset(new MappedFile(this->path));
+
+	const char *data = toReturn->file->getData();
+	std::size_t size = toReturn->file->getSize();
+
+	//First pass checks the file and counts the addresses
+	std::size_t entries = 0;
+	const char *previous = NULL;
+	std::size_t previousLength = 0;
+
+	for(std::size_t start = 0; start < size; ) {
+		const char *newline = static_cast<const char*>(std::memchr(data + start, '\n', size - start));
+		std::size_t end = newline ? (std::size_t)(newline - data) : size;
+		std::size_t length = end - start;
+
+		if(length == 0) {
+			throw std::runtime_error("Error loading suppression list: blank line in " + this->path);
+		}
+
+		for(std::size_t i=start; i<end; i++){
+			if(isTrimmed(data[i]) || (lowerCase(data[i]) != data[i])) {
+				throw std::runtime_error("Error loading suppression list: address not in lower case or containing whitespace or angle brackets in " + this->path);
+			}
+		}
+
+		if(previous && (compareKeys(previous, previousLength, data + start, length) > 0)) {
+			throw std::runtime_error("Error loading suppression list: addresses not sorted in " + this->path);
+		}
+
+		if(entries % SAMPLE_INTERVAL == 0) {
+			toReturn->prefixes.push_back(prefixOf(data + start, length));
+			toReturn->offsets.push_back(start);
+		}
+
+		previous = data + start;
+		previousLength = length;
+		entries++;
+
+		start = end + 1;
+	}
+
+	std::uint64_t blockCount = ((std::uint64_t)entries * this->bitsPerEntry + BLOCK_BITS - 1) / BLOCK_BITS;
+	if(blockCount == 0) {
+		blockCount = 1;
+	}
+
+	if(blockCount > 0xffffffffULL) {
+		throw std::runtime_error("Error loading suppression list: too many addresses in " + this->path);
+	}
+
+	std::size_t words = blockCount * BLOCK_WORDS + BLOCK_WORDS - 1;
+	toReturn->storage.reserve(words);
+
+	std::uintptr_t address = reinterpret_cast<std::uintptr_t>(toReturn->storage.data());
+
+#ifdef MADV_HUGEPAGE
+	//Every lookup lands on a random block, so a large filter costs a TLB miss per lookup unless backed by huge pages,
+	//which must be asked for before the memory is first touched
+	std::uintptr_t hugeStart = (address + HUGE_PAGE_SIZE - 1) & ~(std::uintptr_t)(HUGE_PAGE_SIZE - 1);
+	std::uintptr_t hugeEnd = (address + words * sizeof(std::uint64_t)) & ~(std::uintptr_t)(HUGE_PAGE_SIZE - 1);
+
+	if(hugeEnd > hugeStart) {
+		madvise(reinterpret_cast<void*>(hugeStart), hugeEnd - hugeStart, MADV_HUGEPAGE);
+	}
+#endif
+
+	toReturn->storage.assign(words, 0);
+
+	std::size_t skip = ((64 - (address % 64)) % 64) / sizeof(std::uint64_t);
+	std::uint64_t *blocks = &toReturn->storage[skip];
+
+	//Second pass fills the filter
+	for(std::size_t start = 0; start < size; ) {
+		const char *newline = static_cast<const char*>(std::memchr(data + start, '\n', size - start));
+		std::size_t end = newline ? (std::size_t)(newline - data) : size;
+
+		std::uint64_t hash = hashKey(data + start, end - start);
+		std::uint64_t *block = blocks + blockOf(hash, blockCount) * BLOCK_WORDS;
+		std::uint64_t bits = bitsOf(hash);
+
+		for(std::size_t i=0; i<BLOCK_WORDS; i++){
+			block[i] |= 1ULL << ((bits >> (6 * i)) & 63);
+		}
+
+		start = end + 1;
+	}
+
+	toReturn->blocks = blocks;
+	toReturn->blockCount = blockCount;
+	toReturn->entries = entries;
+
+	return toReturn;
+}
+
+bool SuppressionList::lookup(const Snapshot &list, const char *key, std::size_t length) {
+	std::uint64_t hash = hashKey(key, length);
+	const std::uint64_t *block = list.blocks + blockOf(hash, list.blockCount) * BLOCK_WORDS;
+	std::uint64_t bits = bitsOf(hash);
+
+	//Test every word without branching, since which one rules the key out is random
+	std::uint64_t missing = 0;
+	for(std::size_t i=0; i<BLOCK_WORDS; i++){
+		missing |= ~block[i] & (1ULL << ((bits >> (6 * i)) & 63));
+	}
+
+	if(missing != 0) {
+		return false;
+	}
+
+	//Confirm against the file: the sparse index narrows the search to one run of lines, which is scanned in order
+	const char *data = list.file->getData();
+	std::size_t size = list.file->getSize();
+
+	std::uint64_t prefix = prefixOf(key, length);
+	std::vector<std::uint64_t>::const_iterator first = std::lower_bound(list.prefixes.begin(), list.prefixes.end(), prefix);
+	std::vector<std::uint64_t>::const_iterator last = std::upper_bound(first, list.prefixes.end(), prefix);
+
+	//Samples sharing the key's prefix are told apart by their full address
+	std::size_t low = first - list.prefixes.begin();
+	std::size_t high = last - list.prefixes.begin();
+
+	while(low < high) {
+		std::size_t middle = low + (high - low) / 2;
+		std::size_t start = list.offsets[middle];
+		const char *newline = static_cast<const char*>(std::memchr(data + start, '\n', size - start));
+		std::size_t end = newline ? (std::size_t)(newline - data) : size;
+
+		if(compareKeys(data + start, end - start, key, length) <= 0) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+
+	//low is now the first sample after the key, so the key can only be in the run before it
+	if(low == 0) {
+		return false;
+	}
+
+	std::size_t start = list.offsets[low - 1];
+	std::size_t stop = (low < list.offsets.size()) ? list.offsets[low] : size;
+
+	while(start < stop) {
+		const char *newline = static_cast<const char*>(std::memchr(data + start, '\n', stop - start));
+		std::size_t end = newline ? (std::size_t)(newline - data) : stop;
+
+		int result = compareKeys(data + start, end - start, key, length);
+
+		if(result == 0) {
+			return true;
+		}
+
+		if(result > 0) {
+			return false;
+		}
+
+		start = end + 1;
+	}
+
+	return false;
+}
+
+bool SuppressionList::lookupAddress(const Snapshot &list, const std::string &address) {
+	std::size_t start = 0;
+	std::size_t end = address.length();
+
+	while((start < end) && isTrimmed(address[start])) {
+		start++;
+	}
+
+	while((end > start) && isTrimmed(address[end - 1])) {
+		end--;
+	}
+
+	std::size_t length = end - start;
+
+	if(length > MAX_STACK_KEY) {
+		std::string key = normalize(address);
+		return lookup(list, key.data(), key.length());
+	}
+
+	char key[MAX_STACK_KEY];
+	for(std::size_t i=0; i<length; i++){
+		key[i] = lowerCase(address[start + i]);
+	}
+
+	return lookup(list, key, length);
+}
+
+} /* namespace SimplyEmail */
@@ -0,0 +1,82 @@
+/**
+ * \file ThreadPool.cpp
+ *
+ * \brief Implementation file for the bounded worker thread pool
+ */
+
+#include "../lib/ThreadPool.h"
+
+namespace SimplyEmail {
+
+ThreadPool::ThreadPool(unsigned int threads) {
+	this->stopping = false;
+
+	if(threads == 0) {
+		threads = std::thread::hardware_concurrency();
+	}
+
+	if(threads == 0) {
+		threads = 1;
+	}
+
+	for(unsigned int i=0; i<threads; i++){
+		this->workers.push_back(std::thread(&ThreadPool::run, this));
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+
+	this->available.notify_all();
+
+	for(unsigned int i=0; i<this->workers.size(); i++){
+		this->workers[i].join();
+	}
+}
+
+std::future<void> ThreadPool::submit(const std::function<void()> &task) {
+	std::packaged_task<void()> packaged(task);
+	std::future<void> toReturn = packaged.get_future();
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->tasks.push_back(std::move(packaged));
+	}
+
+	this->available.notify_one();
+
+	return toReturn;
+}
+
+unsigned int ThreadPool::getThreadCount() const {
+	return this->workers.size();
+}
+
+void ThreadPool::run() {
+	while(true) {
+		std::packaged_task<void()> task;
+
+		{
+			std::unique_lock<std::mutex> lock(this->mutex);
+			while(this->tasks.empty() && !this->stopping) {
+				this->available.wait(lock);
+			}
+
+			//Only stop once every submitted task has run
+			if(this->tasks.empty()) {
+				return;
+			}
+
+			task = std::move(this->tasks.front());
+			this->tasks.pop_front();
+		}
+
+		//Exceptions are captured in the task's future
+		task();
+	}
+}
+
+} /* namespace SimplyEmail */
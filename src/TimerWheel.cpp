@@ -0,0 +1,211 @@
+/**
+ * \file TimerWheel.cpp
+ *
+ * \brief Implementation file for the hierarchical timer wheel
+ */
+
+#include "../lib/TimerWheel.h"
+
+#include <stdexcept>
+
+namespace SimplyEmail {
+
+const TimerWheel::Handle TimerWheel::INVALID_HANDLE = 0xffffffff;
+
+TimerWheel::TimerWheel(std::uint64_t startTick) {
+	this->freeList = -1;
+	this->currentTick = startTick;
+	this->size = 0;
+
+	for(unsigned int i=0; i<LEVELS * SLOTS; i++){
+		this->heads[i] = -1;
+	}
+
+	for(unsigned int i=0; i<LEVELS; i++){
+		this->levelSizes[i] = 0;
+	}
+}
+
+TimerWheel::Handle TimerWheel::schedule(std::uint64_t id, std::uint64_t expiryTick) {
+	std::int32_t index;
+
+	//Reuse a free node if there is one
+	if(this->freeList >= 0) {
+		index = this->freeList;
+		this->freeList = this->nodes[index].next;
+	}
+	else {
+		if(this->nodes.size() >= (std::size_t)INVALID_HANDLE >> 1) {
+			throw std::runtime_error("Error scheduling timer: too many timers");
+		}
+
+		index = this->nodes.size();
+		this->nodes.push_back(Node());
+	}
+
+	//The current slot has already been expired, so anything due now fires on the next tick
+	if(expiryTick <= this->currentTick) {
+		expiryTick = this->currentTick + 1;
+	}
+
+	this->nodes[index].id = id;
+	this->nodes[index].expiry = expiryTick;
+	this->link(index);
+	this->size++;
+
+	return (Handle)index;
+}
+
+void TimerWheel::cancel(Handle handle) {
+	std::int32_t index = (std::int32_t)handle;
+
+	if((handle >= this->nodes.size()) || (this->nodes[index].slot < 0)) {
+		throw std::runtime_error("Error cancelling timer: invalid handle");
+	}
+
+	this->unlink(index);
+	this->nodes[index].slot = -1;
+	this->nodes[index].next = this->freeList;
+	this->freeList = index;
+	this->size--;
+}
+
+void TimerWheel::advance(std::uint64_t nowTick, std::vector<std::uint64_t> &expired) {
+	while(this->currentTick < nowTick) {
+
+		//While the lowest levels are empty nothing happens until the next slot of the first occupied level comes round
+		unsigned int emptyLevels = 0;
+		while((emptyLevels < LEVELS) && (this->levelSizes[emptyLevels] == 0)) {
+			emptyLevels++;
+		}
+
+		if(emptyLevels > 0) {
+			std::uint64_t quiet = this->currentTick | ((1ULL << (SLOT_BITS * emptyLevels)) - 1);
+
+			if(quiet >= nowTick) {
+				this->currentTick = nowTick;
+				break;
+			}
+
+			this->currentTick = quiet;
+		}
+
+		this->currentTick++;
+
+		//Redistribute the higher levels whose slot has come round, highest first
+		unsigned int cascadeLevels = 0;
+		while((cascadeLevels + 1 < LEVELS) && ((this->currentTick & ((1ULL << (SLOT_BITS * (cascadeLevels + 1))) - 1)) == 0)) {
+			cascadeLevels++;
+		}
+
+		for(unsigned int level=cascadeLevels; level>0; level--){
+			this->cascade(level, (unsigned int)((this->currentTick >> (SLOT_BITS * level)) & (SLOTS - 1)));
+		}
+
+		//Expire the current slot of the first level
+		std::int32_t &head = this->heads[this->currentTick & (SLOTS - 1)];
+		std::int32_t index = head;
+		head = -1;
+
+		while(index >= 0) {
+			Node &node = this->nodes[index];
+			std::int32_t next = node.next;
+			this->levelSizes[0]--;
+
+			if(node.expiry <= this->currentTick) {
+				expired.push_back(node.id);
+
+				node.slot = -1;
+				node.next = this->freeList;
+				this->freeList = index;
+				this->size--;
+			}
+			else {
+				this->link(index);
+			}
+
+			index = next;
+		}
+	}
+}
+
+std::uint64_t TimerWheel::getCurrentTick() const {
+	return this->currentTick;
+}
+
+std::size_t TimerWheel::getSize() const {
+	return this->size;
+}
+
+void TimerWheel::link(std::int32_t index) {
+	Node &node = this->nodes[index];
+
+	//Timers reaching the first level while cascading may be due on the current tick, which is expired next
+	std::uint64_t expiry = node.expiry;
+	if(expiry < this->currentTick) {
+		expiry = this->currentTick;
+	}
+
+	std::uint64_t delta = expiry - this->currentTick;
+	std::int32_t slot;
+
+	if(delta < (1ULL << SLOT_BITS)) {
+		slot = (std::int32_t)(expiry & (SLOTS - 1));
+	}
+	else if(delta < (1ULL << (2 * SLOT_BITS))) {
+		slot = SLOTS + (std::int32_t)((expiry >> SLOT_BITS) & (SLOTS - 1));
+	}
+	else if(delta < (1ULL << (3 * SLOT_BITS))) {
+		slot = (2 * SLOTS) + (std::int32_t)((expiry >> (2 * SLOT_BITS)) & (SLOTS - 1));
+	}
+	else if(delta < (1ULL << (4 * SLOT_BITS))) {
+		slot = (3 * SLOTS) + (std::int32_t)((expiry >> (3 * SLOT_BITS)) & (SLOTS - 1));
+	}
+	else {
+		//Beyond the span of the wheel; wait in the last slot to be reached and be redistributed from there
+		slot = (3 * SLOTS) + (std::int32_t)(((this->currentTick >> (3 * SLOT_BITS)) + SLOTS - 1) & (SLOTS - 1));
+	}
+
+	node.slot = slot;
+	node.previous = -1;
+	this->levelSizes[slot / SLOTS]++;
+	node.next = this->heads[slot];
+
+	if(node.next >= 0) {
+		this->nodes[node.next].previous = index;
+	}
+
+	this->heads[slot] = index;
+}
+
+void TimerWheel::unlink(std::int32_t index) {
+	Node &node = this->nodes[index];
+
+	if(node.previous >= 0) {
+		this->nodes[node.previous].next = node.next;
+	}
+	else {
+		this->heads[node.slot] = node.next;
+	}
+
+	if(node.next >= 0) {
+		this->nodes[node.next].previous = node.previous;
+	}
+
+	this->levelSizes[node.slot / SLOTS]--;
+}
+
+void TimerWheel::cascade(unsigned int level, unsigned int slot) {
+	std::int32_t &head = this->heads[(level * SLOTS) + slot];
+	std::int32_t index = head;
+	head = -1;
+
+	while(index >= 0) {
+		std::int32_t next = this->nodes[index].next;
+		this->levelSizes[level]--;
+		this->link(index);
+		index = next;
+	}
+}
+
+} /* namespace SimplyEmail */
@@ -0,0 +1,190 @@
+/**
+ * \file ConcurrencyStressTest.cpp
+ *
+ * \brief Stress test of the documented thread safety of Email and SMTPConnection
+ *
+ * \details Several threads encode one shared const email, with both encode() and encode(EncodeArena&), starting
+ * together so that they also race to fill its section cache. Apart from the Date header every encoding must be the
+ * same, as the attachment ids rendered into the cache once are shared by all of them. At the same time every thread
+ * toggles the setters of a connection of its own while a monitor thread polls the status of all of them and cancels
+ * them, as send monitors do. Build with SIMPLYEMAIL_TSAN to have ThreadSanitizer check the run for data races. Exits
+ * with a non-zero status on a failure.
+ */
+
+#include "../lib/Email.h"
+#include "../lib/EmailAttachment.h"
+#include "../lib/EncodeArena.h"
+#include "../lib/SMTPConnection.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const unsigned int THREAD_COUNT = 8;		/// Encoding threads
+const unsigned int ITERATIONS = 200;		/// Encodings per thread with each encode function
+
+/**
+ * \brief Removes the Date header, the only part of an encoding that changes between calls
+ *
+ * \param[in] encoded The encoded email
+ *
+ * \return std::string The encoding without its Date line
+ */
+std::string withoutDate(const std::string &encoded) {
+	std::string::size_type start = encoded.find("Date: ");
+
+	if(start == std::string::npos) {
+		return encoded;
+	}
+
+	std::string::size_type end = encoded.find("\r\n", start);
+
+	return encoded.substr(0, start) + encoded.substr(end);
+}
+
+/**
+ * \brief Holds the encoding threads until all of them are ready, so that they start at once
+ */
+class StartLine {
+public:
+	explicit StartLine(unsigned int _waiting) : waiting(_waiting) {}
+
+	void arriveAndWait() {
+		std::unique_lock<std::mutex> lock(this->mutex);
+
+		if(--this->waiting == 0) {
+			this->released.notify_all();
+			return;
+		}
+
+		this->released.wait(lock, [this]() { return this->waiting == 0; });
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable released;
+	unsigned int waiting;
+};
+
+} /* namespace */
+
+int main() {
+	std::vector<std::string> recipients;
+	recipients.push_back("first@example.com");
+	recipients.push_back("second@example.com");
+
+	std::string body;
+	for(unsigned int i=0; i<200; i++){
+		body += "Line of the body that is long enough to matter, with a lone LF\n";
+	}
+
+	SimplyEmail::Email email(recipients, std::vector<std::string>(1, "copy@example.com"), std::vector<std::string>(), "sender@example.com", "reply@example.com", "Stress test \xc3\xa9t\xc3\xa9", body);
+	email.addHeader("X-Campaign", "Caf\xc3\xa9 opening");
+
+	std::string attachmentData(100000, '\0');
+	for(std::size_t i=0; i<attachmentData.size(); i++){
+		attachmentData[i] = (char)(i * 31);
+	}
+
+	email.addAttachment(SimplyEmail::EmailAttachment("first.bin", "application/octet-stream", attachmentData.data(), attachmentData.size()));
+	email.addAttachment(SimplyEmail::EmailAttachment("second.txt", "text/plain", body.data(), body.size()));
+
+	const SimplyEmail::Email &shared = email;
+	std::vector<std::string> firstEncodings(THREAD_COUNT);
+
+	std::atomic<unsigned int> failures(0);
+	std::atomic<bool> finished(false);
+
+	std::vector<std::unique_ptr<SimplyEmail::SMTPConnection> > connections;
+	for(unsigned int i=0; i<THREAD_COUNT; i++){
+		connections.push_back(std::unique_ptr<SimplyEmail::SMTPConnection>(new SimplyEmail::SMTPConnection("smtp://127.0.0.1:1", "", "")));
+	}
+
+	StartLine start(THREAD_COUNT);
+	std::vector<std::thread> encoders;
+
+	for(unsigned int t=0; t<THREAD_COUNT; t++){
+		encoders.push_back(std::thread([&, t]() {
+			SimplyEmail::SMTPConnection &connection = *connections[t];
+			SimplyEmail::EncodeArena arena;
+			SimplyEmail::SendTimeouts timeouts;
+
+			start.arriveAndWait();
+
+			const std::string &reference = firstEncodings[t] = withoutDate(shared.encode());
+
+			for(unsigned int i=0; i<ITERATIONS; i++){
+				std::string encoded = shared.encode();
+
+				if(withoutDate(encoded) != reference) {
+					failures++;
+				}
+
+				{
+					SimplyEmail::ArenaString arenaEncoded = shared.encode(arena);
+
+					if(withoutDate(std::string(arenaEncoded.data(), arenaEncoded.size())) != reference) {
+						failures++;
+					}
+				}
+				arena.reset();
+
+				connection.setVerbose((i % 2) == 0);
+				timeouts.connect = std::chrono::milliseconds(1000 + i);
+				connection.setTimeouts(timeouts);
+				connection.setSuppressionList(NULL);
+				connection.setOversizeFallback(NULL);
+
+				if((connection.getVerbose() != ((i % 2) == 0)) || (connection.getTimeouts().connect != timeouts.connect)) {
+					failures++;
+				}
+			}
+		}));
+	}
+
+	//Monitors may read the status and cancel from any thread while the owners use their connections
+	std::thread monitor([&]() {
+		while(!finished.load()) {
+			for(unsigned int i=0; i<connections.size(); i++){
+				connections[i]->getStatus();
+				connections[i]->cancel();
+			}
+
+			std::this_thread::yield();
+		}
+	});
+
+	for(unsigned int i=0; i<encoders.size(); i++){
+		encoders[i].join();
+	}
+
+	finished = true;
+	monitor.join();
+
+	const std::string reference = withoutDate(shared.encode());
+
+	for(unsigned int i=0; i<firstEncodings.size(); i++){
+		if(firstEncodings[i] != reference) {
+			failures++;
+		}
+	}
+
+	if(failures.load() != 0) {
+		std::cerr << "ConcurrencyStressTest: " << failures.load() << " mismatched results" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::cout << "ConcurrencyStressTest: " << (THREAD_COUNT * ITERATIONS * 2) << " concurrent encodings matched" << std::endl;
+
+	return EXIT_SUCCESS;
+}
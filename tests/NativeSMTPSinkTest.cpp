@@ -0,0 +1,247 @@
+/**
+ * \file NativeSMTPSinkTest.cpp
+ *
+ * \brief Sends through NativeSMTPConnection to an in process SMTP sink
+ *
+ * \details The sink speaks just enough ESMTP to accept mail, optionally offering PIPELINING and STARTTLS with a
+ * certificate generated for the run, and keeps every message it receives with its dot stuffing removed. Each case
+ * checks that the messages arrive byte for byte as Email::encode() produces them, apart from the Date header, and
+ * that the envelope was pipelined only when the sink offered PIPELINING. Exits with a non-zero status on a failure.
+ */
+
+#include "../lib/Email.h"
+#include "../lib/EmailAttachment.h"
+#include "../lib/NativeSMTPConnection.h"
+#include "../lib/SMTPError.h"
+#include "../lib/SMTPEventLoop.h"
+
+#include "./SMTPSink.h"
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+using SimplyEmailTest::Received;
+using SimplyEmailTest::Sink;
+
+unsigned int failures = 0;
+
+void check(bool condition, const std::string &what) {
+	if(!condition) {
+		std::cerr << "NativeSMTPSinkTest: FAILED " << what << std::endl;
+		failures++;
+	}
+}
+
+std::string withoutDate(const std::string &message) {
+	std::string::size_type start = message.find("Date: ");
+
+	if(start == std::string::npos) {
+		return message;
+	}
+
+	return message.substr(0, start) + message.substr(message.find("\r\n", start) + 2);
+}
+
+std::string withoutFinalBreak(const std::string &message) {
+	if((message.size() >= 2) && (message.compare(message.size() - 2, 2, "\r\n") == 0)) {
+		return message.substr(0, message.size() - 2);
+	}
+
+	return message;
+}
+
+/**
+ * \brief A self signed certificate for localhost, written where OpenSSL's default verify paths will trust it
+ */
+class TestCertificate {
+public:
+	TestCertificate() : key(NULL), certificate(NULL) {
+		EVP_PKEY_CTX *context = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+
+		if(!context || (EVP_PKEY_keygen_init(context) != 1) || (EVP_PKEY_CTX_set_ec_paramgen_curve_nid(context, NID_X9_62_prime256v1) != 1)
+				|| (EVP_PKEY_keygen(context, &this->key) != 1)) {
+			EVP_PKEY_CTX_free(context);
+			throw std::runtime_error("Error creating test certificate: could not generate a key");
+		}
+		EVP_PKEY_CTX_free(context);
+
+		this->certificate = X509_new();
+		X509_set_version(this->certificate, 2);
+		ASN1_INTEGER_set(X509_get_serialNumber(this->certificate), 1);
+		X509_gmtime_adj(X509_getm_notBefore(this->certificate), -3600);
+		X509_gmtime_adj(X509_getm_notAfter(this->certificate), 86400);
+		X509_set_pubkey(this->certificate, this->key);
+
+		X509_NAME *name = X509_get_subject_name(this->certificate);
+		X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+		X509_set_issuer_name(this->certificate, name);
+
+		X509V3_CTX extensionContext;
+		X509V3_set_ctx_nodb(&extensionContext);
+		X509V3_set_ctx(&extensionContext, this->certificate, this->certificate, NULL, NULL, 0);
+
+		X509_EXTENSION *alternativeNames = X509V3_EXT_conf_nid(NULL, &extensionContext, NID_subject_alt_name, const_cast<char*>("DNS:localhost"));
+		X509_add_ext(this->certificate, alternativeNames, -1);
+		X509_EXTENSION_free(alternativeNames);
+
+		if(X509_sign(this->certificate, this->key, EVP_sha256()) == 0) {
+			throw std::runtime_error("Error creating test certificate: could not sign it");
+		}
+
+		char pathTemplate[] = "/tmp/simplyemail-test-XXXXXX";
+		int file = mkstemp(pathTemplate);
+		if(file < 0) {
+			throw std::runtime_error("Error creating test certificate: could not create a temporary file");
+		}
+		close(file);
+		this->path = pathTemplate;
+
+		FILE *output = std::fopen(this->path.c_str(), "w");
+		PEM_write_X509(output, this->certificate);
+		std::fclose(output);
+
+		setenv("SSL_CERT_FILE", this->path.c_str(), 1);
+	}
+
+	~TestCertificate() {
+		std::remove(this->path.c_str());
+		X509_free(this->certificate);
+		EVP_PKEY_free(this->key);
+	}
+
+	EVP_PKEY *key;
+	X509 *certificate;
+	std::string path;
+};
+
+SimplyEmail::Email makeEmail(const std::string &subject) {
+	std::vector<std::string> recipients;
+	recipients.push_back("first@example.com");
+	recipients.push_back("second@example.com");
+
+	//Lines that must be dot stuffed, including a lone dot that would otherwise end the data early
+	std::string body = ".leading dot\n..two dots\n.\nmiddle\r\n.\r\n. space after dot\nno final line break.";
+
+	SimplyEmail::Email email(recipients, std::vector<std::string>(1, "copy@example.com"), std::vector<std::string>(), "sender@example.com", "reply@example.com", subject, body);
+
+	std::string data(3000, '\0');
+	for(std::size_t i=0; i<data.size(); i++){
+		data[i] = (char)(i * 7);
+	}
+	email.addAttachment(SimplyEmail::EmailAttachment("data.bin", "application/octet-stream", data.data(), data.size()));
+
+	return email;
+}
+
+/**
+ * \brief Sends three messages, one synchronously and two queued, and checks them against the sink's copies
+ */
+void runCase(const std::string &name, Sink &sink, SimplyEmail::SMTPEventLoop &loop, int startTLS) {
+	std::vector<SimplyEmail::Email> emails;
+	for(unsigned int i=0; i<3; i++){
+		emails.push_back(makeEmail(name + " message " + std::to_string(i)));
+	}
+
+	bool pipelined = false;
+	bool encrypted = false;
+
+	try {
+		SimplyEmail::NativeSMTPConnection connection(sink.getAddress(), "", "", loop);
+		connection.setStartTLS(startTLS);
+
+		connection.send(emails[0]);
+
+		std::future<void> second = connection.sendAsync(emails[1]);
+		std::future<void> third = connection.sendAsync(emails[2]);
+		second.get();
+		third.get();
+
+		pipelined = connection.isPipelining();
+		encrypted = connection.isEncrypted();
+	}
+	catch(const std::exception &error) {
+		check(false, name + ": send threw " + error.what());
+		return;
+	}
+
+	std::vector<Received> received = sink.getReceived();
+	check(received.size() == emails.size(), name + ": sink received every message");
+
+	for(std::size_t i=0; (i<received.size()) && (i<emails.size()); i++){
+		std::string expected = withoutFinalBreak(withoutDate(emails[i].encode()));
+		check(withoutFinalBreak(withoutDate(received[i].data)) == expected, name + ": message " + std::to_string(i) + " round trips unchanged");
+		check(received[i].encrypted == (sink.tls != NULL), name + ": message " + std::to_string(i) + " encryption");
+	}
+
+	check(pipelined == sink.pipelining, name + ": client saw PIPELINING as offered");
+	check(encrypted == (sink.tls != NULL), name + ": session encryption");
+
+	if(sink.pipelining) {
+		check((sink.pipelinedEnvelopes == emails.size()) && (sink.splitEnvelopes == 0), name + ": every envelope pipelined");
+	}
+	else {
+		check(sink.earlyCommands == 0, name + ": no command sent before its reply");
+	}
+}
+
+} /* namespace */
+
+int main() {
+	TestCertificate certificate;
+
+	SSL_CTX *serverTLS = SSL_CTX_new(TLS_server_method());
+	if(!serverTLS || (SSL_CTX_use_certificate(serverTLS, certificate.certificate) != 1) || (SSL_CTX_use_PrivateKey(serverTLS, certificate.key) != 1)) {
+		std::cerr << "NativeSMTPSinkTest: could not set up the sink's TLS" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	{
+		//The loop reads SSL_CERT_FILE when it is created, so it comes after the certificate
+		SimplyEmail::SMTPEventLoop loop;
+
+		{
+			Sink sink(true, NULL);
+			runCase("pipelined", sink, loop, SimplyEmail::NativeSMTPConnection::STARTTLS_NEVER);
+		}
+
+		{
+			Sink sink(false, NULL);
+			runCase("not pipelined", sink, loop, SimplyEmail::NativeSMTPConnection::STARTTLS_NEVER);
+		}
+
+		{
+			Sink sink(true, serverTLS);
+			runCase("STARTTLS pipelined", sink, loop, SimplyEmail::NativeSMTPConnection::STARTTLS_REQUIRED);
+		}
+
+		{
+			Sink sink(false, serverTLS);
+			runCase("STARTTLS not pipelined", sink, loop, SimplyEmail::NativeSMTPConnection::STARTTLS_REQUIRED);
+		}
+	}
+
+	SSL_CTX_free(serverTLS);
+
+	if(failures != 0) {
+		return EXIT_FAILURE;
+	}
+
+	std::cout << "NativeSMTPSinkTest: every case passed" << std::endl;
+
+	return EXIT_SUCCESS;
+}
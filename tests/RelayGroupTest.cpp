@@ -0,0 +1,195 @@
+/**
+ * \file RelayGroupTest.cpp
+ *
+ * \brief Sends through a RelayGroup of in process SMTP sinks, one of them down and one refusing mail
+ *
+ * \details Checks that sends fail over from the relay that is down and the one replying 451 to the relay that accepts
+ * them, that both failing relays are ejected once they reach the failure threshold and are left alone while their
+ * circuits are open, and that once the open duration has passed each is probed: the relay that recovered rejoins the
+ * group and the one still down is ejected again for twice as long. Exits with a non-zero status on a failure.
+ */
+
+#include "../lib/Email.h"
+#include "../lib/RelayGroup.h"
+#include "../lib/SMTPError.h"
+
+#include "./SMTPSink.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const std::size_t DOWN = 0;							/// The relay nothing listens on
+const std::size_t REFUSING = 1;						/// The relay replying 451 until it recovers
+const std::size_t ACCEPTING = 2;					/// The relay accepting every message
+
+//The sink holds each transaction for 200 ms to catch early commands, so the circuits must stay open well past the
+//few sends made while the failing relays are ejected
+const std::chrono::milliseconds OPEN_DURATION(3000);	/// How long a circuit first stays open
+
+unsigned int failures = 0;
+
+void check(bool condition, const std::string &what) {
+	if(!condition) {
+		std::cerr << "RelayGroupTest: FAILED " << what << std::endl;
+		failures++;
+	}
+}
+
+/**
+ * \brief Finds a loopback port that nothing listens on
+ *
+ * \return std::string The address of a relay that refuses every connection
+ */
+std::string downAddress() {
+	int probe = socket(AF_INET, SOCK_STREAM, 0);
+
+	struct sockaddr_in address = sockaddr_in();
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	socklen_t length = sizeof(address);
+	if((bind(probe, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0)
+			|| (getsockname(probe, reinterpret_cast<struct sockaddr*>(&address), &length) != 0)) {
+		close(probe);
+		throw std::runtime_error("Error finding a closed port: could not bind on the loopback interface");
+	}
+
+	//Closing the socket without listening leaves the port refusing connections
+	close(probe);
+
+	return "smtp://127.0.0.1:" + std::to_string(ntohs(address.sin_port));
+}
+
+SimplyEmail::Email makeEmail(const std::string &subject) {
+	return SimplyEmail::Email(std::vector<std::string>(1, "first@example.com"), std::vector<std::string>(), std::vector<std::string>(), "sender@example.com", "reply@example.com", subject, "Body of the message\n");
+}
+
+/**
+ * \brief Sends a message through the group, recording a failure instead of throwing
+ *
+ * \return std::size_t The index of the relay that accepted it, or the relay count if none did
+ */
+std::size_t sendThrough(SimplyEmail::RelayGroup &group, const std::string &subject) {
+	try {
+		return group.send(makeEmail(subject));
+	}
+	catch(const std::exception &error) {
+		check(false, subject + ": send threw " + error.what());
+		return group.getRelayCount();
+	}
+}
+
+} /* namespace */
+
+int main() {
+	SimplyEmailTest::Sink refusing(false, NULL);
+	SimplyEmailTest::Sink accepting(false, NULL);
+	refusing.refusing = true;
+
+	SimplyEmail::RelayGroupPolicy policy;
+	policy.failureThreshold = 2;
+	policy.openDuration = OPEN_DURATION;
+	policy.maxOpenDuration = std::chrono::milliseconds(60000);
+
+	SimplyEmail::RelayGroup group(policy);
+	group.addRelay(downAddress(), "", "");
+	group.addRelay(refusing.getAddress(), "", "");
+	group.addRelay(accepting.getAddress(), "", "");
+
+	//Failover: every send reaches the accepting relay, and the failing ones are ejected on their second failure
+	for(unsigned int i=0; i<4; i++){
+		check(sendThrough(group, "failover " + std::to_string(i)) == ACCEPTING, "failover " + std::to_string(i) + " delivered by the accepting relay");
+	}
+
+	std::vector<SimplyEmail::RelayStats> stats = group.getStats();
+
+	for(std::size_t i=DOWN; i<=REFUSING; i++){
+		std::string name = (i == DOWN) ? "down relay" : "refusing relay";
+
+		check(stats[i].circuit == SimplyEmail::RelayGroup::CIRCUIT_OPEN, name + ": ejected");
+		check(stats[i].ejections == 1, name + ": ejected once");
+		check(stats[i].failed == policy.failureThreshold, name + ": tried until the failure threshold");
+		check(stats[i].failovers == stats[i].failed, name + ": each failure failed over");
+		check(stats[i].sent == 0, name + ": delivered nothing");
+	}
+
+	check(stats[ACCEPTING].sent == 4, "accepting relay: delivered every message");
+	check(accepting.getReceived().size() == 4, "accepting sink: received every message");
+	check(refusing.getReceived().empty(), "refusing sink: received nothing");
+
+	//Ejection: while the circuits are open the failing relays are not tried at all
+	for(unsigned int i=0; i<3; i++){
+		check(sendThrough(group, "ejected " + std::to_string(i)) == ACCEPTING, "ejected " + std::to_string(i) + " delivered by the accepting relay");
+	}
+
+	std::vector<SimplyEmail::RelayStats> ejected = group.getStats();
+
+	for(std::size_t i=DOWN; i<=REFUSING; i++){
+		check((ejected[i].selected == stats[i].selected) && (ejected[i].probes == 0), "relay " + std::to_string(i) + ": not tried while ejected");
+	}
+
+	//Reopen probing: once the open duration has passed each failing relay takes one probe send
+	refusing.refusing = false;
+	std::this_thread::sleep_for(OPEN_DURATION + std::chrono::milliseconds(200));
+
+	for(unsigned int i=0; (i<3) && ((group.getStats()[DOWN].probes == 0) || (group.getStats()[REFUSING].probes == 0)); i++){
+		sendThrough(group, "probe " + std::to_string(i));
+	}
+
+	stats = group.getStats();
+
+	check(stats[DOWN].probes == 1, "down relay: probed once");
+	check(stats[DOWN].circuit == SimplyEmail::RelayGroup::CIRCUIT_OPEN, "down relay: ejected again after its failed probe");
+	check(stats[DOWN].ejections == 2, "down relay: ejected twice");
+
+	check(stats[REFUSING].probes == 1, "recovered relay: probed once");
+	check(stats[REFUSING].circuit == SimplyEmail::RelayGroup::CIRCUIT_CLOSED, "recovered relay: rejoined after its probe");
+	check((stats[REFUSING].sent >= 1) && (stats[REFUSING].consecutiveFailures == 0), "recovered relay: delivered the probe");
+	check(refusing.getReceived().size() == stats[REFUSING].sent, "recovered sink: received what the relay delivered");
+
+	//The second ejection lasts twice as long, so the down relay is not probed again yet
+	std::this_thread::sleep_for(OPEN_DURATION + std::chrono::milliseconds(200));
+	sendThrough(group, "reopened");
+
+	check(group.getStats()[DOWN].probes == 1, "down relay: open for twice as long after a failed probe");
+
+	//A group whose every relay is ejected fails without trying any
+	SimplyEmail::RelayGroupPolicy strict;
+	strict.failureThreshold = 1;
+	strict.openDuration = std::chrono::milliseconds(60000);
+
+	SimplyEmail::RelayGroup lone(strict);
+	lone.addRelay(downAddress(), "", "");
+
+	for(unsigned int i=0; i<2; i++){
+		try {
+			lone.send(makeEmail("lone " + std::to_string(i)));
+			check(false, "lone relay: send " + std::to_string(i) + " failed");
+		}
+		catch(const SimplyEmail::SMTPError &error) {
+			check(error.isTransient(), "lone relay: send " + std::to_string(i) + " failed transiently");
+		}
+	}
+
+	check(lone.getStats()[0].selected == 1, "lone relay: not tried while ejected");
+
+	if(failures != 0) {
+		return EXIT_FAILURE;
+	}
+
+	std::cout << "RelayGroupTest: every case passed" << std::endl;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,285 @@
+/**
+ * \file SMTPSink.h
+ *
+ * \brief An in process SMTP sink for the tests that send to a server
+ *
+ * \details The sink speaks just enough ESMTP to accept mail, optionally offering PIPELINING and STARTTLS, and keeps
+ * every message it receives with its dot stuffing removed. It can also refuse every transaction with a transient reply.
+ */
+
+#ifndef SMTPSINK_H_
+#define SMTPSINK_H_
+
+#include <openssl/ssl.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cctype>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace SimplyEmailTest {
+
+/**
+ * \brief A received message and how it arrived
+ */
+struct Received {
+	std::string data;			/// The message with its dot stuffing removed
+	bool encrypted;				/// Whether the session was upgraded with STARTTLS first
+};
+
+/**
+ * \brief An SMTP server on an ephemeral loopback port that serves one session at a time
+ */
+class Sink {
+public:
+	Sink(bool _pipelining, SSL_CTX *_tls) : pipelining(_pipelining), tls(_tls), stopping(false), refusing(false),
+			pipelinedEnvelopes(0), splitEnvelopes(0), earlyCommands(0) {
+		this->listener = socket(AF_INET, SOCK_STREAM, 0);
+
+		struct sockaddr_in address = sockaddr_in();
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		socklen_t length = sizeof(address);
+		if((bind(this->listener, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0) || (listen(this->listener, 8) != 0)
+				|| (getsockname(this->listener, reinterpret_cast<struct sockaddr*>(&address), &length) != 0)) {
+			throw std::runtime_error("Error starting sink: could not listen on the loopback interface");
+		}
+
+		this->port = ntohs(address.sin_port);
+		this->thread = std::thread(&Sink::run, this);
+	}
+
+	~Sink() {
+		this->stopping = true;
+		shutdown(this->listener, SHUT_RDWR);
+		this->thread.join();
+		close(this->listener);
+	}
+
+	std::string getAddress() const {
+		return "smtp://localhost:" + std::to_string(this->port);
+	}
+
+	std::vector<Received> getReceived() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->received;
+	}
+
+	const bool pipelining;						/// Whether PIPELINING is offered
+	SSL_CTX *const tls;							/// Offers STARTTLS with this context if not NULL
+	std::atomic<bool> stopping;
+	std::atomic<bool> refusing;					/// Replies 451 to every transaction while set, as a busy relay does
+	std::atomic<unsigned int> pipelinedEnvelopes;	/// Transactions whose MAIL, RCPT and DATA arrived before any reply
+	std::atomic<unsigned int> splitEnvelopes;		/// Transactions on a pipelining sink that waited for replies
+	std::atomic<unsigned int> earlyCommands;		/// Commands sent before the reply to MAIL without PIPELINING
+
+private:
+	/**
+	 * \brief One client session over a plain or TLS socket
+	 */
+	struct Session {
+		int socket;
+		SSL *ssl;
+		std::string buffer;
+
+		bool pending(int timeoutMillis) {
+			if(!this->buffer.empty() || (this->ssl && (SSL_pending(this->ssl) > 0))) {
+				return true;
+			}
+
+			struct pollfd waiting;
+			waiting.fd = this->socket;
+			waiting.events = POLLIN;
+			waiting.revents = 0;
+
+			return poll(&waiting, 1, timeoutMillis) > 0;
+		}
+
+		bool readLine(std::string &line) {
+			std::string::size_type end;
+
+			while((end = this->buffer.find("\r\n")) == std::string::npos) {
+				char chunk[4096];
+				int count = this->ssl ? SSL_read(this->ssl, chunk, sizeof(chunk)) : (int)read(this->socket, chunk, sizeof(chunk));
+
+				if(count <= 0) {
+					return false;
+				}
+
+				this->buffer.append(chunk, count);
+			}
+
+			line = this->buffer.substr(0, end);
+			this->buffer.erase(0, end + 2);
+
+			return true;
+		}
+
+		void reply(const std::string &line) {
+			std::string toSend = line + "\r\n";
+
+			if(this->ssl) {
+				SSL_write(this->ssl, toSend.data(), (int)toSend.size());
+			}
+			else if(write(this->socket, toSend.data(), toSend.size()) < 0) {
+				return;
+			}
+		}
+	};
+
+	void run() {
+		while(!this->stopping) {
+			int client = accept(this->listener, NULL, NULL);
+
+			if(client < 0) {
+				return;
+			}
+
+			Session session;
+			session.socket = client;
+			session.ssl = NULL;
+
+			this->serve(session);
+
+			if(session.ssl) {
+				SSL_free(session.ssl);
+			}
+			close(client);
+		}
+	}
+
+	void serve(Session &session) {
+		session.reply("220 sink ready");
+
+		std::string line;
+		while(session.readLine(line)) {
+			std::string verb = line.substr(0, line.find(' '));
+			for(std::size_t i=0; i<verb.size(); i++){
+				verb[i] = (char)toupper(verb[i]);
+			}
+
+			if(this->refusing && ((verb == "MAIL") || (verb == "RCPT") || (verb == "DATA"))) {
+				session.reply("451 try again later");
+			}
+			else if(verb == "EHLO") {
+				session.reply("250-sink");
+				if(this->pipelining) {
+					session.reply("250-PIPELINING");
+				}
+				if(this->tls && !session.ssl) {
+					session.reply("250-STARTTLS");
+				}
+				session.reply("250 8BITMIME");
+			}
+			else if((verb == "STARTTLS") && this->tls && !session.ssl) {
+				session.reply("220 go ahead");
+
+				session.ssl = SSL_new(this->tls);
+				SSL_set_fd(session.ssl, session.socket);
+
+				if(SSL_accept(session.ssl) != 1) {
+					return;
+				}
+			}
+			else if(verb == "MAIL") {
+				std::vector<std::string> envelope(1, line);
+
+				if(this->pipelining) {
+					//Collect the rest of the envelope before replying; a client that waits for the reply to MAIL
+					//instead sends nothing more
+					while((envelope.back().compare(0, 4, "DATA") != 0) && session.pending(1000) && session.readLine(line)) {
+						envelope.push_back(line);
+					}
+
+					if(envelope.back().compare(0, 4, "DATA") == 0) {
+						this->pipelinedEnvelopes++;
+					}
+					else {
+						this->splitEnvelopes++;
+					}
+				}
+				else if(session.pending(200)) {
+					this->earlyCommands++;
+				}
+
+				for(std::size_t i=0; i<envelope.size(); i++){
+					if(envelope[i].compare(0, 4, "DATA") == 0) {
+						if(!this->receiveData(session)) {
+							return;
+						}
+					}
+					else {
+						session.reply("250 ok");
+					}
+				}
+			}
+			else if(verb == "RCPT") {
+				session.reply("250 ok");
+			}
+			else if(verb == "DATA") {
+				if(!this->receiveData(session)) {
+					return;
+				}
+			}
+			else if(verb == "QUIT") {
+				session.reply("221 bye");
+				return;
+			}
+			else if((verb == "RSET") || (verb == "NOOP") || (verb == "HELO")) {
+				session.reply("250 ok");
+			}
+			else {
+				session.reply("502 unknown command");
+			}
+		}
+	}
+
+	bool receiveData(Session &session) {
+		session.reply("354 go ahead");
+
+		Received message;
+		message.encrypted = (session.ssl != NULL);
+
+		std::string line;
+		while(session.readLine(line)) {
+			if(line == ".") {
+				{
+					std::lock_guard<std::mutex> lock(this->mutex);
+					this->received.push_back(message);
+				}
+
+				session.reply("250 queued");
+				return true;
+			}
+
+			//Undo the dot stuffing
+			if(!line.empty() && (line[0] == '.')) {
+				line.erase(0, 1);
+			}
+
+			message.data.append(line).append("\r\n");
+		}
+
+		return false;
+	}
+
+	int listener;
+	unsigned short port;
+	std::thread thread;
+	std::mutex mutex;
+	std::vector<Received> received;
+};
+
+} /* namespace SimplyEmailTest */
+
+#endif /* SMTPSINK_H_ */
@@ -0,0 +1,996 @@
+/**
+ * \file simplyemail-send.cpp
+ *
+ * \brief Command line tool that sends the messages listed in a manifest
+ *
+ * \details Reads one message per line from a JSONL or CSV manifest and sends them concurrently through one or more
+ * relays, printing live progress and a throughput and latency summary. With --dry-run the messages are built and
+ * encoded but not sent, which measures the encoding side on its own; with --maildir or --mbox they are written to disk
+ * instead of being sent.
+ */
+
+#include "../lib/Email.h"
+#include "../lib/EmailAttachment.h"
+#include "../lib/MailboxWriter.h"
+#include "../lib/RelayGroup.h"
+#include "../lib/SuppressionList.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+/**
+ * \brief Settings taken from the command line
+ */
+struct Options {
+	std::string manifest;								/// The manifest path, or "-" for standard input
+	std::string format;									/// "jsonl" or "csv"
+	std::vector<std::string> relays;					/// The relay addresses
+	std::string username;								/// The username for every relay
+	std::string password;								/// The password for every relay
+	std::string from;									/// The sender for entries that do not name one
+	unsigned int concurrency;							/// The number of sending threads
+	double rate;										/// The most messages started per second, or 0 for no limit
+	double timeout;										/// The most seconds to spend sending each message, or 0 for no limit
+	bool dryRun;										/// Build and encode messages without sending them
+	std::string maildir;								/// Write messages to this Maildir instead of sending them
+	std::string mbox;									/// Write messages to this mbox instead of sending them
+	unsigned int syncBatch;								/// Messages written to disk between syncs
+	std::string suppress;								/// A sorted file of addresses never to send to
+	bool verbose;										/// Print the SMTP conversations
+	bool quiet;											/// Do not print live progress
+};
+
+/**
+ * \brief One message read from the manifest
+ */
+struct ManifestEntry {
+	std::string from;									/// The sender
+	std::vector<std::string> to;						/// The recipients
+	std::vector<std::string> cc;						/// The CC recipients
+	std::vector<std::string> bcc;						/// The BCC recipients
+	std::string replyTo;								/// The reply to address
+	std::string subject;								/// The subject
+	std::string body;									/// The body text
+	std::string bodyFile;								/// A file holding the body text
+	std::vector<std::string> attachments;				/// Paths of files to attach
+};
+
+void usage(std::ostream &out) {
+	out << "Usage: simplyemail-send [options] MANIFEST\n"
+		<< "\n"
+		<< "Sends every message listed in MANIFEST, one per line, as JSONL objects or CSV rows with a header.\n"
+		<< "Fields: from, to, cc, bcc, reply_to, subject, body, body_file, attachments. In JSONL, address and\n"
+		<< "attachment lists may be arrays; in CSV, list items are separated by ';'. Use - to read standard input.\n"
+		<< "\n"
+		<< "Options:\n"
+		<< "  -r, --relay URL        relay to send through, such as smtp://host:25; repeat or separate with ','\n"
+		<< "  -u, --user NAME        username for the relays\n"
+		<< "  -p, --password TEXT    password for the relays\n"
+		<< "  -f, --from ADDRESS     sender for entries without one\n"
+		<< "  -c, --concurrency N    sending threads (default 4)\n"
+		<< "  -R, --rate N           most messages started per second (default unlimited)\n"
+		<< "  -t, --timeout SECONDS  most time to spend sending each message, over every relay tried (default unlimited)\n"
+		<< "      --format FORMAT    jsonl or csv (default from the file extension, else jsonl)\n"
+		<< "  -n, --dry-run          build and encode messages without sending them\n"
+		<< "      --maildir DIR      write messages to a Maildir instead of sending them\n"
+		<< "      --mbox FILE        append messages to an mbox instead of sending them\n"
+		<< "      --sync-batch N     messages written between syncs to disk; 0 never syncs (default 64, at most 256)\n"
+		<< "  -s, --suppress FILE    drop recipients listed in FILE, one lower case address per line, sorted\n"
+		<< "  -v, --verbose          print the SMTP conversations\n"
+		<< "  -q, --quiet            do not print live progress\n"
+		<< "  -h, --help             show this help\n";
+}
+
+void split(const std::string &text, const char *separators, std::vector<std::string> &output) {
+	std::size_t start = 0;
+
+	while(start <= text.length()) {
+		std::size_t end = text.find_first_of(separators, start);
+		if(end == std::string::npos) {
+			end = text.length();
+		}
+
+		//Trim surrounding white space
+		std::size_t first = start;
+		std::size_t last = end;
+		while((first < last) && std::isspace((unsigned char)text[first])) {
+			first++;
+		}
+		while((last > first) && std::isspace((unsigned char)text[last - 1])) {
+			last--;
+		}
+
+		if(last > first) {
+			output.push_back(text.substr(first, last - first));
+		}
+
+		start = end + 1;
+	}
+}
+
+Options parseOptions(int argc, char **argv) {
+	Options options;
+	options.concurrency = 4;
+	options.rate = 0;
+	options.timeout = 0;
+	options.dryRun = false;
+	options.syncBatch = SimplyEmail::MailboxWriter::DEFAULT_SYNC_BATCH;
+	options.verbose = false;
+	options.quiet = false;
+
+	for(int i=1; i<argc; i++){
+		std::string argument = argv[i];
+
+		//Options taking a value accept it as the next argument or after '='
+		std::string value;
+		bool hasValue = false;
+
+		std::size_t equals = argument.find('=');
+		if((argument.compare(0, 2, "--") == 0) && (equals != std::string::npos)) {
+			value = argument.substr(equals + 1);
+			argument = argument.substr(0, equals);
+			hasValue = true;
+		}
+
+		struct {
+			bool operator()(const std::string &argument, const char *shortName, const char *longName) const {
+				return ((shortName != NULL) && (argument == shortName)) || (argument == longName);
+			}
+		} is;
+
+		bool takesValue = is(argument, "-r", "--relay") || is(argument, "-u", "--user") || is(argument, "-p", "--password") ||
+			is(argument, "-f", "--from") || is(argument, "-c", "--concurrency") || is(argument, "-R", "--rate") || is(argument, "-t", "--timeout") ||
+			is(argument, NULL, "--format") || is(argument, NULL, "--maildir") || is(argument, NULL, "--mbox") || is(argument, NULL, "--sync-batch") ||
+			is(argument, "-s", "--suppress");
+
+		if(takesValue && !hasValue) {
+			if(i + 1 >= argc) {
+				throw std::invalid_argument("option " + argument + " needs a value");
+			}
+
+			value = argv[++i];
+		}
+
+		if(is(argument, "-r", "--relay")) {
+			split(value, ",", options.relays);
+		}
+		else if(is(argument, "-u", "--user")) {
+			options.username = value;
+		}
+		else if(is(argument, "-p", "--password")) {
+			options.password = value;
+		}
+		else if(is(argument, "-f", "--from")) {
+			options.from = value;
+		}
+		else if(is(argument, "-c", "--concurrency")) {
+			options.concurrency = std::strtoul(value.c_str(), NULL, 10);
+			if(options.concurrency == 0) {
+				throw std::invalid_argument("concurrency must be at least 1");
+			}
+		}
+		else if(is(argument, "-R", "--rate")) {
+			options.rate = std::strtod(value.c_str(), NULL);
+			if(options.rate < 0) {
+				throw std::invalid_argument("rate must not be negative");
+			}
+		}
+		else if(is(argument, "-t", "--timeout")) {
+			options.timeout = std::strtod(value.c_str(), NULL);
+			if(options.timeout < 0) {
+				throw std::invalid_argument("timeout must not be negative");
+			}
+		}
+		else if(is(argument, NULL, "--format")) {
+			if((value != "jsonl") && (value != "csv")) {
+				throw std::invalid_argument("format must be jsonl or csv");
+			}
+			options.format = value;
+		}
+		else if(is(argument, NULL, "--maildir")) {
+			options.maildir = value;
+		}
+		else if(is(argument, NULL, "--mbox")) {
+			options.mbox = value;
+		}
+		else if(is(argument, NULL, "--sync-batch")) {
+			options.syncBatch = std::strtoul(value.c_str(), NULL, 10);
+		}
+		else if(is(argument, "-s", "--suppress")) {
+			options.suppress = value;
+		}
+		else if(is(argument, "-n", "--dry-run")) {
+			options.dryRun = true;
+		}
+		else if(is(argument, "-v", "--verbose")) {
+			options.verbose = true;
+		}
+		else if(is(argument, "-q", "--quiet")) {
+			options.quiet = true;
+		}
+		else if(is(argument, "-h", "--help")) {
+			usage(std::cout);
+			std::exit(0);
+		}
+		else if((argument.length() > 1) && (argument[0] == '-')) {
+			throw std::invalid_argument("unknown option " + argument);
+		}
+		else if(options.manifest.empty()) {
+			options.manifest = argument;
+		}
+		else {
+			throw std::invalid_argument("only one manifest may be given");
+		}
+	}
+
+	if(options.manifest.empty()) {
+		throw std::invalid_argument("no manifest given");
+	}
+
+	int sinks = (options.relays.empty() ? 0 : 1) + (options.maildir.empty() ? 0 : 1) + (options.mbox.empty() ? 0 : 1) + (options.dryRun ? 1 : 0);
+
+	if(sinks == 0) {
+		throw std::invalid_argument("nowhere to send; use --relay, --maildir, --mbox or --dry-run");
+	}
+
+	if(sinks > 1) {
+		throw std::invalid_argument("--relay, --maildir, --mbox and --dry-run cannot be combined");
+	}
+
+	if(options.format.empty()) {
+		std::size_t dot = options.manifest.rfind('.');
+		options.format = ((dot != std::string::npos) && (options.manifest.substr(dot) == ".csv")) ? "csv" : "jsonl";
+	}
+
+	return options;
+}
+
+/**
+ * \brief Reads the flat JSON objects of a JSONL manifest
+ *
+ * \details Accepts objects whose values are strings, arrays of strings, numbers, booleans or null; only strings and
+ * arrays of strings are kept.
+ */
+class JsonLineParser {
+public:
+	explicit JsonLineParser(const std::string &_text) : text(_text), position(0) {}
+
+	void parse(std::map<std::string, std::vector<std::string> > &fields) {
+		this->skipSpace();
+		this->expect('{');
+		this->skipSpace();
+
+		if(this->peek() == '}') {
+			this->position++;
+			return;
+		}
+
+		while(true) {
+			this->skipSpace();
+			std::string key = this->parseString();
+			this->skipSpace();
+			this->expect(':');
+			this->skipSpace();
+
+			std::vector<std::string> &values = fields[key];
+
+			if(this->peek() == '[') {
+				this->position++;
+				this->skipSpace();
+
+				if(this->peek() == ']') {
+					this->position++;
+				}
+				else {
+					while(true) {
+						this->skipSpace();
+						values.push_back(this->parseString());
+						this->skipSpace();
+
+						if(this->peek() == ',') {
+							this->position++;
+							continue;
+						}
+
+						this->expect(']');
+						break;
+					}
+				}
+			}
+			else if(this->peek() == '"') {
+				values.push_back(this->parseString());
+			}
+			else {
+				//Numbers, booleans and null have no meaning in a manifest
+				while((this->position < this->text.length()) && (this->peek() != ',') && (this->peek() != '}')) {
+					this->position++;
+				}
+			}
+
+			this->skipSpace();
+
+			if(this->peek() == ',') {
+				this->position++;
+				continue;
+			}
+
+			this->expect('}');
+			break;
+		}
+	}
+
+private:
+	const std::string &text;							/// The line being parsed
+	std::size_t position;								/// The next character to read
+
+	char peek() const {
+		return (this->position < this->text.length()) ? this->text[this->position] : '\0';
+	}
+
+	void skipSpace() {
+		while((this->position < this->text.length()) && std::isspace((unsigned char)this->text[this->position])) {
+			this->position++;
+		}
+	}
+
+	void expect(char wanted) {
+		if(this->peek() != wanted) {
+			throw std::runtime_error(std::string("expected '") + wanted + "'");
+		}
+		this->position++;
+	}
+
+	unsigned int parseHex() {
+		if(this->position + 4 > this->text.length()) {
+			throw std::runtime_error("truncated \\u escape");
+		}
+
+		unsigned int value = 0;
+		for(int i=0; i<4; i++){
+			char digit = this->text[this->position++];
+			value <<= 4;
+
+			if((digit >= '0') && (digit <= '9')) {
+				value |= digit - '0';
+			}
+			else if((digit >= 'a') && (digit <= 'f')) {
+				value |= digit - 'a' + 10;
+			}
+			else if((digit >= 'A') && (digit <= 'F')) {
+				value |= digit - 'A' + 10;
+			}
+			else {
+				throw std::runtime_error("bad \\u escape");
+			}
+		}
+
+		return value;
+	}
+
+	static void appendUtf8(std::string &output, unsigned int codePoint) {
+		if(codePoint < 0x80) {
+			output += (char)codePoint;
+		}
+		else if(codePoint < 0x800) {
+			output += (char)(0xc0 | (codePoint >> 6));
+			output += (char)(0x80 | (codePoint & 0x3f));
+		}
+		else if(codePoint < 0x10000) {
+			output += (char)(0xe0 | (codePoint >> 12));
+			output += (char)(0x80 | ((codePoint >> 6) & 0x3f));
+			output += (char)(0x80 | (codePoint & 0x3f));
+		}
+		else {
+			output += (char)(0xf0 | (codePoint >> 18));
+			output += (char)(0x80 | ((codePoint >> 12) & 0x3f));
+			output += (char)(0x80 | ((codePoint >> 6) & 0x3f));
+			output += (char)(0x80 | (codePoint & 0x3f));
+		}
+	}
+
+	std::string parseString() {
+		this->expect('"');
+
+		std::string toReturn;
+
+		while(true) {
+			if(this->position >= this->text.length()) {
+				throw std::runtime_error("unterminated string");
+			}
+
+			char c = this->text[this->position++];
+
+			if(c == '"') {
+				return toReturn;
+			}
+
+			if(c != '\\') {
+				toReturn += c;
+				continue;
+			}
+
+			char escape = this->peek();
+			this->position++;
+
+			switch(escape) {
+			case '"': toReturn += '"'; break;
+			case '\\': toReturn += '\\'; break;
+			case '/': toReturn += '/'; break;
+			case 'b': toReturn += '\b'; break;
+			case 'f': toReturn += '\f'; break;
+			case 'n': toReturn += '\n'; break;
+			case 'r': toReturn += '\r'; break;
+			case 't': toReturn += '\t'; break;
+			case 'u': {
+				unsigned int codePoint = this->parseHex();
+
+				//Join surrogate pairs
+				if((codePoint >= 0xd800) && (codePoint < 0xdc00) && (this->text.compare(this->position, 2, "\\u") == 0)) {
+					this->position += 2;
+					unsigned int low = this->parseHex();
+					codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + (low - 0xdc00);
+				}
+
+				appendUtf8(toReturn, codePoint);
+				break;
+			}
+			default:
+				throw std::runtime_error("bad escape");
+			}
+		}
+	}
+};
+
+/**
+ * \brief Splits one CSV record into fields, following RFC 4180 quoting
+ */
+std::vector<std::string> parseCsvLine(const std::string &line) {
+	std::vector<std::string> fields(1);
+	bool quoted = false;
+
+	for(std::size_t i=0; i<line.length(); i++){
+		char c = line[i];
+
+		if(quoted) {
+			if((c == '"') && (i + 1 < line.length()) && (line[i + 1] == '"')) {
+				fields.back() += '"';
+				i++;
+			}
+			else if(c == '"') {
+				quoted = false;
+			}
+			else {
+				fields.back() += c;
+			}
+		}
+		else if(c == '"') {
+			quoted = true;
+		}
+		else if(c == ',') {
+			fields.push_back(std::string());
+		}
+		else if(c != '\r') {
+			fields.back() += c;
+		}
+	}
+
+	if(quoted) {
+		throw std::runtime_error("unterminated quoted field");
+	}
+
+	return fields;
+}
+
+void fillEntry(const std::map<std::string, std::vector<std::string> > &fields, bool splitLists, ManifestEntry &entry) {
+	for(std::map<std::string, std::vector<std::string> >::const_iterator it = fields.begin(); it != fields.end(); ++it) {
+		const std::string &key = it->first;
+		const std::vector<std::string> &values = it->second;
+
+		std::vector<std::string> *list = NULL;
+		std::string *single = NULL;
+
+		if(key == "to") {
+			list = &entry.to;
+		}
+		else if(key == "cc") {
+			list = &entry.cc;
+		}
+		else if(key == "bcc") {
+			list = &entry.bcc;
+		}
+		else if(key == "attachments") {
+			list = &entry.attachments;
+		}
+		else if(key == "from") {
+			single = &entry.from;
+		}
+		else if((key == "reply_to") || (key == "replyTo")) {
+			single = &entry.replyTo;
+		}
+		else if(key == "subject") {
+			single = &entry.subject;
+		}
+		else if(key == "body") {
+			single = &entry.body;
+		}
+		else if((key == "body_file") || (key == "bodyFile")) {
+			single = &entry.bodyFile;
+		}
+		else {
+			throw std::runtime_error("unknown field \"" + key + "\"");
+		}
+
+		for(std::size_t i=0; i<values.size(); i++){
+			if(list && splitLists) {
+				split(values[i], ";", *list);
+			}
+			else if(list) {
+				list->push_back(values[i]);
+			}
+			else {
+				*single = values[i];
+			}
+		}
+	}
+}
+
+std::string readFile(const std::string &path) {
+	std::ifstream input(path.c_str(), std::ifstream::binary);
+	if(!input.is_open()) {
+		throw std::runtime_error("could not open " + path);
+	}
+
+	std::ostringstream contents;
+	contents << input.rdbuf();
+
+	return contents.str();
+}
+
+/**
+ * \brief Encodes each attachment file once however many messages attach it
+ */
+class AttachmentCache {
+public:
+	SimplyEmail::EmailAttachment get(const std::string &path) {
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+
+			std::map<std::string, SimplyEmail::EmailAttachment>::const_iterator it = this->attachments.find(path);
+			if(it != this->attachments.end()) {
+				return it->second;
+			}
+		}
+
+		//Encode outside the lock; two threads racing on a new file both encode it, which is harmless
+		SimplyEmail::EmailAttachment attachment(path);
+
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->attachments.insert(std::make_pair(path, attachment));
+
+		return attachment;
+	}
+
+private:
+	std::mutex mutex;									/// Guards the map
+	std::map<std::string, SimplyEmail::EmailAttachment> attachments;	/// Encoded attachments by path
+};
+
+/**
+ * \brief Spaces the start of sends evenly to hold a rate
+ */
+class RateLimiter {
+public:
+	explicit RateLimiter(double rate) {
+		this->interval = (rate > 0) ? std::chrono::nanoseconds((long long)(1e9 / rate)) : std::chrono::nanoseconds(0);
+		this->next = std::chrono::steady_clock::now();
+	}
+
+	void wait() {
+		if(this->interval.count() == 0) {
+			return;
+		}
+
+		std::chrono::steady_clock::time_point slot;
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+
+			//Idle time is not saved up into a burst
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if(this->next < now) {
+				this->next = now;
+			}
+
+			slot = this->next;
+			this->next += this->interval;
+		}
+
+		std::this_thread::sleep_until(slot);
+	}
+
+private:
+	std::mutex mutex;									/// Guards next
+	std::chrono::nanoseconds interval;					/// The time between sends
+	std::chrono::steady_clock::time_point next;			/// The next free start time
+};
+
+/**
+ * \brief Counts outcomes and collects latencies from every thread
+ */
+struct Summary {
+	std::atomic<std::uint64_t> sent;					/// Messages sent, or encoded in a dry run
+	std::atomic<std::uint64_t> failed;					/// Messages that could not be built or sent
+	std::atomic<std::uint64_t> bytes;					/// Encoded bytes of the sent messages
+	std::atomic<std::uint64_t> suppressed;				/// Recipients dropped because they are on the suppression list
+	std::atomic<std::uint64_t> skipped;					/// Messages not sent because every To recipient was dropped
+
+	std::mutex mutex;									/// Guards latencies
+	std::vector<std::uint64_t> latencies;				/// The duration of each successful message in microseconds
+
+	Summary() : sent(0), failed(0), bytes(0), suppressed(0), skipped(0) {}
+};
+
+/**
+ * \brief Hands out manifest lines to the sending threads
+ */
+class ManifestReader {
+public:
+	ManifestReader(std::istream &_input, bool _csv) : input(_input), csv(_csv), lineNumber(0) {
+		if(this->csv) {
+			std::string header;
+			if(!std::getline(this->input, header)) {
+				throw std::runtime_error("the CSV manifest has no header row");
+			}
+
+			this->lineNumber++;
+			this->columns = parseCsvLine(header);
+		}
+	}
+
+	//Returns false at the end of the manifest
+	bool next(std::string &line, unsigned long &number) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		while(std::getline(this->input, line)) {
+			this->lineNumber++;
+
+			if(line.find_first_not_of(" \t\r") != std::string::npos) {
+				number = this->lineNumber;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void parse(const std::string &line, ManifestEntry &entry) const {
+		std::map<std::string, std::vector<std::string> > fields;
+
+		if(this->csv) {
+			std::vector<std::string> values = parseCsvLine(line);
+
+			if(values.size() > this->columns.size()) {
+				throw std::runtime_error("more fields than header columns");
+			}
+
+			for(std::size_t i=0; i<values.size(); i++){
+				if(!values[i].empty()) {
+					fields[this->columns[i]].push_back(values[i]);
+				}
+			}
+		}
+		else {
+			JsonLineParser(line).parse(fields);
+		}
+
+		fillEntry(fields, this->csv, entry);
+	}
+
+private:
+	std::mutex mutex;									/// Guards the stream
+	std::istream &input;								/// The manifest
+	bool csv;											/// Whether the manifest is CSV
+	std::vector<std::string> columns;					/// The CSV header
+	unsigned long lineNumber;							/// The last line read
+};
+
+SimplyEmail::Email buildEmail(const ManifestEntry &entry, const Options &options, AttachmentCache &attachments, const SimplyEmail::SuppressionList *suppression) {
+	SimplyEmail::Email email;
+	email.setSuppressionList(suppression);
+
+	email.setFrom(entry.from.empty() ? options.from : entry.from);
+	email.setReplyTo(entry.replyTo.empty() ? email.getFrom() : entry.replyTo);
+	email.setSubject(entry.subject);
+	email.setBody(entry.bodyFile.empty() ? entry.body : readFile(entry.bodyFile));
+
+	if(email.getFrom().empty()) {
+		throw std::runtime_error("no sender; give \"from\" or --from");
+	}
+
+	for(std::size_t i=0; i<entry.to.size(); i++){
+		email.addRecipient(entry.to[i]);
+	}
+
+	for(std::size_t i=0; i<entry.cc.size(); i++){
+		email.addCC(entry.cc[i]);
+	}
+
+	for(std::size_t i=0; i<entry.bcc.size(); i++){
+		email.addBCC(entry.bcc[i]);
+	}
+
+	for(std::size_t i=0; i<entry.attachments.size(); i++){
+		email.addAttachment(attachments.get(entry.attachments[i]));
+	}
+
+	return email;
+}
+
+//The body and encoded attachments, which make up nearly all of a sent message
+std::size_t payloadLength(const SimplyEmail::Email &email) {
+	std::size_t length = email.getBody().length();
+
+	for(unsigned int i=0; i<email.getAttachmentNumber(); i++){
+		length += email.getAttachment(i).getDataLength();
+	}
+
+	return length;
+}
+
+std::uint64_t percentile(const std::vector<std::uint64_t> &sorted, double fraction) {
+	if(sorted.empty()) {
+		return 0;
+	}
+
+	std::size_t index = (std::size_t)(fraction * (sorted.size() - 1) + 0.5);
+	return sorted[index];
+}
+
+void printSummary(Summary &summary, double seconds, const char *verb) {
+	std::vector<std::uint64_t> latencies;
+	{
+		std::lock_guard<std::mutex> lock(summary.mutex);
+		latencies = summary.latencies;
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+
+	std::uint64_t sent = summary.sent;
+	std::uint64_t failed = summary.failed;
+	double megabytes = (double)summary.bytes / (1024.0 * 1024.0);
+
+	if(seconds <= 0) {
+		seconds = 1e-9;
+	}
+
+	std::fprintf(stdout, "%s %llu, failed %llu in %.3f s\n", verb, (unsigned long long)sent, (unsigned long long)failed, seconds);
+	std::fprintf(stdout, "throughput %.1f msg/s, %.2f MiB/s (%.2f MiB)\n", sent / seconds, megabytes / seconds, megabytes);
+	std::fprintf(stdout, "latency ms p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+		percentile(latencies, 0.50) / 1000.0, percentile(latencies, 0.90) / 1000.0,
+		percentile(latencies, 0.99) / 1000.0, (latencies.empty() ? 0 : latencies.back()) / 1000.0);
+
+	if((summary.suppressed > 0) || (summary.skipped > 0)) {
+		std::fprintf(stdout, "suppressed %llu recipients, skipped %llu messages\n", (unsigned long long)summary.suppressed.load(),
+			(unsigned long long)summary.skipped.load());
+	}
+}
+
+} /* namespace */
+
+int main(int argc, char **argv) {
+	Options options;
+
+	try {
+		options = parseOptions(argc, argv);
+	}
+	catch(const std::exception &error) {
+		std::cerr << "simplyemail-send: " << error.what() << "\n\n";
+		usage(std::cerr);
+		return 2;
+	}
+
+	std::ifstream file;
+	std::istream *input = &std::cin;
+
+	if(options.manifest != "-") {
+		file.open(options.manifest.c_str());
+		if(!file.is_open()) {
+			std::cerr << "simplyemail-send: could not open " << options.manifest << "\n";
+			return 2;
+		}
+		input = &file;
+	}
+
+	std::unique_ptr<ManifestReader> reader;
+	try {
+		reader.reset(new ManifestReader(*input, options.format == "csv"));
+	}
+	catch(const std::exception &error) {
+		std::cerr << "simplyemail-send: " << error.what() << "\n";
+		return 2;
+	}
+
+	SimplyEmail::RelayGroup relays;
+	relays.setVerbose(options.verbose);
+
+	for(std::size_t i=0; i<options.relays.size(); i++){
+		relays.addRelay(options.relays[i], options.username, options.password);
+	}
+
+	std::unique_ptr<SimplyEmail::MailboxWriter> mailbox;
+	try {
+		if(!options.maildir.empty()) {
+			mailbox.reset(new SimplyEmail::MailboxWriter(options.maildir, SimplyEmail::MailboxWriter::MAILDIR, options.syncBatch));
+		}
+		else if(!options.mbox.empty()) {
+			mailbox.reset(new SimplyEmail::MailboxWriter(options.mbox, SimplyEmail::MailboxWriter::MBOX, options.syncBatch));
+		}
+	}
+	catch(const std::exception &error) {
+		std::cerr << "simplyemail-send: " << error.what() << "\n";
+		return 2;
+	}
+
+	std::unique_ptr<SimplyEmail::SuppressionList> suppression;
+	try {
+		if(!options.suppress.empty()) {
+			suppression.reset(new SimplyEmail::SuppressionList(options.suppress));
+		}
+	}
+	catch(const std::exception &error) {
+		std::cerr << "simplyemail-send: " << error.what() << "\n";
+		return 2;
+	}
+
+	const char *verb = options.dryRun ? "encoded" : (mailbox ? "written" : "sent");
+
+	AttachmentCache attachments;
+	RateLimiter limiter(options.rate);
+	Summary summary;
+	std::mutex errorMutex;
+
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+	for(unsigned int t=0; t<options.concurrency; t++){
+		workers.push_back(std::thread([&]() {
+			std::string line;
+			unsigned long number = 0;
+
+			while(reader->next(line, number)) {
+				try {
+					ManifestEntry entry;
+					reader->parse(line, entry);
+
+					SimplyEmail::Email email = buildEmail(entry, options, attachments, suppression.get());
+
+					summary.suppressed += email.getSuppressed().size();
+
+					if((email.getRecipientNumber() == 0) && !email.getSuppressed().empty()) {
+						summary.skipped++;
+						continue;
+					}
+
+					limiter.wait();
+					std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+					std::size_t bytes;
+					if(options.dryRun) {
+						bytes = email.encode().size();
+					}
+					else if(mailbox) {
+						mailbox->write(email);
+						bytes = payloadLength(email);
+					}
+					else if(options.timeout > 0) {
+						relays.send(email, start + std::chrono::milliseconds((std::int64_t)(options.timeout * 1000)));
+						bytes = payloadLength(email);
+					}
+					else {
+						relays.send(email);
+						bytes = payloadLength(email);
+					}
+
+					std::uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+					summary.sent++;
+					summary.bytes += bytes;
+
+					std::lock_guard<std::mutex> lock(summary.mutex);
+					summary.latencies.push_back(micros);
+				}
+				catch(const std::exception &error) {
+					summary.failed++;
+
+					std::lock_guard<std::mutex> lock(errorMutex);
+					std::cerr << "simplyemail-send: line " << number << ": " << error.what() << "\n";
+				}
+			}
+		}));
+	}
+
+	//Report progress once a second until the workers finish
+	std::atomic<bool> finished(false);
+	std::mutex progressMutex;
+	std::condition_variable progressDone;
+
+	std::thread progress([&]() {
+		std::uint64_t previous = 0;
+		std::unique_lock<std::mutex> lock(progressMutex);
+
+		while(!progressDone.wait_for(lock, std::chrono::seconds(1), [&]() { return finished.load(); })) {
+			if(options.quiet) {
+				continue;
+			}
+
+			std::uint64_t sent = summary.sent;
+			double seconds = std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::steady_clock::now() - started).count();
+
+			std::lock_guard<std::mutex> errorLock(errorMutex);
+			std::fprintf(stderr, "[%6.1fs] %s %llu, failed %llu, %llu msg/s\n", seconds, verb,
+				(unsigned long long)sent, (unsigned long long)summary.failed.load(), (unsigned long long)(sent - previous));
+			previous = sent;
+		}
+	});
+
+	for(std::size_t i=0; i<workers.size(); i++){
+		workers[i].join();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(progressMutex);
+		finished = true;
+	}
+	progressDone.notify_all();
+	progress.join();
+
+	if(mailbox) {
+		try {
+			mailbox->flush();
+		}
+		catch(const std::exception &error) {
+			std::cerr << "simplyemail-send: " << error.what() << "\n";
+			summary.failed++;
+		}
+	}
+
+	double seconds = std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::steady_clock::now() - started).count();
+	printSummary(summary, seconds, verb);
+
+	if(mailbox) {
+		SimplyEmail::MailboxStats stats = mailbox->getStats();
+
+		std::fprintf(stdout, "mailbox %s: %llu messages, %llu discarded, %llu syncs, %.1f files/s\n", mailbox->getPath().c_str(),
+			(unsigned long long)stats.messages, (unsigned long long)stats.discarded, (unsigned long long)stats.syncs,
+			stats.messagesPerSecond);
+	}
+	else if(!options.dryRun) {
+		std::vector<SimplyEmail::RelayStats> stats = relays.getStats();
+
+		for(std::size_t i=0; i<stats.size(); i++){
+			std::fprintf(stdout, "relay %s: sent %llu, failed %llu, failovers %llu, ejections %llu, latency %.3f ms\n",
+				stats[i].address.c_str(), (unsigned long long)stats[i].sent, (unsigned long long)stats[i].failed,
+				(unsigned long long)stats[i].failovers, (unsigned long long)stats[i].ejections, stats[i].latencyMicros / 1000.0);
+		}
+	}
+
+	return (summary.failed > 0) ? 1 : 0;
+}